@@ -0,0 +1,479 @@
+/* bench.c - Throughput benchmark for the scan, transfer, backup, restore and logging paths */
+
+#define _XOPEN_SOURCE 700  // nftw
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include "upload_gen.h"
+#include "../include/config.h"
+#include "../include/audit.h"
+#include "../include/backup.h"
+#include "../include/change_log.h"
+#include "../include/file_ops.h"
+#include "../include/logging.h"
+#include "../include/metrics.h"
+#include "../include/publish.h"
+#include "../include/restore.h"
+#include "../include/settings.h"
+#include "../include/transfer.h"
+
+// Uploads for the copy phase live here, on another filesystem than DAEMON_ROOT (tmpfs by default)
+#ifndef BENCH_COPY_ROOT
+#define BENCH_COPY_ROOT "/dev/shm/report_daemon_bench"
+#endif
+#define BENCH_COPY_MAX 2000
+
+#define BENCH_MAX_COUNTS 16
+#define BENCH_MAX_RESULTS (BENCH_MAX_COUNTS * 13)
+#define BENCH_MAX_SETTINGS 16
+
+struct bench_result {
+    const char *phase;
+    long files;
+    long long bytes;
+    double seconds;
+};
+
+static struct bench_result results[BENCH_MAX_RESULTS];
+static int result_count = 0;
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--dist SPEC] [--seed N] [--set KEY=VALUE] [--output FILE] COUNT...\n", program);
+    fprintf(stderr, "  --dist SPEC      report sizes: fixed:SIZE, uniform:MIN-MAX or mixed:MIN-MAX (default mixed:1k-256k)\n");
+    fprintf(stderr, "  --seed N         generator seed (default 1)\n");
+    fprintf(stderr, "  --set KEY=VALUE  global configuration setting, e.g. io_backend=threads\n");
+    fprintf(stderr, "  --output FILE    write JSON results to FILE instead of stdout\n");
+    fprintf(stderr, "Runs every phase against %s with COUNT uploads (default 1000)\n", DAEMON_ROOT);
+}
+
+static double seconds_since(uint64_t start) {
+    return (double) (metric_clock() - start) / 1e9;
+}
+
+static void record(const char *phase, long files, long long bytes, uint64_t start) {
+    struct bench_result *result;
+
+    if (result_count == BENCH_MAX_RESULTS) {
+        return;
+    }
+    result = &results[result_count++];
+    result->phase = phase;
+    result->files = files;
+    result->bytes = bytes;
+    result->seconds = seconds_since(start);
+
+    fprintf(stderr, "%-18s %8ld files %10.3fs %12.0f files/s %9.1f MB/s\n", phase, files, result->seconds,
+            result->seconds > 0 ? files / result->seconds : 0.0,
+            result->seconds > 0 ? bytes / result->seconds / (1024.0 * 1024.0) : 0.0);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void) st;
+    (void) type;
+    (void) ftw;
+    return remove(path);
+}
+
+// Starting each run from empty report trees under DAEMON_ROOT (logs are kept)
+static int reset_tree() {
+    static const char *scratch[] = {
+        DAEMON_ROOT "/var/reports", DAEMON_ROOT "/var/backups", DAEMON_ROOT "/var/lib"
+    };
+    const char *dirs[] = {
+        DAEMON_ROOT "/var", DAEMON_ROOT "/var/run", DAEMON_ROOT "/var/lib", DAEMON_ROOT "/var/reports",
+        DAEMON_ROOT "/var/backups", DAEMON_ROOT "/var/log",
+        settings.shards[0].upload_dir, settings.shards[0].backup_dir, settings.log_dir, settings.state_dir,
+        settings.shards[0].quarantine_dir, settings.shards[0].digest_dir
+    };
+
+    for (size_t i = 0; i < sizeof(scratch) / sizeof(scratch[0]); i++) {
+        if (nftw(scratch[i], remove_entry, 64, FTW_DEPTH | FTW_PHYS) != 0 && errno != ENOENT) {
+            fprintf(stderr, "Failed to clear %s: %s\n", scratch[i], strerror(errno));
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        if (mkdir(dirs[i], 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Failed to create %s: %s\n", dirs[i], strerror(errno));
+            return -1;
+        }
+    }
+    return init_publishing(&settings.shards[0]);
+}
+
+static char *read_whole(const char *path, long *size) {
+    FILE *file = fopen(path, "rb");
+    char *data = NULL;
+
+    if (file != NULL && fseek(file, 0, SEEK_END) == 0 && (*size = ftell(file)) >= 0 &&
+        fseek(file, 0, SEEK_SET) == 0 && (data = malloc(*size + 1)) != NULL &&
+        fread(data, 1, *size, file) != (size_t) *size) {
+        free(data);
+        data = NULL;
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+    return data;
+}
+
+static int same_contents(const char *a, const char *b) {
+    long a_size = 0, b_size = -1;
+    char *a_data = read_whole(a, &a_size);
+    char *b_data = read_whole(b, &b_size);
+    int same = a_data != NULL && b_data != NULL && a_size == b_size && memcmp(a_data, b_data, a_size) == 0;
+
+    free(a_data);
+    free(b_data);
+    return same;
+}
+
+// Names in dir, malloc'd
+static int list_names(const char *dir, char ***names, size_t *count) {
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    size_t capacity = 0;
+
+    *names = NULL;
+    *count = 0;
+    if (d == NULL) {
+        return -1;
+    }
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        if (*count == capacity) {
+            char **grown = realloc(*names, (capacity = capacity * 2 + 64) * sizeof(**names));
+
+            if (grown == NULL) {
+                break;
+            }
+            *names = grown;
+        }
+        (*names)[(*count)++] = strdup(entry->d_name);
+    }
+    closedir(d);
+    return 0;
+}
+
+static void free_names(char **names, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+// Uploads on another filesystem are copied, not renamed. Each report has a <name>.tmp sibling with other
+// contents, the name a careless temporary file would take, and every file must arrive intact
+static int run_copy_phase(long count, const struct size_dist *dist, unsigned long seed) {
+    const char *ref_dir = DAEMON_ROOT "/var/lib/copy_ref";
+    const char *src_dir = BENCH_COPY_ROOT "/upload";
+    const char *dst_dir = DAEMON_ROOT "/var/reports/copy";
+    char src_path[PATH_MAX];
+    char dst_path[PATH_MAX];
+    struct transfer_result *results;
+    struct stat src_st, dst_st;
+    char **names;
+    size_t name_count;
+    long long bytes;
+    int bad = 0;
+    uint64_t start;
+
+    if (count > BENCH_COPY_MAX) {
+        count = BENCH_COPY_MAX;  // all of it sits in memory on tmpfs
+    }
+
+    if ((nftw(BENCH_COPY_ROOT, remove_entry, 64, FTW_DEPTH | FTW_PHYS) != 0 && errno != ENOENT) ||
+        mkdir(BENCH_COPY_ROOT, 0755) != 0 || mkdir(src_dir, 0755) != 0 || mkdir(ref_dir, 0755) != 0 ||
+        mkdir(dst_dir, 0755) != 0) {
+        fprintf(stderr, "Failed to prepare %s: %s\n", BENCH_COPY_ROOT, strerror(errno));
+        return -1;
+    }
+    if (stat(src_dir, &src_st) != 0 || stat(dst_dir, &dst_st) != 0 || src_st.st_dev == dst_st.st_dev) {
+        fprintf(stderr, "%s shares a filesystem with %s, skipping the copy phase\n", BENCH_COPY_ROOT, DAEMON_ROOT);
+        nftw(BENCH_COPY_ROOT, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+        return 0;
+    }
+
+    if (generate_uploads(ref_dir, count, dist, seed, &bytes) != 0 || list_names(ref_dir, &names, &name_count) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < name_count && bad == 0; i++) {
+        FILE *sibling;
+
+        snprintf(dst_path, sizeof(dst_path), "%s/%s.tmp", ref_dir, names[i]);
+        sibling = fopen(dst_path, "w");
+        if (sibling == NULL) {
+            bad++;
+            break;
+        }
+        fprintf(sibling, "<report><sibling>%s</sibling></report>\n", names[i]);
+        bad += fclose(sibling) != 0;
+    }
+    free_names(names, name_count);
+    if (bad != 0 || list_names(ref_dir, &names, &name_count) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < name_count && bad == 0; i++) {
+        snprintf(src_path, sizeof(src_path), "%s/%s", ref_dir, names[i]);
+        snprintf(dst_path, sizeof(dst_path), "%s/%s", src_dir, names[i]);
+        bad += copy_file(src_path, dst_path, NULL) != 0;
+    }
+    if (bad != 0) {
+        free_names(names, name_count);
+        return -1;
+    }
+
+    results = calloc(name_count > 0 ? name_count : 1, sizeof(*results));
+    if (results == NULL) {
+        free_names(names, name_count);
+        return -1;
+    }
+    bytes = 0;
+    start = metric_clock();
+    if (settings.io_backend == IO_BACKEND_URING && transfer_batch_available()) {
+        transfer_files(src_dir, dst_dir, names, name_count, results);
+    } else {
+        for (size_t i = 0; i < name_count; i++) {
+            transfer_file(src_dir, dst_dir, names[i], &results[i]);
+        }
+    }
+    for (size_t i = 0; i < name_count; i++) {
+        bytes += results[i].bytes;
+    }
+    record("transfer_copy", (long) name_count, bytes, start);
+
+    for (size_t i = 0; i < name_count; i++) {
+        snprintf(src_path, sizeof(src_path), "%s/%s", ref_dir, names[i]);
+        snprintf(dst_path, sizeof(dst_path), "%s/%s", dst_dir, names[i]);
+        if (results[i].error != 0 || results[i].method != TRANSFER_COPY || !same_contents(src_path, dst_path)) {
+            fprintf(stderr, "Copy of %s did not arrive intact\n", names[i]);
+            bad++;
+        }
+    }
+    free(results);
+    free_names(names, name_count);
+    nftw(BENCH_COPY_ROOT, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    return bad == 0 ? 0 : -1;
+}
+
+// Snapshots are named by the second, so a second run must not share the first one's
+static void wait_for_next_second() {
+    time_t now = time(NULL);
+    struct timespec pause = { 0, 10000000 };
+
+    while (time(NULL) == now) {
+        nanosleep(&pause, NULL);
+    }
+}
+
+static int run_benchmark(long count, const struct size_dist *dist, unsigned long seed) {
+    struct shard *shard = &settings.shards[0];
+    struct run_summary summary;
+    static struct restore_request request;
+    char snapshot[PATH_MAX];
+    char generation[PATH_MAX];
+    long long bytes;
+    long changed;
+    uint64_t start;
+
+    if (reset_tree() != 0) {
+        return -1;
+    }
+
+    start = metric_clock();
+    if (generate_uploads(shard->upload_dir, count, dist, seed, &bytes) != 0) {
+        return -1;
+    }
+    record("generate", count, bytes, start);
+
+    // A cold scan finds every upload, a warm one finds nothing new
+    open_change_log();
+    start = metric_clock();
+    check_uploads(shard);
+    flush_change_log();
+    flush_logging();
+    record("scan_cold", count, bytes, start);
+
+    start = metric_clock();
+    check_uploads(shard);
+    record("scan_warm", count, 0, start);
+
+    start = metric_clock();
+    check_missing_reports(shard, NULL);
+    record("audit", count, 0, start);
+
+    start = metric_clock();
+    for (long i = 0; i < count; i++) {
+        log_message(CLOG_INFO, "Benchmark message %ld of %ld", i, count);
+    }
+    flush_logging();
+    record("logging", count, 0, start);
+
+    start = metric_clock();
+    transfer_reports(shard, &summary);
+    record("transfer", summary.files, summary.bytes, start);
+
+    start = metric_clock();
+    backup_reports(shard, &summary);
+    record("backup_full", summary.files + summary.linked, summary.bytes, start);
+
+    // Nothing changed, so the second snapshot should reuse every report
+    wait_for_next_second();
+    start = metric_clock();
+    backup_reports(shard, &summary);
+    record("backup_incremental", summary.files + summary.linked, summary.bytes, start);
+
+    // A day of corrections: one report in twenty differs by a digit, so only the chunks
+    // around each change are new
+    if (current_generation(shard, generation, sizeof(generation)) != 0 ||
+        correct_reports(generation, 20, &changed, &bytes) != 0) {
+        return -1;
+    }
+    wait_for_next_second();
+    start = metric_clock();
+    backup_reports(shard, &summary);
+    record("backup_changed", summary.files + summary.linked, summary.bytes, start);
+
+    // Extracting the whole dashboard from the newest snapshot
+    memset(&request, 0, sizeof(request));
+    parse_restore_time("now", request.at, sizeof(request.at));
+    start = metric_clock();
+    restore_reports(shard, &request, &summary, snapshot, sizeof(snapshot));
+    record("restore", summary.files, summary.bytes, start);
+
+    if (run_copy_phase(count, dist, seed) != 0) {
+        fprintf(stderr, "Copy phase failed\n");
+        return -1;
+    }
+
+    cleanup_upload_index(shard);
+    close_change_log();
+    return 0;
+}
+
+static void write_json(FILE *out, const struct size_dist *dist, unsigned long seed) {
+    char dist_text[64];
+    struct utsname host;
+
+    format_size_dist(dist, dist_text, sizeof(dist_text));
+    if (uname(&host) != 0) {
+        snprintf(host.nodename, sizeof(host.nodename), "unknown");
+        snprintf(host.release, sizeof(host.release), "unknown");
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"benchmark\": \"report_daemon\",\n");
+    fprintf(out, "  \"timestamp\": %lld,\n", (long long) time(NULL));
+    fprintf(out, "  \"host\": \"%s\",\n", host.nodename);
+    fprintf(out, "  \"kernel\": \"%s\",\n", host.release);
+    fprintf(out, "  \"root\": \"%s\",\n", DAEMON_ROOT);
+    fprintf(out, "  \"workers\": %d,\n", settings.shards[0].workers);
+    fprintf(out, "  \"distribution\": \"%s\",\n", dist_text);
+    fprintf(out, "  \"seed\": %lu,\n", seed);
+    fprintf(out, "  \"results\": [\n");
+    for (int i = 0; i < result_count; i++) {
+        const struct bench_result *r = &results[i];
+        fprintf(out, "    {\"phase\": \"%s\", \"files\": %ld, \"bytes\": %lld, \"seconds\": %.6f, "
+                     "\"files_per_second\": %.1f, \"mb_per_second\": %.2f}%s\n",
+                r->phase, r->files, r->bytes, r->seconds,
+                r->seconds > 0 ? r->files / r->seconds : 0.0,
+                r->seconds > 0 ? r->bytes / r->seconds / (1024.0 * 1024.0) : 0.0,
+                i + 1 < result_count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct size_dist dist = { DIST_MIXED, 1024, 256 * 1024 };
+    unsigned long seed = 1;
+    const char *output = NULL;
+    long counts[BENCH_MAX_COUNTS];
+    int count_total = 0;
+    char *sets[BENCH_MAX_SETTINGS];
+    int set_total = 0;
+    FILE *out = stdout;
+
+    // Refusing to wipe the real /var
+    if (strlen(DAEMON_ROOT) == 0) {
+        fprintf(stderr, "%s must be built with DAEMON_ROOT set to a scratch directory\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--dist") == 0 && i + 1 < argc) {
+            if (parse_size_dist(argv[++i], &dist) != 0) {
+                fprintf(stderr, "Invalid size distribution: %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--set") == 0 && i + 1 < argc && set_total < BENCH_MAX_SETTINGS &&
+                   strchr(argv[i + 1], '=') != NULL) {
+            sets[set_total++] = argv[++i];
+        } else if (argv[i][0] != '-' && count_total < BENCH_MAX_COUNTS && atol(argv[i]) > 0) {
+            counts[count_total++] = atol(argv[i]);
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (count_total == 0) {
+        counts[count_total++] = 1000;
+    }
+
+    if (mkdir(DAEMON_ROOT, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create %s: %s\n", DAEMON_ROOT, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    // The compiled-in directories, as the single default shard
+    default_settings();
+    for (int i = 0; i < set_total; i++) {
+        char *value = strchr(sets[i], '=');
+
+        *value++ = '\0';
+        if (apply_setting(NULL, sets[i], value) != 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    if (finish_settings() != 0 || reset_tree() != 0 || init_shard(&settings.shards[0]) != 0 ||
+        init_logging() != 0 || start_async_logging() != 0) {
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < count_total; i++) {
+        fprintf(stderr, "== %ld uploads ==\n", counts[i]);
+        if (run_benchmark(counts[i], &dist, seed) != 0) {
+            fprintf(stderr, "Benchmark with %ld uploads failed\n", counts[i]);
+            cleanup_logging();
+            return EXIT_FAILURE;
+        }
+    }
+    cleanup_logging();
+
+    if (output != NULL && (out = fopen(output, "w")) == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", output, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    write_json(out, &dist, seed);
+    if (out != stdout) {
+        fclose(out);
+        fprintf(stderr, "Results written to %s\n", output);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,235 @@
+/* upload_gen.c - Implementation of the synthetic upload generator */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "upload_gen.h"
+#include "../include/timestamp.h"
+
+// The departments check_missing_reports() looks for
+static const char *departments[] = { "warehouse", "manufacturing", "sales", "distribution" };
+#define DEPARTMENT_COUNT (sizeof(departments) / sizeof(departments[0]))
+
+#define REPORT_FOOTER "</report>\n"
+#define REPORT_HEADER_MAX 256
+
+// xorshift64*, fast and reproducible for a given seed
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static long parse_size(const char *text, char **end) {
+    long value = strtol(text, end, 10);
+
+    if (**end == 'k' || **end == 'K') {
+        value *= 1024;
+        (*end)++;
+    } else if (**end == 'm' || **end == 'M') {
+        value *= 1024 * 1024;
+        (*end)++;
+    }
+    return value;
+}
+
+int parse_size_dist(const char *text, struct size_dist *dist) {
+    const char *colon = strchr(text, ':');
+    char *end;
+
+    if (colon == NULL) {
+        return -1;
+    }
+
+    if (strncmp(text, "fixed:", 6) == 0) {
+        dist->kind = DIST_FIXED;
+    } else if (strncmp(text, "uniform:", 8) == 0) {
+        dist->kind = DIST_UNIFORM;
+    } else if (strncmp(text, "mixed:", 6) == 0) {
+        dist->kind = DIST_MIXED;
+    } else {
+        return -1;
+    }
+
+    dist->min = parse_size(colon + 1, &end);
+    dist->max = dist->min;
+    if (dist->kind != DIST_FIXED) {
+        if (*end != '-') {
+            return -1;
+        }
+        dist->max = parse_size(end + 1, &end);
+    }
+
+    return *end == '\0' && dist->min > 0 && dist->max >= dist->min ? 0 : -1;
+}
+
+void format_size_dist(const struct size_dist *dist, char *buffer, size_t size) {
+    static const char *names[] = { "fixed", "uniform", "mixed" };
+
+    if (dist->kind == DIST_FIXED) {
+        snprintf(buffer, size, "fixed:%ld", dist->min);
+    } else {
+        snprintf(buffer, size, "%s:%ld-%ld", names[dist->kind], dist->min, dist->max);
+    }
+}
+
+static long next_size(const struct size_dist *dist, uint64_t *state) {
+    long max = dist->max;
+
+    switch (dist->kind) {
+        case DIST_UNIFORM:
+            break;
+        case DIST_MIXED:
+            // Most reports are small, a few carry the bulk of the bytes
+            if (next_random(state) % 10 != 0 && max / 16 > dist->min) {
+                max /= 16;
+            }
+            break;
+        default:
+            return dist->min;
+    }
+    return dist->min + (long) (next_random(state) % (uint64_t) (max - dist->min + 1));
+}
+
+// Building a well-formed report of roughly 'size' bytes
+static size_t build_report(char *buffer, long size, const char *department, const char *date,
+                           long number, uint64_t *state) {
+    size_t len;
+    long row = 0;
+
+    len = (size_t) snprintf(buffer, REPORT_HEADER_MAX,
+                            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                            "<report department=\"%s\" date=\"%s\" sequence=\"%ld\">\n",
+                            department, date, number);
+
+    for (;;) {
+        char line[96];
+        int n = snprintf(line, sizeof(line), "  <row id=\"%ld\" sku=\"SKU%08u\" qty=\"%u\"/>\n",
+                         row++, (unsigned int) (next_random(state) % 100000000),
+                         (unsigned int) (next_random(state) % 1000));
+        if ((long) (len + n + strlen(REPORT_FOOTER)) > size) {
+            break;
+        }
+        memcpy(buffer + len, line, n);
+        len += n;
+    }
+
+    memcpy(buffer + len, REPORT_FOOTER, strlen(REPORT_FOOTER));
+    return len + strlen(REPORT_FOOTER);
+}
+
+int generate_uploads(const char *dir, long count, const struct size_dist *dist,
+                     unsigned long seed, long long *bytes) {
+    char path[PATH_MAX];
+    char date[16];
+    char *buffer;
+    uint64_t state = seed ? seed : 1;
+    time_t yesterday = time(NULL) - 24 * 60 * 60;
+
+    // Dated yesterday, as the audit expects of a morning's uploads
+    snprintf(date, sizeof(date), "%s", format_timestamp(yesterday, TS_DATE));
+
+    // Room for the header and footer even when the requested size is tiny
+    buffer = malloc(dist->max + REPORT_HEADER_MAX + strlen(REPORT_FOOTER));
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    *bytes = 0;
+    for (long i = 0; i < count; i++) {
+        const char *department = departments[i % DEPARTMENT_COUNT];
+        size_t len = build_report(buffer, next_size(dist, &state), department, date, i, &state);
+        int fd;
+
+        snprintf(path, sizeof(path), "%s/%s_%s_%07ld.xml", dir, department, date, i);
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || write(fd, buffer, len) != (ssize_t) len) {
+            fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            free(buffer);
+            return -1;
+        }
+        close(fd);
+        *bytes += len;
+    }
+
+    free(buffer);
+    return 0;
+}
+
+// A digit in the middle of the report changes, the way a corrected quantity would; the report is
+// replaced rather than written in place, since published reports may be hard-linked elsewhere
+static int correct_report(const char *dir, const char *name, long long *bytes) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    struct stat st;
+    char *buffer;
+    int fd;
+    int ret = -1;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/.%s.tmp", dir, name);
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || (buffer = malloc(st.st_size + 1)) == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (read(fd, buffer, st.st_size) == st.st_size) {
+        for (off_t i = st.st_size / 2; i < st.st_size; i++) {
+            if (buffer[i] >= '0' && buffer[i] <= '9') {
+                buffer[i] = buffer[i] == '9' ? '0' : buffer[i] + 1;
+                break;
+            }
+        }
+        ret = 0;
+    }
+    close(fd);
+
+    fd = ret == 0 ? open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (fd < 0 || write(fd, buffer, st.st_size) != st.st_size || close(fd) != 0 || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "Failed to rewrite %s: %s\n", path, strerror(errno));
+        ret = -1;
+    }
+    *bytes += st.st_size;
+    free(buffer);
+    return ret;
+}
+
+int correct_reports(const char *dir, long every, long *count, long long *bytes) {
+    struct dirent *entry;
+    DIR *d;
+    long seen = 0;
+
+    *count = 0;
+    *bytes = 0;
+    d = opendir(dir);
+    if (d == NULL) {
+        return -1;
+    }
+    while ((entry = readdir(d)) != NULL) {
+        if (strstr(entry->d_name, ".xml") == NULL || entry->d_name[0] == '.' || seen++ % every != 0) {
+            continue;
+        }
+        if (correct_report(dir, entry->d_name, bytes) != 0) {
+            closedir(d);
+            return -1;
+        }
+        (*count)++;
+    }
+    closedir(d);
+    return 0;
+}
@@ -0,0 +1,32 @@
+/* upload_gen.h - Synthetic department report generator for benchmarks */
+
+#ifndef UPLOAD_GEN_H
+#define UPLOAD_GEN_H
+
+#include <stddef.h>
+
+/* Size distributions for generated reports */
+#define DIST_FIXED   0  /* every report is min bytes */
+#define DIST_UNIFORM 1  /* uniform between min and max */
+#define DIST_MIXED   2  /* mostly min..max/16, one in ten up to max, like real uploads */
+
+struct size_dist {
+    int kind;
+    long min;
+    long max;
+};
+
+/* Parse "fixed:SIZE", "uniform:MIN-MAX" or "mixed:MIN-MAX" (sizes accept k and m suffixes) */
+int parse_size_dist(const char *text, struct size_dist *dist);
+
+/* Describe a distribution for reports */
+void format_size_dist(const struct size_dist *dist, char *buffer, size_t size);
+
+/* Write count reports named <department>_<date>_<n>.xml, returns 0 and the bytes written */
+int generate_uploads(const char *dir, long count, const struct size_dist *dist,
+                     unsigned long seed, long long *bytes);
+
+/* Change one digit in every every-th report of dir, returns 0 and how many reports and bytes were rewritten */
+int correct_reports(const char *dir, long every, long *count, long long *bytes);
+
+#endif /* UPLOAD_GEN_H */
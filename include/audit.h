@@ -0,0 +1,43 @@
+/* audit.h - Department registry and the missing-report audit */
+
+#ifndef AUDIT_H
+#define AUDIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_DEPARTMENTS 256
+#define DEPARTMENT_NAME_MAX 32
+#define DEPARTMENT_SLOTS 512  /* power of two, twice MAX_DEPARTMENTS */
+
+/* Departments expected to upload a report every day, found by hashed name */
+struct department_registry {
+    int count;
+    char names[MAX_DEPARTMENTS][DEPARTMENT_NAME_MAX];
+    int16_t slots[DEPARTMENT_SLOTS];  /* index into names, -1 when empty */
+};
+
+/* Days of the window by outcome */
+struct audit_result {
+    int missing;
+    int late;
+    int duplicate;
+};
+
+struct shard;
+
+/* Find a report's department and date (days since the epoch) in its name, -1 if either is missing;
+   department is still set when only the date is missing */
+int parse_report_name(const struct department_registry *registry, const char *name, int *department, long *day);
+
+/* Add the names in a comma or space separated list, returns -1 on an invalid name */
+int add_departments(struct department_registry *registry, const char *list);
+
+/* Index of a department name of len bytes, -1 if it is not registered */
+int find_department(const struct department_registry *registry, const char *name, size_t len);
+
+/* Check the shard's uploads and dashboard for each department's report over the audit window,
+   logging missing reports and writing a summary of missing, late and duplicate ones */
+int check_missing_reports(struct shard *shard, struct audit_result *result);
+
+#endif /* AUDIT_H */
@@ -0,0 +1,23 @@
+/* backup.h - Incremental snapshots of the report directory */
+
+#ifndef BACKUP_H
+#define BACKUP_H
+
+#include <stddef.h>
+
+/* Length of a snapshot's YYYYMMDD_HHMMSS time stamp */
+#define SNAPSHOT_STAMP_LEN 15
+
+struct shard;
+struct run_summary;
+
+/* Find the shard's newest completed snapshot archive, returns 0 and fills path if one exists */
+int find_latest_snapshot(const struct shard *shard, char *path, size_t size);
+
+/* Find the newest snapshot archive taken at or before a YYYYMMDD_HHMMSS stamp (any, if NULL) */
+int find_snapshot_at(const struct shard *shard, const char *stamp, char *path, size_t size);
+
+/* Backup the shard's dashboard into a new archive, returns 0 if every report was saved */
+int backup_reports(struct shard *shard, struct run_summary *summary);
+
+#endif /* BACKUP_H */
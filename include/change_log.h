@@ -0,0 +1,26 @@
+/* change_log.h - Buffered writer for the change log */
+
+#ifndef CHANGE_LOG_H
+#define CHANGE_LOG_H
+
+#include <stddef.h>
+
+/* Open the change log, creating it with its CSV header if needed */
+int open_change_log();
+
+/* Queue a change record, flushing when the buffer fills */
+void append_change_log(const char *filename, const char *username, const char *timestamp, const char *change);
+
+/* Write buffered records, reopening the file if it was rotated */
+int flush_change_log();
+
+/* Seconds until buffered records should be flushed, -1 if none are buffered */
+int change_log_pending();
+
+/* Bytes of records waiting in the buffer */
+size_t change_log_buffered();
+
+/* Flush and close the change log */
+void close_change_log();
+
+#endif /* CHANGE_LOG_H */
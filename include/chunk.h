@@ -0,0 +1,90 @@
+/* chunk.h - Content-defined chunking and the chunk store shared by a shard's snapshots */
+
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <linux/limits.h>
+
+#include "pack.h"
+
+/* Length of a chunk's name in its container: the id in hex */
+#define CHUNK_NAME_LEN 32
+
+/* Reference to a chunk; a chunked snapshot entry stores an array of them */
+struct chunk_ref {
+    uint64_t id[2];     /* two XXH64 hashes of the chunk, with different seeds */
+    uint32_t size;
+    uint32_t reserved;
+};
+
+/* A <stamp>.chunks archive holding the chunks first seen by the backup of that stamp */
+struct chunk_container {
+    char name[NAME_MAX + 1];
+    struct pack_reader pack;
+    int retiring;  /* its snapshot is gone: new snapshots copy its chunks forward instead of using them */
+    int used;      /* referenced by the snapshot being written */
+};
+
+/* Hash table slot: where a chunk lives */
+struct chunk_slot {
+    uint64_t id[2];
+    uint32_t container;  /* index into containers, or container_count for the one being written */
+    uint32_t entry;      /* index into that container's entries */
+};
+
+/* The chunks of every container in a backup directory, plus the container a backup is writing */
+struct chunk_store {
+    char dir[PATH_MAX];
+    struct chunk_container *containers;
+    size_t container_count;
+    struct chunk_slot *slots;
+    size_t slot_mask;
+    size_t slots_used;
+    pthread_mutex_t mutex;
+
+    /* New container, only while a backup writes one */
+    int writing;
+    int failed;
+    struct pack_writer writer;
+    char writer_name[NAME_MAX + 1];
+    struct pack_entry *new_entries;
+    char (*new_names)[CHUNK_NAME_LEN + 1];
+    size_t new_count;
+    size_t new_capacity;
+    long long new_bytes;  /* stored bytes of the new chunks */
+};
+
+/* Length of the first chunk of data: a content-defined cut point between the minimum and maximum sizes */
+size_t chunk_boundary(const unsigned char *data, size_t len);
+
+/* Open every container of a backup directory; containers whose snapshot is gone are marked retiring */
+int chunk_store_open(struct chunk_store *store, const char *dir);
+
+/* Start the container for the snapshot with this stamp */
+int chunk_store_begin(struct chunk_store *store, const char *stamp);
+
+/* Split data into chunks, storing the ones the store lacks; returns a malloc'd array of refs. Thread-safe */
+int chunk_store_put(struct chunk_store *store, const unsigned char *data, size_t len, struct chunk_ref **refs,
+                    size_t *count);
+
+/* Whether every ref points into a container that is not retiring; marks those containers used. Thread-safe */
+int chunk_store_has(struct chunk_store *store, const struct chunk_ref *refs, size_t count);
+
+/* Finish the new container (or drop it if empty) and list the containers the snapshot uses,
+   one name per line, in a malloc'd buffer */
+int chunk_store_finish(struct chunk_store *store, char **list, size_t *len);
+
+/* Drop the new container */
+void chunk_store_abort(struct chunk_store *store);
+
+/* Write the chunks of a chunked entry to fd; fails with EIO if one is missing or damaged */
+int chunk_store_extract(const struct chunk_store *store, const struct pack_reader *pack,
+                        const struct pack_entry *entry, int fd);
+
+/* Close every container */
+void chunk_store_close(struct chunk_store *store);
+
+#endif /* CHUNK_H */
@@ -6,18 +6,84 @@
 #include <limits.h>
 #include <sys/stat.h>
 
+/* Prefix for every path below, set when building the benchmark against a scratch tree */
+#ifndef DAEMON_ROOT
+#define DAEMON_ROOT ""
+#endif
+
+/* Config file read at startup; settings there and on the command line override the defaults below */
+#define CONFIG_FILE "/etc/report_daemon.conf"
+
 /* Daemon configuration */
-#define PID_FILE "/var/run/report_daemon.pid"
+#define PID_FILE DAEMON_ROOT "/var/run/report_daemon.pid"
+
+/* Default directory paths, used by the "default" shard */
+#define UPLOAD_DIR DAEMON_ROOT "/var/reports/upload"
+#define REPORT_DIR DAEMON_ROOT "/var/reports/dashboard"  /* symlink to the published generation */
+#define BACKUP_DIR DAEMON_ROOT "/var/backups/reports"
+#define LOG_DIR DAEMON_ROOT "/var/log/report_daemon"
+
+/* Most (upload, dashboard, backup) shards one daemon serves */
+#define MAX_SHARDS 16
+
+/* Continuous publishing: seconds an upload found by a scan must stay unchanged,
+   and seconds complete uploads are gathered into one generation */
+#define SETTLE_SECONDS 10
+#define PUBLISH_DELAY 2
+
+/* Daemon state (file indexes, transfer journals, scheduler) */
+#define STATE_DIR DAEMON_ROOT "/var/lib/report_daemon"
+#define UPLOAD_INDEX_FILE_NAME "upload.index"
+#define TRANSFER_JOURNAL_FILE_NAME "transfer.journal"
+#define INDEX_SAVE_INTERVAL 30
+
+/* Copies across filesystems are written under a temporary name starting with this, never containing
+   ".xml", so it cannot clash with a report */
+#define COPY_TMP_PREFIX ".copy-"
+
+/* Hashes of each generation's reports, kept under the state directory as <generation>.digest */
+#define DIGEST_DIR_NAME "digests"
+#define DIGEST_SUFFIX ".digest"
+
+/* Files are hashed through a buffer of this size, never mapped: an upload truncated under a mapping
+   would kill the daemon with SIGBUS */
+#define HASH_READ_SIZE (64 * 1024)
+
+/* Malformed uploads are moved here with a .reason file instead of being published */
+#define QUARANTINE_DIR_NAME "quarantine"
+#define QUARANTINE_REASON_SUFFIX ".reason"
+
+/* Snapshot archives: reports up to PACK_COMPRESS_MAX bytes are compressed at this zlib level */
+#define PACK_SUFFIX ".pack"
+#define PACK_COMPRESSION_LEVEL 1
+#define PACK_COMPRESS_MAX (64LL * 1024 * 1024)
 
-/* Directory paths */
-#define UPLOAD_DIR "/var/reports/upload"
-#define REPORT_DIR "/var/reports/dashboard"
-#define BACKUP_DIR "/var/backups/reports"
-#define LOG_DIR "/var/log/report_daemon"
+/* Snapshot chunking: reports are cut into content-defined chunks of these sizes (FastCDC, the masks
+   in chunk.c are tuned for the 8 KiB average); each backup stores the chunks it is first to see in
+   a <stamp>.chunks container, and lists the containers it uses in its CHUNK_LIST_NAME entry */
+#define CHUNK_MIN_SIZE (2 * 1024)
+#define CHUNK_AVG_SIZE (8 * 1024)
+#define CHUNK_MAX_SIZE (32 * 1024)
+#define CHUNK_SUFFIX ".chunks"
+#define CHUNK_LIST_NAME ".chunks"
+#define CHUNK_ID_SEED 0x9E3779B97F4A7C15ULL
 
-/* Log file */
-#define LOG_FILE LOG_DIR "/report_daemon.log"
-#define CHANGE_LOG_FILE LOG_DIR "/changes.log"
+/* Snapshot retention: every snapshot for KEEP_ALL_DAYS, the newest of each day for KEEP_DAILY_DAYS,
+   of each month for KEEP_MONTHLY_MONTHS; BACKUP_BUDGET bytes at most (0 for no limit) */
+#define KEEP_ALL_DAYS 7
+#define KEEP_DAILY_DAYS 30
+#define KEEP_MONTHLY_MONTHS 12
+#define BACKUP_BUDGET 0
+#define SNAPSHOT_CATALOG_NAME ".catalog"
+#define RETENTION_BATCH 4  /* snapshots deleted per pass, the rest in later passes */
+
+/* Log files, inside the log directory */
+#define LOG_FILE_NAME "report_daemon.log"
+#define CHANGE_LOG_FILE_NAME "changes.log"
+
+/* Change log buffering: flush when the buffer fills or records are this old (seconds) */
+#define CHANGE_LOG_BUFFER 8192
+#define CHANGE_LOG_FLUSH_INTERVAL 5
 
 /* Log levels */
 #undef LOG_DEBUG
@@ -32,13 +98,73 @@
 /* Current log level */
 #define LOG_LEVEL CLOG_INFO
 
+/* Asynchronous logging: ring size (power of two), line length and the default full-buffer policy
+   (log_full_policy = block, drop or count) */
+#define LOG_FULL_BLOCK 0  /* wait for the writer */
+#define LOG_FULL_DROP  1  /* discard silently */
+#define LOG_FULL_COUNT 2  /* discard and log how many were lost */
+#define LOG_RING_SLOTS 4096
+#define LOG_LINE_MAX 512
+#define LOG_FULL_POLICY LOG_FULL_COUNT
+#define LOG_FLUSH_TIMEOUT_MS 2000
+
 /* Directory permissions */
 #define UPLOAD_DIR_PERMS (S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) /* 0775 */
 #define REPORT_DIR_PERMS (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH) /* 0664 */
+#define REPORT_FILE_PERMS (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) /* 0644 */
+
+/* Dashboard generations kept: the published one plus rollback targets */
+#define GENERATIONS_KEPT 2
 
 /* Check interval in seconds */
 #define CHECK_INTERVAL 60
 
+/* Control socket used by the CLI (root only); replies wait for the command to finish, commands that
+   run jobs on the shards are queued for one worker thread so the event loop keeps answering */
+#define CONTROL_SOCKET DAEMON_ROOT "/var/run/report_daemon.sock"
+#define CONTROL_SOCKET_PERMS 0600
+#define CONTROL_BACKLOG 16
+#define CONTROL_QUEUE_MAX 16
+#define CONTROL_TIMEOUT_MS 1000
+
+/* Metrics, exported in Prometheus text format a few seconds after activity */
+#define METRICS_FILE_NAME "metrics.prom"
+#define METRICS_EXPORT_DELAY 10
+#define METRICS_TEXT_MAX 65536
+
+/* Missing-report audit: departments expected every day unless configured, days looked back,
+   hours after a report's day ends before it counts as late, and the summary in the log directory */
+#define DEPARTMENTS "warehouse, manufacturing, sales, distribution"
+#define AUDIT_DAYS 1
+#define AUDIT_MAX_DAYS 366
+#define LATE_AFTER_HOURS 6
+#define AUDIT_FILE_NAME "audit.csv"
+
+/* Job schedules, cron syntax: minute hour day-of-month month day-of-week */
+#define AUDIT_SCHEDULE "0 1 * * *"
+#define NIGHTLY_SCHEDULE "0 1 * * *"
+#define NIGHTLY_JITTER 60
+#define RECONCILE_SCHEDULE "0 * * * *"
+#define SCHEDULER_MAX_JOBS 16
+#define SCHEDULER_STATE_FILE_NAME "scheduler.state"
+
+/* Username cache: slots, lifetime in seconds, and the file that invalidates it */
+#define USERNAME_CACHE_SIZE 64
+#define USERNAME_CACHE_TTL 300
+#define USERNAME_MAX 64
+#define PASSWD_FILE "/etc/passwd"
+
+/* Worker pool used by transfer and backup jobs */
+#define WORKER_THREADS 4
+#define WORKER_QUEUE_SIZE 256
+
+/* Batched transfers: io_uring unless io_backend = threads (or the kernel refuses it), with this ring size
+   and these registered buffers for copies across filesystems; larger reports are copied one at a time */
+#define IO_BACKEND IO_BACKEND_URING
+#define URING_ENTRIES 256
+#define URING_BUFFERS 16
+#define URING_BUFFER_SIZE (128 * 1024)
+
 /* Buffer size for IPC */
 #define BUFFER_SIZE 4096
 
@@ -0,0 +1,39 @@
+/* control.h - Unix-domain control socket for the daemon and its CLI */
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stddef.h>
+
+/* Largest reply a command can send */
+#define CONTROL_REPLY_MAX 65536
+
+/* Reply status, the first line of every reply */
+#define CONTROL_OK 0
+#define CONTROL_ERR 1
+
+/* A control command: writes reply text and returns CONTROL_OK or CONTROL_ERR */
+typedef int (*control_fn)(const char *args, char *reply, size_t size);
+
+/* Create the listening socket, returns its fd or -1 */
+int init_control_socket(const char *path);
+
+/* Get the listening socket (-1 if not listening) */
+int control_fd();
+
+/* Register a command by name */
+int register_control_command(const char *name, control_fn fn);
+
+/* Register a command that waits for shard jobs: it runs on the control worker thread, one at a time */
+int register_long_control_command(const char *name, control_fn fn);
+
+/* Accept and answer every pending client, call when the socket is readable */
+int handle_control_clients();
+
+/* Finish the running long command, refuse the queued ones, then close the socket and remove its path */
+void cleanup_control_socket();
+
+/* Send a command to the daemon: CONTROL_OK/CONTROL_ERR with the reply body, -1 if unreachable */
+int send_control_command(const char *path, const char *command, char *reply, size_t size);
+
+#endif /* CONTROL_H */
@@ -0,0 +1,66 @@
+/* file_index.h - Persistent index of file state for change detection */
+
+#ifndef FILE_INDEX_H
+#define FILE_INDEX_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* Kinds of change found by comparing a directory with its index */
+#define INDEX_CREATED  0
+#define INDEX_MODIFIED 1
+#define INDEX_DELETED  2
+
+/* State recorded for one file */
+struct index_record {
+    char name[NAME_MAX + 1];
+    uint64_t inode;
+    int64_t size;
+    int64_t mtime_ns;
+    uint64_t hash;
+};
+
+/* In-memory index, records sorted by name */
+struct file_index {
+    char path[PATH_MAX];
+    struct index_record *records;
+    size_t count;
+    size_t capacity;
+    int dirty;
+    void *owner;  /* Passed to change callbacks */
+    pthread_mutex_t mutex;
+};
+
+/* Called for each change; st is NULL for deletions */
+typedef void (*index_change_fn)(void *owner, const char *name, int change, const struct stat *st);
+
+/* Load an index from disk, starting empty if the file is missing or invalid */
+int load_file_index(struct file_index *index, const char *path);
+
+/* Compare every .xml file in dir with the index and report the differences */
+int scan_file_index(struct file_index *index, const char *dir, index_change_fn on_change);
+
+/* Compare a single file with the index and report the difference, if any */
+int update_file_index(struct file_index *index, const char *dir, const char *name, index_change_fn on_change);
+
+/* Drop a file from the index without reporting it */
+void forget_file_index(struct file_index *index, const char *name);
+
+/* Current hash of dir/name, reusing the recorded hash while the file's metadata matches; -1 if unreadable */
+int file_index_hash(struct file_index *index, const char *dir, const char *name, struct index_record *record);
+
+/* Add or replace many records at once */
+int merge_file_index(struct file_index *index, struct index_record *records, size_t count);
+
+/* Write the index to disk if it has changed */
+int save_file_index(struct file_index *index);
+
+/* Release the index */
+void free_file_index(struct file_index *index);
+
+/* Name of a change kind for logs */
+const char *index_change_str(int change);
+
+#endif /* FILE_INDEX_H */
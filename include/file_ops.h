@@ -4,37 +4,79 @@
 #define FILE_OPS_H
 
 #include <sys/types.h>
+#include <linux/limits.h>
+
+struct shard;
+
+/* Outcome of a backup or transfer run */
+struct run_summary {
+    int files;          /* Files copied or transferred */
+    int linked;         /* Files hard-linked from the previous snapshot */
+    int unchanged;      /* Uploads identical to the published report, dropped */
+    int quarantined;    /* Malformed uploads moved to quarantine */
+    int failed;
+    long long bytes;
+    char target[PATH_MAX];  /* Snapshot or generation written */
+};
 
 /* Create directory if it doesn't exist */
 int create_directory_if_not_exists(const char *path);
 
-/* Get username from UID */
-char *get_username_from_uid(uid_t uid);
+/* Get username from UID (cached, borrowed until the calling thread's next lookup) */
+const char *get_username_from_uid(uid_t uid);
+
+/* Username cache hit and miss counters */
+void get_username_cache_stats(unsigned long *hits, unsigned long *misses);
 
-/* Get formatted time string from timestamp */
-char *get_time_string(time_t timestamp);
+/* Drop all cached usernames */
+void invalidate_username_cache();
 
-/* Log file change to the change log file */
-void log_file_change(const char *filename, const char *username, const char *timestamp);
+/* Get formatted time string from timestamp (borrowed, not to be freed) */
+const char *get_time_string(time_t timestamp);
+
+/* Log file change (created, modified or deleted) to the change log file */
+void log_file_change(const char *filename, const char *username, const char *timestamp, const char *change);
 
 /* Count files in directory matching pattern */
 int count_files_in_dir(const char *dir_path, const char *pattern);
 
-void check_uploads();
+/* Load the shard's persistent upload index */
+int init_upload_index(struct shard *shard);
+
+/* Write the upload index to disk if it changed */
+int save_upload_index(struct shard *shard);
+
+/* Check whether the upload index has changes not yet saved */
+int upload_index_dirty(struct shard *shard);
 
-/* Check for missing reports from departments */
-void check_missing_reports();
+/* Save and release the upload index */
+void cleanup_upload_index(struct shard *shard);
+
+/* Report a created or modified upload to the daemon and change logs */
+void report_upload_change(struct shard *shard, const char *filename);
+
+/* Report an upload that was deleted or moved away */
+void report_upload_removed(struct shard *shard, const char *filename);
+
+/* Full scan of the upload directory, diffed against the upload index, returns changes found */
+int check_uploads(struct shard *shard);
 
 /* Lock directories before backup/transfer operations */
-int lock_directories();
+int lock_directories(struct shard *shard);
 
 /* Unlock directories after backup/transfer operations */
-int unlock_directories();
+int unlock_directories(struct shard *shard);
+
+/* Transfer XML reports from upload to report directory, returns 0 if all were moved */
+int transfer_reports(struct shard *shard, struct run_summary *summary);
+
+/* Transfer just the named uploads, for continuous publishing */
+int transfer_uploads(struct shard *shard, char *const *names, size_t count, struct run_summary *summary);
 
-/* Transfer XML reports from upload to report directory */
-void transfer_reports();
+/* Finish a transfer interrupted by a crash from its journal and publish it */
+int recover_transfer(struct shard *shard);
 
-/* Backup report directory */
-void backup_reports();
+/* Republish the generation before the published one, between transfers */
+int rollback_reports(struct shard *shard);
 
 #endif /* FILE_OPS_H */
\ No newline at end of file
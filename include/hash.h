@@ -0,0 +1,32 @@
+/* hash.h - Content hashing for reports */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Running XXH64 state, for data hashed a piece at a time */
+struct hash_state {
+    uint64_t v[4];
+    uint64_t seed;
+    uint64_t total;
+    unsigned char pending[32];
+    size_t pending_len;
+};
+
+/* 64-bit XXH64 hash of a memory block */
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed);
+
+/* Streaming XXH64: the digest equals hash_bytes over everything passed to hash_update */
+void hash_init(struct hash_state *state, uint64_t seed);
+void hash_update(struct hash_state *state, const void *data, size_t len);
+uint64_t hash_digest(const struct hash_state *state);
+
+/* Hash the contents of an open file, read rather than mapped so a file may change underneath */
+int hash_fd(int fd, uint64_t *hash);
+
+/* Hash the contents of a file by path */
+int hash_file(const char *path, uint64_t *hash);
+
+#endif /* HASH_H */
@@ -0,0 +1,40 @@
+/* journal.h - Write-ahead journal of the moves made by a transfer run */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <linux/limits.h>
+
+/* An open journal, shared by the transfer workers */
+struct transfer_journal {
+    char path[PATH_MAX];
+    FILE *fp;
+    pthread_mutex_t mutex;
+};
+
+/* A planned move read back from an unfinished journal */
+struct journal_move {
+    char *name;
+    int done;  /* completion was recorded */
+};
+
+/* Record the generation and every planned move, durable before any file moves */
+int journal_begin(struct transfer_journal *journal, const char *path, const char *gen_dir,
+                  char *const *names, size_t count);
+
+/* Record that a file reached the generation */
+void journal_done(struct transfer_journal *journal, const char *name);
+
+/* Close and remove the journal once the generation is published or discarded */
+int journal_finish(struct transfer_journal *journal);
+
+/* Read an unfinished journal, returns 1 if one was found, 0 if none, -1 on error */
+int load_journal(const char *path, char *gen_dir, size_t size, struct journal_move **moves, size_t *count);
+
+/* Free the moves returned by load_journal */
+void free_journal_moves(struct journal_move *moves, size_t count);
+
+#endif /* JOURNAL_H */
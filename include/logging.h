@@ -6,9 +6,19 @@
 /* Initialize logging */
 int init_logging();
 
+/* Hand log writes to a background thread through a lock-free ring buffer, treating a full ring as
+   settings.log_full_policy says */
+int start_async_logging();
+
+/* Wait for queued messages to reach the log file (signal safe) */
+void flush_logging();
+
 /* Clean up logging */
 void cleanup_logging();
 
+/* Messages waiting for the writer thread and messages dropped so far */
+void get_logging_stats(unsigned long *queued, unsigned long *dropped);
+
 /* Get log level string */
 const char *get_log_level_str(int level);
 
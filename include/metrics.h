@@ -0,0 +1,68 @@
+/* metrics.h - Lock-free counters and latency histograms */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Monotonic counters */
+enum metric_counter {
+    METRIC_FILES_SCANNED,
+    METRIC_UPLOAD_CHANGES,
+    METRIC_FILES_TRANSFERRED,
+    METRIC_BYTES_TRANSFERRED,
+    METRIC_TRANSFER_FAILURES,
+    METRIC_UPLOADS_UNCHANGED,
+    METRIC_UPLOADS_QUARANTINED,
+    METRIC_FILES_BACKED_UP,
+    METRIC_FILES_LINKED,
+    METRIC_BYTES_BACKED_UP,
+    METRIC_BACKUP_FAILURES,
+    METRIC_CHUNKS_STORED,
+    METRIC_CHUNKS_DEDUPLICATED,
+    METRIC_FILES_RESTORED,
+    METRIC_RESTORE_FAILURES,
+    METRIC_SNAPSHOTS_DELETED,
+    METRIC_SNAPSHOT_BYTES_FREED,
+    METRIC_CONTROL_COMMANDS,
+    METRIC_JOBS_RUN,
+    METRIC_LOG_MESSAGES,
+    METRIC_COUNTERS
+};
+
+/* Latency histograms */
+enum metric_histogram {
+    HIST_SCAN,
+    HIST_TRANSFER_RUN,
+    HIST_BACKUP_RUN,
+    HIST_RESTORE_RUN,
+    HIST_FILE_COPY,
+    HIST_TRANSFER_BATCH,
+    HIST_CONTROL_COMMAND,
+    HIST_LOG_MESSAGE,
+    METRIC_HISTOGRAMS
+};
+
+/* Add to a counter */
+void metric_add(enum metric_counter id, uint64_t n);
+
+/* Monotonic clock in nanoseconds, for timing with metric_observe_since */
+uint64_t metric_clock();
+
+/* Record a duration in nanoseconds */
+void metric_observe(enum metric_histogram id, uint64_t nanos);
+
+/* Record the time elapsed since a metric_clock() reading */
+void metric_observe_since(enum metric_histogram id, uint64_t start);
+
+/* Check whether job metrics changed since the last export */
+int metrics_changed();
+
+/* Render all metrics in Prometheus text format, returns the length written */
+size_t format_metrics(char *buffer, size_t size);
+
+/* Write the metrics file atomically */
+int export_metrics(const char *path);
+
+#endif /* METRICS_H */
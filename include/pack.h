@@ -0,0 +1,84 @@
+/* pack.h - Append-only snapshot archives with a trailing index */
+
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/limits.h>
+
+/* How a report's bytes are stored */
+#define PACK_STORED  0
+#define PACK_DEFLATE 1  /* zlib stream */
+#define PACK_CHUNKED 2  /* list of chunks in a chunk store, see chunk.h */
+
+/* Index entry, written in name order after the data; the name lives in the names block */
+struct pack_entry {
+    uint64_t offset;       /* of the stored bytes from the start of the archive */
+    uint64_t stored_size;
+    uint64_t size;         /* of the report */
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t hash;         /* XXH64 of the report */
+    uint32_t method;
+    uint32_t name_offset;  /* into the names block, NUL-terminated */
+};
+
+/* An archive being written; workers append concurrently */
+struct pack_writer {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    int fd;
+    uint64_t end;  /* next free offset, reserved atomically */
+};
+
+/* An archive mapped for reading */
+struct pack_reader {
+    int fd;
+    const unsigned char *map;
+    size_t map_size;
+    const struct pack_entry *entries;
+    const char *names;
+    size_t names_size;
+    size_t count;
+};
+
+/* Start an archive, written under a temporary name until pack_finish */
+int pack_create(struct pack_writer *pack, const char *path);
+
+/* Compress and append a block of memory, filling entry except for the name and mtime; thread-safe */
+int pack_add_data(struct pack_writer *pack, const void *data, size_t len, struct pack_entry *entry);
+
+/* Append bytes as they are, setting only the entry's offset and stored size; thread-safe */
+int pack_add_raw(struct pack_writer *pack, const void *data, size_t len, struct pack_entry *entry);
+
+/* Compress and append a file, filling entry except for the name; safe to call from several threads */
+int pack_add_file(struct pack_writer *pack, const char *path, struct pack_entry *entry);
+
+/* Append an entry's stored bytes from another archive without decompressing them */
+int pack_copy_entry(struct pack_writer *pack, const struct pack_reader *from, const struct pack_entry *src,
+                    struct pack_entry *entry);
+
+/* Write the index of names[i] -> entries[i], sync and move the archive into place */
+int pack_finish(struct pack_writer *pack, struct pack_entry *entries, char *const *names, size_t count);
+
+/* Remove an unfinished archive */
+void pack_abort(struct pack_writer *pack);
+
+/* Map an archive and check its index */
+int pack_open(struct pack_reader *pack, const char *path);
+
+/* Find an entry by name, NULL if absent */
+const struct pack_entry *pack_find(const struct pack_reader *pack, const char *name);
+
+/* Name of an entry */
+const char *pack_entry_name(const struct pack_reader *pack, const struct pack_entry *entry);
+
+/* Write an entry's report to fd, decompressing as it goes; fails with EIO if the stored bytes are damaged,
+   EINVAL for chunked entries, which only the chunk store can put together */
+int pack_extract(const struct pack_reader *pack, const struct pack_entry *entry, int fd);
+
+/* Unmap an archive */
+void pack_close(struct pack_reader *pack);
+
+#endif /* PACK_H */
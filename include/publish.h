@@ -0,0 +1,38 @@
+/* publish.h - Generation-swap publishing of the dashboard */
+
+#ifndef PUBLISH_H
+#define PUBLISH_H
+
+#include <stddef.h>
+
+struct shard;
+
+/* Make the shard's dashboard a symlink to the current generation, migrating an old directory */
+int init_publishing(const struct shard *shard);
+
+/* Resolve the generation directory the dashboard currently points at */
+int current_generation(const struct shard *shard, char *path, size_t size);
+
+/* Create a new generation holding hard links to every report in the current one */
+int begin_generation(const struct shard *shard, char *gen_dir, size_t size);
+
+/* Create a new, empty generation */
+int begin_empty_generation(const struct shard *shard, char *gen_dir, size_t size);
+
+/* Atomically point the dashboard at the generation and prune old generations */
+int commit_generation(const struct shard *shard, const char *gen_dir);
+
+/* Where the hashes of a generation's reports are kept, outside the generation itself */
+int generation_digest_path(const struct shard *shard, const char *gen_dir, char *path, size_t size);
+
+/* Discard a generation that was never published */
+void abort_generation(const char *gen_dir);
+
+/* Discard generations newer than the published one that a crash left holding only links to older
+   reports; the caller holds the directory lock and has no journaled transfer to finish */
+void remove_unpublished_generations(const struct shard *shard);
+
+/* Point the dashboard back at the previous generation; the caller holds the directory lock */
+int rollback_generation(const struct shard *shard);
+
+#endif /* PUBLISH_H */
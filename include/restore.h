@@ -0,0 +1,32 @@
+/* restore.h - Point-in-time restore of the dashboard from snapshot archives */
+
+#ifndef RESTORE_H
+#define RESTORE_H
+
+#include <stddef.h>
+#include <linux/limits.h>
+
+#include "audit.h"
+#include "backup.h"
+#include "shard.h"
+
+/* What to restore: reports of the newest snapshot at or before a time, optionally filtered */
+struct restore_request {
+    char at[SNAPSHOT_STAMP_LEN + 1];          /* YYYYMMDD_HHMMSS */
+    struct department_registry departments;   /* only these departments, any when empty */
+    char pattern[NAME_MAX + 1];               /* only names matching this glob, any when empty */
+    char shard[SHARD_NAME_MAX];               /* only this shard, every shard when empty */
+};
+
+/* Turn a time like 2024-01-31, 2024-01-31 13:45[:00] or 20240131_134500 into a YYYYMMDD_HHMMSS stamp;
+   a date alone means the end of that day, a time without seconds the end of that minute */
+int parse_restore_time(const char *text, char *stamp, size_t size);
+
+/* Read a request from control arguments: at=STAMP [dept=LIST] [file=GLOB] [shard=NAME] */
+int parse_restore_args(const char *args, struct restore_request *request, char *error, size_t size);
+
+/* Extract the matching reports of the snapshot into a new generation and publish it */
+int restore_reports(struct shard *shard, const struct restore_request *request, struct run_summary *summary,
+                    char *snapshot, size_t size);
+
+#endif /* RESTORE_H */
@@ -0,0 +1,37 @@
+/* retention.h - Tiered retention and garbage collection of backup snapshots */
+
+#ifndef RETENTION_H
+#define RETENTION_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Which snapshots to keep: every one for a while, then one a day, then one a month,
+   within an optional limit on the disk space they use */
+struct retention_policy {
+    int keep_all_days;
+    int keep_daily_days;
+    int keep_monthly_months;
+    long long budget;  /* bytes, 0 for no limit */
+};
+
+/* Outcome of a collection pass */
+struct gc_result {
+    int kept;
+    int deleted;
+    int pending;             /* expired snapshots left for the next pass */
+    long long freed;         /* bytes the deletions gave back to the filesystem */
+    long long disk_bytes;    /* used by the kept snapshots and their chunk containers */
+    long long report_bytes;  /* of reports in the kept snapshots */
+};
+
+struct shard;
+
+/* Delete snapshots the policy no longer keeps, a few per pass, and update the catalog
+   of snapshot sizes in the backup directory */
+int collect_snapshots(struct shard *shard, struct gc_result *result);
+
+/* Print the shard's snapshots and space use from the catalog, without opening the snapshots */
+int print_snapshot_usage(const struct shard *shard, FILE *out);
+
+#endif /* RETENTION_H */
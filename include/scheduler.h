@@ -0,0 +1,56 @@
+/* scheduler.h - timerfd based job scheduler */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* A scheduled job */
+typedef void (*scheduled_fn)(void);
+
+/* Parsed five-field cron expression: minute hour day-of-month month day-of-week */
+struct cron_expr {
+    uint64_t minutes;
+    uint32_t hours;
+    uint32_t days;
+    uint16_t months;
+    uint8_t weekdays;
+    int any_day;      /* day-of-month field was '*' */
+    int any_weekday;  /* day-of-week field was '*' */
+};
+
+/* Parse a cron expression (also @hourly, @daily, @weekly, @monthly) */
+int parse_cron(const char *text, struct cron_expr *expr);
+
+/* First time strictly after 'after' that matches the expression, -1 if none */
+time_t next_cron_time(const struct cron_expr *expr, time_t after);
+
+/* Create the timer and load persisted run times, returns the timerfd or -1 */
+int init_scheduler();
+
+/* Get the timer file descriptor to add to an epoll set */
+int scheduler_fd();
+
+/* Run fn on a cron schedule; catch_up runs it once at startup if a run was missed */
+int schedule_cron(const char *name, const char *expr, int jitter, int catch_up, scheduled_fn fn);
+
+/* Run fn every 'seconds' seconds */
+int schedule_interval(const char *name, int seconds, int jitter, scheduled_fn fn);
+
+/* Register fn to run only when triggered */
+int schedule_on_demand(const char *name, scheduled_fn fn);
+
+/* Run a job 'delay' seconds from now, unless it is already due sooner */
+void trigger_job(int job_id, int delay);
+
+/* Run every job that is due and re-arm the timer, call when the timerfd is readable */
+int run_due_jobs();
+
+/* Seconds until the next job, -1 if nothing is scheduled */
+long seconds_until_next_job();
+
+/* Stop the timer */
+void cleanup_scheduler();
+
+#endif /* SCHEDULER_H */
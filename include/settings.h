@@ -0,0 +1,51 @@
+/* settings.h - Runtime configuration from the config file and command line */
+
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <linux/limits.h>
+
+#include "shard.h"
+
+/* Daemon-wide settings and the shards it serves */
+struct daemon_settings {
+    char pid_file[PATH_MAX];
+    char control_socket[PATH_MAX];
+    char log_dir[PATH_MAX];
+    char log_file[PATH_MAX];
+    char change_log_file[PATH_MAX];
+    char metrics_file[PATH_MAX];
+    char state_dir[PATH_MAX];
+    char scheduler_state_file[PATH_MAX];
+    int check_interval;
+    int settle_seconds;
+    int workers;
+    int publish;            /* default for shards that do not set it */
+    int io_backend;         /* IO_BACKEND_URING or IO_BACKEND_THREADS, see transfer.h */
+    int log_full_policy;    /* LOG_FULL_BLOCK, LOG_FULL_DROP or LOG_FULL_COUNT */
+    int audit_days;
+    int late_after_hours;
+    struct department_registry departments;  /* for shards that list none */
+    struct retention_policy retention;
+    int shard_count;
+    struct shard shards[MAX_SHARDS];
+};
+
+extern struct daemon_settings settings;
+
+/* Reset to the compiled-in defaults from config.h */
+void default_settings();
+
+/* Read a config file; a missing file is only an error when required */
+int load_settings_file(const char *path, int required);
+
+/* Apply one "key = value" setting, to a named shard or (NULL) the daemon */
+int apply_setting(const char *shard_name, const char *key, const char *value);
+
+/* Fill in derived paths and check the result, call once everything is applied */
+int finish_settings();
+
+/* Find a shard by name */
+struct shard *find_shard(const char *name);
+
+#endif /* SETTINGS_H */
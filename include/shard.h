@@ -0,0 +1,139 @@
+/* shard.h - Upload, dashboard and backup directory triples, each served by its own thread */
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "audit.h"
+#include "file_index.h"
+#include "file_ops.h"
+#include "journal.h"
+#include "retention.h"
+#include "watcher.h"
+
+#define SHARD_NAME_MAX 32
+
+/* Name of the shard made from the single-directory settings */
+#define DEFAULT_SHARD "default"
+
+/* When uploads reach the dashboard: in the nightly batch, or as soon as each is complete */
+#define PUBLISH_NIGHTLY    1
+#define PUBLISH_CONTINUOUS 2
+
+/* Jobs a shard thread can run, combined as a bit mask */
+#define SHARD_AUDIT    0x01
+#define SHARD_SCAN     0x02
+#define SHARD_BACKUP   0x04
+#define SHARD_TRANSFER 0x08
+#define SHARD_RESTORE  0x10  /* needs shard->restore */
+#define SHARD_GC       0x20  /* also run after every backup */
+#define SHARD_ROLLBACK 0x40
+
+/* Results of jobs run synchronously on a shard */
+struct shard_report {
+    int status;        /* 0 if every job succeeded */
+    int changes;       /* changes found by SHARD_SCAN */
+    int audit_status;
+    struct audit_result audit;
+    int backup_status;
+    int transfer_status;
+    int restore_status;
+    int gc_status;
+    int rollback_status;
+    struct gc_result gc;
+    struct run_summary backup;
+    struct run_summary transfer;
+    struct run_summary restore;
+    char restored_from[PATH_MAX];  /* snapshot archive */
+};
+
+struct restore_request;
+
+/* An upload waiting to be published by a continuous shard */
+struct pending_upload {
+    char name[NAME_MAX + 1];
+    int64_t size;
+    int64_t mtime_ns;
+    long checked_at;  /* monotonic seconds: last size/mtime check, or when it became ready */
+    int ready;        /* complete, waiting for the next publish */
+};
+
+/* One directory triple with its index, watch and worker thread */
+struct shard {
+    char name[SHARD_NAME_MAX];
+    char upload_dir[PATH_MAX];
+    char report_dir[PATH_MAX];      /* symlink to the published generation */
+    char generation_dir[PATH_MAX];
+    char backup_dir[PATH_MAX];
+    char quarantine_dir[PATH_MAX];  /* malformed uploads */
+    char index_file[PATH_MAX];
+    char journal_file[PATH_MAX];
+    char digest_dir[PATH_MAX];      /* hashes of each generation's reports */
+    char audit_file[PATH_MAX];      /* summary written by the missing-report audit */
+    struct department_registry departments;
+    int workers;
+    long long backup_budget;        /* bytes, 0 for the daemon-wide budget */
+    int publish;                    /* PUBLISH_NIGHTLY or PUBLISH_CONTINUOUS */
+
+    /* Runtime state */
+    struct file_index index;
+    int index_loaded;
+    struct watcher watcher;
+    pthread_mutex_t dir_mutex;
+    struct transfer_journal journal;  /* open while a transfer runs */
+    int quarantined;                /* uploads quarantined by the running transfer's workers */
+    struct file_index digest;       /* hashes of the published reports */
+    int digest_loaded;
+    const struct restore_request *restore;  /* set for SHARD_RESTORE by whoever requests it */
+
+    pthread_t thread;
+    int thread_running;
+    int epoll_fd;                   /* waits on the watcher and event_fd */
+    int event_fd;                   /* wakes the thread for new requests */
+    pthread_mutex_t request_mutex;
+    pthread_cond_t request_done;
+    int pending_jobs;               /* fire-and-forget requests */
+    int sync_jobs;                  /* request someone is waiting for */
+    int sync_done;
+    int stopping;
+    struct shard_report sync_report;
+
+    /* Continuous publishing, owned by the shard thread, sorted by name */
+    int timer_fd;
+    struct pending_upload *pending;
+    size_t pending_count;
+    size_t pending_capacity;
+};
+
+/* Set up the shard's locks and create its directories */
+int init_shard(struct shard *shard);
+
+/* Start the shard thread and its upload watch, returns 0 if the thread runs */
+int start_shard(struct shard *shard);
+
+/* Check whether the shard's uploads are watched with inotify */
+int shard_watching(const struct shard *shard);
+
+/* Queue jobs without waiting (run inline if the thread is not running) */
+void post_shard_jobs(struct shard *shard, int jobs);
+
+/* Run jobs on every shard at once and wait for all of them; one caller at a time (the control worker) */
+int run_jobs_on_shards(struct shard *shards, int count, int jobs, struct shard_report *reports);
+
+/* Note a written upload; a continuous shard publishes it once its size and mtime settle */
+void track_upload(struct shard *shard, const char *name, const struct stat *st);
+
+/* Stop the thread and release the shard */
+void stop_shard(struct shard *shard);
+
+/* Descriptor the main loop polls: readable after a shard handled upload events */
+int shard_activity_fd();
+
+/* Reset the activity descriptor after it became readable */
+void clear_shard_activity();
+
+#endif /* SHARD_H */
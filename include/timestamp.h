@@ -0,0 +1,21 @@
+/* timestamp.h - Cached timestamp formatting */
+
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#include <time.h>
+
+/* Timestamp formats */
+#define TS_LOG      0  /* 2024-01-31 13:45:00, log lines and change records */
+#define TS_SNAPSHOT 1  /* 20240131_134500, backup directory names */
+#define TS_DATE     2  /* 20240131, report file dates */
+#define TS_FORMATS  3
+
+/* Format a timestamp in local time. The result is borrowed: it is owned by
+   the calling thread and stays valid until its next call with the same format. */
+const char *format_timestamp(time_t timestamp, int format);
+
+/* Format the current time */
+const char *current_timestamp(int format);
+
+#endif /* TIMESTAMP_H */
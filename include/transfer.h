@@ -0,0 +1,43 @@
+/* transfer.h - Native file transfer engine */
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <limits.h>
+#include <sys/types.h>
+
+/* How a file reached its destination */
+#define TRANSFER_RENAME 0
+#define TRANSFER_COPY   1
+
+/* How batches of files are moved */
+#define IO_BACKEND_URING   1  /* one io_uring per batch, worker threads if the kernel refuses it */
+#define IO_BACKEND_THREADS 2  /* a worker pool job per file */
+
+/* Outcome of transferring a single file */
+struct transfer_result {
+    char name[NAME_MAX + 1];
+    off_t bytes;
+    mode_t mode;  /* of the file as it arrived, 0 if unknown */
+    int method;
+    int error;    /* errno value, 0 on success */
+};
+
+/* Copy a file to dst_path via a temporary file, fsync and rename into place */
+int copy_file(const char *src_path, const char *dst_path, off_t *bytes_copied);
+
+/* Delete the temporary files of copies into dir that were cut short */
+void remove_copy_leftovers(const char *dir);
+
+/* Move src_dir/name to dst_dir/name, renaming when possible and copying across filesystems */
+int transfer_file(const char *src_dir, const char *dst_dir, const char *name, struct transfer_result *result);
+
+/* Whether transfer_files can batch through io_uring */
+int transfer_batch_available(void);
+
+/* Move names[i] from src_dir to dst_dir for every i through one io_uring, renaming in batches and
+   copying across filesystems with registered buffers; returns the number that failed */
+int transfer_files(const char *src_dir, const char *dst_dir, char *const *names, size_t count,
+                   struct transfer_result *results);
+
+#endif /* TRANSFER_H */
@@ -0,0 +1,60 @@
+/* uring.h - Minimal io_uring rings driven by raw system calls, for batched file I/O */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* A ring and its mappings; one thread submits and reaps */
+struct uring {
+    int fd;
+    unsigned queued;  /* entries filled in since the last submit */
+
+    void *sq_map;
+    size_t sq_map_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    void *cq_map;
+    size_t cq_map_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+/* Whether the kernel allows io_uring and has every operation the batched transfer needs; checked once */
+int uring_available(void);
+
+/* Set up a ring with room for entries submissions */
+int uring_init(struct uring *ring, unsigned entries);
+
+/* Register buffers for READ_FIXED and WRITE_FIXED */
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, unsigned count);
+
+/* Register count empty file slots for direct descriptors */
+int uring_register_file_slots(struct uring *ring, unsigned count);
+
+/* Next free submission entry, cleared, or NULL if the queue is full */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/* Submit the queued entries and wait for at least wait completions */
+int uring_submit_and_wait(struct uring *ring, unsigned wait);
+
+/* Oldest unread completion, or NULL if none is ready */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+/* Mark the completion returned by uring_peek_cqe as read */
+void uring_cqe_seen(struct uring *ring);
+
+/* Unmap and close the ring, dropping registered buffers and files */
+void uring_exit(struct uring *ring);
+
+#endif /* URING_H */
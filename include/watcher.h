@@ -0,0 +1,31 @@
+/* watcher.h - Event-driven watcher for the upload directory */
+
+#ifndef WATCHER_H
+#define WATCHER_H
+
+/* Result of draining the watcher: events handled, or a request for a full rescan */
+#define WATCHER_OVERFLOW -2
+
+/* An inotify watch on one directory */
+struct watcher {
+    int fd;
+    int wd;
+    const char *dir;  /* Watched again if the watch is dropped */
+    int lost;         /* Closed after the watch was dropped and could not be added again */
+    void *owner;      /* Passed to the event callback */
+};
+
+/* Called for each XML file written into (removed 0) or taken out of (removed 1) the directory */
+typedef void (*watch_event_fn)(void *owner, const char *name, int removed);
+
+/* Start watching a directory with inotify, returns the inotify fd or -1 */
+int init_watcher(struct watcher *watcher, const char *dir_path, void *owner);
+
+/* Drain pending events, returns events handled, WATCHER_OVERFLOW or -1
+   A watch the kernel dropped is added again; if that fails the watcher is closed and marked lost */
+int process_watcher_events(struct watcher *watcher, watch_event_fn on_event);
+
+/* Stop watching and release the inotify descriptor */
+void cleanup_watcher(struct watcher *watcher);
+
+#endif /* WATCHER_H */
@@ -0,0 +1,29 @@
+/* worker_pool.h - Bounded pthread worker pool for file jobs */
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+/* A unit of work, returns bytes processed or -1 on failure. The job owns arg. */
+typedef long long (*pool_job_fn)(void *arg);
+
+struct worker_pool;
+
+/* Create a pool with the given number of workers and queue slots */
+struct worker_pool *pool_create(const char *label, int workers, int queue_size);
+
+/* Queue a job, blocking while the queue is full */
+int pool_submit(struct worker_pool *pool, pool_job_fn fn, void *arg);
+
+/* Wait until every submitted job has finished */
+void pool_wait(struct worker_pool *pool);
+
+/* Totals across all workers since the pool was created */
+void pool_totals(struct worker_pool *pool, int *done, int *failed, long long *bytes);
+
+/* Log per-worker throughput to the daemon log */
+void pool_log_stats(struct worker_pool *pool);
+
+/* Finish outstanding jobs, stop the workers and free the pool */
+void pool_destroy(struct worker_pool *pool);
+
+#endif /* WORKER_POOL_H */
@@ -0,0 +1,17 @@
+/* xml_check.h - Well-formedness check for uploaded reports */
+
+#ifndef XML_CHECK_H
+#define XML_CHECK_H
+
+#include <stddef.h>
+
+/* Room for the reason a report was rejected */
+#define XML_REASON_MAX 160
+
+/* Check a memory block, returns 0 if it is well-formed XML, 1 if not (reason says why) */
+int check_xml(const char *data, size_t len, char *reason, size_t size);
+
+/* Check a file by reading it into memory, returns 0 if well-formed, 1 if not, -1 if it could not be read */
+int check_xml_file(const char *path, char *reason, size_t size);
+
+#endif /* XML_CHECK_H */
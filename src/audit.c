@@ -0,0 +1,360 @@
+/* audit.c - Implementation of the department registry and missing-report audit */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "../include/config.h"
+#include "../include/audit.h"
+#include "../include/hash.h"
+#include "../include/logging.h"
+#include "../include/publish.h"
+#include "../include/settings.h"
+#include "../include/shard.h"
+
+#ifndef DT_REG
+#define DT_REG 8  // Value for regular files
+#endif
+#ifndef DT_UNKNOWN
+#define DT_UNKNOWN 0
+#endif
+
+#define DATE_TOKEN_LEN 8  // YYYYMMDD
+
+// Reports counted for each department and day of the window, yesterday first
+struct audit {
+    const struct department_registry *registry;
+    long last_day;           // yesterday, as days since the epoch
+    int days;
+    time_t *deadlines;       // per day: reports modified after this are late
+    char (*dates)[DATE_TOKEN_LEN + 1];
+    int *reports;            // [department * days + day]
+    int *late;
+};
+
+static size_t department_slot(const char *name, size_t len) {
+    return (size_t) hash_bytes(name, len, 0) & (DEPARTMENT_SLOTS - 1);
+}
+
+int find_department(const struct department_registry *registry, const char *name, size_t len) {
+    if (registry->count == 0 || len == 0 || len >= DEPARTMENT_NAME_MAX) {
+        return -1;
+    }
+
+    // Open addressing with linear probing; the table is never more than half full
+    for (size_t slot = department_slot(name, len); registry->slots[slot] >= 0;
+         slot = (slot + 1) & (DEPARTMENT_SLOTS - 1)) {
+        const char *known = registry->names[registry->slots[slot]];
+        if (strncmp(known, name, len) == 0 && known[len] == '\0') {
+            return registry->slots[slot];
+        }
+    }
+    return -1;
+}
+
+// Department names are plain words, the separators of report names cannot appear in them
+static int add_department(struct department_registry *registry, const char *name, size_t len) {
+    size_t slot;
+
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char) name[i])) {
+            log_message(CLOG_ERROR, "Invalid department name: %.*s", (int) len, name);
+            return -1;
+        }
+    }
+    if (len >= DEPARTMENT_NAME_MAX) {
+        log_message(CLOG_ERROR, "Department name too long: %.*s", (int) len, name);
+        return -1;
+    }
+    if (registry->count == 0) {
+        memset(registry->slots, 0xff, sizeof(registry->slots));  // All -1
+    }
+    if (find_department(registry, name, len) >= 0) {
+        return 0;
+    }
+    if (registry->count == MAX_DEPARTMENTS) {
+        log_message(CLOG_ERROR, "Too many departments, at most %d are supported", MAX_DEPARTMENTS);
+        return -1;
+    }
+
+    slot = department_slot(name, len);
+    while (registry->slots[slot] >= 0) {
+        slot = (slot + 1) & (DEPARTMENT_SLOTS - 1);
+    }
+    memcpy(registry->names[registry->count], name, len);
+    registry->names[registry->count][len] = '\0';
+    registry->slots[slot] = (int16_t) registry->count++;
+    return 0;
+}
+
+int add_departments(struct department_registry *registry, const char *list) {
+    const char *p = list;
+
+    while (*p != '\0') {
+        size_t len = strcspn(p, ", \t");
+        if (len > 0 && add_department(registry, p, len) != 0) {
+            return -1;
+        }
+        p += len;
+        p += strspn(p, ", \t");
+    }
+    return 0;
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date
+static long days_from_civil(long year, int month, int day) {
+    long era;
+    long year_of_era;
+    long day_of_year;
+    long day_of_era;
+
+    year -= month <= 2;
+    era = (year >= 0 ? year : year - 399) / 400;
+    year_of_era = year - era * 400;
+    day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+
+// Reading a YYYYMMDD token, -1 if it is not a date
+static long parse_date_token(const char *token) {
+    int year = 0, month = 0, day = 0;
+
+    for (int i = 0; i < DATE_TOKEN_LEN; i++) {
+        if (token[i] < '0' || token[i] > '9') {
+            return -1;
+        }
+    }
+    year = (token[0] - '0') * 1000 + (token[1] - '0') * 100 + (token[2] - '0') * 10 + (token[3] - '0');
+    month = (token[4] - '0') * 10 + (token[5] - '0');
+    day = (token[6] - '0') * 10 + (token[7] - '0');
+    if (month < 1 || month > 12 || day < 1 || day > 31) {
+        return -1;
+    }
+    return days_from_civil(year, month, day);
+}
+
+// Splitting a report name on '_', '-' and '.' in one pass: the first registered department
+// and the first YYYYMMDD token identify the report, e.g. sales_20240131_0001.xml
+int parse_report_name(const struct department_registry *registry, const char *name, int *department, long *day) {
+    const char *token = name;
+
+    *department = -1;
+    *day = -1;
+    for (const char *p = name;; p++) {
+        if (*p == '_' || *p == '-' || *p == '.' || *p == '\0') {
+            size_t len = p - token;
+            long date = len == DATE_TOKEN_LEN && *day < 0 ? parse_date_token(token) : -1;
+
+            if (date >= 0) {
+                *day = date;
+            } else if (*department < 0) {
+                *department = find_department(registry, token, len);
+            }
+            if (*p == '\0' || (*department >= 0 && *day >= 0)) {
+                break;
+            }
+            token = p + 1;
+        }
+    }
+    return *department >= 0 && *day >= 0 ? 0 : -1;
+}
+
+// Counting the reports of one directory; names also in skip_fd are counted there instead
+static int count_reports(struct audit *audit, const char *path, int skip_fd) {
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    int department;
+    long day;
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        log_message(CLOG_ERROR, "Failed to open %s for the report audit: %s", path, strerror(errno));
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        long index;
+
+        if ((entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN) || strstr(entry->d_name, ".xml") == NULL ||
+            parse_report_name(audit->registry, entry->d_name, &department, &day) != 0) {
+            continue;
+        }
+        index = audit->last_day - day;
+        if (index < 0 || index >= audit->days) {
+            continue;
+        }
+        if (skip_fd >= 0 && faccessat(skip_fd, entry->d_name, F_OK, 0) == 0) {
+            continue;  // A replacement for a published report, not a second report
+        }
+        if (fstatat(dirfd(dir), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        audit->reports[department * audit->days + index]++;
+        if (st.st_mtime > audit->deadlines[index]) {
+            audit->late[department * audit->days + index]++;
+        }
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+// Laying out the window: dates and deadlines of the audit_days days before today
+static int init_audit(struct audit *audit, const struct shard *shard) {
+    time_t now = time(NULL);
+    struct tm today;
+    size_t cells;
+
+    memset(audit, 0, sizeof(*audit));
+    audit->registry = &shard->departments;
+    audit->days = settings.audit_days;
+
+    localtime_r(&now, &today);
+    audit->last_day = days_from_civil(today.tm_year + 1900L, today.tm_mon + 1, today.tm_mday) - 1;
+
+    cells = (size_t) audit->registry->count * audit->days;
+    audit->deadlines = calloc(audit->days, sizeof(*audit->deadlines));
+    audit->dates = calloc(audit->days, sizeof(*audit->dates));
+    audit->reports = calloc(cells > 0 ? cells : 1, sizeof(*audit->reports));
+    audit->late = calloc(cells > 0 ? cells : 1, sizeof(*audit->late));
+    if (audit->deadlines == NULL || audit->dates == NULL || audit->reports == NULL || audit->late == NULL) {
+        log_message(CLOG_ERROR, "Failed to allocate the report audit: %s", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < audit->days; i++) {
+        struct tm day = today;
+
+        // Local midnight ending the day, then the day itself; mktime normalises across months
+        day.tm_hour = day.tm_min = day.tm_sec = 0;
+        day.tm_isdst = -1;
+        day.tm_mday -= i;
+        audit->deadlines[i] = mktime(&day) + (time_t) settings.late_after_hours * 3600;
+
+        day.tm_mday -= 1;
+        day.tm_isdst = -1;
+        mktime(&day);
+        if (snprintf(audit->dates[i], sizeof(audit->dates[i]), "%04d%02d%02d", day.tm_year + 1900, day.tm_mon + 1,
+                     day.tm_mday) >= (int) sizeof(audit->dates[i])) {
+            log_message(CLOG_ERROR, "Audit date out of range");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void free_audit(struct audit *audit) {
+    free(audit->deadlines);
+    free(audit->dates);
+    free(audit->reports);
+    free(audit->late);
+}
+
+// Writing one row per department and day through a temporary file, oldest day first
+static int write_audit_summary(const struct audit *audit, const char *path) {
+    char tmp_path[PATH_MAX];
+    FILE *fp;
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int) sizeof(tmp_path)) {
+        return -1;
+    }
+    fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        log_message(CLOG_ERROR, "Failed to write audit summary %s: %s", tmp_path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(fp, "date,department,reports,late,status\n");
+    for (int i = audit->days - 1; i >= 0; i--) {
+        for (int d = 0; d < audit->registry->count; d++) {
+            int reports = audit->reports[d * audit->days + i];
+            int late = audit->late[d * audit->days + i];
+            const char *status = "ok";
+
+            if (reports == 0) {
+                status = "missing";
+            } else if (reports > 1) {
+                status = "duplicate";
+            } else if (late > 0) {
+                status = "late";
+            }
+            fprintf(fp, "%s,%s,%d,%d,%s\n", audit->dates[i], audit->registry->names[d], reports, late, status);
+        }
+    }
+
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        log_message(CLOG_ERROR, "Failed to write audit summary %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Counting reports in the uploads and the published dashboard, so continuous shards are audited too
+int check_missing_reports(struct shard *shard, struct audit_result *result) {
+    struct audit audit;
+    char published[PATH_MAX];
+    int published_fd = -1;
+    int missing = 0, late = 0, duplicate = 0;
+    int ret = -1;
+
+    if (result != NULL) {
+        memset(result, 0, sizeof(*result));
+    }
+
+    if (init_audit(&audit, shard) != 0) {
+        free_audit(&audit);
+        return -1;
+    }
+
+    if (current_generation(shard, published, sizeof(published)) == 0) {
+        published_fd = open(published, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (count_reports(&audit, shard->upload_dir, published_fd) == 0 &&
+        (published_fd < 0 || count_reports(&audit, published, -1) == 0)) {
+        ret = 0;
+    }
+    if (published_fd >= 0) {
+        close(published_fd);
+    }
+
+    if (ret == 0) {
+        for (int i = audit.days - 1; i >= 0; i--) {
+            for (int d = 0; d < audit.registry->count; d++) {
+                int reports = audit.reports[d * audit.days + i];
+
+                if (reports == 0) {
+                    log_message(CLOG_WARNING, "Missing %s report for %s", audit.registry->names[d], audit.dates[i]);
+                    missing++;
+                } else if (reports > 1) {
+                    duplicate++;
+                }
+                late += audit.late[d * audit.days + i] > 0;
+            }
+        }
+
+        log_message(missing > 0 ? CLOG_WARNING : CLOG_INFO,
+                    "Report audit of %s over %d days: %d missing, %d late, %d duplicate",
+                    shard->name, audit.days, missing, late, duplicate);
+        ret = write_audit_summary(&audit, shard->audit_file);
+        if (result != NULL) {
+            result->missing = missing;
+            result->late = late;
+            result->duplicate = duplicate;
+        }
+    }
+
+    free_audit(&audit);
+    return ret;
+}
@@ -0,0 +1,460 @@
+/* backup.c - Implementation of incremental report snapshots */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <linux/limits.h>
+
+#include "../include/config.h"
+#include "../include/backup.h"
+#include "../include/chunk.h"
+#include "../include/file_ops.h"
+#include "../include/hash.h"
+#include "../include/logging.h"
+#include "../include/metrics.h"
+#include "../include/pack.h"
+#include "../include/publish.h"
+#include "../include/shard.h"
+#include "../include/timestamp.h"
+#include "../include/worker_pool.h"
+
+#ifndef DT_REG
+#define DT_REG 8  // Value for regular files
+#endif
+
+// Shared state for one backup run
+struct backup_run {
+    char source_dir[PATH_MAX];
+    char snapshot_path[PATH_MAX];
+    char prev_path[PATH_MAX];
+    struct pack_writer pack;
+    struct pack_reader prev;
+    int have_prev;
+    struct chunk_store chunks;
+};
+
+// One report queued for backup, filled in by the worker
+struct backup_item {
+    struct backup_run *run;
+    struct pack_entry *entry;
+    char *name;
+    int linked;
+    int ok;
+};
+
+// Snapshot archives are named YYYYMMDD_HHMMSS.pack
+static int is_snapshot_name(const char *name) {
+    if (strlen(name) != SNAPSHOT_STAMP_LEN + strlen(PACK_SUFFIX) || name[8] != '_' ||
+        strcmp(name + SNAPSHOT_STAMP_LEN, PACK_SUFFIX) != 0) {
+        return 0;
+    }
+    for (int i = 0; i < SNAPSHOT_STAMP_LEN; i++) {
+        if (i != 8 && (name[i] < '0' || name[i] > '9')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int find_latest_snapshot(const struct shard *shard, char *path, size_t size) {
+    return find_snapshot_at(shard, NULL, path, size);
+}
+
+// Names sort by time, so the newest archive at or before stamp is the last one not above it;
+// unfinished archives still carry their temporary name
+int find_snapshot_at(const struct shard *shard, const char *stamp, char *path, size_t size) {
+    struct dirent **names;
+    int count;
+    int found = -1;
+
+    count = scandir(shard->backup_dir, &names, NULL, alphasort);
+    if (count < 0) {
+        return -1;
+    }
+
+    for (int i = count - 1; i >= 0; i--) {
+        if (found != 0 && is_snapshot_name(names[i]->d_name) &&
+            (stamp == NULL || strncmp(names[i]->d_name, stamp, SNAPSHOT_STAMP_LEN) <= 0) &&
+            snprintf(path, size, "%s/%s", shard->backup_dir, names[i]->d_name) < (int) size) {
+            found = 0;
+        }
+        free(names[i]);
+    }
+    free(names);
+
+    return found;
+}
+
+// Whether a previous entry's chunks can all be used as they are
+static int chunks_current(struct backup_run *run, const struct pack_entry *prev) {
+    struct chunk_ref *refs;
+    size_t count = prev->stored_size / sizeof(*refs);
+    int ret;
+
+    if (prev->method != PACK_CHUNKED || prev->stored_size % sizeof(*refs) != 0 ||
+        prev->offset > run->prev.map_size || prev->stored_size > run->prev.map_size - prev->offset) {
+        return 0;
+    }
+    refs = malloc(count > 0 ? prev->stored_size : 1);
+    if (refs == NULL) {
+        return 0;
+    }
+    memcpy(refs, run->prev.map + prev->offset, prev->stored_size);
+    ret = chunk_store_has(&run->chunks, refs, count);
+    free(refs);
+    return ret;
+}
+
+// Cutting a report into chunks; the snapshot keeps only the list of them
+static int chunk_report(struct backup_run *run, const char *path, struct pack_entry *entry) {
+    struct chunk_ref *refs = NULL;
+    struct stat st;
+    void *map = NULL;
+    size_t count = 0;
+    int fd;
+    int ret;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    entry->size = st.st_size;
+    entry->mtime_sec = st.st_mtim.tv_sec;
+    entry->mtime_nsec = st.st_mtim.tv_nsec;
+    entry->hash = hash_bytes(map != NULL ? map : "", st.st_size, 0);
+    entry->method = PACK_CHUNKED;
+
+    ret = chunk_store_put(&run->chunks, map, st.st_size, &refs, &count);
+    if (map != NULL) {
+        munmap(map, st.st_size);
+    }
+    if (ret == 0) {
+        ret = pack_add_raw(&run->pack, refs, count * sizeof(*refs), entry);
+    }
+    free(refs);
+    return ret;
+}
+
+// Worker job reusing an unchanged report's chunk list or chunking a changed one
+static long long backup_job(void *arg) {
+    struct backup_item *item = arg;
+    struct backup_run *run = item->run;
+    struct pack_entry *entry = item->entry;
+    const struct pack_entry *prev;
+    char src_path[PATH_MAX];
+    struct stat st;
+    uint64_t hash;
+    uint64_t start;
+
+    if (snprintf(src_path, sizeof(src_path), "%s/%s", run->source_dir, item->name) >= (int) sizeof(src_path)) {
+        log_message(CLOG_ERROR, "Backup path too long for %s", item->name);
+        return -1;
+    }
+
+    // Unchanged since the previous snapshot, with every chunk still in a live container:
+    // copy its chunk list as it is
+    prev = run->have_prev ? pack_find(&run->prev, item->name) : NULL;
+    if (prev != NULL && stat(src_path, &st) == 0 && (uint64_t) st.st_size == prev->size &&
+        st.st_mtim.tv_sec == prev->mtime_sec && st.st_mtim.tv_nsec == prev->mtime_nsec &&
+        hash_file(src_path, &hash) == 0 && hash == prev->hash && chunks_current(run, prev)) {
+        if (pack_copy_entry(&run->pack, &run->prev, prev, entry) == 0) {
+            item->linked = 1;
+            item->ok = 1;
+            return (long long) entry->stored_size;
+        }
+        log_message(CLOG_WARNING, "Failed to reuse %s from previous snapshot, chunking: %s", item->name,
+                    strerror(errno));
+    }
+
+    start = metric_clock();
+    if (chunk_report(run, src_path, entry) != 0) {
+        log_message(CLOG_ERROR, "Failed to back up %s: %s", item->name, strerror(errno));
+        return -1;
+    }
+    metric_observe_since(HIST_FILE_COPY, start);
+
+    item->ok = 1;
+    return (long long) entry->stored_size;
+}
+
+// Listing the reports to back up
+static struct backup_item *list_reports(struct backup_run *run, size_t *count) {
+    DIR *dir;
+    struct dirent *entry;
+    struct backup_item *items = NULL;
+    size_t capacity = 0;
+
+    *count = 0;
+    dir = opendir(run->source_dir);
+    if (dir == NULL) {
+        log_message(CLOG_ERROR, "Failed to open report directory: %s", strerror(errno));
+        return NULL;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type != DT_REG || strstr(entry->d_name, ".xml") == NULL) {
+            continue;
+        }
+
+        if (*count == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 256;
+            struct backup_item *grown = realloc(items, new_capacity * sizeof(*grown));
+            if (grown == NULL) {
+                log_message(CLOG_ERROR, "Failed to list reports: %s", strerror(errno));
+                goto fail;
+            }
+            items = grown;
+            capacity = new_capacity;
+        }
+
+        memset(&items[*count], 0, sizeof(items[*count]));
+        items[*count].run = run;
+        items[*count].name = strdup(entry->d_name);
+        if (items[*count].name == NULL) {
+            log_message(CLOG_ERROR, "Failed to list reports: %s", strerror(errno));
+            goto fail;
+        }
+        (*count)++;
+    }
+
+    closedir(dir);
+
+    // An empty dashboard is still a valid (empty) snapshot
+    if (items == NULL) {
+        items = calloc(1, sizeof(*items));
+    }
+    return items;
+
+fail:
+    for (size_t i = 0; i < *count; i++) {
+        free(items[i].name);
+    }
+    free(items);
+    closedir(dir);
+    *count = 0;
+    return NULL;
+}
+
+// Finishing the new chunk container first, so the archive never lists chunks that are not on disk,
+// then indexing only the reports that made it into the archive, plus the list of containers it uses
+static int finish_snapshot(struct backup_run *run, struct backup_item *items, size_t count) {
+    struct pack_entry *entries = malloc((count + 1) * sizeof(*entries));
+    char **names = malloc((count + 1) * sizeof(*names));
+    char *list = NULL;
+    size_t list_len = 0;
+    size_t saved = 0;
+    int ret;
+
+    if (entries == NULL || names == NULL || chunk_store_finish(&run->chunks, &list, &list_len) != 0) {
+        free(entries);
+        free(names);
+        chunk_store_abort(&run->chunks);
+        pack_abort(&run->pack);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (items[i].ok) {
+            entries[saved] = *items[i].entry;
+            names[saved++] = items[i].name;
+        }
+    }
+
+    memset(&entries[saved], 0, sizeof(entries[saved]));
+    entries[saved].method = PACK_STORED;
+    entries[saved].size = list_len;
+    entries[saved].hash = hash_bytes(list, list_len, 0);
+    if (pack_add_raw(&run->pack, list, list_len, &entries[saved]) != 0) {
+        log_message(CLOG_ERROR, "Failed to write archive %s: %s", run->snapshot_path, strerror(errno));
+        free(entries);
+        free(names);
+        free(list);
+        pack_abort(&run->pack);
+        return -1;
+    }
+    names[saved++] = CHUNK_LIST_NAME;
+
+    ret = pack_finish(&run->pack, entries, names, saved);
+    free(entries);
+    free(names);
+    free(list);
+    return ret;
+}
+
+// Backup report directory
+int backup_reports(struct shard *shard, struct run_summary *summary) {
+    struct backup_run run;
+    struct backup_item *items = NULL;
+    struct pack_entry *entries = NULL;
+    struct worker_pool *pool;
+    struct stat st;
+    char stamp[SNAPSHOT_STAMP_LEN + 1];
+    size_t count = 0;
+    int copied = 0;
+    int linked = 0;
+    int failed = 0;
+    long long total_bytes = 0;
+    long long stored_bytes = 0;
+    uint64_t start = metric_clock();
+
+    memset(&run, 0, sizeof(run));
+    run.pack.fd = -1;
+    run.prev.fd = -1;
+    if (summary != NULL) {
+        memset(summary, 0, sizeof(*summary));
+    }
+
+    // Creating timestamp for the backup archive and its chunk container
+    snprintf(stamp, sizeof(stamp), "%s", current_timestamp(TS_SNAPSHOT));
+    if (snprintf(run.snapshot_path, PATH_MAX, "%s/%s%s", shard->backup_dir, stamp, PACK_SUFFIX) >= PATH_MAX) {
+        log_message(CLOG_ERROR, "Backup archive path too long: %s", shard->backup_dir);
+        return -1;
+    }
+    if (lstat(run.snapshot_path, &st) == 0) {
+        log_message(CLOG_ERROR, "Backup archive %s already exists", run.snapshot_path);
+        return -1;
+    }
+
+    // The newest archive is the base for unchanged reports
+    if (find_latest_snapshot(shard, run.prev_path, sizeof(run.prev_path)) == 0 &&
+        pack_open(&run.prev, run.prev_path) == 0) {
+        run.have_prev = 1;
+        log_message(CLOG_INFO, "Incremental backup based on %s (%zu reports)", run.prev_path, run.prev.count);
+    }
+
+    if (chunk_store_open(&run.chunks, shard->backup_dir) != 0) {
+        if (run.have_prev) {
+            pack_close(&run.prev);
+        }
+        return -1;
+    }
+    if (chunk_store_begin(&run.chunks, stamp) != 0 || pack_create(&run.pack, run.snapshot_path) != 0) {
+        chunk_store_close(&run.chunks);
+        if (run.have_prev) {
+            pack_close(&run.prev);
+        }
+        return -1;
+    }
+
+    // Locking directories before backup
+    if (lock_directories(shard) != 0) {
+        pack_abort(&run.pack);
+        chunk_store_close(&run.chunks);
+        if (run.have_prev) {
+            pack_close(&run.prev);
+        }
+        return -1;
+    }
+
+    // Reading from the published generation, which never changes underneath us
+    if (current_generation(shard, run.source_dir, sizeof(run.source_dir)) != 0) {
+        snprintf(run.source_dir, sizeof(run.source_dir), "%s", shard->report_dir);
+    }
+
+    items = list_reports(&run, &count);
+    entries = items != NULL ? calloc(count > 0 ? count : 1, sizeof(*entries)) : NULL;
+    pool = entries != NULL ? pool_create("backup", shard->workers, WORKER_QUEUE_SIZE) : NULL;
+    if (pool == NULL) {
+        for (size_t i = 0; items != NULL && i < count; i++) {
+            free(items[i].name);
+        }
+        free(items);
+        free(entries);
+        pack_abort(&run.pack);
+        chunk_store_close(&run.chunks);
+        if (run.have_prev) {
+            pack_close(&run.prev);
+        }
+        unlock_directories(shard);
+        return -1;
+    }
+
+    // Chunking runs on the workers, each report reserving its own range of the archive
+    // and each new chunk its own range of the container
+    for (size_t i = 0; i < count; i++) {
+        items[i].entry = &entries[i];
+        if (pool_submit(pool, backup_job, &items[i]) != 0) {
+            log_message(CLOG_ERROR, "Failed to queue %s: worker pool is shutting down", items[i].name);
+        }
+    }
+
+    pool_totals(pool, NULL, NULL, &stored_bytes);
+    pool_log_stats(pool);
+    pool_destroy(pool);
+
+    for (size_t i = 0; i < count; i++) {
+        if (!items[i].ok) {
+            failed++;
+            continue;
+        }
+        if (items[i].linked) {
+            linked++;
+        } else {
+            copied++;
+        }
+        total_bytes += (long long) entries[i].size;
+    }
+
+    if (finish_snapshot(&run, items, count) != 0) {
+        failed++;
+    }
+    stored_bytes += run.chunks.new_bytes;
+
+    if (failed == 0) {
+        log_message(CLOG_INFO, "Backup completed successfully to %s: %d chunked, %d reused, "
+                    "%lld bytes stored as %lld new (%.1f%%)", run.snapshot_path, copied, linked, total_bytes,
+                    stored_bytes, total_bytes > 0 ? 100.0 * stored_bytes / total_bytes : 100.0);
+    } else {
+        log_message(CLOG_ERROR, "Backup to %s finished with %d failures (%d chunked, %d reused)",
+                    run.snapshot_path, failed, copied, linked);
+    }
+
+    metric_add(METRIC_FILES_BACKED_UP, copied);
+    metric_add(METRIC_FILES_LINKED, linked);
+    metric_add(METRIC_BYTES_BACKED_UP, stored_bytes);
+    metric_add(METRIC_BACKUP_FAILURES, failed);
+    metric_observe_since(HIST_BACKUP_RUN, start);
+
+    if (summary != NULL) {
+        summary->files = copied;
+        summary->linked = linked;
+        summary->failed = failed;
+        summary->bytes = stored_bytes;
+        snprintf(summary->target, sizeof(summary->target), "%s", run.snapshot_path);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        free(items[i].name);
+    }
+    free(items);
+    free(entries);
+    chunk_store_close(&run.chunks);
+    if (run.have_prev) {
+        pack_close(&run.prev);
+    }
+
+    // Unlock directories after backup
+    unlock_directories(shard);
+    return failed == 0 ? 0 : -1;
+}
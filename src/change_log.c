@@ -0,0 +1,194 @@
+/* change_log.c - Implementation of the buffered change log writer */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "../include/config.h"
+#include "../include/change_log.h"
+#include "../include/logging.h"
+#include "../include/settings.h"
+
+#define CHANGE_LOG_HEADER "File,User,Timestamp,Change\n"
+
+static int change_fd = -1;
+static char change_buffer[CHANGE_LOG_BUFFER];
+static size_t change_len = 0;
+static time_t oldest_pending = 0;
+static pthread_mutex_t change_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Writing the whole buffer, retrying short writes
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Opening the change log, caller holds change_mutex
+static int open_change_log_locked() {
+    struct stat st;
+
+    // Making sure the log directory exists
+    if (stat(settings.log_dir, &st) != 0 && mkdir(settings.log_dir, 0755) != 0) {
+        log_message(CLOG_ERROR, "Failed to create log directory: %s", strerror(errno));
+        return -1;
+    }
+
+    // Read-only for everyone, the daemon keeps writing through its descriptor
+    change_fd = open(settings.change_log_file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IRGRP | S_IROTH);
+    if (change_fd < 0) {
+        log_message(CLOG_ERROR, "Failed to open change log file: %s", strerror(errno));
+        return -1;
+    }
+
+    // A new (or freshly rotated) file starts with the CSV header
+    if (fstat(change_fd, &st) == 0 && st.st_size == 0) {
+        write_all(change_fd, CHANGE_LOG_HEADER, strlen(CHANGE_LOG_HEADER));
+    }
+
+    return 0;
+}
+
+int open_change_log() {
+    int ret = 0;
+
+    pthread_mutex_lock(&change_mutex);
+    if (change_fd < 0) {
+        ret = open_change_log_locked();
+    }
+    pthread_mutex_unlock(&change_mutex);
+
+    return ret;
+}
+
+// Reopening the log if logrotate moved or removed it
+static void check_rotation_locked() {
+    struct stat path_st, fd_st;
+
+    if (change_fd < 0) {
+        return;
+    }
+
+    if (stat(settings.change_log_file, &path_st) == 0 && fstat(change_fd, &fd_st) == 0 &&
+        path_st.st_ino == fd_st.st_ino && path_st.st_dev == fd_st.st_dev) {
+        return;
+    }
+
+    log_message(CLOG_INFO, "Change log was rotated, reopening %s", settings.change_log_file);
+    close(change_fd);
+    change_fd = -1;
+}
+
+// Flushing the buffer, caller holds change_mutex
+static int flush_change_log_locked() {
+    int ret = 0;
+
+    if (change_len == 0) {
+        return 0;
+    }
+
+    check_rotation_locked();
+    if (change_fd < 0 && open_change_log_locked() != 0) {
+        return -1;  // Keep the records and retry on the next flush
+    }
+
+    if (write_all(change_fd, change_buffer, change_len) != 0) {
+        log_message(CLOG_ERROR, "Failed to write change log: %s", strerror(errno));
+        ret = -1;
+    }
+
+    change_len = 0;
+    oldest_pending = 0;
+    return ret;
+}
+
+// Buffering one change record
+void append_change_log(const char *filename, const char *username, const char *timestamp, const char *change) {
+    char record[CHANGE_LOG_BUFFER];
+    int len;
+
+    len = snprintf(record, sizeof(record), "%s,%s,%s,%s\n", filename, username, timestamp, change);
+    if (len < 0 || len >= (int) sizeof(record)) {
+        log_message(CLOG_WARNING, "Change record for %s too long, skipped", filename);
+        return;
+    }
+
+    pthread_mutex_lock(&change_mutex);
+
+    if (change_len + len > sizeof(change_buffer)) {
+        flush_change_log_locked();
+    }
+    if (change_len + len > sizeof(change_buffer)) {
+        // Still failing to flush: drop the oldest records rather than block
+        log_message(CLOG_WARNING, "Change log buffer full, dropping %zu bytes", change_len);
+        change_len = 0;
+    }
+
+    memcpy(change_buffer + change_len, record, len);
+    change_len += len;
+    if (oldest_pending == 0) {
+        oldest_pending = time(NULL);
+    }
+
+    pthread_mutex_unlock(&change_mutex);
+}
+
+int flush_change_log() {
+    int ret;
+
+    pthread_mutex_lock(&change_mutex);
+    ret = flush_change_log_locked();
+    pthread_mutex_unlock(&change_mutex);
+
+    return ret;
+}
+
+// Seconds until buffered records are due to be written, -1 if nothing is buffered
+int change_log_pending() {
+    int remaining = -1;
+
+    pthread_mutex_lock(&change_mutex);
+    if (change_len > 0) {
+        remaining = CHANGE_LOG_FLUSH_INTERVAL - (int) (time(NULL) - oldest_pending);
+        if (remaining < 0) {
+            remaining = 0;
+        }
+    }
+    pthread_mutex_unlock(&change_mutex);
+
+    return remaining;
+}
+
+size_t change_log_buffered() {
+    size_t len;
+
+    pthread_mutex_lock(&change_mutex);
+    len = change_len;
+    pthread_mutex_unlock(&change_mutex);
+    return len;
+}
+
+void close_change_log() {
+    pthread_mutex_lock(&change_mutex);
+    flush_change_log_locked();
+    if (change_fd >= 0) {
+        close(change_fd);
+        change_fd = -1;
+    }
+    pthread_mutex_unlock(&change_mutex);
+}
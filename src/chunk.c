@@ -0,0 +1,486 @@
+/* chunk.c - Implementation of content-defined chunking and the chunk store */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "../include/config.h"
+#include "../include/chunk.h"
+#include "../include/backup.h"
+#include "../include/hash.h"
+#include "../include/logging.h"
+#include "../include/metrics.h"
+
+// FastCDC normalized chunking masks for an 8 KiB average: harder to match (15 bits) before the
+// average size, easier (11 bits) after it, which narrows the spread of chunk sizes
+#define MASK_SMALL 0x0003590703530000ULL
+#define MASK_LARGE 0x0000d90003530000ULL
+
+// Marks an empty hash table slot
+#define SLOT_EMPTY UINT32_MAX
+
+// Smallest hash table, in slots
+#define MIN_SLOTS 1024
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// The table must never change, or new chunks stop matching old ones; splitmix64 from a fixed seed
+static void init_gear(void) {
+    uint64_t state = 0x5245504f52544443ULL;
+
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+// Bytes below the minimum size are skipped rather than hashed, since no cut can fall there
+size_t chunk_boundary(const unsigned char *data, size_t len) {
+    size_t normal = CHUNK_AVG_SIZE;
+    size_t max = len < CHUNK_MAX_SIZE ? len : CHUNK_MAX_SIZE;
+    uint64_t fp = 0;
+    size_t i = CHUNK_MIN_SIZE;
+
+    if (len <= CHUNK_MIN_SIZE) {
+        return len;
+    }
+    pthread_once(&gear_once, init_gear);
+    if (normal > max) {
+        normal = max;
+    }
+
+    for (; i < normal; i++) {
+        fp = (fp << 1) + gear[data[i]];
+        if ((fp & MASK_SMALL) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < max; i++) {
+        fp = (fp << 1) + gear[data[i]];
+        if ((fp & MASK_LARGE) == 0) {
+            return i + 1;
+        }
+    }
+    return max;
+}
+
+static void format_chunk_name(const uint64_t id[2], char *name) {
+    snprintf(name, CHUNK_NAME_LEN + 1, "%016llx%016llx", (unsigned long long) id[0], (unsigned long long) id[1]);
+}
+
+static int parse_chunk_name(const char *name, uint64_t id[2]) {
+    char half[17];
+
+    if (strlen(name) != CHUNK_NAME_LEN || strspn(name, "0123456789abcdef") != CHUNK_NAME_LEN) {
+        return -1;
+    }
+    memcpy(half, name, 16);
+    half[16] = '\0';
+    id[0] = strtoull(half, NULL, 16);
+    memcpy(half, name + 16, 16);
+    id[1] = strtoull(half, NULL, 16);
+    return 0;
+}
+
+// Containers are named YYYYMMDD_HHMMSS.chunks, after the snapshot that wrote them
+static int is_container_name(const char *name) {
+    return strlen(name) == SNAPSHOT_STAMP_LEN + strlen(CHUNK_SUFFIX) && name[8] == '_' &&
+           strspn(name, "0123456789") == 8 && strspn(name + 9, "0123456789") == 6 &&
+           strcmp(name + SNAPSHOT_STAMP_LEN, CHUNK_SUFFIX) == 0;
+}
+
+// Open addressing on the first half of the id, which is already a good hash
+static struct chunk_slot *find_slot(const struct chunk_store *store, const uint64_t id[2]) {
+    size_t i = (size_t) id[0] & store->slot_mask;
+
+    while (store->slots[i].container != SLOT_EMPTY &&
+           (store->slots[i].id[0] != id[0] || store->slots[i].id[1] != id[1])) {
+        i = (i + 1) & store->slot_mask;
+    }
+    return &store->slots[i];
+}
+
+static int resize_slots(struct chunk_store *store, size_t capacity) {
+    struct chunk_slot *old = store->slots;
+    size_t old_capacity = old != NULL ? store->slot_mask + 1 : 0;
+
+    store->slots = malloc(capacity * sizeof(*store->slots));
+    if (store->slots == NULL) {
+        store->slots = old;
+        return -1;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        store->slots[i].container = SLOT_EMPTY;
+    }
+    store->slot_mask = capacity - 1;
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].container != SLOT_EMPTY) {
+            *find_slot(store, old[i].id) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+// Keeping the table at most three quarters full
+static int reserve_slot(struct chunk_store *store) {
+    if ((store->slots_used + 1) * 4 > (store->slot_mask + 1) * 3) {
+        return resize_slots(store, (store->slot_mask + 1) * 2);
+    }
+    return 0;
+}
+
+// Where a chunk is in several containers, the one to use: a live container over a retiring one,
+// then the newest
+static int better_container(const struct chunk_store *store, uint32_t candidate, uint32_t current) {
+    if (store->containers[candidate].retiring != store->containers[current].retiring) {
+        return !store->containers[candidate].retiring;
+    }
+    return candidate > current;
+}
+
+static int index_container(struct chunk_store *store, uint32_t c) {
+    const struct pack_reader *pack = &store->containers[c].pack;
+
+    for (size_t e = 0; e < pack->count; e++) {
+        struct chunk_slot *slot;
+        uint64_t id[2];
+
+        if (parse_chunk_name(pack_entry_name(pack, &pack->entries[e]), id) != 0) {
+            continue;
+        }
+        if (reserve_slot(store) != 0) {
+            return -1;
+        }
+        slot = find_slot(store, id);
+        if (slot->container == SLOT_EMPTY) {
+            store->slots_used++;
+        } else if (!better_container(store, c, slot->container)) {
+            continue;
+        }
+        slot->id[0] = id[0];
+        slot->id[1] = id[1];
+        slot->container = c;
+        slot->entry = (uint32_t) e;
+    }
+    return 0;
+}
+
+// Opening the containers in time order; one that fails to open is left out, and the chunks
+// only it held are written again by the next backup that needs them
+int chunk_store_open(struct chunk_store *store, const char *dir) {
+    struct dirent **names;
+    struct stat st;
+    char path[PATH_MAX];
+    int count;
+
+    memset(store, 0, sizeof(*store));
+    store->writer.fd = -1;
+    snprintf(store->dir, sizeof(store->dir), "%s", dir);
+    pthread_mutex_init(&store->mutex, NULL);
+
+    count = scandir(dir, &names, NULL, alphasort);
+    if (count < 0) {
+        log_message(CLOG_ERROR, "Failed to open backup directory %s: %s", dir, strerror(errno));
+        chunk_store_close(store);
+        return -1;
+    }
+    store->containers = calloc(count > 0 ? count : 1, sizeof(*store->containers));
+    if (store->containers == NULL || resize_slots(store, MIN_SLOTS) != 0) {
+        log_message(CLOG_ERROR, "Failed to allocate chunk store: %s", strerror(errno));
+        for (int i = 0; i < count; i++) {
+            free(names[i]);
+        }
+        free(names);
+        chunk_store_close(store);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct chunk_container *container = &store->containers[store->container_count];
+
+        if (is_container_name(names[i]->d_name) &&
+            snprintf(path, sizeof(path), "%s/%s", dir, names[i]->d_name) < (int) sizeof(path) &&
+            pack_open(&container->pack, path) == 0) {
+            snprintf(container->name, sizeof(container->name), "%s", names[i]->d_name);
+            snprintf(path, sizeof(path), "%s/%.*s%s", dir, SNAPSHOT_STAMP_LEN, names[i]->d_name, PACK_SUFFIX);
+            container->retiring = stat(path, &st) != 0;
+            store->container_count++;
+        }
+        free(names[i]);
+    }
+    free(names);
+
+    for (size_t c = 0; c < store->container_count; c++) {
+        if (index_container(store, (uint32_t) c) != 0) {
+            log_message(CLOG_ERROR, "Failed to index chunk store %s: %s", dir, strerror(errno));
+            chunk_store_close(store);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int chunk_store_begin(struct chunk_store *store, const char *stamp) {
+    char path[PATH_MAX];
+
+    snprintf(store->writer_name, sizeof(store->writer_name), "%s%s", stamp, CHUNK_SUFFIX);
+    if (snprintf(path, sizeof(path), "%s/%s", store->dir, store->writer_name) >= (int) sizeof(path)) {
+        log_message(CLOG_ERROR, "Chunk container path too long: %s", store->dir);
+        return -1;
+    }
+    if (pack_create(&store->writer, path) != 0) {
+        return -1;
+    }
+    store->writing = 1;
+    return 0;
+}
+
+// Claiming a chunk for the new container; called with the mutex held
+static int claim_chunk(struct chunk_store *store, const uint64_t id[2], size_t *index) {
+    struct chunk_slot *slot;
+
+    if (store->new_count == store->new_capacity) {
+        size_t capacity = store->new_capacity ? store->new_capacity * 2 : 1024;
+        struct pack_entry *entries = realloc(store->new_entries, capacity * sizeof(*entries));
+        char (*names)[CHUNK_NAME_LEN + 1];
+
+        if (entries == NULL) {
+            return -1;
+        }
+        store->new_entries = entries;
+        names = realloc(store->new_names, capacity * sizeof(*names));
+        if (names == NULL) {
+            return -1;
+        }
+        store->new_names = names;
+        store->new_capacity = capacity;
+    }
+    if (reserve_slot(store) != 0) {
+        return -1;
+    }
+
+    slot = find_slot(store, id);
+    if (slot->container == SLOT_EMPTY) {
+        store->slots_used++;
+    }
+    slot->id[0] = id[0];
+    slot->id[1] = id[1];
+    slot->container = (uint32_t) store->container_count;
+    slot->entry = (uint32_t) store->new_count;
+
+    *index = store->new_count++;
+    memset(&store->new_entries[*index], 0, sizeof(store->new_entries[*index]));
+    format_chunk_name(id, store->new_names[*index]);
+    return 0;
+}
+
+// A chunk found in a live container (or already in the new one) is only referenced; the rest are
+// claimed under the mutex, so two workers never store the same chunk, and compressed outside it
+static int put_chunk(struct chunk_store *store, const unsigned char *data, size_t len, struct chunk_ref *ref) {
+    struct chunk_slot *slot;
+    struct pack_entry entry;
+    size_t index;
+    int ret;
+
+    memset(ref, 0, sizeof(*ref));
+    ref->id[0] = hash_bytes(data, len, 0);
+    ref->id[1] = hash_bytes(data, len, CHUNK_ID_SEED);
+    ref->size = (uint32_t) len;
+
+    pthread_mutex_lock(&store->mutex);
+    slot = find_slot(store, ref->id);
+    if (slot->container != SLOT_EMPTY &&
+        (slot->container == store->container_count || !store->containers[slot->container].retiring)) {
+        if (slot->container < store->container_count) {
+            store->containers[slot->container].used = 1;
+        }
+        pthread_mutex_unlock(&store->mutex);
+        metric_add(METRIC_CHUNKS_DEDUPLICATED, 1);
+        return 0;
+    }
+    ret = claim_chunk(store, ref->id, &index);
+    pthread_mutex_unlock(&store->mutex);
+    if (ret != 0) {
+        return -1;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    ret = pack_add_data(&store->writer, data, len, &entry);
+
+    pthread_mutex_lock(&store->mutex);
+    store->new_entries[index] = entry;
+    store->new_bytes += (long long) entry.stored_size;
+    if (ret != 0) {
+        store->failed = 1;
+    }
+    pthread_mutex_unlock(&store->mutex);
+    metric_add(METRIC_CHUNKS_STORED, 1);
+    return ret;
+}
+
+int chunk_store_put(struct chunk_store *store, const unsigned char *data, size_t len, struct chunk_ref **refs,
+                    size_t *count) {
+    size_t pos = 0;
+
+    *count = 0;
+    *refs = malloc((len / CHUNK_MIN_SIZE + 1) * sizeof(**refs));
+    if (*refs == NULL) {
+        return -1;
+    }
+
+    while (pos < len) {
+        size_t cut = chunk_boundary(data + pos, len - pos);
+
+        if (put_chunk(store, data + pos, cut, &(*refs)[*count]) != 0) {
+            pthread_mutex_lock(&store->mutex);
+            store->failed = 1;
+            pthread_mutex_unlock(&store->mutex);
+            free(*refs);
+            *refs = NULL;
+            *count = 0;
+            return -1;
+        }
+        (*count)++;
+        pos += cut;
+    }
+    return 0;
+}
+
+int chunk_store_has(struct chunk_store *store, const struct chunk_ref *refs, size_t count) {
+    int ret = 1;
+
+    pthread_mutex_lock(&store->mutex);
+    for (size_t i = 0; i < count && ret; i++) {
+        const struct chunk_slot *slot = find_slot(store, refs[i].id);
+
+        ret = slot->container != SLOT_EMPTY &&
+              (slot->container == store->container_count || !store->containers[slot->container].retiring);
+    }
+    for (size_t i = 0; i < count && ret; i++) {
+        const struct chunk_slot *slot = find_slot(store, refs[i].id);
+
+        if (slot->container < store->container_count) {
+            store->containers[slot->container].used = 1;
+        }
+    }
+    pthread_mutex_unlock(&store->mutex);
+    return ret;
+}
+
+int chunk_store_finish(struct chunk_store *store, char **list, size_t *len) {
+    char **names;
+    size_t size = 0;
+
+    *list = NULL;
+    *len = 0;
+    if (store->failed) {
+        chunk_store_abort(store);
+        return -1;
+    }
+
+    // Nothing new: the snapshot lives entirely on older containers
+    if (store->writing && store->new_count == 0) {
+        chunk_store_abort(store);
+    } else if (store->writing) {
+        names = malloc(store->new_count * sizeof(*names));
+        if (names == NULL) {
+            chunk_store_abort(store);
+            return -1;
+        }
+        for (size_t i = 0; i < store->new_count; i++) {
+            names[i] = store->new_names[i];
+        }
+        store->writing = 0;
+        if (pack_finish(&store->writer, store->new_entries, names, store->new_count) != 0) {
+            free(names);
+            return -1;
+        }
+        free(names);
+    }
+
+    *list = malloc((store->container_count + 1) * (NAME_MAX + 2) + 1);
+    if (*list == NULL) {
+        return -1;
+    }
+    for (size_t c = 0; c < store->container_count; c++) {
+        if (store->containers[c].used) {
+            size += sprintf(*list + size, "%s\n", store->containers[c].name);
+        }
+    }
+    if (store->new_count > 0) {
+        size += sprintf(*list + size, "%s\n", store->writer_name);
+    }
+    *len = size;
+    return 0;
+}
+
+void chunk_store_abort(struct chunk_store *store) {
+    if (store->writing) {
+        pack_abort(&store->writer);
+        store->writing = 0;
+    }
+}
+
+// The refs are copied out of the mapping, where they need not be aligned
+int chunk_store_extract(const struct chunk_store *store, const struct pack_reader *pack,
+                        const struct pack_entry *entry, int fd) {
+    uint64_t total = 0;
+
+    if (entry->method != PACK_CHUNKED || entry->offset > pack->map_size ||
+        entry->stored_size > pack->map_size - entry->offset || entry->stored_size % sizeof(struct chunk_ref) != 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    for (uint64_t pos = 0; pos < entry->stored_size; pos += sizeof(struct chunk_ref)) {
+        const struct chunk_slot *slot;
+        const struct pack_reader *container;
+        const struct pack_entry *chunk;
+        struct chunk_ref ref;
+
+        memcpy(&ref, pack->map + entry->offset + pos, sizeof(ref));
+        slot = find_slot(store, ref.id);
+        if (slot->container >= store->container_count) {
+            errno = EIO;
+            return -1;
+        }
+        container = &store->containers[slot->container].pack;
+        chunk = &container->entries[slot->entry];
+        if (chunk->size != ref.size || pack_extract(container, chunk, fd) != 0) {
+            errno = EIO;
+            return -1;
+        }
+        total += ref.size;
+    }
+
+    if (total != entry->size) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+void chunk_store_close(struct chunk_store *store) {
+    chunk_store_abort(store);
+    for (size_t c = 0; c < store->container_count; c++) {
+        pack_close(&store->containers[c].pack);
+    }
+    free(store->containers);
+    free(store->slots);
+    free(store->new_entries);
+    free(store->new_names);
+    pthread_mutex_destroy(&store->mutex);
+    memset(store, 0, sizeof(*store));
+    store->writer.fd = -1;
+}
@@ -0,0 +1,384 @@
+/* control.c - Implementation of the control socket */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../include/config.h"
+#include "../include/control.h"
+#include "../include/logging.h"
+#include "../include/metrics.h"
+
+#define CONTROL_MAX_COMMANDS 16
+#define CONTROL_REQUEST_MAX 1024  // Room for restore filters
+
+struct control_command {
+    char name[32];
+    control_fn fn;
+    int long_running;  // Waits for shard jobs, served by the worker
+};
+
+// A client whose long command waits for the worker
+struct queued_client {
+    int fd;
+    char request[CONTROL_REQUEST_MAX];
+};
+
+static struct control_command commands[CONTROL_MAX_COMMANDS];
+static int command_count = 0;
+static int listen_fd = -1;
+static char socket_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+// Long commands, taken in arrival order by the worker thread
+static struct queued_client queue[CONTROL_QUEUE_MAX];
+static size_t queue_head = 0;
+static size_t queue_count = 0;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static pthread_t worker;
+static int worker_running = 0;
+static int worker_stopping = 0;
+
+// Filling in a socket address, -1 if the path does not fit
+static int control_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return -1;
+    }
+    memcpy(addr->sun_path, path, strlen(path) + 1);
+    return 0;
+}
+
+static void set_socket_timeout(int fd, int millis) {
+    struct timeval tv;
+
+    tv.tv_sec = millis / 1000;
+    tv.tv_usec = (millis % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Sending the whole buffer; a client that hung up must not SIGPIPE the daemon
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int add_command(const char *name, control_fn fn, int long_running) {
+    if (command_count == CONTROL_MAX_COMMANDS) {
+        log_message(CLOG_ERROR, "Cannot register control command %s: too many commands", name);
+        return -1;
+    }
+    snprintf(commands[command_count].name, sizeof(commands[command_count].name), "%s", name);
+    commands[command_count].fn = fn;
+    commands[command_count].long_running = long_running;
+    command_count++;
+    return 0;
+}
+
+int register_control_command(const char *name, control_fn fn) {
+    return add_command(name, fn, 0);
+}
+
+int register_long_control_command(const char *name, control_fn fn) {
+    return add_command(name, fn, 1);
+}
+
+// Finding the command a request line starts with
+static const struct control_command *find_command(const char *request) {
+    size_t len = strcspn(request, " \t");
+
+    for (int i = 0; i < command_count; i++) {
+        if (strlen(commands[i].name) == len && strncmp(commands[i].name, request, len) == 0) {
+            return &commands[i];
+        }
+    }
+    return NULL;
+}
+
+// Running one request line: "<command> [arguments]"
+static int dispatch_command(char *request, char *reply, size_t size) {
+    const struct control_command *command = find_command(request);
+    char *args = request + strcspn(request, " \t");
+
+    if (*args != '\0') {
+        *args++ = '\0';
+        args += strspn(args, " \t");
+    }
+
+    if (command == NULL) {
+        snprintf(reply, size, "unknown command '%s'\n", request);
+        return CONTROL_ERR;
+    }
+    return command->fn(args, reply, size);
+}
+
+static void send_reply(int fd, int status, const char *reply) {
+    if (send_all(fd, status == CONTROL_OK ? "OK\n" : "ERR\n", status == CONTROL_OK ? 3 : 4) != 0 ||
+        send_all(fd, reply, strlen(reply)) != 0) {
+        log_message(CLOG_WARNING, "Failed to reply to control client: %s", strerror(errno));
+    }
+}
+
+// Running a request and replying, then closing the connection
+static void answer_client(int fd, char *request) {
+    char reply[CONTROL_REPLY_MAX];
+    uint64_t start;
+    int status;
+
+    reply[0] = '\0';
+    log_message(CLOG_DEBUG, "Control command: %s", request);
+    start = metric_clock();
+    status = dispatch_command(request, reply, sizeof(reply));
+    metric_observe_since(HIST_CONTROL_COMMAND, start);
+    metric_add(METRIC_CONTROL_COMMANDS, 1);
+
+    send_reply(fd, status, reply);
+    close(fd);
+}
+
+// Answering long commands one at a time, so shard jobs requested by two clients never overlap
+static void *control_worker(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&queue_mutex);
+    for (;;) {
+        struct queued_client client;
+
+        while (queue_count == 0 && !worker_stopping) {
+            pthread_cond_wait(&queue_ready, &queue_mutex);
+        }
+        if (worker_stopping) {
+            break;
+        }
+        client = queue[queue_head];
+        queue_head = (queue_head + 1) % CONTROL_QUEUE_MAX;
+        queue_count--;
+        pthread_mutex_unlock(&queue_mutex);
+
+        answer_client(client.fd, client.request);
+        pthread_mutex_lock(&queue_mutex);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    return NULL;
+}
+
+// Handing a long command to the worker, -1 if the queue is full
+static int queue_client(int fd, const char *request) {
+    struct queued_client *client;
+
+    pthread_mutex_lock(&queue_mutex);
+    if (queue_count == CONTROL_QUEUE_MAX) {
+        pthread_mutex_unlock(&queue_mutex);
+        return -1;
+    }
+    client = &queue[(queue_head + queue_count) % CONTROL_QUEUE_MAX];
+    client->fd = fd;
+    snprintf(client->request, sizeof(client->request), "%s", request);
+    queue_count++;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_mutex);
+    return 0;
+}
+
+int init_control_socket(const char *path) {
+    struct sockaddr_un addr;
+
+    if (control_address(path, &addr) != 0) {
+        log_message(CLOG_ERROR, "Control socket path too long: %s", path);
+        return -1;
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        log_message(CLOG_ERROR, "Failed to create control socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // Only one daemon runs at a time, so a leftover socket is stale
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        chmod(path, CONTROL_SOCKET_PERMS) != 0 ||
+        listen(listen_fd, CONTROL_BACKLOG) != 0) {
+        log_message(CLOG_ERROR, "Failed to listen on %s: %s", path, strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        unlink(path);
+        return -1;
+    }
+
+    snprintf(socket_path, sizeof(socket_path), "%s", path);
+    log_message(CLOG_INFO, "Listening for commands on %s", path);
+
+    // Without the worker long commands are answered inline, holding up the event loop
+    worker_stopping = 0;
+    if (pthread_create(&worker, NULL, control_worker, NULL) != 0) {
+        log_message(CLOG_WARNING, "Failed to start control worker, long commands block the daemon");
+    } else {
+        worker_running = 1;
+    }
+    return listen_fd;
+}
+
+int control_fd() {
+    return listen_fd;
+}
+
+// Reading one request and answering it, or queueing it for the worker if it waits for the shards
+static void serve_client(int fd) {
+    char request[CONTROL_REQUEST_MAX];
+    const struct control_command *command;
+    size_t len = 0;
+
+    set_socket_timeout(fd, CONTROL_TIMEOUT_MS);
+
+    while (len < sizeof(request) - 1 && memchr(request, '\n', len) == NULL) {
+        ssize_t n = read(fd, request + len, sizeof(request) - 1 - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+    }
+    request[len] = '\0';
+    request[strcspn(request, "\r\n")] = '\0';
+
+    if (request[0] == '\0') {
+        close(fd);  // Client went away or sent nothing
+        return;
+    }
+
+    command = find_command(request);
+    if (command != NULL && command->long_running && worker_running) {
+        if (queue_client(fd, request) != 0) {
+            send_reply(fd, CONTROL_ERR, "busy: too many commands waiting, try again later\n");
+            close(fd);
+        }
+        return;
+    }
+    answer_client(fd, request);
+}
+
+int handle_control_clients() {
+    int served = 0;
+
+    if (listen_fd < 0) {
+        return -1;
+    }
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_message(CLOG_ERROR, "Failed to accept control client: %s", strerror(errno));
+            }
+            break;
+        }
+
+        // Accepted sockets do not inherit the listener's O_NONBLOCK on Linux
+        serve_client(fd);
+        served++;
+    }
+
+    return served;
+}
+
+void cleanup_control_socket() {
+    if (worker_running) {
+        pthread_mutex_lock(&queue_mutex);
+        worker_stopping = 1;
+        pthread_cond_signal(&queue_ready);
+        pthread_mutex_unlock(&queue_mutex);
+        pthread_join(worker, NULL);
+        worker_running = 0;
+
+        // Commands that never started get an answer rather than a dropped connection
+        for (; queue_count > 0; queue_count--) {
+            send_reply(queue[queue_head].fd, CONTROL_ERR, "daemon is shutting down\n");
+            close(queue[queue_head].fd);
+            queue_head = (queue_head + 1) % CONTROL_QUEUE_MAX;
+        }
+    }
+
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        unlink(socket_path);
+    }
+    command_count = 0;
+}
+
+int send_control_command(const char *path, const char *command, char *reply, size_t size) {
+    struct sockaddr_un addr;
+    char request[CONTROL_REQUEST_MAX];
+    size_t len = 0;
+    int fd;
+    int status;
+
+    if (control_address(path, &addr) != 0 ||
+        snprintf(request, sizeof(request), "%s\n", command) >= (int) sizeof(request)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        send_all(fd, request, strlen(request)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Reading until the daemon closes the connection
+    while (len < size - 1) {
+        ssize_t n = read(fd, reply + len, size - 1 - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+    }
+    reply[len] = '\0';
+    close(fd);
+
+    if (strncmp(reply, "OK\n", 3) == 0) {
+        status = CONTROL_OK;
+    } else if (strncmp(reply, "ERR\n", 4) == 0) {
+        status = CONTROL_ERR;
+    } else {
+        errno = EPROTO;
+        return -1;
+    }
+
+    // Handing back only the body
+    memmove(reply, strchr(reply, '\n') + 1, len - (strchr(reply, '\n') - reply));
+    return status;
+}
@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <signal.h>
 #include <limits.h>
 #include <unistd.h>
@@ -17,11 +18,22 @@
 #include <sys/file.h>
 #include <dirent.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 
 #include "../include/config.h"
 #include "../include/daemon.h"
+#include "../include/backup.h"
+#include "../include/change_log.h"
+#include "../include/control.h"
+#include "../include/publish.h"
+#include "../include/restore.h"
+#include "../include/scheduler.h"
 #include "../include/file_ops.h"
 #include "../include/logging.h"
+#include "../include/metrics.h"
+#include "../include/settings.h"
+#include "../include/shard.h"
 #include <linux/limits.h>
 
 #ifndef DT_REG
@@ -39,6 +51,7 @@ void handle_signal(int sig) {
         case SIGINT:
             log_message(CLOG_INFO, "Received termination signal, shutting down...");
             running = 0;
+            flush_logging();
             break;
         case SIGUSR1:
             log_message(CLOG_INFO, "Received manual backup signal");
@@ -201,70 +214,519 @@ int start_daemon(const char *pid_file) {
 
 
 
-    // Initialize logging
+    // Initialize logging, with writes handed to a background thread
     init_logging();
+    start_async_logging();
     log_message(CLOG_INFO, "Daemon started successfully");
 
     // Ensure directories exist
-    if (create_directory_if_not_exists(UPLOAD_DIR) != 0 ||
-        create_directory_if_not_exists(REPORT_DIR) != 0 ||
-        create_directory_if_not_exists(BACKUP_DIR) != 0) {
+    if (create_directory_if_not_exists(settings.state_dir) != 0) {
         log_message(CLOG_ERROR, "Failed to create required directories");
         return -1;
     }
 
-    //Ensure correct permissions at startup
-    if (chmod(UPLOAD_DIR, 0777) != 0) { // Fully open for all users
-        log_message(CLOG_ERROR, "Failed to set upload directory permissions at startup: %s", strerror(errno));
+    for (int i = 0; i < settings.shard_count; i++) {
+        if (init_shard(&settings.shards[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Handing jobs to every shard thread without waiting
+static void post_jobs(int jobs) {
+    for (int i = 0; i < settings.shard_count; i++) {
+        post_shard_jobs(&settings.shards[i], jobs);
+    }
+}
+
+// Jobs run by the scheduler
+static void audit_job() {
+    post_jobs(SHARD_AUDIT);
+}
+
+// Continuous shards have published their uploads already, they only back up
+static void nightly_job() {
+    log_message(CLOG_INFO, "Scheduled backup and transfer");
+    for (int i = 0; i < settings.shard_count; i++) {
+        struct shard *shard = &settings.shards[i];
+        post_shard_jobs(shard, shard->publish == PUBLISH_CONTINUOUS ? SHARD_BACKUP : SHARD_BACKUP | SHARD_TRANSFER);
+    }
+}
+
+// Full scans, of the shards that have no inotify watch unless reconciling
+static void scan_job() {
+    for (int i = 0; i < settings.shard_count; i++) {
+        if (!shard_watching(&settings.shards[i])) {
+            post_shard_jobs(&settings.shards[i], SHARD_SCAN);
+        }
+    }
+}
+
+static void reconcile_job() {
+    post_jobs(SHARD_SCAN);
+}
+
+static void flush_job() {
+    flush_change_log();
+}
+
+static void save_index_job() {
+    for (int i = 0; i < settings.shard_count; i++) {
+        save_upload_index(&settings.shards[i]);
     }
+}
+
+static void metrics_job() {
+    export_metrics(settings.metrics_file);
+}
+
+static int flush_job_id = -1;
+static int save_index_job_id = -1;
+static int metrics_job_id = -1;
+static time_t started_at = 0;
+
+// Appending formatted text to a control reply
+static void reply_append(char *reply, size_t size, const char *format, ...) {
+    size_t used = strlen(reply);
+    va_list args;
 
-    if (chmod(REPORT_DIR, 0755) != 0) { // Readable by all, modifiable only by root
-        log_message(CLOG_ERROR, "Failed to set dashboard directory permissions at startup: %s", strerror(errno));
+    if (used + 1 >= size) {
+        return;
+    }
+    va_start(args, format);
+    vsnprintf(reply + used, size - used, format, args);
+    va_end(args);
+}
+
+// Run lines are prefixed with the shard name when there is more than one shard
+static void summarise_run(const struct shard *shard, const char *what, int ret, const struct run_summary *summary,
+                          char *reply, size_t size) {
+    const char *name = settings.shard_count > 1 ? shard->name : "";
+    const char *sep = settings.shard_count > 1 ? " " : "";
+
+    if (ret != 0 && summary->files == 0 && summary->failed == 0) {
+        reply_append(reply, size, "%s%s%s: failed, see %s\n", name, sep, what, settings.log_file);
+    } else {
+        reply_append(reply, size, "%s%s%s: %d files, %d linked, %d unchanged, %d quarantined, %d failed, %lld bytes%s%s\n",
+                     name, sep, what, summary->files, summary->linked, summary->unchanged, summary->quarantined,
+                     summary->failed, summary->bytes,
+                     summary->target[0] != '\0' ? " -> " : "", summary->target);
+    }
+}
+
+/* Control socket commands; those that run shard jobs wait on the control worker thread, so status and
+   stats are answered from the event loop meanwhile */
+
+// Backup followed by transfer, the same as the nightly run
+static int control_backup(const char *args, char *reply, size_t size) {
+    struct shard_report reports[MAX_SHARDS];
+    int ret;
+
+    (void) args;
+    log_message(CLOG_INFO, "Manual backup and transfer requested");
+    ret = run_jobs_on_shards(settings.shards, settings.shard_count, SHARD_BACKUP | SHARD_TRANSFER, reports);
+    for (int i = 0; i < settings.shard_count; i++) {
+        summarise_run(&settings.shards[i], "backup", reports[i].backup_status, &reports[i].backup, reply, size);
+        summarise_run(&settings.shards[i], "transfer", reports[i].transfer_status, &reports[i].transfer, reply, size);
+    }
+    return ret == 0 ? CONTROL_OK : CONTROL_ERR;
+}
+
+static int control_transfer(const char *args, char *reply, size_t size) {
+    struct shard_report reports[MAX_SHARDS];
+    int ret;
+
+    (void) args;
+    log_message(CLOG_INFO, "Manual transfer requested");
+    ret = run_jobs_on_shards(settings.shards, settings.shard_count, SHARD_TRANSFER, reports);
+    for (int i = 0; i < settings.shard_count; i++) {
+        summarise_run(&settings.shards[i], "transfer", reports[i].transfer_status, &reports[i].transfer, reply, size);
+    }
+    return ret == 0 ? CONTROL_OK : CONTROL_ERR;
+}
+
+static int control_scan(const char *args, char *reply, size_t size) {
+    struct shard_report reports[MAX_SHARDS];
+    int ret;
+
+    (void) args;
+    ret = run_jobs_on_shards(settings.shards, settings.shard_count, SHARD_SCAN, reports);
+    for (int i = 0; i < settings.shard_count; i++) {
+        const char *name = settings.shard_count > 1 ? settings.shards[i].name : "";
+        const char *sep = settings.shard_count > 1 ? " " : "";
+
+        if (reports[i].changes < 0) {
+            reply_append(reply, size, "%s%sscan failed, see %s\n", name, sep, settings.log_file);
+        } else {
+            reply_append(reply, size, "%s%sscan: %d changes\n", name, sep, reports[i].changes);
+        }
+    }
+    return ret == 0 ? CONTROL_OK : CONTROL_ERR;
+}
+
+static int control_status(const char *args, char *reply, size_t size) {
+    char generation[PATH_MAX];
+    long next_job = seconds_until_next_job();
+
+    (void) args;
+    reply_append(reply, size, "Daemon is running\n");
+    reply_append(reply, size, "pid: %d\n", (int) getpid());
+    reply_append(reply, size, "uptime: %lds\n", (long) (time(NULL) - started_at));
+    for (int i = 0; i < settings.shard_count; i++) {
+        const struct shard *shard = &settings.shards[i];
+
+        reply_append(reply, size, "shard %s: %s, watcher: %s, publish: %s\n", shard->name, shard->upload_dir,
+                     shard_watching(shard) ? "inotify" : "polling",
+                     shard->publish == PUBLISH_CONTINUOUS ? "continuous" : "nightly");
+        if (current_generation(shard, generation, sizeof(generation)) == 0) {
+            reply_append(reply, size, "  dashboard: %s\n", generation);
+        }
+    }
+    if (next_job >= 0) {
+        reply_append(reply, size, "next job: in %lds\n", next_job);
+    }
+    return CONTROL_OK;
+}
+
+// Metrics in the same Prometheus format as the metrics file, plus live gauges
+static int control_stats(const char *args, char *reply, size_t size) {
+    (void) args;
+    format_metrics(reply, size);
+    reply_append(reply, size, "# TYPE report_daemon_uploads_pending gauge\n");
+    for (int i = 0; i < settings.shard_count; i++) {
+        reply_append(reply, size, "report_daemon_uploads_pending{shard=\"%s\"} %d\n", settings.shards[i].name,
+                     count_files_in_dir(settings.shards[i].upload_dir, ".xml"));
+    }
+    reply_append(reply, size, "# TYPE report_daemon_change_log_buffered_bytes gauge\n"
+                 "report_daemon_change_log_buffered_bytes %zu\n", change_log_buffered());
+    return CONTROL_OK;
+}
+
+// Dropping cached state and reopening files, for use after logrotate or passwd changes
+// Shards are read from the config file at startup only, changing them needs a restart
+static int control_reload(const char *args, char *reply, size_t size) {
+    (void) args;
+    log_message(CLOG_INFO, "Reloading");
+    invalidate_username_cache();
+    close_change_log();
+    if (open_change_log() != 0) {
+        reply_append(reply, size, "failed to reopen %s\n", settings.change_log_file);
+        return CONTROL_ERR;
+    }
+    reply_append(reply, size, "reloaded\n");
+    return CONTROL_OK;
+}
+
+static int control_audit(const char *args, char *reply, size_t size) {
+    struct shard_report reports[MAX_SHARDS];
+    int ret;
+
+    (void) args;
+    ret = run_jobs_on_shards(settings.shards, settings.shard_count, SHARD_AUDIT, reports);
+    for (int i = 0; i < settings.shard_count; i++) {
+        const struct shard *shard = &settings.shards[i];
+        const char *name = settings.shard_count > 1 ? shard->name : "";
+        const char *sep = settings.shard_count > 1 ? " " : "";
+
+        if (reports[i].audit_status != 0) {
+            reply_append(reply, size, "%s%saudit failed, see %s\n", name, sep, settings.log_file);
+        } else {
+            reply_append(reply, size, "%s%saudit: %d missing, %d late, %d duplicate -> %s\n", name, sep,
+                         reports[i].audit.missing, reports[i].audit.late, reports[i].audit.duplicate, shard->audit_file);
+        }
+    }
+    return ret == 0 ? CONTROL_OK : CONTROL_ERR;
+}
+
+// One pass of the retention policy; further passes follow in the background if more expired
+static int control_gc(const char *args, char *reply, size_t size) {
+    struct shard_report reports[MAX_SHARDS];
+    int ret;
+
+    (void) args;
+    ret = run_jobs_on_shards(settings.shards, settings.shard_count, SHARD_GC, reports);
+    for (int i = 0; i < settings.shard_count; i++) {
+        const struct gc_result *gc = &reports[i].gc;
+        const char *name = settings.shard_count > 1 ? settings.shards[i].name : "";
+        const char *sep = settings.shard_count > 1 ? " " : "";
+
+        if (reports[i].gc_status != 0 && gc->kept == 0) {
+            reply_append(reply, size, "%s%sgc failed, see %s\n", name, sep, settings.log_file);
+        } else {
+            reply_append(reply, size, "%s%sgc: %d snapshots kept, %lld bytes on disk, %d deleted, %lld bytes freed, "
+                         "%d left to delete\n", name, sep, gc->kept, gc->disk_bytes, gc->deleted, gc->freed,
+                         gc->pending);
+        }
+    }
+    return ret == 0 ? CONTROL_OK : CONTROL_ERR;
+}
+
+// Restore on the shard threads, so no transfer publishes while the snapshot is extracted
+static int control_restore(const char *args, char *reply, size_t size) {
+    static struct restore_request request;
+    struct shard_report reports[MAX_SHARDS];
+    struct shard *shards = settings.shards;
+    int count = settings.shard_count;
+    int ret;
+
+    if (parse_restore_args(args, &request, reply, size) != 0) {
+        return CONTROL_ERR;
+    }
+    if (request.shard[0] != '\0') {
+        shards = find_shard(request.shard);
+        if (shards == NULL) {
+            reply_append(reply, size, "unknown shard: %s\n", request.shard);
+            return CONTROL_ERR;
+        }
+        count = 1;
+    }
+
+    log_message(CLOG_INFO, "Restore to %s requested", request.at);
+    for (int i = 0; i < count; i++) {
+        shards[i].restore = &request;
+    }
+    ret = run_jobs_on_shards(shards, count, SHARD_RESTORE, reports);
+    for (int i = 0; i < count; i++) {
+        shards[i].restore = NULL;
+        summarise_run(&shards[i], "restore", reports[i].restore_status, &reports[i].restore, reply, size);
+        if (reports[i].restored_from[0] != '\0') {
+            reply_append(reply, size, "  from %s\n", reports[i].restored_from);
+        }
+    }
+    return ret == 0 ? CONTROL_OK : CONTROL_ERR;
+}
+
+// Rollback on the shard threads too, so it never repoints the dashboard under a running transfer
+static int control_rollback(const char *args, char *reply, size_t size) {
+    struct shard_report reports[MAX_SHARDS];
+    struct shard *shards = settings.shards;
+    int count = settings.shard_count;
+    char generation[PATH_MAX];
+    int ret;
+
+    if (args[0] != '\0') {
+        shards = find_shard(args);
+        if (shards == NULL) {
+            reply_append(reply, size, "unknown shard: %s\n", args);
+            return CONTROL_ERR;
+        }
+        count = 1;
+    }
+
+    log_message(CLOG_INFO, "Rollback requested");
+    ret = run_jobs_on_shards(shards, count, SHARD_ROLLBACK, reports);
+    for (int i = 0; i < count; i++) {
+        if (reports[i].rollback_status != 0) {
+            reply_append(reply, size, "rollback of %s failed, see %s\n", shards[i].name, settings.log_file);
+        } else if (current_generation(&shards[i], generation, sizeof(generation)) == 0) {
+            reply_append(reply, size, "dashboard %s rolled back to %s\n", shards[i].report_dir, generation);
+        }
+    }
+    return ret == 0 ? CONTROL_OK : CONTROL_ERR;
+}
+
+static void register_control_commands() {
+    // Commands that wait for shard jobs run on the control worker, the rest in the event loop
+    register_long_control_command("backup", control_backup);
+    register_long_control_command("transfer", control_transfer);
+    register_long_control_command("scan", control_scan);
+    register_long_control_command("audit", control_audit);
+    register_long_control_command("restore", control_restore);
+    register_long_control_command("rollback", control_rollback);
+    register_long_control_command("gc", control_gc);
+    register_control_command("status", control_status);
+    register_control_command("stats", control_stats);
+    register_control_command("reload", control_reload);
+}
+
+// Deferring change log and index writes until they are due, so an idle daemon sets no timers
+static void schedule_deferred_writes() {
+    int pending = change_log_pending();
+
+    if (pending >= 0) {
+        trigger_job(flush_job_id, pending);
+    }
+    for (int i = 0; i < settings.shard_count; i++) {
+        if (upload_index_dirty(&settings.shards[i])) {
+            trigger_job(save_index_job_id, INDEX_SAVE_INTERVAL);
+            break;
+        }
+    }
+    if (metrics_changed()) {
+        trigger_job(metrics_job_id, METRICS_EXPORT_DELAY);
+    }
+}
+
+// Adding a descriptor to the epoll set
+static int watch_fd(int epoll_fd, int fd) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        log_message(CLOG_ERROR, "Failed to register descriptor with epoll: %s", strerror(errno));
+        return -1;
     }
     return 0;
 }
 
+// Taking termination and backup signals through a descriptor instead of a handler
+static int open_signal_fd(int epoll_fd) {
+    sigset_t mask;
+    int fd;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR1);
+
+    fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        log_message(CLOG_ERROR, "Failed to create signal descriptor: %s", strerror(errno));
+        return -1;
+    }
+    if (watch_fd(epoll_fd, fd) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Blocked here, so worker threads created later never take the signals either
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    return fd;
+}
+
+static void read_signals(int signal_fd) {
+    struct signalfd_siginfo info;
+
+    while (read(signal_fd, &info, sizeof(info)) == (ssize_t) sizeof(info)) {
+        handle_signal((int) info.ssi_signo);
+    }
+}
+
+// Seconds to wait for the next job when the scheduler has no timer descriptor
+static unsigned int next_job_wait() {
+    long wait = seconds_until_next_job();
+
+    return wait < 0 || wait > settings.check_interval ? (unsigned int) settings.check_interval : (unsigned int) wait;
+}
+
 // Running the daemon in the main loop
 void run_daemon() {
-    time_t last_check_time = 0;
-    time_t now;
-    struct tm *time_info;
-    int last_backup_day = -1;  // Track the last day a backup was performed
-    
-    // Main daemon loop
+    int epoll_fd;
+    int signal_fd = -1;
+    int polled_shards = 0;
+    struct epoll_event events[8];
+
+    started_at = time(NULL);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        log_message(CLOG_ERROR, "Failed to create epoll instance: %s", strerror(errno));
+    } else {
+        signal_fd = open_signal_fd(epoll_fd);
+
+        // Answering CLI commands from the same loop
+        if (init_control_socket(settings.control_socket) >= 0) {
+            if (watch_fd(epoll_fd, control_fd()) == 0) {
+                register_control_commands();
+            } else {
+                cleanup_control_socket();
+            }
+        }
+    }
+
+    // Shard threads start after the signal mask is set, so they never take the signals
+    for (int i = 0; i < settings.shard_count; i++) {
+        start_shard(&settings.shards[i]);
+        if (!shard_watching(&settings.shards[i])) {
+            polled_shards++;
+        }
+    }
+    if (epoll_fd >= 0 && shard_activity_fd() >= 0) {
+        watch_fd(epoll_fd, shard_activity_fd());
+    }
+
+    if (init_scheduler() >= 0 && epoll_fd >= 0 && watch_fd(epoll_fd, scheduler_fd()) != 0) {
+        cleanup_scheduler();
+    }
+
+    open_change_log();
+
+    // Registration order breaks ties, so the audit runs before the nightly backup
+    schedule_cron("audit", AUDIT_SCHEDULE, 0, 1, audit_job);
+    schedule_cron("nightly", NIGHTLY_SCHEDULE, NIGHTLY_JITTER, 1, nightly_job);
+    // Reconciling now and then in case an event was ever missed
+    schedule_cron("reconcile", RECONCILE_SCHEDULE, 0, 0, reconcile_job);
+    if (polled_shards > 0) {
+        log_message(CLOG_WARNING, "Upload watcher unavailable for %d shards, scanning every %d seconds",
+                    polled_shards, settings.check_interval);
+    }
+    // Also for shards that lose their watch later on
+    schedule_interval("scan", settings.check_interval, 0, scan_job);
+    flush_job_id = schedule_on_demand("flush-changes", flush_job);
+    save_index_job_id = schedule_on_demand("save-index", save_index_job);
+    metrics_job_id = schedule_on_demand("export-metrics", metrics_job);
+
+    // Catching up on changes made while the daemon was stopped
+    post_jobs(SHARD_SCAN);
+
+    // Main daemon loop, blocked until a signal, a command, shard activity or a job is due
     while (running) {
-        now = time(NULL);
-        time_info = localtime(&now);
-
-        // Check if it's exactly 1:00 AM and hasn't run today
-        if (time_info->tm_hour == 1 && time_info->tm_min == 0 && time_info->tm_mday != last_backup_day) {
-            last_backup_day = time_info->tm_mday;  // Mark backup as done for today
-            log_message(CLOG_INFO, "Scheduled backup and transfer at 1AM");
-            
-            // Check for missing reports
-            check_missing_reports();
-            
-            // Perform backup and transfer
-            backup_reports();
-            transfer_reports();
+        schedule_deferred_writes();
+
+        if (epoll_fd < 0) {
+            // Degraded mode: sleep until the next job, signals (never blocked here) cut the sleep short
+            sleep(next_job_wait());
+            run_due_jobs();
+        } else {
+            // Without the scheduler's timer the wait ends when the next job is due; the signals are
+            // blocked, so the signal descriptor is the only way to see them
+            int ready = epoll_wait(epoll_fd, events, 8, scheduler_fd() < 0 ? (int) next_job_wait() * 1000 : -1);
+            if (scheduler_fd() < 0) {
+                run_due_jobs();
+            }
+            if (ready < 0 && errno != EINTR) {
+                log_message(CLOG_ERROR, "epoll_wait failed: %s", strerror(errno));
+                sleep(1);
+                continue;
+            }
+
+            for (int i = 0; i < ready; i++) {
+                int fd = events[i].data.fd;
+
+                if (fd == signal_fd) {
+                    read_signals(signal_fd);
+                } else if (fd == scheduler_fd()) {
+                    run_due_jobs();
+                } else if (fd == control_fd()) {
+                    handle_control_clients();
+                } else if (fd == shard_activity_fd()) {
+                    // Shards logged changes, the deferred writes are rescheduled above
+                    clear_shard_activity();
+                }
+            }
         }
 
         // Check for manual backup signal
         if (force_backup) {
             log_message(CLOG_INFO, "Manual backup and transfer requested");
-            backup_reports();
-            transfer_reports();
+            post_jobs(SHARD_BACKUP | SHARD_TRANSFER);
             force_backup = 0;
         }
+    }
 
-        // Regular check for file changes
-        if (now - last_check_time >= CHECK_INTERVAL) {
-            check_uploads();
-            last_check_time = now;
-        }
-
-        // Sleep to reduce CPU usage
-        sleep(1);
+    cleanup_control_socket();
+    for (int i = 0; i < settings.shard_count; i++) {
+        stop_shard(&settings.shards[i]);
+    }
+    export_metrics(settings.metrics_file);
+    cleanup_scheduler();
+    close_change_log();
+    if (signal_fd >= 0) {
+        close(signal_fd);
+    }
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
     }
 
     log_message(CLOG_INFO, "Daemon shutting down");
@@ -0,0 +1,517 @@
+/* file_index.c - Implementation of the persistent file-state index */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <linux/limits.h>
+
+#include "../include/config.h"
+#include "../include/file_index.h"
+#include "../include/hash.h"
+#include "../include/logging.h"
+
+#ifndef DT_REG
+#define DT_REG 8  // Value for regular files
+#endif
+
+#define INDEX_MAGIC "RDINDEX"
+#define INDEX_VERSION 1
+
+// On-disk header, followed by count records sorted by name
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+};
+
+static int64_t stat_mtime_ns(const struct stat *st) {
+    return (int64_t) st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+const char *index_change_str(int change) {
+    switch (change) {
+        case INDEX_CREATED:
+            return "created";
+        case INDEX_MODIFIED:
+            return "modified";
+        case INDEX_DELETED:
+            return "deleted";
+        default:
+            return "unknown";
+    }
+}
+
+// Binary search, returns the position of name or where it would be inserted
+static size_t find_record(const struct file_index *index, const char *name, int *found) {
+    size_t lo = 0, hi = index->count;
+
+    *found = 0;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(index->records[mid].name, name);
+        if (cmp == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int reserve_records(struct file_index *index, size_t needed) {
+    struct index_record *grown;
+    size_t capacity;
+
+    if (needed <= index->capacity) {
+        return 0;
+    }
+    capacity = index->capacity ? index->capacity : 64;
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+
+    grown = realloc(index->records, capacity * sizeof(*grown));
+    if (grown == NULL) {
+        log_message(CLOG_ERROR, "Failed to grow file index: %s", strerror(errno));
+        return -1;
+    }
+    index->records = grown;
+    index->capacity = capacity;
+    return 0;
+}
+
+// Loading the index by mapping the file and copying its records
+int load_file_index(struct file_index *index, const char *path) {
+    const struct index_header *header;
+    struct stat st;
+    void *map;
+    int fd;
+
+    memset(index, 0, sizeof(*index));
+    pthread_mutex_init(&index->mutex, NULL);
+    snprintf(index->path, sizeof(index->path), "%s", path);
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            log_message(CLOG_WARNING, "Failed to open file index %s: %s", path, strerror(errno));
+        }
+        return 0;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(*header)) {
+        close(fd);
+        log_message(CLOG_WARNING, "File index %s is empty or unreadable, rebuilding", path);
+        return 0;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_message(CLOG_WARNING, "Failed to map file index %s: %s", path, strerror(errno));
+        return 0;
+    }
+
+    header = map;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 ||
+        header->version != INDEX_VERSION ||
+        header->record_size != sizeof(struct index_record) ||
+        header->count > (st.st_size - sizeof(*header)) / sizeof(struct index_record)) {
+        log_message(CLOG_WARNING, "File index %s has an unknown format, rebuilding", path);
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    if (reserve_records(index, header->count + 1) == 0) {
+        memcpy(index->records, (const char *) map + sizeof(*header), header->count * sizeof(struct index_record));
+        index->count = header->count;
+    }
+    munmap(map, st.st_size);
+
+    log_message(CLOG_INFO, "Loaded file index %s (%zu files)", path, index->count);
+    return 0;
+}
+
+// Deciding whether a file differs from its record, hashing only when metadata moved
+static int classify_file(const struct index_record *old, const char *path, const struct stat *st,
+                         struct index_record *updated) {
+    updated->inode = st->st_ino;
+    updated->size = st->st_size;
+    updated->mtime_ns = stat_mtime_ns(st);
+
+    if (old != NULL && old->inode == updated->inode && old->size == updated->size &&
+        old->mtime_ns == updated->mtime_ns) {
+        updated->hash = old->hash;
+        return -1;  // Unchanged
+    }
+
+    if (hash_file(path, &updated->hash) != 0) {
+        return -2;  // Vanished or unreadable, leave it for the next event
+    }
+
+    if (old == NULL) {
+        return INDEX_CREATED;
+    }
+    // Same content under new metadata (touch, atomic replace) is not a modification
+    return old->hash == updated->hash ? -1 : INDEX_MODIFIED;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+// Listing the .xml files of a directory in name order
+static char **list_xml_files(const char *dir_path, size_t *count) {
+    DIR *dir;
+    struct dirent *entry;
+    char **names = NULL;
+    size_t capacity = 0;
+
+    *count = 0;
+    dir = opendir(dir_path);
+    if (dir == NULL) {
+        log_message(CLOG_ERROR, "Failed to open directory %s: %s", dir_path, strerror(errno));
+        return NULL;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type != DT_REG || strstr(entry->d_name, ".xml") == NULL) {
+            continue;
+        }
+        if (*count == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 256;
+            char **grown = realloc(names, new_capacity * sizeof(*grown));
+            if (grown == NULL) {
+                break;
+            }
+            names = grown;
+            capacity = new_capacity;
+        }
+        names[*count] = strdup(entry->d_name);
+        if (names[*count] != NULL) {
+            (*count)++;
+        }
+    }
+    closedir(dir);
+
+    if (names == NULL) {
+        names = malloc(sizeof(*names));
+    }
+    if (names != NULL) {
+        qsort(names, *count, sizeof(*names), compare_names);
+    }
+    return names;
+}
+
+// Merging a sorted directory listing with the sorted index
+int scan_file_index(struct file_index *index, const char *dir, index_change_fn on_change) {
+    struct index_record *merged;
+    char **names;
+    size_t name_count;
+    size_t merged_count = 0;
+    size_t i = 0, j = 0;
+    char path[PATH_MAX];
+    struct stat st;
+    int changes = 0;
+
+    names = list_xml_files(dir, &name_count);
+    if (names == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&index->mutex);
+
+    merged = malloc((name_count + 1) * sizeof(*merged));
+    if (merged == NULL) {
+        pthread_mutex_unlock(&index->mutex);
+        for (size_t k = 0; k < name_count; k++) {
+            free(names[k]);
+        }
+        free(names);
+        return -1;
+    }
+
+    while (i < name_count || j < index->count) {
+        int cmp;
+
+        if (i == name_count) {
+            cmp = 1;
+        } else if (j == index->count) {
+            cmp = -1;
+        } else {
+            cmp = strcmp(names[i], index->records[j].name);
+        }
+
+        if (cmp > 0) {
+            // In the index but gone from the directory
+            on_change(index->owner, index->records[j].name, INDEX_DELETED, NULL);
+            changes++;
+            j++;
+            continue;
+        }
+
+        const struct index_record *old = cmp == 0 ? &index->records[j] : NULL;
+        struct index_record *rec = &merged[merged_count];
+        int change;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            change = -2;
+        } else {
+            change = classify_file(old, path, &st, rec);
+        }
+
+        if (change == -2) {
+            // Disappeared during the scan: a deletion if we knew it
+            if (old != NULL) {
+                on_change(index->owner, old->name, INDEX_DELETED, NULL);
+                changes++;
+            }
+        } else {
+            snprintf(rec->name, sizeof(rec->name), "%s", names[i]);
+            merged_count++;
+            if (change >= 0) {
+                on_change(index->owner, rec->name, change, &st);
+                changes++;
+            }
+        }
+
+        i++;
+        if (cmp == 0) {
+            j++;
+        }
+    }
+
+    free(index->records);
+    index->records = merged;
+    index->count = merged_count;
+    index->capacity = name_count + 1;
+    index->dirty = 1;
+
+    pthread_mutex_unlock(&index->mutex);
+
+    for (size_t k = 0; k < name_count; k++) {
+        free(names[k]);
+    }
+    free(names);
+
+    return changes;
+}
+
+// Re-checking one file after a watcher event
+int update_file_index(struct file_index *index, const char *dir, const char *name, index_change_fn on_change) {
+    char path[PATH_MAX];
+    struct stat st;
+    struct index_record rec;
+    size_t pos;
+    int found;
+    int change;
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int) sizeof(path)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&index->mutex);
+    pos = find_record(index, name, &found);
+
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (found) {
+            on_change(index->owner, name, INDEX_DELETED, NULL);
+            memmove(&index->records[pos], &index->records[pos + 1], (index->count - pos - 1) * sizeof(rec));
+            index->count--;
+            index->dirty = 1;
+        }
+        pthread_mutex_unlock(&index->mutex);
+        return found ? 1 : 0;
+    }
+
+    change = classify_file(found ? &index->records[pos] : NULL, path, &st, &rec);
+    if (change == -2) {
+        pthread_mutex_unlock(&index->mutex);
+        return 0;
+    }
+
+    snprintf(rec.name, sizeof(rec.name), "%s", name);
+    if (found) {
+        index->records[pos] = rec;
+    } else {
+        if (reserve_records(index, index->count + 1) != 0) {
+            pthread_mutex_unlock(&index->mutex);
+            return -1;
+        }
+        memmove(&index->records[pos + 1], &index->records[pos], (index->count - pos) * sizeof(rec));
+        index->records[pos] = rec;
+        index->count++;
+    }
+    index->dirty = 1;
+
+    if (change >= 0) {
+        on_change(index->owner, name, change, &st);
+    }
+
+    pthread_mutex_unlock(&index->mutex);
+    return change >= 0 ? 1 : 0;
+}
+
+void forget_file_index(struct file_index *index, const char *name) {
+    size_t pos;
+    int found;
+
+    pthread_mutex_lock(&index->mutex);
+    pos = find_record(index, name, &found);
+    if (found) {
+        memmove(&index->records[pos], &index->records[pos + 1], (index->count - pos - 1) * sizeof(*index->records));
+        index->count--;
+        index->dirty = 1;
+    }
+    pthread_mutex_unlock(&index->mutex);
+}
+
+// Copying the record out so the hash runs without the lock; callers merge the result afterwards
+int file_index_hash(struct file_index *index, const char *dir, const char *name, struct index_record *record) {
+    char path[PATH_MAX];
+    struct index_record old;
+    struct stat st;
+    size_t pos;
+    int found;
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int) sizeof(path) ||
+        snprintf(record->name, sizeof(record->name), "%s", name) >= (int) sizeof(record->name) ||
+        stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&index->mutex);
+    pos = find_record(index, name, &found);
+    if (found) {
+        old = index->records[pos];
+    }
+    pthread_mutex_unlock(&index->mutex);
+
+    return classify_file(found ? &old : NULL, path, &st, record) == -2 ? -1 : 0;
+}
+
+static int compare_records(const void *a, const void *b) {
+    return strcmp(((const struct index_record *) a)->name, ((const struct index_record *) b)->name);
+}
+
+// Sorting the new records and merging them in one pass, so large batches stay linear
+int merge_file_index(struct file_index *index, struct index_record *records, size_t count) {
+    struct index_record *merged;
+    size_t i = 0, j = 0, merged_count = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+    qsort(records, count, sizeof(*records), compare_records);
+
+    pthread_mutex_lock(&index->mutex);
+    merged = malloc((index->count + count) * sizeof(*merged));
+    if (merged == NULL) {
+        pthread_mutex_unlock(&index->mutex);
+        log_message(CLOG_ERROR, "Failed to grow file index: %s", strerror(errno));
+        return -1;
+    }
+
+    while (i < count || j < index->count) {
+        int cmp;
+
+        if (i == count) {
+            cmp = 1;
+        } else if (j == index->count) {
+            cmp = -1;
+        } else {
+            cmp = strcmp(records[i].name, index->records[j].name);
+        }
+
+        if (cmp > 0) {
+            merged[merged_count++] = index->records[j++];
+        } else {
+            merged[merged_count++] = records[i++];
+            if (cmp == 0) {
+                j++;  // The new record replaces the old one
+            }
+        }
+    }
+
+    free(index->records);
+    index->records = merged;
+    index->count = merged_count;
+    index->capacity = index->count + count;
+    index->dirty = 1;
+    pthread_mutex_unlock(&index->mutex);
+    return 0;
+}
+
+// Writing the index through a temporary file so a crash never leaves it torn
+int save_file_index(struct file_index *index) {
+    struct index_header header;
+    char tmp_path[PATH_MAX];
+    size_t bytes;
+    int fd;
+    int ret = -1;
+
+    pthread_mutex_lock(&index->mutex);
+    if (!index->dirty) {
+        pthread_mutex_unlock(&index->mutex);
+        return 0;
+    }
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index->path) >= (int) sizeof(tmp_path)) {
+        pthread_mutex_unlock(&index->mutex);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = INDEX_VERSION;
+    header.record_size = sizeof(struct index_record);
+    header.count = index->count;
+    bytes = index->count * sizeof(struct index_record);
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        if (write(fd, &header, sizeof(header)) == (ssize_t) sizeof(header) &&
+            (bytes == 0 || write(fd, index->records, bytes) == (ssize_t) bytes) &&
+            fsync(fd) == 0) {
+            ret = 0;
+        }
+        close(fd);
+    }
+
+    if (ret == 0 && rename(tmp_path, index->path) != 0) {
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        index->dirty = 0;
+    } else {
+        log_message(CLOG_ERROR, "Failed to save file index %s: %s", index->path, strerror(errno));
+        unlink(tmp_path);
+    }
+
+    pthread_mutex_unlock(&index->mutex);
+    return ret;
+}
+
+void free_file_index(struct file_index *index) {
+    pthread_mutex_lock(&index->mutex);
+    free(index->records);
+    index->records = NULL;
+    index->count = 0;
+    index->capacity = 0;
+    pthread_mutex_unlock(&index->mutex);
+    pthread_mutex_destroy(&index->mutex);
+}
@@ -15,14 +15,22 @@
 #include <pthread.h>
 
 #include "../include/config.h"
+#include "../include/change_log.h"
 #include "../include/file_ops.h"
 #include "../include/logging.h"
+#include "../include/metrics.h"
+#include "../include/file_index.h"
+#include "../include/journal.h"
+#include "../include/publish.h"
+#include "../include/settings.h"
+#include "../include/timestamp.h"
+#include "../include/transfer.h"
+#include "../include/worker_pool.h"
+#include "../include/xml_check.h"
 #ifndef DT_REG
 #define DT_REG 8  // Value for regular files
 #endif
 
-
-pthread_mutex_t dir_mutex = PTHREAD_MUTEX_INITIALIZER;
 // Creating the directory if it doesn't exist
 int create_directory_if_not_exists(const char *path) {
     struct stat st;
@@ -37,74 +45,137 @@ int create_directory_if_not_exists(const char *path) {
     }
     
     if (mkdir(path, 0755) != 0) {
-        log_message(CLOG_ERROR, "Failed to create directory %s: %s", path, strerror(errno));
-        return -1;
+        int created = 0;
+
+        // Creating missing parents first, shard directories may sit in a new tree
+        if (errno == ENOENT) {
+            char parent[PATH_MAX];
+            char *slash;
+
+            snprintf(parent, sizeof(parent), "%s", path);
+            slash = strrchr(parent, '/');
+            if (slash != NULL && slash != parent) {
+                *slash = '\0';
+                created = create_directory_if_not_exists(parent) == 0 && mkdir(path, 0755) == 0;
+            }
+        }
+        if (!created) {
+            log_message(CLOG_ERROR, "Failed to create directory %s: %s", path, strerror(errno));
+            return -1;
+        }
     }
     
     log_message(CLOG_INFO, "Created directory %s", path);
     return 0;
 }
 
-// Getting the username from UID
-char *get_username_from_uid(uid_t uid) {
-    struct passwd *pwd;
-    char *username;
-    
-    pwd = getpwuid(uid);
-    if (pwd == NULL) {
-        log_message(CLOG_WARNING, "Failed to get username for UID %d: %s", uid, strerror(errno));
-        username = strdup("unknown");
-    } else {
-        username = strdup(pwd->pw_name);
+// Cached UID to username mapping, names stored inline
+struct username_entry {
+    uid_t uid;
+    int valid;
+    time_t loaded_at;
+    char name[USERNAME_MAX];
+};
+
+static struct username_entry username_cache[USERNAME_CACHE_SIZE];
+static pthread_mutex_t username_mutex = PTHREAD_MUTEX_INITIALIZER;
+static time_t passwd_checked_at = 0;
+static struct timespec passwd_mtime;
+static unsigned long username_hits = 0;
+static unsigned long username_misses = 0;
+
+// Dropping every cached name, caller holds username_mutex
+static void invalidate_username_cache_locked() {
+    for (int i = 0; i < USERNAME_CACHE_SIZE; i++) {
+        username_cache[i].valid = 0;
     }
-    
-    return username;
 }
 
-// Getting the formatted time string from timestamp
-char *get_time_string(time_t timestamp) {
-    char *time_str = malloc(64);
-    struct tm *time_info;
-    
-    time_info = localtime(&timestamp);
-    strftime(time_str, 64, "%Y-%m-%d %H:%M:%S", time_info);
-    
-    return time_str;
+void invalidate_username_cache() {
+    pthread_mutex_lock(&username_mutex);
+    invalidate_username_cache_locked();
+    passwd_checked_at = 0;
+    pthread_mutex_unlock(&username_mutex);
 }
 
-// Logging the file change to the change log file
-void log_file_change(const char *filename, const char *username, const char *timestamp) {
-    FILE *fp;
-
-    // Making sure the /var/log/report_daemon/ directory exists
+// Invalidating the cache when /etc/passwd changes, checked at most once a second
+static void check_passwd_locked(time_t now) {
     struct stat st;
-    if (stat(LOG_DIR, &st) != 0) {
-        if (mkdir(LOG_DIR, 0755) != 0) {
-            log_message(CLOG_ERROR, "Failed to create log directory: %s", strerror(errno));
-            return;
-        }
-    }
 
-    // Ensure changes.log exists in LOG_DIR
-    if (access(CHANGE_LOG_FILE, F_OK) != 0) {
-        fp = fopen(CHANGE_LOG_FILE, "w");
-        if (fp != NULL) {
-            fprintf(fp, "File,User,Timestamp\n"); // CSV-style header
-            fclose(fp);
-        }
-        // Set read-only permissions for log file
-        chmod(CHANGE_LOG_FILE, S_IRUSR | S_IRGRP | S_IROTH);
+    if (now == passwd_checked_at) {
+        return;
     }
+    passwd_checked_at = now;
 
-    // Open the file for appending logs
-    fp = fopen(CHANGE_LOG_FILE, "a");
-    if (fp == NULL) {
-        log_message(CLOG_ERROR, "Failed to open change log file: %s", strerror(errno));
+    if (stat(PASSWD_FILE, &st) != 0) {
         return;
     }
+    if (st.st_mtim.tv_sec != passwd_mtime.tv_sec || st.st_mtim.tv_nsec != passwd_mtime.tv_nsec) {
+        invalidate_username_cache_locked();
+        passwd_mtime = st.st_mtim;
+    }
+}
+
+// Getting the username from UID, the result is borrowed until this thread's next call
+const char *get_username_from_uid(uid_t uid) {
+    static __thread char username[USERNAME_MAX];
+    struct username_entry *entry = &username_cache[uid % USERNAME_CACHE_SIZE];
+    struct passwd pwd_buf;
+    struct passwd *pwd = NULL;
+    char buffer[BUFFER_SIZE];
+    time_t now = time(NULL);
+    int ret;
+
+    pthread_mutex_lock(&username_mutex);
+    check_passwd_locked(now);
+
+    if (entry->valid && entry->uid == uid && now - entry->loaded_at < USERNAME_CACHE_TTL) {
+        username_hits++;
+        memcpy(username, entry->name, sizeof(username));
+        pthread_mutex_unlock(&username_mutex);
+        return username;
+    }
+
+    username_misses++;
+    pthread_mutex_unlock(&username_mutex);
+
+    // NSS lookups can be slow, so they run without the lock held
+    ret = getpwuid_r(uid, &pwd_buf, buffer, sizeof(buffer), &pwd);
+    if (pwd == NULL) {
+        log_message(CLOG_WARNING, "Failed to get username for UID %d: %s", uid,
+                    ret != 0 ? strerror(ret) : "no such user");
+        snprintf(username, sizeof(username), "unknown");
+    } else {
+        snprintf(username, sizeof(username), "%s", pwd->pw_name);
+    }
+
+    // Unknown users are cached too, so a missing entry is not looked up every time
+    pthread_mutex_lock(&username_mutex);
+    entry->uid = uid;
+    entry->valid = 1;
+    entry->loaded_at = now;
+    memcpy(entry->name, username, sizeof(entry->name));
+    pthread_mutex_unlock(&username_mutex);
+
+    return username;
+}
+
+void get_username_cache_stats(unsigned long *hits, unsigned long *misses) {
+    pthread_mutex_lock(&username_mutex);
+    *hits = username_hits;
+    *misses = username_misses;
+    pthread_mutex_unlock(&username_mutex);
+}
 
-    fprintf(fp, "%s,%s,%s\n", filename, username, timestamp);
-    fclose(fp);
+// Getting the formatted time string from timestamp (borrowed, see format_timestamp)
+const char *get_time_string(time_t timestamp) {
+    return format_timestamp(timestamp, TS_LOG);
+}
+
+// Logging the file change to the change log file
+void log_file_change(const char *filename, const char *username, const char *timestamp, const char *change) {
+    // Buffered, the writer keeps changes.log open between records
+    append_change_log(filename, username, timestamp, change);
 }
 
 
@@ -132,323 +203,795 @@ int count_files_in_dir(const char *dir_path, const char *pattern) {
     return count;
 }
 
+// Loading the shard's upload index from the state directory
+// The index is persisted so restarts see exactly what changed
+int init_upload_index(struct shard *shard) {
+    if (shard->index_loaded) {
+        return 0;
+    }
+    if (create_directory_if_not_exists(settings.state_dir) != 0) {
+        return -1;
+    }
+    load_file_index(&shard->index, shard->index_file);
+    shard->index.owner = shard;
+    shard->index_loaded = 1;
+    return 0;
+}
+
+int save_upload_index(struct shard *shard) {
+    return shard->index_loaded ? save_file_index(&shard->index) : 0;
+}
+
+int upload_index_dirty(struct shard *shard) {
+    int dirty = 0;
+
+    if (shard->index_loaded) {
+        pthread_mutex_lock(&shard->index.mutex);
+        dirty = shard->index.dirty;
+        pthread_mutex_unlock(&shard->index.mutex);
+    }
+    return dirty;
+}
+
+void cleanup_upload_index(struct shard *shard) {
+    if (shard->index_loaded) {
+        save_file_index(&shard->index);
+        free_file_index(&shard->index);
+        shard->index_loaded = 0;
+    }
+    if (shard->digest_loaded) {
+        free_file_index(&shard->digest);
+        shard->digest_loaded = 0;
+    }
+}
+
+// Files outside the default shard are logged as <shard>/<file>
+static void change_log_name(const struct shard *shard, const char *name, char *filename, size_t size) {
+    if (strcmp(shard->name, DEFAULT_SHARD) == 0) {
+        snprintf(filename, size, "%s", name);
+    } else {
+        snprintf(filename, size, "%s/%s", shard->name, name);
+    }
+}
+
+// Logging one change found by the index to the daemon and change logs
+static void log_upload_change(void *owner, const char *name, int change, const struct stat *file_stat) {
+    struct shard *shard = owner;
+    const char *username = "unknown";
+    const char *timestamp;
+    char filename[SHARD_NAME_MAX + NAME_MAX + 2];
+
+    change_log_name(shard, name, filename, sizeof(filename));
+
+    if (file_stat != NULL) {
+        // Get username from UID and last modified time
+        username = get_username_from_uid(file_stat->st_uid);
+        timestamp = get_time_string(file_stat->st_mtime);
+    } else {
+        // Deletions carry no owner, record when they were seen
+        timestamp = get_time_string(time(NULL));
+    }
+
+    log_message(CLOG_INFO, "XML file %s: %s by %s at %s",
+                index_change_str(change), filename, username, timestamp);
+
+    // Log change to the change log file
+    log_file_change(filename, username, timestamp, index_change_str(change));
+    metric_add(METRIC_UPLOAD_CHANGES, 1);
+
+    // Continuous shards publish the upload once it stops changing
+    if (file_stat != NULL) {
+        track_upload(shard, name, file_stat);
+    }
+}
+
+// Reporting a single created or modified upload to the logs
+void report_upload_change(struct shard *shard, const char *filename) {
+    if (init_upload_index(shard) == 0) {
+        update_file_index(&shard->index, shard->upload_dir, filename, log_upload_change);
+    }
+}
+
+// Reporting an upload that was deleted or moved out of the directory
+void report_upload_removed(struct shard *shard, const char *filename) {
+    // Transferred uploads are already dropped from the index, so only real deletions remain
+    if (init_upload_index(shard) == 0) {
+        update_file_index(&shard->index, shard->upload_dir, filename, log_upload_change);
+    }
+}
+
 //Check uploaded XML reports and log the changes, this goes to a changes_log text file in uploads folder
-void check_uploads() {
-    DIR *dir;
-    struct dirent *entry;
-    struct stat file_stat;
+//This is the full scan, diffed against the upload index so every change is reported exactly once
+int check_uploads(struct shard *shard) {
+    uint64_t start = metric_clock();
+    int changes;
+
+    if (init_upload_index(shard) != 0) {
+        return -1;
+    }
+
+    changes = scan_file_index(&shard->index, shard->upload_dir, log_upload_change);
+    metric_add(METRIC_FILES_SCANNED, shard->index.count);
+    metric_observe_since(HIST_SCAN, start);
+    if (changes > 0) {
+        log_message(CLOG_INFO, "Upload scan of %s found %d changes", shard->name, changes);
+    }
+    save_file_index(&shard->index);
+    return changes;
+}
+
+/* Lock directories before backup/transfer */
+// Only serialises jobs: readers are never blocked since the dashboard is published by generation
+int lock_directories(struct shard *shard) {
+    // Lock directory mutex
+    int ret = pthread_mutex_lock(&shard->dir_mutex);
+    if (ret != 0) {
+        log_message(CLOG_ERROR, "Failed to lock directories: %s", strerror(ret));
+        return -1;
+    }
+
+    log_message(CLOG_DEBUG, "Directories locked for backup/transfer.");
+    return 0;
+}
+
+
+// Unlocking directories after backup/transfer operations
+int unlock_directories(struct shard *shard) {
+    // Unlock directory mutex
+    int ret = pthread_mutex_unlock(&shard->dir_mutex);
+    if (ret != 0) {
+        log_message(CLOG_ERROR, "Failed to unlock directories: %s", strerror(ret));
+        return -1;
+    }
+
+    log_message(CLOG_DEBUG, "Directories unlocked after backup/transfer.");
+    return 0;
+}
+
+// A single file handed to the worker pool
+struct file_job {
+    struct shard *shard;
+    char name[NAME_MAX + 1];
+    char dst_dir[PATH_MAX];
+};
+
+static struct file_job *new_file_job(struct shard *shard, const char *name, const char *dst_dir) {
+    struct file_job *job = malloc(sizeof(*job));
+
+    if (job != NULL) {
+        job->shard = shard;
+        snprintf(job->name, sizeof(job->name), "%s", name);
+        snprintf(job->dst_dir, sizeof(job->dst_dir), "%s", dst_dir);
+    }
+    return job;
+}
+
+// Queueing a job for a file, returns -1 if it could not be queued
+static int queue_file_job(struct worker_pool *pool, pool_job_fn fn, struct shard *shard,
+                          const char *name, const char *dst_dir) {
+    struct file_job *job = new_file_job(shard, name, dst_dir);
+
+    if (job == NULL) {
+        log_message(CLOG_ERROR, "Failed to queue %s: %s", name, strerror(errno));
+        return -1;
+    }
+    if (pool_submit(pool, fn, job) != 0) {
+        log_message(CLOG_ERROR, "Failed to queue %s: worker pool is shutting down", name);
+        free(job);
+        return -1;
+    }
+    return 0;
+}
+
+// Finishing a report that reached the dashboard generation; mode is what it arrived with, if known
+static void transferred_report(struct shard *shard, const char *dst_dir, const char *name, mode_t mode) {
+    char dst_path[PATH_MAX];
+
+    // Moving an upload to the dashboard is not a deletion worth logging
+    if (shard->index_loaded) {
+        forget_file_index(&shard->index, name);
+    }
+
+    // Dashboard reports are readable by all but writable only by root
+    if ((mode & 07777) != REPORT_FILE_PERMS &&
+        snprintf(dst_path, sizeof(dst_path), "%s/%s", dst_dir, name) < (int) sizeof(dst_path) &&
+        chmod(dst_path, REPORT_FILE_PERMS) != 0) {
+        log_message(CLOG_WARNING, "Failed to set permissions on %s: %s", dst_path, strerror(errno));
+    }
+}
+
+// Moving a malformed upload to the quarantine directory with the reason beside it
+static int quarantine_upload(struct shard *shard, const char *name, const char *reason) {
+    struct transfer_result result;
+    struct stat st;
     char path[PATH_MAX];
-    char *last_modified_time;
-    char *username;
-    
-    dir = opendir(UPLOAD_DIR);
-    if (dir == NULL) {
-        log_message(CLOG_ERROR, "Failed to open upload directory: %s", strerror(errno));
-        return;
+    char filename[SHARD_NAME_MAX + NAME_MAX + 2];
+    const char *username = "unknown";
+    FILE *fp;
+
+    if (snprintf(path, sizeof(path), "%s/%s", shard->upload_dir, name) < (int) sizeof(path) && stat(path, &st) == 0) {
+        username = get_username_from_uid(st.st_uid);
     }
-    
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG && strstr(entry->d_name, ".xml") != NULL) {
-            snprintf(path, PATH_MAX, "%s/%s", UPLOAD_DIR, entry->d_name);
-            
-            if (stat(path, &file_stat) == 0) {
-                // Check if file was modified in the last CHECK_INTERVAL seconds
-                if (time(NULL) - file_stat.st_mtime < CHECK_INTERVAL) {
-                    // Get username from UID
-                    username = get_username_from_uid(file_stat.st_uid);
-                    
-                    // Get last modified time
-                    last_modified_time = get_time_string(file_stat.st_mtime);
-                    
-                    log_message(CLOG_INFO, "XML file modified: %s by %s at %s", 
-                                entry->d_name, username, last_modified_time);
-                    
-                    // Log change to the change log file
-                    log_file_change(entry->d_name, username, last_modified_time);
-                    
-                    free(last_modified_time);
-                    free(username);
+
+    if (transfer_file(shard->upload_dir, shard->quarantine_dir, name, &result) != 0) {
+        log_message(CLOG_ERROR, "Failed to quarantine %s (%s): %s", name, reason, strerror(result.error));
+        return -1;
+    }
+    if (shard->index_loaded) {
+        forget_file_index(&shard->index, name);
+    }
+
+    if (snprintf(path, sizeof(path), "%s/%s%s", shard->quarantine_dir, name, QUARANTINE_REASON_SUFFIX) < (int) sizeof(path) &&
+        (fp = fopen(path, "w")) != NULL) {
+        fprintf(fp, "%s\n", reason);
+        fclose(fp);
+    }
+
+    log_message(CLOG_WARNING, "Quarantined %s: %s", name, reason);
+    change_log_name(shard, name, filename, sizeof(filename));
+    log_file_change(filename, username, get_time_string(time(NULL)), "quarantined");
+    metric_add(METRIC_UPLOADS_QUARANTINED, 1);
+    return 0;
+}
+
+// Checking an upload is well-formed before it reaches the dashboard, returns 1 if it was quarantined
+// and -1 if it is malformed but could not be moved (it stays in the uploads, unpublished)
+// Unreadable uploads are left for the transfer to report
+static int quarantine_if_malformed(struct shard *shard, const char *name) {
+    char path[PATH_MAX];
+    char reason[XML_REASON_MAX];
+
+    if (snprintf(path, sizeof(path), "%s/%s", shard->upload_dir, name) >= (int) sizeof(path) ||
+        check_xml_file(path, reason, sizeof(reason)) != 1) {
+        return 0;
+    }
+    return quarantine_upload(shard, name, reason) == 0 ? 1 : -1;
+}
+
+// Worker job moving one upload into the dashboard
+static long long transfer_job(void *arg) {
+    struct file_job *job = arg;
+    struct transfer_result result;
+    long long bytes = -1;
+    uint64_t start = metric_clock();
+    int quarantined = quarantine_if_malformed(job->shard, job->name);
+
+    if (quarantined != 0) {
+        if (quarantined > 0) {
+            __atomic_add_fetch(&job->shard->quarantined, 1, __ATOMIC_RELAXED);
+        }
+        free(job);
+        return -1;
+    }
+
+    if (transfer_file(job->shard->upload_dir, job->dst_dir, job->name, &result) == 0) {
+        metric_observe_since(HIST_FILE_COPY, start);
+        journal_done(&job->shard->journal, job->name);
+        transferred_report(job->shard, job->dst_dir, job->name, result.mode);
+        log_message(CLOG_INFO, "Transferred: %s (%lld bytes, %s)", result.name,
+                    (long long) result.bytes, result.method == TRANSFER_RENAME ? "renamed" : "copied");
+        bytes = result.bytes;
+    } else {
+        log_message(CLOG_ERROR, "Failed to transfer %s: %s", result.name, strerror(result.error));
+    }
+
+    free(job);
+    return bytes;
+}
+
+// Finishing a transfer that was interrupted, caller holds the directory lock
+// Only moves with no completion record touch the filesystem
+static int recover_transfer_locked(struct shard *shard) {
+    struct journal_move *moves;
+    size_t count;
+    char gen_dir[PATH_MAX];
+    char path[PATH_MAX];
+    struct stat st;
+    int resumed = 0;
+    int failed = 0;
+    int quarantined;
+    int found;
+
+    found = load_journal(shard->journal_file, gen_dir, sizeof(gen_dir), &moves, &count);
+    if (found < 0) {
+        return -1;
+    }
+    if (found == 0) {
+        unlink(shard->journal_file);  // Empty or torn before the plan was written
+        // A generation begun but never journaled holds only links to published reports
+        remove_unpublished_generations(shard);
+        return 0;
+    }
+
+    if (stat(gen_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        // The generation never made it to disk, so neither did any move into it
+        log_message(CLOG_WARNING, "Interrupted transfer left no generation %s, nothing to recover", gen_dir);
+    } else {
+        // A copy cut short never got past its temporary name
+        remove_copy_leftovers(gen_dir);
+        for (size_t i = 0; i < count; i++) {
+            struct transfer_result result;
+            const char *name = moves[i].name;
+
+            if (moves[i].done) {
+                if (shard->index_loaded) {
+                    forget_file_index(&shard->index, name);
                 }
+                continue;
+            }
+
+            // Gone from the uploads means it was moved before the completion was recorded,
+            // unless it is missing from the generation too: quarantined or deleted
+            if (snprintf(path, sizeof(path), "%s/%s", shard->upload_dir, name) >= (int) sizeof(path) ||
+                stat(path, &st) != 0) {
+                if (snprintf(path, sizeof(path), "%s/%s", gen_dir, name) < (int) sizeof(path) && stat(path, &st) == 0) {
+                    transferred_report(shard, gen_dir, name, 0);
+                } else if (shard->index_loaded) {
+                    forget_file_index(&shard->index, name);
+                }
+                continue;
+            }
+
+            // Malformed but stuck in the uploads is a failure, not a quarantine
+            quarantined = quarantine_if_malformed(shard, name);
+            if (quarantined != 0) {
+                failed += quarantined < 0;
+                continue;
             }
+
+            if (transfer_file(shard->upload_dir, gen_dir, name, &result) == 0) {
+                transferred_report(shard, gen_dir, name, 0);
+                resumed++;
+            } else {
+                log_message(CLOG_ERROR, "Failed to resume transfer of %s: %s", name, strerror(result.error));
+                failed++;
+            }
+        }
+
+        log_message(CLOG_INFO, "Recovering interrupted transfer into %s: %zu files planned, %d resumed, %d failed",
+                    gen_dir, count, resumed, failed);
+        if (commit_generation(shard, gen_dir) != 0) {
+            failed++;
         }
     }
-    
-    closedir(dir);
+
+    free_journal_moves(moves, count);
+    if (unlink(shard->journal_file) != 0 && errno != ENOENT) {
+        log_message(CLOG_ERROR, "Failed to remove transfer journal %s: %s", shard->journal_file, strerror(errno));
+        return -1;
+    }
+    return failed == 0 ? 0 : -1;
 }
 
-/* Check for missing reports from departments */
-void check_missing_reports() {
-    int warehouse_found = 0;
-    int manufacturing_found = 0;
-    int sales_found = 0;
-    int distribution_found = 0;
+int recover_transfer(struct shard *shard) {
+    int ret;
+
+    if (lock_directories(shard) != 0) {
+        return -1;
+    }
+    ret = recover_transfer_locked(shard);
+    unlock_directories(shard);
+    return ret;
+}
+
+int rollback_reports(struct shard *shard) {
+    int ret;
+
+    if (lock_directories(shard) != 0) {
+        return -1;
+    }
+    ret = rollback_generation(shard);
+    unlock_directories(shard);
+    return ret;
+}
+
+// Listing the uploads a transfer run will move
+static int list_uploads(const char *dir_path, char ***names_out, size_t *count) {
     DIR *dir;
     struct dirent *entry;
-    char today_date[20];
-    time_t now = time(NULL);
-    struct tm *time_info = localtime(&now);
-    
-    // Get yesterday's date
-    time_info->tm_mday -= 1;  // Moving back one day
-    mktime(time_info); 
-    char yesterday_date[20];
-    strftime(yesterday_date, sizeof(yesterday_date), "%Y%m%d", time_info);
+    char **names = NULL;
+    size_t capacity = 0;
 
-    
-    dir = opendir(UPLOAD_DIR);
+    *names_out = NULL;
+    *count = 0;
+    dir = opendir(dir_path);
     if (dir == NULL) {
         log_message(CLOG_ERROR, "Failed to open upload directory: %s", strerror(errno));
-        return;
+        return -1;
     }
-    
+
     while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG && strstr(entry->d_name, ".xml") != NULL) {
-            if (strstr(entry->d_name, "warehouse") && strstr(entry->d_name, yesterday_date))
-                warehouse_found = 1;
-            else if (strstr(entry->d_name, "manufacturing") && strstr(entry->d_name, yesterday_date))
-                manufacturing_found = 1;
-            else if (strstr(entry->d_name, "sales") && strstr(entry->d_name, yesterday_date))
-                sales_found = 1;
-            else if (strstr(entry->d_name, "distribution") && strstr(entry->d_name, yesterday_date))
-                distribution_found = 1;
+        if (entry->d_type != DT_REG || strstr(entry->d_name, ".xml") == NULL) {
+            continue;
         }
+        // The journal is line based
+        if (strchr(entry->d_name, '\n') != NULL) {
+            log_message(CLOG_WARNING, "Skipping upload with a newline in its name");
+            continue;
+        }
+        if (*count == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 64;
+            char **grown = realloc(names, new_capacity * sizeof(*grown));
+            if (grown == NULL) {
+                break;
+            }
+            names = grown;
+            capacity = new_capacity;
+        }
+        if ((names[*count] = strdup(entry->d_name)) == NULL) {
+            break;
+        }
+        (*count)++;
     }
-    
+
+    // Out of memory part way: the rest wait for the next run
     closedir(dir);
-    
-    // Logging missing reports
-    if (!warehouse_found)
-        log_message(CLOG_WARNING, "Missing warehouse report for %s", today_date);
-    if (!manufacturing_found)
-        log_message(CLOG_WARNING, "Missing manufacturing report for %s", today_date);
-    if (!sales_found)
-        log_message(CLOG_WARNING, "Missing sales report for %s", today_date);
-    if (!distribution_found)
-        log_message(CLOG_WARNING, "Missing distribution report for %s", today_date);
+    *names_out = names;
+    return 0;
 }
 
-/* Lock directories before backup/transfer */
-int lock_directories() {
-    // Restrict access to the upload directory (read-only for all)
-    if (chmod(UPLOAD_DIR, S_IRUSR | S_IRGRP | S_IROTH) != 0) {
-        log_message(CLOG_ERROR, "Failed to lock upload directory: %s", strerror(errno));
-        return -1;
+static void free_uploads(char **names, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+// Loading the digest of the published generation, kept in memory until another generation is published
+static struct file_index *published_digest(struct shard *shard) {
+    char current[PATH_MAX];
+    char path[PATH_MAX];
+
+    if (current_generation(shard, current, sizeof(current)) != 0 ||
+        generation_digest_path(shard, current, path, sizeof(path)) != 0) {
+        path[0] = '\0';  // Nothing published yet, every upload is new
+    }
+
+    if (shard->digest_loaded && strcmp(shard->digest.path, path) == 0) {
+        return &shard->digest;
+    }
+    if (shard->digest_loaded) {
+        free_file_index(&shard->digest);  // Published elsewhere since, e.g. by a rollback
+    }
+    load_file_index(&shard->digest, path);
+    shard->digest_loaded = 1;
+    return &shard->digest;
+}
+
+// Whether the upload is still the file that was hashed, checked just before it is dropped, so a
+// rewrite landing after the hash is published rather than lost
+static int upload_unchanged_since(const char *path, const struct index_record *hashed) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    int same;
+
+    if (fd < 0) {
+        return 0;
     }
+    same = fstat(fd, &st) == 0 && (uint64_t) st.st_ino == hashed->inode && st.st_size == hashed->size &&
+           (int64_t) st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec == hashed->mtime_ns;
+    close(fd);
+    return same;
+}
 
-    // Restrict access to the dashboard directory (read-only for all)
-    if (chmod(REPORT_DIR, S_IRUSR | S_IRGRP | S_IROTH) != 0) {
-        log_message(CLOG_ERROR, "Failed to lock report directory: %s", strerror(errno));
+// Dropping uploads whose content the dashboard already publishes
+// Leaves the uploads to publish in kept; the hashes of everything examined go into the digest
+static int drop_unchanged_uploads(struct shard *shard, struct file_index *digest, const char *current,
+                                  char *const *names, size_t count, char **kept, size_t *kept_count) {
+    struct index_record *updates;
+    struct index_record upload;
+    struct index_record published;
+    char path[PATH_MAX];
+    size_t update_count = 0;
+    int unchanged = 0;
+
+    *kept_count = 0;
+    updates = malloc((count > 0 ? count : 1) * sizeof(*updates));
+    if (updates == NULL) {
+        log_message(CLOG_ERROR, "Failed to allocate upload digest: %s", strerror(errno));
         return -1;
     }
 
-    // Lock directory mutex
-    int ret = pthread_mutex_lock(&dir_mutex);
-    if (ret != 0) {
-        log_message(CLOG_ERROR, "Failed to lock directories: %s", strerror(ret));
+    for (size_t i = 0; i < count; i++) {
+        // The upload index already hashed most uploads when they were written
+        struct file_index *hashes = shard->index_loaded ? &shard->index : digest;
+
+        if (file_index_hash(hashes, shard->upload_dir, names[i], &upload) != 0) {
+            kept[(*kept_count)++] = names[i];  // Vanished or unreadable, the transfer reports it
+            continue;
+        }
+
+        if (current[0] == '\0' ||
+            file_index_hash(digest, current, names[i], &published) != 0 ||
+            upload.hash != published.hash || upload.size != published.size ||
+            snprintf(path, sizeof(path), "%s/%s", shard->upload_dir, names[i]) >= (int) sizeof(path) ||
+            !upload_unchanged_since(path, &upload) || unlink(path) != 0) {
+            kept[(*kept_count)++] = names[i];
+            updates[update_count++] = upload;
+            continue;
+        }
+
+        if (shard->index_loaded) {
+            forget_file_index(&shard->index, names[i]);
+        }
+        updates[update_count++] = published;
+        unchanged++;
+        log_message(CLOG_INFO, "Unchanged: %s matches the published report, not republished", names[i]);
+    }
+
+    merge_file_index(digest, updates, update_count);
+    free(updates);
+    return unchanged;
+}
+
+// A job per upload, each checking its upload and moving it
+static int move_with_workers(struct shard *shard, char *const *names, size_t count, const char *gen_dir,
+                             int *transferred, int *failures, long long *bytes) {
+    struct worker_pool *pool = pool_create("transfer", shard->workers, WORKER_QUEUE_SIZE);
+    int failed = 0;
+
+    if (pool == NULL) {
         return -1;
     }
+    for (size_t i = 0; i < count; i++) {
+        if (queue_file_job(pool, transfer_job, shard, names[i], gen_dir) != 0) {
+            failed++;
+        }
+    }
 
-    log_message(CLOG_INFO, "Directories locked for backup/transfer.");
+    pool_totals(pool, transferred, failures, bytes);
+    pool_log_stats(pool);
+    pool_destroy(pool);
+    *failures += failed;
     return 0;
 }
 
+// An upload awaiting its well-formedness check
+struct check_item {
+    struct shard *shard;
+    const char *name;
+    int kept;
+};
 
-// Locking directories before backup/transfer operations to prevent modifications
-int unlock_directories() {
-    // Ensure /var/reports/ allows access to subdirectories
-    if (chmod("/var/reports", S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0) {
-        log_message(CLOG_ERROR, "Failed to set /var/reports permissions: %s", strerror(errno));
+static long long check_job(void *arg) {
+    struct check_item *item = arg;
+    int quarantined = quarantine_if_malformed(item->shard, item->name);
+
+    if (quarantined != 0) {
+        if (quarantined > 0) {
+            __atomic_add_fetch(&item->shard->quarantined, 1, __ATOMIC_RELAXED);
+        }
         return -1;
     }
+    item->kept = 1;
+    return 0;
+}
 
-    // 🔹 Fully writable upload directory (everyone has full access)
-    if (chmod(UPLOAD_DIR, 0777) != 0) {
-        log_message(CLOG_ERROR, "Failed to restore upload directory permissions: %s", strerror(errno));
+// Parsing runs on the workers; the well-formed uploads then move through one io_uring batch,
+// so the renames (or copies) of a whole run take a handful of system calls
+static int move_batched(struct shard *shard, char *const *names, size_t count, const char *gen_dir,
+                        int *transferred, int *failures, long long *bytes) {
+    struct check_item *items = malloc((count > 0 ? count : 1) * sizeof(*items));
+    struct transfer_result *results = calloc(count > 0 ? count : 1, sizeof(*results));
+    char **moving = malloc((count > 0 ? count : 1) * sizeof(*moving));
+    struct worker_pool *pool = NULL;
+    size_t moving_count = 0;
+    uint64_t start, elapsed;
+
+    *transferred = *failures = 0;
+    *bytes = 0;
+    if (items != NULL && results != NULL && moving != NULL) {
+        pool = pool_create("check", shard->workers, WORKER_QUEUE_SIZE);
+    }
+    if (pool == NULL) {
+        log_message(CLOG_ERROR, "Failed to start transfer of %zu uploads: %s", count, strerror(errno));
+        free(items);
+        free(results);
+        free(moving);
         return -1;
     }
 
-    // 🔹 Ensure all files in upload directory are writable by all
-    system("chmod -R 777 /var/reports/upload/*.xml");
-
-    // 🔹 Dashboard directory: Read-only for non-root users
-    if (chmod(REPORT_DIR, 0755) != 0) {
-        log_message(CLOG_ERROR, "Failed to set dashboard directory as read-only: %s", strerror(errno));
-        return -1;
+    for (size_t i = 0; i < count; i++) {
+        items[i].shard = shard;
+        items[i].name = names[i];
+        items[i].kept = 0;
+        if (pool_submit(pool, check_job, &items[i]) != 0) {
+            log_message(CLOG_ERROR, "Failed to queue %s: worker pool is shutting down", names[i]);
+            (*failures)++;
+        }
     }
+    pool_log_stats(pool);
+    pool_destroy(pool);
 
-    // 🔹 Ensure all files in dashboard are readable, but NOT writable by non-root users
-    system("chmod -R 644 /var/reports/dashboard/*.xml");
+    for (size_t i = 0; i < count; i++) {
+        if (items[i].kept) {
+            moving[moving_count++] = names[i];
+        } else {
+            (*failures)++;  // Quarantined, or never checked
+        }
+    }
 
-    // Unlock directory mutex
-    int ret = pthread_mutex_unlock(&dir_mutex);
-    if (ret != 0) {
-        log_message(CLOG_ERROR, "Failed to unlock directories: %s", strerror(ret));
-        return -1;
+    start = metric_clock();
+    transfer_files(shard->upload_dir, gen_dir, moving, moving_count, results);
+    for (size_t i = 0; i < moving_count; i++) {
+        if (results[i].error != 0) {
+            log_message(CLOG_ERROR, "Failed to transfer %s: %s", moving[i], strerror(results[i].error));
+            (*failures)++;
+            continue;
+        }
+        journal_done(&shard->journal, moving[i]);
+        transferred_report(shard, gen_dir, moving[i], results[i].mode);
+        log_message(CLOG_INFO, "Transferred: %s (%lld bytes, %s)", moving[i], (long long) results[i].bytes,
+                    results[i].method == TRANSFER_RENAME ? "renamed" : "copied");
+        (*transferred)++;
+        *bytes += results[i].bytes;
     }
 
-    log_message(CLOG_INFO, "Directories unlocked after backup/transfer. Permissions set for reports.");
+    // The batch has no per-file timings, so it is timed as a whole
+    elapsed = metric_clock() - start;
+    metric_observe(HIST_TRANSFER_BATCH, elapsed);
+    log_message(CLOG_INFO, "transfer batch: %zu files (%d failed) through io_uring, %.3fs wall time",
+                moving_count, *failures - shard->quarantined, (double) elapsed / 1e9);
+
+    free(items);
+    free(results);
+    free(moving);
     return 0;
 }
 
-// Transfer XML reports from upload to report directory
-void transfer_reports() {
-    pid_t pid;
-    int status;
-    int pipe_fd[2];
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
-    
-    // Create a pipe for IPC
-    if (pipe(pipe_fd) == -1) {
-        log_message(CLOG_ERROR, "Failed to create pipe: %s", strerror(errno));
-        return;
+// Moving the named uploads into a new generation, caller holds the directory lock
+// The moves are journaled first, so a crash part way is finished by recover_transfer()
+static int transfer_names_locked(struct shard *shard, char *const *names, size_t count, struct run_summary *summary) {
+    struct file_index *digest;
+    char gen_dir[PATH_MAX];
+    char current[PATH_MAX];
+    char **kept;
+    size_t kept_count;
+    int unchanged;
+    int transferred = 0;
+    int failed = 0;
+    int job_failures = 0;
+    long long total_bytes = 0;
+    uint64_t start = metric_clock();
+
+    if (current_generation(shard, current, sizeof(current)) != 0) {
+        current[0] = '\0';
     }
-    
-    // Lock directories before transfer
-    if (lock_directories() != 0) {
-        close(pipe_fd[0]);
-        close(pipe_fd[1]);
-        return;
+
+    kept = malloc((count > 0 ? count : 1) * sizeof(*kept));
+    if (kept == NULL) {
+        log_message(CLOG_ERROR, "Failed to allocate transfer list: %s", strerror(errno));
+        return -1;
     }
-    
-    pid = fork();
-    
-    if (pid < 0) {
-        log_message(CLOG_ERROR, "Failed to fork for transfer: %s", strerror(errno));
-        unlock_directories();
-        close(pipe_fd[0]);
-        close(pipe_fd[1]);
-        return;
-    } else if (pid == 0) {
-        // Child process
-        close(pipe_fd[0]); // Close read end
-        
-        // Redirect stdout to pipe
-        dup2(pipe_fd[1], STDOUT_FILENO);
-        close(pipe_fd[1]);
-        
-        // Executing the transfer operation and delete the file from upload after
-        execl("/bin/sh", "sh", "-c", "find " UPLOAD_DIR " -name \"*.xml\" -exec cp {} " REPORT_DIR " \\; -exec echo \"Transferred: {}\" \\; -exec rm {} \\;", NULL);
-
-        
-        // If execl fails
-        log_message(CLOG_ERROR, "Failed to execute transfer command: %s", strerror(errno));
-        exit(EXIT_FAILURE);
+
+    digest = published_digest(shard);
+    unchanged = drop_unchanged_uploads(shard, digest, current, names, count, kept, &kept_count);
+    if (unchanged < 0) {
+        free(kept);
+        return -1;
+    }
+    metric_add(METRIC_UPLOADS_UNCHANGED, unchanged);
+    if (summary != NULL) {
+        summary->unchanged = unchanged;
+    }
+
+    // Nothing new to show, keep the published generation and just refresh its digest
+    if (kept_count == 0) {
+        free(kept);
+        if (count > 0) {
+            log_message(CLOG_INFO, "Transfer for %s: all %zu uploads unchanged, nothing published", shard->name, count);
+        }
+        if (digest->path[0] != '\0') {
+            save_file_index(digest);
+        }
+        return 0;
+    }
+
+    if (begin_generation(shard, gen_dir, sizeof(gen_dir)) != 0) {
+        free(kept);
+        return -1;
+    }
+
+    if (journal_begin(&shard->journal, shard->journal_file, gen_dir, kept, kept_count) != 0) {
+        free(kept);
+        abort_generation(gen_dir);
+        return -1;
+    }
+
+    shard->quarantined = 0;
+    if ((settings.io_backend == IO_BACKEND_URING && transfer_batch_available()
+             ? move_batched(shard, kept, kept_count, gen_dir, &transferred, &job_failures, &total_bytes)
+             : move_with_workers(shard, kept, kept_count, gen_dir, &transferred, &job_failures, &total_bytes)) != 0) {
+        free(kept);
+        abort_generation(gen_dir);
+        journal_finish(&shard->journal);
+        return -1;
+    }
+    free(kept);
+
+    // Quarantined uploads end their job unsuccessfully but are not failures
+    failed += job_failures - shard->quarantined;
+
+    // Publishing even after partial failures: moved uploads exist only in the new generation
+    // The digest follows the generation; records for failed moves no longer match and are rehashed
+    if (transferred == 0) {
+        abort_generation(gen_dir);
     } else {
-        // Parent process
-        close(pipe_fd[1]); // Close write end
-        
-        // Read output from child process
-        while ((bytes_read = read(pipe_fd[0], buffer, BUFFER_SIZE - 1)) > 0) {
-            buffer[bytes_read] = '\0';
-            log_message(CLOG_INFO, "%s", buffer);
+        if (generation_digest_path(shard, gen_dir, digest->path, sizeof(digest->path)) == 0) {
+            digest->dirty = 1;
+            save_file_index(digest);
         }
-        
-        close(pipe_fd[0]);
-        
-        // Waiting for child to complete
-        waitpid(pid, &status, 0);
-        
-        if (WIFEXITED(status)) {
-            if (WEXITSTATUS(status) == 0) {
-                log_message(CLOG_INFO, "Transfer completed successfully");
-            } else {
-                log_message(CLOG_ERROR, "Transfer failed with status %d", WEXITSTATUS(status));
-            }
-        } else {
-            log_message(CLOG_ERROR, "Transfer process terminated abnormally");
+        if (commit_generation(shard, gen_dir) != 0) {
+            failed++;
         }
-        
-        // Unlocking directories after transfer
-        unlock_directories();
     }
-}
 
-// Backup report directory
-void backup_reports() {
-    pid_t pid;
-    int status;
-    int pipe_fd[2];
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
-    char backup_dir[PATH_MAX];
-    char timestamp[20];
-    time_t now = time(NULL);
-    struct tm *time_info = localtime(&now);
-    
-    // Creating timestamp for backup directory
-    strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", time_info);
-    snprintf(backup_dir, PATH_MAX, "%s/%s", BACKUP_DIR, timestamp);
+    // Published or discarded, either way there is nothing left to recover
+    journal_finish(&shard->journal);
     
-    // Creating backup directory
-    if (mkdir(backup_dir, 0755) != 0) {
-        log_message(CLOG_ERROR, "Failed to create backup directory %s: %s", backup_dir, strerror(errno));
-        return;
+    if (failed == 0) {
+        log_message(CLOG_INFO, "Transfer for %s completed successfully: %d files, %lld bytes, %d quarantined", shard->name,
+                    transferred, total_bytes, shard->quarantined);
+    } else {
+        log_message(CLOG_ERROR, "Transfer for %s finished with %d failures (%d files transferred)", shard->name, failed, transferred);
     }
     
-    // Creating a pipe for IPC
-    if (pipe(pipe_fd) == -1) {
-        log_message(CLOG_ERROR, "Failed to create pipe: %s", strerror(errno));
-        return;
+    metric_add(METRIC_FILES_TRANSFERRED, transferred);
+    metric_add(METRIC_BYTES_TRANSFERRED, total_bytes);
+    metric_add(METRIC_TRANSFER_FAILURES, failed);
+    metric_observe_since(HIST_TRANSFER_RUN, start);
+
+    if (summary != NULL) {
+        summary->files = transferred;
+        summary->quarantined = shard->quarantined;
+        summary->failed = failed;
+        summary->bytes = total_bytes;
+        snprintf(summary->target, sizeof(summary->target), "%s", transferred > 0 ? gen_dir : "");
+    }
+    return failed == 0 ? 0 : -1;
+}
+
+// Transfer XML reports from upload to report directory
+// Reports go into a new generation that is published with one symlink swap
+int transfer_reports(struct shard *shard, struct run_summary *summary) {
+    char **names;
+    size_t count;
+    int ret;
+
+    if (summary != NULL) {
+        memset(summary, 0, sizeof(*summary));
     }
     
-    // Locking directories before backup
-    if (lock_directories() != 0) {
-        close(pipe_fd[0]);
-        close(pipe_fd[1]);
-        return;
+    // Lock directories before transfer
+    if (lock_directories(shard) != 0) {
+        return -1;
     }
+
+    // An earlier run that never finished comes first
+    recover_transfer_locked(shard);
     
-    pid = fork();
+    ret = list_uploads(shard->upload_dir, &names, &count);
+    if (ret == 0) {
+        ret = transfer_names_locked(shard, names, count, summary);
+        free_uploads(names, count);
+    }
     
-    if (pid < 0) {
-        log_message(CLOG_ERROR, "Failed to fork for backup: %s", strerror(errno));
-        unlock_directories();
-        close(pipe_fd[0]);
-        close(pipe_fd[1]);
-        return;
-    } else if (pid == 0) {
-        // Child process
-        close(pipe_fd[0]); // Close read end
-        
-        // Redirecting stdout to pipe
-        dup2(pipe_fd[1], STDOUT_FILENO);
-        close(pipe_fd[1]);
-        
-        // Executing the backup operation
-        char command[PATH_MAX];
-        snprintf(command, sizeof(command), "cp -r %s/*.xml %s/ 2>> /var/log/report_daemon/report_daemon.log", REPORT_DIR, backup_dir);
-        execl("/bin/sh", "sh", "-c", command, (char *) NULL);
-
-        // If execl fails
-        log_message(CLOG_ERROR, "Failed to execute backup command: %s", strerror(errno));
-        exit(EXIT_FAILURE);
-    } else {
-        // Parent process
-        close(pipe_fd[1]); // Close write end
-        
-        // Reading output from child process
-        while ((bytes_read = read(pipe_fd[0], buffer, BUFFER_SIZE - 1)) > 0) {
-            buffer[bytes_read] = '\0';
-            log_message(CLOG_INFO, "%s", buffer);
-        }
-        
-        close(pipe_fd[0]);
-        
-        // Waiting for child to complete
-        waitpid(pid, &status, 0);
-        
-        if (WIFEXITED(status)) {
-            if (WEXITSTATUS(status) == 0) {
-                log_message(CLOG_INFO, "Backup completed successfully to %s", backup_dir);
-            } else {
-                log_message(CLOG_ERROR, "Backup failed with status %d", WEXITSTATUS(status));
-            }
-        } else {
-            log_message(CLOG_ERROR, "Backup process terminated abnormally");
-        }
-        
-        // Unlock directories after backup
-        unlock_directories();
+    // Unlocking directories after transfer
+    unlock_directories(shard);
+    return ret;
+}
+
+int transfer_uploads(struct shard *shard, char *const *names, size_t count, struct run_summary *summary) {
+    int ret;
+
+    if (summary != NULL) {
+        memset(summary, 0, sizeof(*summary));
     }
-}
\ No newline at end of file
+    if (lock_directories(shard) != 0) {
+        return -1;
+    }
+    recover_transfer_locked(shard);
+    ret = transfer_names_locked(shard, names, count, summary);
+    unlock_directories(shard);
+    return ret;
+}
@@ -0,0 +1,208 @@
+/* hash.c - Implementation of XXH64 content hashing */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "../include/config.h"
+#include "../include/hash.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t val) {
+    acc ^= round64(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+// Mixing in the bytes after the last 32-byte stripe, then the final avalanche
+static uint64_t finish64(uint64_t h, const unsigned char *p, const unsigned char *end) {
+    while (p + 8 <= end) {
+        h ^= round64(0, read64(p));
+        h = rotl64(h, 27) * PRIME1 + PRIME4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t) read32(p) * PRIME1;
+        h = rotl64(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * PRIME5;
+        h = rotl64(h, 11) * PRIME1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+static void stripe64(uint64_t v[4], const unsigned char *p) {
+    v[0] = round64(v[0], read64(p));
+    v[1] = round64(v[1], read64(p + 8));
+    v[2] = round64(v[2], read64(p + 16));
+    v[3] = round64(v[3], read64(p + 24));
+}
+
+static uint64_t converge64(const uint64_t v[4]) {
+    uint64_t h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+
+    h = merge64(h, v[0]);
+    h = merge64(h, v[1]);
+    h = merge64(h, v[2]);
+    h = merge64(h, v[3]);
+    return h;
+}
+
+// Hashing a memory block with XXH64 (little-endian hosts)
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        const unsigned char *limit = end - 32;
+        uint64_t v[4] = {seed + PRIME1 + PRIME2, seed + PRIME2, seed, seed - PRIME1};
+
+        do {
+            stripe64(v, p);
+            p += 32;
+        } while (p <= limit);
+        h = converge64(v);
+    } else {
+        h = seed + PRIME5;
+    }
+
+    h += (uint64_t) len;
+    return finish64(h, p, end);
+}
+
+void hash_init(struct hash_state *state, uint64_t seed) {
+    state->v[0] = seed + PRIME1 + PRIME2;
+    state->v[1] = seed + PRIME2;
+    state->v[2] = seed;
+    state->v[3] = seed - PRIME1;
+    state->seed = seed;
+    state->total = 0;
+    state->pending_len = 0;
+}
+
+// Consuming whole 32-byte stripes, keeping the remainder for the next piece or the digest
+void hash_update(struct hash_state *state, const void *data, size_t len) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+
+    state->total += len;
+    if (state->pending_len + len < sizeof(state->pending)) {
+        memcpy(state->pending + state->pending_len, p, len);
+        state->pending_len += len;
+        return;
+    }
+
+    if (state->pending_len > 0) {
+        size_t fill = sizeof(state->pending) - state->pending_len;
+
+        memcpy(state->pending + state->pending_len, p, fill);
+        stripe64(state->v, state->pending);
+        p += fill;
+        state->pending_len = 0;
+    }
+    while (end - p >= 32) {
+        stripe64(state->v, p);
+        p += 32;
+    }
+    memcpy(state->pending, p, (size_t) (end - p));
+    state->pending_len = (size_t) (end - p);
+}
+
+uint64_t hash_digest(const struct hash_state *state) {
+    uint64_t h = state->total >= 32 ? converge64(state->v) : state->seed + PRIME5;
+
+    h += state->total;
+    return finish64(h, state->pending, state->pending + state->pending_len);
+}
+
+// Hashing an open file through a fixed buffer; a file that shrinks is hashed as far as it goes
+int hash_fd(int fd, uint64_t *hash) {
+    struct hash_state state;
+    unsigned char *buf;
+    off_t offset = 0;
+
+    buf = malloc(HASH_READ_SIZE);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    hash_init(&state, 0);
+    for (;;) {
+        ssize_t n = pread(fd, buf, HASH_READ_SIZE, offset);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            int saved_errno = errno;
+
+            free(buf);
+            errno = saved_errno;
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        hash_update(&state, buf, (size_t) n);
+        offset += n;
+    }
+
+    free(buf);
+    *hash = hash_digest(&state);
+    return 0;
+}
+
+int hash_file(const char *path, uint64_t *hash) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    int ret;
+    int saved_errno;
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    ret = hash_fd(fd, hash);
+    saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return ret;
+}
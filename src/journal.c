@@ -0,0 +1,190 @@
+/* journal.c - Implementation of the transfer journal */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "../include/config.h"
+#include "../include/journal.h"
+#include "../include/logging.h"
+
+#define JOURNAL_BEGIN "begin "
+#define JOURNAL_MOVE  "move "
+#define JOURNAL_DONE  "done "
+
+int journal_begin(struct transfer_journal *journal, const char *path, const char *gen_dir,
+                  char *const *names, size_t count) {
+    int fd;
+
+    snprintf(journal->path, sizeof(journal->path), "%s", path);
+    pthread_mutex_init(&journal->mutex, NULL);
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0 || (journal->fp = fdopen(fd, "w")) == NULL) {
+        log_message(CLOG_ERROR, "Failed to create transfer journal %s: %s", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        pthread_mutex_destroy(&journal->mutex);
+        return -1;
+    }
+
+    fprintf(journal->fp, JOURNAL_BEGIN "%s\n", gen_dir);
+    for (size_t i = 0; i < count; i++) {
+        fprintf(journal->fp, JOURNAL_MOVE "%s\n", names[i]);
+    }
+
+    // The plan must be on disk before the first file moves
+    if (fflush(journal->fp) != 0 || fdatasync(fileno(journal->fp)) != 0) {
+        log_message(CLOG_ERROR, "Failed to write transfer journal %s: %s", path, strerror(errno));
+        fclose(journal->fp);
+        journal->fp = NULL;
+        unlink(path);
+        pthread_mutex_destroy(&journal->mutex);
+        return -1;
+    }
+    return 0;
+}
+
+// Completions are buffered, not synced: a lost record only costs recovery one extra check
+void journal_done(struct transfer_journal *journal, const char *name) {
+    pthread_mutex_lock(&journal->mutex);
+    if (journal->fp != NULL) {
+        fprintf(journal->fp, JOURNAL_DONE "%s\n", name);
+    }
+    pthread_mutex_unlock(&journal->mutex);
+}
+
+int journal_finish(struct transfer_journal *journal) {
+    int ret = 0;
+
+    if (journal->fp == NULL) {
+        return 0;
+    }
+
+    fclose(journal->fp);
+    journal->fp = NULL;
+    pthread_mutex_destroy(&journal->mutex);
+
+    if (unlink(journal->path) != 0 && errno != ENOENT) {
+        log_message(CLOG_ERROR, "Failed to remove transfer journal %s: %s", journal->path, strerror(errno));
+        ret = -1;
+    }
+    return ret;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+// Appending a copy of a name to a growing array
+static int push_name(char ***names, size_t *count, size_t *capacity, const char *name) {
+    if (*count == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 64;
+        char **grown = realloc(*names, new_capacity * sizeof(*grown));
+        if (grown == NULL) {
+            return -1;
+        }
+        *names = grown;
+        *capacity = new_capacity;
+    }
+    if (((*names)[*count] = strdup(name)) == NULL) {
+        return -1;
+    }
+    (*count)++;
+    return 0;
+}
+
+static void free_names(char **names, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+int load_journal(const char *path, char *gen_dir, size_t size, struct journal_move **moves, size_t *count) {
+    FILE *fp;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    char **planned = NULL, **done = NULL;
+    size_t planned_count = 0, planned_capacity = 0;
+    size_t done_count = 0, done_capacity = 0;
+    int have_begin = 0;
+    int ret = 1;
+
+    *moves = NULL;
+    *count = 0;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        log_message(CLOG_ERROR, "Failed to open transfer journal %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    while ((len = getline(&line, &line_size, fp)) > 0) {
+        // A torn last line is a record that never made it
+        if (line[len - 1] != '\n') {
+            break;
+        }
+        line[len - 1] = '\0';
+
+        if (!have_begin) {
+            if (strncmp(line, JOURNAL_BEGIN, strlen(JOURNAL_BEGIN)) != 0) {
+                break;
+            }
+            snprintf(gen_dir, size, "%s", line + strlen(JOURNAL_BEGIN));
+            have_begin = 1;
+        } else if (strncmp(line, JOURNAL_MOVE, strlen(JOURNAL_MOVE)) == 0) {
+            if (push_name(&planned, &planned_count, &planned_capacity, line + strlen(JOURNAL_MOVE)) != 0) {
+                ret = -1;
+                break;
+            }
+        } else if (strncmp(line, JOURNAL_DONE, strlen(JOURNAL_DONE)) == 0) {
+            if (push_name(&done, &done_count, &done_capacity, line + strlen(JOURNAL_DONE)) != 0) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    free(line);
+    fclose(fp);
+
+    if (ret < 0) {
+        log_message(CLOG_ERROR, "Out of memory reading transfer journal %s", path);
+    } else if (!have_begin) {
+        ret = 0;  // Crashed before the plan was written, nothing moved
+    } else if (planned_count > 0 && (*moves = calloc(planned_count, sizeof(**moves))) == NULL) {
+        log_message(CLOG_ERROR, "Out of memory reading transfer journal %s", path);
+        ret = -1;
+    } else {
+        // Matching completions against the plan by sorted lookup
+        if (done_count > 0) {
+            qsort(done, done_count, sizeof(*done), compare_names);
+        }
+        for (size_t i = 0; i < planned_count; i++) {
+            (*moves)[i].name = planned[i];
+            (*moves)[i].done = done_count > 0 &&
+                               bsearch(&planned[i], done, done_count, sizeof(*done), compare_names) != NULL;
+            planned[i] = NULL;
+        }
+        *count = planned_count;
+    }
+
+    free_names(planned, planned_count);
+    free_names(done, done_count);
+    return ret;
+}
+
+void free_journal_moves(struct journal_move *moves, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(moves[i].name);
+    }
+    free(moves);
+}
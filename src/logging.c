@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
@@ -10,26 +11,53 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/uio.h>
 
 #include "../include/config.h"
 #include "../include/logging.h"
+#include "../include/metrics.h"
+#include "../include/settings.h"
+#include "../include/timestamp.h"
 
 static FILE *log_fp = NULL;
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Slots of the asynchronous ring buffer, published through seq
+struct log_slot {
+    unsigned long seq;
+    int level;
+    int len;
+    char text[LOG_LINE_MAX];
+};
+
+#define LOG_RING_MASK (LOG_RING_SLOTS - 1)
+#define LOG_WRITE_BATCH 64
+
+static struct log_slot *log_ring = NULL;
+static unsigned long enqueue_pos = 0;
+static unsigned long dequeue_pos = 0;
+static unsigned long dropped_messages = 0;
+static int full_policy = LOG_FULL_BLOCK;
+static int async_active = 0;
+static int writer_stop = 0;
+static sem_t log_sem;
+static pthread_t writer_thread;
+
 // Initialize logging
 int init_logging() {
     // Creating the log directory if it doesn't exist
     struct stat st;
-    if (stat(LOG_DIR, &st) != 0) {
-        if (mkdir(LOG_DIR, 0755) != 0) {
+    if (stat(settings.log_dir, &st) != 0) {
+        if (mkdir(settings.log_dir, 0755) != 0) {
             fprintf(stderr, "Failed to create log directory: %s\n", strerror(errno));
             return -1;
         }
     }
     
     // Open log file
-    log_fp = fopen(LOG_FILE, "a");
+    log_fp = fopen(settings.log_file, "a");
     if (log_fp == NULL) {
         fprintf(stderr, "Failed to open log file: %s\n", strerror(errno));
         return -1;
@@ -41,14 +69,192 @@ int init_logging() {
     return 0;
 }
 
+// Writing a batch of consecutive slots with a single writev
+static unsigned long write_log_batch(unsigned long pos) {
+    struct iovec iov[LOG_WRITE_BATCH];
+    struct iovec err_iov[LOG_WRITE_BATCH];
+    int count = 0;
+    int err_count = 0;
+
+    while (count < LOG_WRITE_BATCH) {
+        struct log_slot *slot = &log_ring[(pos + count) & LOG_RING_MASK];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + count + 1) {
+            break;
+        }
+        iov[count].iov_base = slot->text;
+        iov[count].iov_len = slot->len;
+        if (slot->level >= CLOG_ERROR) {
+            err_iov[err_count++] = iov[count];
+        }
+        count++;
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    // Short writes are not retried: a log line is not worth stalling the writer
+    if (writev(fileno(log_fp), iov, count) < 0) {
+        __atomic_fetch_add(&dropped_messages, count, __ATOMIC_RELAXED);
+    }
+    if (err_count > 0 && writev(STDERR_FILENO, err_iov, err_count) < 0) {
+        // stderr is /dev/null once daemonised, nothing to report
+    }
+
+    // Handing the slots back to producers
+    for (int i = 0; i < count; i++) {
+        struct log_slot *slot = &log_ring[(pos + i) & LOG_RING_MASK];
+        __atomic_store_n(&slot->seq, pos + i + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&dequeue_pos, pos + count, __ATOMIC_RELEASE);
+
+    return count;
+}
+
+// Reporting messages dropped because the ring was full
+static void write_drop_notice(unsigned long *reported) {
+    unsigned long dropped = __atomic_load_n(&dropped_messages, __ATOMIC_RELAXED);
+    char line[128];
+    int len;
+
+    if (dropped == *reported) {
+        return;
+    }
+
+    len = snprintf(line, sizeof(line), "[%s] [%s] %lu log messages dropped, log buffer full\n",
+                   current_timestamp(TS_LOG), get_log_level_str(CLOG_WARNING), dropped - *reported);
+    if (write(fileno(log_fp), line, len) == len) {
+        *reported = dropped;
+    }
+}
+
+// Writer thread draining the ring buffer
+static void *log_writer_main(void *arg) {
+    unsigned long pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+    unsigned long reported = 0;
+    unsigned long written;
+
+    (void) arg;
+
+    for (;;) {
+        written = write_log_batch(pos);
+        pos += written;
+        if (written > 0) {
+            continue;
+        }
+
+        if (full_policy == LOG_FULL_COUNT) {
+            write_drop_notice(&reported);
+        }
+
+        // Exit only once every claimed slot has been written
+        if (__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE) &&
+            pos == __atomic_load_n(&enqueue_pos, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        while (sem_wait(&log_sem) != 0 && errno == EINTR) {
+        }
+    }
+
+    return NULL;
+}
+
+// Switching to asynchronous logging through the ring buffer
+int start_async_logging() {
+    sigset_t all, old;
+    int ret;
+
+    if (async_active || log_fp == NULL) {
+        return -1;
+    }
+
+    log_ring = calloc(LOG_RING_SLOTS, sizeof(*log_ring));
+    if (log_ring == NULL) {
+        log_message(CLOG_ERROR, "Failed to allocate log ring buffer: %s", strerror(errno));
+        return -1;
+    }
+    for (unsigned long i = 0; i < LOG_RING_SLOTS; i++) {
+        log_ring[i].seq = i;
+    }
+
+    enqueue_pos = 0;
+    dequeue_pos = 0;
+    writer_stop = 0;
+    full_policy = settings.log_full_policy;
+    sem_init(&log_sem, 0, 0);
+
+    // The writer must never run signal handlers, they may wait on it to flush
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&writer_thread, NULL, log_writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret != 0) {
+        log_message(CLOG_ERROR, "Failed to start log writer thread: %s", strerror(ret));
+        sem_destroy(&log_sem);
+        free(log_ring);
+        log_ring = NULL;
+        return -1;
+    }
+
+    __atomic_store_n(&async_active, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Waiting for the writer to catch up, safe to call from a signal handler
+void flush_logging() {
+    unsigned long target;
+    struct timespec pause = { 0, 1000000 };
+
+    if (!__atomic_load_n(&async_active, __ATOMIC_ACQUIRE)) {
+        if (log_fp != NULL) {
+            fflush(log_fp);
+        }
+        return;
+    }
+
+    target = __atomic_load_n(&enqueue_pos, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < LOG_FLUSH_TIMEOUT_MS; i++) {
+        if ((long) (__atomic_load_n(&dequeue_pos, __ATOMIC_ACQUIRE) - target) >= 0) {
+            return;
+        }
+        sem_post(&log_sem);
+        nanosleep(&pause, NULL);
+    }
+}
+
+// Stopping the writer thread after it has drained the ring
+static void stop_async_logging() {
+    if (!__atomic_load_n(&async_active, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    __atomic_store_n(&writer_stop, 1, __ATOMIC_RELEASE);
+    sem_post(&log_sem);
+    pthread_join(writer_thread, NULL);
+
+    __atomic_store_n(&async_active, 0, __ATOMIC_RELEASE);
+    sem_destroy(&log_sem);
+    free(log_ring);
+    log_ring = NULL;
+}
+
 // Cleaning up logging
 void cleanup_logging() {
+    stop_async_logging();
+
     if (log_fp != NULL) {
         fclose(log_fp);
         log_fp = NULL;
     }
 }
 
+void get_logging_stats(unsigned long *queued, unsigned long *dropped) {
+    *queued = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED) - __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+    *dropped = __atomic_load_n(&dropped_messages, __ATOMIC_RELAXED);
+}
+
 // Geting log level string
 const char *get_log_level_str(int level) {
     switch (level) {
@@ -67,22 +273,76 @@ const char *get_log_level_str(int level) {
     }
 }
 
+// Claiming a ring slot and formatting the message into it
+static void enqueue_log_message(int level, const char *timestamp, const char *format, va_list args) {
+    struct log_slot *slot;
+    unsigned long pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    struct timespec pause = { 0, 100000 };
+    long diff;
+    int len;
+
+    for (;;) {
+        slot = &log_ring[pos & LOG_RING_MASK];
+        diff = (long) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Ring is full
+            if (full_policy != LOG_FULL_BLOCK) {
+                __atomic_fetch_add(&dropped_messages, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            sem_post(&log_sem);
+            nanosleep(&pause, NULL);
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    len = snprintf(slot->text, LOG_LINE_MAX, "[%s] [%s] ", timestamp, get_log_level_str(level));
+    if (len < LOG_LINE_MAX - 1) {
+        int body = vsnprintf(slot->text + len, LOG_LINE_MAX - 1 - len, format, args);
+        len += body < 0 ? 0 : body;
+    }
+    if (len > LOG_LINE_MAX - 2) {
+        len = LOG_LINE_MAX - 2;  // Truncated message
+    }
+    slot->text[len++] = '\n';
+    slot->len = len;
+    slot->level = level;
+
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    sem_post(&log_sem);
+}
+
 // Logging a message
 void log_message(int level, const char *format, ...) {
     va_list args;
-    time_t now;
-    struct tm *time_info;
-    char timestamp[20];
+    const char *timestamp;
+    uint64_t start;
     
     // Check if log level is enabled
     if (level < LOG_LEVEL) {
         return;
     }
     
-    // Get current time
-    time(&now);
-    time_info = localtime(&now);
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", time_info);
+    start = metric_clock();
+    metric_add(METRIC_LOG_MESSAGES, 1);
+    
+    // Get current time, formatted at most once a second per thread
+    timestamp = current_timestamp(TS_LOG);
+    
+    if (__atomic_load_n(&async_active, __ATOMIC_ACQUIRE)) {
+        va_start(args, format);
+        enqueue_log_message(level, timestamp, format, args);
+        va_end(args);
+        metric_observe_since(HIST_LOG_MESSAGE, start);
+        return;
+    }
     
     // Lock mutex
     pthread_mutex_lock(&log_mutex);
@@ -108,6 +368,7 @@ void log_message(int level, const char *format, ...) {
     
     // Unlock mutex
     pthread_mutex_unlock(&log_mutex);
+    metric_observe_since(HIST_LOG_MESSAGE, start);
 }
 
 // Logging a system error
@@ -5,26 +5,196 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <getopt.h>
 
 #include "../include/config.h"
+#include "../include/control.h"
 #include "../include/daemon.h"
 #include "../include/logging.h"
+#include "../include/restore.h"
+#include "../include/retention.h"
+#include "../include/settings.h"
 #include <sys/types.h>
 #include <errno.h>
 
 void print_usage(const char *program_name) {
-    printf("Usage: %s [start|stop|status|backup]\n", program_name);
-    printf("  start   - Start the daemon\n");
-    printf("  stop    - Stop the daemon\n");
-    printf("  status  - Check if the daemon is running\n");
-    printf("  backup  - Signal running daemon to perform backup\n");
+    printf("Usage: %s [options] [start|stop|status|backup|transfer|scan|audit|gc|stats|reload|rollback [shard]|du [shard]]\n", program_name);
+    printf("       %s [options] restore --at TIME [--dept LIST] [--file GLOB] [shard]\n", program_name);
+    printf("  start    - Start the daemon\n");
+    printf("  stop     - Stop the daemon\n");
+    printf("  status   - Check if the daemon is running\n");
+    printf("  backup   - Back up and transfer reports now, waiting for the result\n");
+    printf("  transfer - Transfer uploaded reports now\n");
+    printf("  scan     - Rescan the upload directory for changes\n");
+    printf("  audit    - Check every department reported for the audit window\n");
+    printf("  gc       - Delete the backups the retention policy no longer keeps\n");
+    printf("  du       - Show the backups with their size and why each is kept\n");
+    printf("  stats    - Print daemon statistics\n");
+    printf("  reload   - Reopen the change log and drop cached usernames\n");
+    printf("  rollback - Point the dashboard back at the previous generation\n");
+    printf("  restore  - Publish the reports of the newest backup at or before TIME, e.g. 2024-01-31 13:45,\n");
+    printf("             only those of the listed departments or matching GLOB if given\n");
+    printf("Options:\n");
+    printf("  -c, --config FILE        Read settings from FILE (default %s)\n", CONFIG_FILE);
+    printf("  --upload-dir DIR         Upload directory of the default shard\n");
+    printf("  --dashboard-dir DIR      Dashboard link of the default shard\n");
+    printf("  --backup-dir DIR         Backup directory of the default shard\n");
+    printf("  --log-dir DIR            Directory for the daemon, change and metrics logs\n");
+    printf("  --pid-file FILE          PID file\n");
+    printf("  --check-interval SECS    Scan interval when uploads cannot be watched\n");
+    printf("  --publish MODE           nightly, or continuous to publish each upload once complete\n");
+}
+
+static const struct option long_options[] = {
+    {"config", required_argument, NULL, 'c'},
+    {"upload-dir", required_argument, NULL, 'u'},
+    {"dashboard-dir", required_argument, NULL, 'd'},
+    {"backup-dir", required_argument, NULL, 'b'},
+    {"log-dir", required_argument, NULL, 'l'},
+    {"pid-file", required_argument, NULL, 'p'},
+    {"check-interval", required_argument, NULL, 'i'},
+    {"publish", required_argument, NULL, 'P'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
+
+// Setting names for the command line options, applied after the config file
+static const char *option_setting(int option) {
+    switch (option) {
+        case 'u': return "upload_dir";
+        case 'd': return "dashboard_dir";
+        case 'b': return "backup_dir";
+        case 'l': return "log_dir";
+        case 'p': return "pid_file";
+        case 'i': return "check_interval";
+        case 'P': return "publish";
+    }
+    return NULL;
+}
+
+// Config file first, then command line overrides, then derived paths
+static int load_settings(int argc, char *argv[]) {
+    const char *config_file = NULL;
+    int option;
+
+    default_settings();
+
+    // First pass only looks for the config file, so options override it whatever their order
+    while ((option = getopt_long(argc, argv, "+c:h", long_options, NULL)) != -1) {
+        if (option == 'c') {
+            config_file = optarg;
+        } else if (option == 'h') {
+            print_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        } else if (option == '?') {
+            return -1;
+        }
+    }
+    if (load_settings_file(config_file != NULL ? config_file : CONFIG_FILE, config_file != NULL) != 0) {
+        return -1;
+    }
+
+    optind = 1;
+    while ((option = getopt_long(argc, argv, "+c:h", long_options, NULL)) != -1) {
+        const char *key = option_setting(option);
+        if (key != NULL && apply_setting(NULL, key, optarg) != 0) {
+            return -1;
+        }
+    }
+
+    return finish_settings();
+}
+
+// Space used by the backups of every shard, or just the one named, from their catalogs
+static int print_usage_of_shards(const char *name) {
+    int status = EXIT_SUCCESS;
+
+    if (name != NULL && find_shard(name) == NULL) {
+        fprintf(stderr, "Unknown shard: %s\n", name);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < settings.shard_count; i++) {
+        if ((name == NULL || strcmp(settings.shards[i].name, name) == 0) &&
+            print_snapshot_usage(&settings.shards[i], stdout) != 0) {
+            status = EXIT_FAILURE;
+        }
+    }
+    return status;
+}
+
+// Turning "restore --at TIME [--dept LIST] [--file GLOB] [shard]" into the daemon's restore arguments
+static int restore_command(int argc, char *argv[], int first, char *command, size_t size) {
+    char stamp[SNAPSHOT_STAMP_LEN + 1] = "";
+    const char *dept = NULL;
+    const char *pattern = NULL;
+    const char *shard = NULL;
+    int len;
+
+    for (int i = first; i < argc; i++) {
+        if (strcmp(argv[i], "--at") == 0 && i + 1 < argc) {
+            if (parse_restore_time(argv[++i], stamp, sizeof(stamp)) != 0) {
+                fprintf(stderr, "Invalid time: %s\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--dept") == 0 && i + 1 < argc) {
+            dept = argv[++i];
+        } else if (strcmp(argv[i], "--file") == 0 && i + 1 < argc) {
+            pattern = argv[++i];
+        } else if (argv[i][0] != '-' && shard == NULL) {
+            shard = argv[i];
+        } else {
+            fprintf(stderr, "Unexpected restore argument: %s\n", argv[i]);
+            return -1;
+        }
+    }
+    if (stamp[0] == '\0') {
+        fprintf(stderr, "restore needs --at TIME\n");
+        return -1;
+    }
+    if ((dept != NULL && strpbrk(dept, " \t\n") != NULL) || (pattern != NULL && strpbrk(pattern, " \t\n") != NULL) ||
+        (shard != NULL && strpbrk(shard, " \t\n") != NULL)) {
+        fprintf(stderr, "Restore arguments cannot contain whitespace\n");
+        return -1;
+    }
+
+    len = snprintf(command, size, "restore at=%s%s%s%s%s%s%s", stamp, dept != NULL ? " dept=" : "",
+                   dept != NULL ? dept : "", pattern != NULL ? " file=" : "", pattern != NULL ? pattern : "",
+                   shard != NULL ? " shard=" : "", shard != NULL ? shard : "");
+    if (len < 0 || (size_t) len >= size) {
+        fprintf(stderr, "Restore arguments too long\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Sending a command over the control socket and printing the reply
+static int run_control_command(const char *command) {
+    char reply[CONTROL_REPLY_MAX];
+    int status;
+
+    status = send_control_command(settings.control_socket, command, reply, sizeof(reply));
+    if (status < 0) {
+        fprintf(stderr, "Cannot reach daemon at %s: %s (daemon not running?)\n", settings.control_socket, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    fputs(reply, status == CONTROL_OK ? stdout : stderr);
+    return status == CONTROL_OK ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
+    int exit_code = EXIT_SUCCESS;
+    const char *command;
+
+    if (load_settings(argc, argv) != 0) {
+        fprintf(stderr, "Invalid settings, run %s --help for usage\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (optind >= argc) {
         print_usage(argv[0]);
         return EXIT_FAILURE;
     }
+    command = argv[optind];
     
     // Initialize logging
     if (init_logging() != 0) {
@@ -33,55 +203,63 @@ int main(int argc, char *argv[]) {
     }
     
     // Process commands
-    if (strcmp(argv[1], "start") == 0) {
+    if (strcmp(command, "start") == 0) {
         // Starting daemon
         log_message(CLOG_INFO, "Starting daemon...");
-        if (start_daemon(PID_FILE) != 0) {
+        if (start_daemon(settings.pid_file) != 0) {
             log_message(CLOG_ERROR, "Failed to start daemon");
+            cleanup_logging();
             return EXIT_FAILURE;
         }
         
         // Running daemon main loop
         run_daemon();
         
-    } else if (strcmp(argv[1], "stop") == 0) {
+    } else if (strcmp(command, "stop") == 0) {
         // Stopping daemon
         log_message(CLOG_INFO, "Stopping daemon...");
-        stop_daemon(PID_FILE);
+        stop_daemon(settings.pid_file);
         
-    } else if (strcmp(argv[1], "status") == 0) {
-        // Checking daemon status
-        if (check_daemon_running(PID_FILE)) {
-            printf("Daemon is running\n");
+    } else if (strcmp(command, "status") == 0) {
+        // Asking the daemon itself, falling back to the PID file for older daemons
+        char reply[CONTROL_REPLY_MAX];
+        if (send_control_command(settings.control_socket, "status", reply, sizeof(reply)) == CONTROL_OK) {
+            fputs(reply, stdout);
         } else {
-            printf("Daemon is not running\n");
+            if (check_daemon_running(settings.pid_file)) {
+                printf("Daemon is running\n");
+            } else {
+                printf("Daemon is not running\n");
+            }
         }
         
-    } else if (strcmp(argv[1], "backup") == 0) {
-        // Signaling daemon to perform backup
-        FILE *fp;
-        pid_t pid;
-        
-        if ((fp = fopen(PID_FILE, "r")) == NULL) {
-            log_message(CLOG_ERROR, "Failed to open PID file %s: Daemon not running?", PID_FILE);
-            return EXIT_FAILURE;
-        }
-        
-        if (fscanf(fp, "%d", &pid) != 1) {
-            log_message(CLOG_ERROR, "Failed to read PID from file %s", PID_FILE);
-            fclose(fp);
-            return EXIT_FAILURE;
-        }
+    } else if (strcmp(command, "backup") == 0 || strcmp(command, "transfer") == 0 ||
+               strcmp(command, "scan") == 0 || strcmp(command, "audit") == 0 || strcmp(command, "gc") == 0 ||
+               strcmp(command, "stats") == 0 || strcmp(command, "reload") == 0) {
+        // Commands answered by the running daemon
+        exit_code = run_control_command(command);
         
-        fclose(fp);
-        
-        if (kill(pid, SIGUSR1) != 0) {
-            log_message(CLOG_ERROR, "Failed to send signal to daemon: %s", strerror(errno));
-            return EXIT_FAILURE;
+    } else if (strcmp(command, "restore") == 0) {
+        // Extracted and published by the daemon, between its own transfers
+        char request[1024];
+        exit_code = restore_command(argc, argv, optind + 1, request, sizeof(request)) == 0
+                    ? run_control_command(request) : EXIT_FAILURE;
+
+    } else if (strcmp(command, "du") == 0) {
+        // Read from the catalogs the daemon keeps, the snapshots themselves are not opened
+        exit_code = print_usage_of_shards(optind + 1 < argc ? argv[optind + 1] : NULL);
+
+    } else if (strcmp(command, "rollback") == 0) {
+        // Republished by the daemon, between its own transfers
+        char request[1024];
+        if (optind + 1 < argc && strpbrk(argv[optind + 1], " \t\n") != NULL) {
+            fprintf(stderr, "Unknown shard: %s\n", argv[optind + 1]);
+            exit_code = EXIT_FAILURE;
+        } else {
+            snprintf(request, sizeof(request), "rollback %s", optind + 1 < argc ? argv[optind + 1] : "");
+            exit_code = run_control_command(request);
         }
         
-        printf("Signal sent to daemon for immediate backup and transfer\n");
-        
     } else {
         print_usage(argv[0]);
         return EXIT_FAILURE;
@@ -90,5 +268,5 @@ int main(int argc, char *argv[]) {
     // Cleaning up logging
     cleanup_logging();
     
-    return EXIT_SUCCESS;
+    return exit_code;
 }
\ No newline at end of file
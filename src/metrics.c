@@ -0,0 +1,241 @@
+/* metrics.c - Implementation of counters, histograms and the Prometheus export */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <linux/limits.h>
+
+#include "../include/config.h"
+#include "../include/metrics.h"
+#include "../include/file_ops.h"
+#include "../include/logging.h"
+
+#define METRIC_PREFIX "report_daemon_"
+
+// Log-linear buckets over microseconds: each power of two split into 2^HIST_SUB_BITS steps
+#define HIST_SUB_BITS 2
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BIT 40  // About 12 days
+#define HIST_BUCKETS (HIST_SUB * (HIST_MAX_BIT - HIST_SUB_BITS + 2))
+
+struct metric_info {
+    const char *name;
+    const char *help;
+    int quiet;  // Updated by the export itself, so not a reason to export again
+};
+
+struct histogram {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t sum_ns;
+};
+
+static const struct metric_info counter_info[METRIC_COUNTERS] = {
+    [METRIC_FILES_SCANNED] = { "files_scanned_total", "Upload files examined by full scans", 0 },
+    [METRIC_UPLOAD_CHANGES] = { "upload_changes_total", "Upload creations, modifications and deletions seen", 0 },
+    [METRIC_FILES_TRANSFERRED] = { "files_transferred_total", "Reports moved to the dashboard", 0 },
+    [METRIC_BYTES_TRANSFERRED] = { "bytes_transferred_total", "Bytes moved to the dashboard", 0 },
+    [METRIC_TRANSFER_FAILURES] = { "transfer_failures_total", "Reports that failed to transfer", 0 },
+    [METRIC_UPLOADS_UNCHANGED] = { "uploads_unchanged_total", "Uploads identical to the published report, not republished", 0 },
+    [METRIC_UPLOADS_QUARANTINED] = { "uploads_quarantined_total", "Malformed uploads moved to quarantine", 0 },
+    [METRIC_FILES_BACKED_UP] = { "files_backed_up_total", "Changed reports chunked into snapshots", 0 },
+    [METRIC_FILES_LINKED] = { "files_linked_total", "Unchanged reports reused from the previous snapshot", 0 },
+    [METRIC_BYTES_BACKED_UP] = { "bytes_backed_up_total", "Bytes stored in snapshots", 0 },
+    [METRIC_BACKUP_FAILURES] = { "backup_failures_total", "Reports that failed to back up", 0 },
+    [METRIC_CHUNKS_STORED] = { "chunks_stored_total", "New chunks written to the chunk store", 0 },
+    [METRIC_CHUNKS_DEDUPLICATED] = { "chunks_deduplicated_total", "Chunks of changed reports already in the store", 0 },
+    [METRIC_FILES_RESTORED] = { "files_restored_total", "Reports extracted from snapshots", 0 },
+    [METRIC_RESTORE_FAILURES] = { "restore_failures_total", "Reports that failed to restore", 0 },
+    [METRIC_SNAPSHOTS_DELETED] = { "snapshots_deleted_total", "Snapshots removed by the retention policy", 0 },
+    [METRIC_SNAPSHOT_BYTES_FREED] = { "snapshot_bytes_freed_total", "Disk space freed by removing snapshots", 0 },
+    [METRIC_CONTROL_COMMANDS] = { "control_commands_total", "Commands answered on the control socket", 0 },
+    [METRIC_JOBS_RUN] = { "scheduled_jobs_total", "Scheduled jobs run", 1 },
+    [METRIC_LOG_MESSAGES] = { "log_messages_total", "Messages logged", 1 },
+};
+
+static const struct metric_info histogram_info[METRIC_HISTOGRAMS] = {
+    [HIST_SCAN] = { "scan_duration_seconds", "Time taken by full upload scans", 0 },
+    [HIST_TRANSFER_RUN] = { "transfer_duration_seconds", "Time taken by transfer runs", 0 },
+    [HIST_BACKUP_RUN] = { "backup_duration_seconds", "Time taken by backup runs", 0 },
+    [HIST_RESTORE_RUN] = { "restore_duration_seconds", "Time taken by restore runs", 0 },
+    [HIST_FILE_COPY] = { "file_copy_duration_seconds", "Time to transfer or copy one report", 0 },
+    [HIST_TRANSFER_BATCH] = { "transfer_batch_duration_seconds", "Time to move one io_uring batch of reports", 0 },
+    [HIST_CONTROL_COMMAND] = { "control_command_duration_seconds", "Time to answer a control command", 0 },
+    [HIST_LOG_MESSAGE] = { "log_message_duration_seconds", "Time spent in log_message", 1 },
+};
+
+static uint64_t counters[METRIC_COUNTERS];
+static struct histogram histograms[METRIC_HISTOGRAMS];
+static int dirty = 0;
+
+void metric_add(enum metric_counter id, uint64_t n) {
+    __atomic_fetch_add(&counters[id], n, __ATOMIC_RELAXED);
+    if (!counter_info[id].quiet) {
+        __atomic_store_n(&dirty, 1, __ATOMIC_RELAXED);
+    }
+}
+
+uint64_t metric_clock() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+// Bucket for a duration: exact below HIST_SUB microseconds, then HIST_SUB steps per doubling
+static int bucket_index(uint64_t micros) {
+    int msb;
+    int index;
+
+    if (micros < HIST_SUB) {
+        return (int) micros;
+    }
+    msb = 63 - __builtin_clzll(micros);
+    index = (msb - HIST_SUB_BITS + 1) * HIST_SUB + (int) ((micros >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+// Exclusive upper bound of a bucket in microseconds
+static uint64_t bucket_limit(int index) {
+    int group = index / HIST_SUB;
+    int shift;
+
+    if (group == 0) {
+        return (uint64_t) index + 1;
+    }
+    shift = group - 1;
+    return ((uint64_t) (HIST_SUB + index % HIST_SUB) << shift) + (1ULL << shift);
+}
+
+void metric_observe(enum metric_histogram id, uint64_t nanos) {
+    struct histogram *hist = &histograms[id];
+
+    __atomic_fetch_add(&hist->buckets[bucket_index(nanos / 1000)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum_ns, nanos, __ATOMIC_RELAXED);
+    if (!histogram_info[id].quiet) {
+        __atomic_store_n(&dirty, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void metric_observe_since(enum metric_histogram id, uint64_t start) {
+    metric_observe(id, metric_clock() - start);
+}
+
+int metrics_changed() {
+    return __atomic_load_n(&dirty, __ATOMIC_RELAXED);
+}
+
+// Appending to the output, tracking how much has been written
+static void emit(char *buffer, size_t size, size_t *len, const char *format, ...) {
+    va_list args;
+    int n;
+
+    if (*len + 1 >= size) {
+        return;
+    }
+    va_start(args, format);
+    n = vsnprintf(buffer + *len, size - *len, format, args);
+    va_end(args);
+    if (n > 0) {
+        *len += (size_t) n < size - *len ? (size_t) n : size - *len - 1;
+    }
+}
+
+static void emit_value(char *buffer, size_t size, size_t *len, const char *name, const char *type,
+                       const char *help, unsigned long long value) {
+    emit(buffer, size, len, "# HELP " METRIC_PREFIX "%s %s\n# TYPE " METRIC_PREFIX "%s %s\n" METRIC_PREFIX "%s %llu\n",
+         name, help, name, type, name, value);
+}
+
+// Cumulative buckets; empty ones are skipped, which Prometheus allows
+static void emit_histogram(char *buffer, size_t size, size_t *len, int id) {
+    const struct metric_info *info = &histogram_info[id];
+    const struct histogram *hist = &histograms[id];
+    uint64_t total = 0;
+
+    emit(buffer, size, len, "# HELP " METRIC_PREFIX "%s %s\n# TYPE " METRIC_PREFIX "%s histogram\n",
+         info->name, info->help, info->name);
+
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t count = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+        if (count == 0) {
+            continue;
+        }
+        total += count;
+        emit(buffer, size, len, METRIC_PREFIX "%s_bucket{le=\"%g\"} %llu\n",
+             info->name, (double) bucket_limit(i) / 1e6, (unsigned long long) total);
+    }
+
+    emit(buffer, size, len, METRIC_PREFIX "%s_bucket{le=\"+Inf\"} %llu\n", info->name, (unsigned long long) total);
+    emit(buffer, size, len, METRIC_PREFIX "%s_sum %.9f\n", info->name,
+         (double) __atomic_load_n(&hist->sum_ns, __ATOMIC_RELAXED) / 1e9);
+    emit(buffer, size, len, METRIC_PREFIX "%s_count %llu\n", info->name, (unsigned long long) total);
+}
+
+size_t format_metrics(char *buffer, size_t size) {
+    unsigned long hits, misses, queued, dropped;
+    size_t len = 0;
+
+    if (size == 0) {
+        return 0;
+    }
+    buffer[0] = '\0';
+
+    for (int i = 0; i < METRIC_COUNTERS; i++) {
+        emit_value(buffer, size, &len, counter_info[i].name, "counter", counter_info[i].help,
+                   (unsigned long long) __atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+    }
+
+    // Sampled from the modules that own them
+    get_username_cache_stats(&hits, &misses);
+    get_logging_stats(&queued, &dropped);
+    emit_value(buffer, size, &len, "username_cache_hits_total", "counter", "Username lookups served from cache", hits);
+    emit_value(buffer, size, &len, "username_cache_misses_total", "counter", "Username lookups that read the user database", misses);
+    emit_value(buffer, size, &len, "log_queue_depth", "gauge", "Log messages waiting for the writer thread", queued);
+    emit_value(buffer, size, &len, "log_dropped_total", "counter", "Log messages dropped because the queue was full", dropped);
+
+    for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+        emit_histogram(buffer, size, &len, i);
+    }
+
+    return len;
+}
+
+// Writing to a temporary file and renaming it, so scrapers never see a partial file
+int export_metrics(const char *path) {
+    char tmp_path[PATH_MAX];
+    char *text;
+    size_t len;
+    FILE *fp;
+    int ret = 0;
+
+    text = malloc(METRICS_TEXT_MAX);
+    if (text == NULL) {
+        return -1;
+    }
+
+    __atomic_store_n(&dirty, 0, __ATOMIC_RELAXED);
+    len = format_metrics(text, METRICS_TEXT_MAX);
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fp = fopen(tmp_path, "w");
+    if (fp == NULL || fwrite(text, 1, len, fp) != len) {
+        ret = -1;
+    }
+    if (fp != NULL && fclose(fp) != 0) {
+        ret = -1;
+    }
+    if (ret == 0 && rename(tmp_path, path) != 0) {
+        ret = -1;
+    }
+    if (ret != 0) {
+        log_message(CLOG_WARNING, "Failed to export metrics to %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+    }
+
+    free(text);
+    return ret;
+}
@@ -0,0 +1,485 @@
+/* pack.c - Implementation of snapshot archives */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+
+#include "../include/config.h"
+#include "../include/pack.h"
+#include "../include/hash.h"
+#include "../include/logging.h"
+
+#define PACK_MAGIC "RDPACK"
+#define PACK_END_MAGIC "RDPKEND"
+#define PACK_VERSION 1
+
+// Largest chunk handed to the kernel in one copy call
+#define COPY_CHUNK (1 << 30)
+
+// Output buffer for inflating a report
+#define INFLATE_CHUNK (256 * 1024)
+
+// Start of the archive
+struct pack_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+};
+
+// End of the archive: where the index is and a hash to check it by
+struct pack_trailer {
+    uint64_t index_offset;
+    uint64_t count;
+    uint64_t names_size;
+    uint64_t index_hash;
+    char magic[8];
+};
+
+static int pwrite_all(int fd, const void *data, size_t len, uint64_t offset) {
+    const char *p = data;
+
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, (off_t) offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Copying a byte range between files inside the kernel, with a pread/pwrite fallback
+static int copy_range(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t len) {
+    char buffer[BUFFER_SIZE * 16];
+    loff_t in_off = (loff_t) in_offset;
+    loff_t out_off = (loff_t) out_offset;
+
+    while (len > 0) {
+        size_t chunk = len > COPY_CHUNK ? COPY_CHUNK : (size_t) len;
+        ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off, chunk, 0);
+
+        if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            errno = EIO;  // Source shorter than its index says
+            return -1;
+        }
+        len -= n;
+    }
+
+    while (len > 0) {
+        size_t chunk = len > sizeof(buffer) ? sizeof(buffer) : (size_t) len;
+        ssize_t n = pread(in_fd, buffer, chunk, in_off);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        if (pwrite_all(out_fd, buffer, n, (uint64_t) out_off) != 0) {
+            return -1;
+        }
+        in_off += n;
+        out_off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Reserving space at the end of the archive, so workers never write over each other
+static uint64_t reserve(struct pack_writer *pack, uint64_t len) {
+    return __atomic_fetch_add(&pack->end, len, __ATOMIC_RELAXED);
+}
+
+int pack_create(struct pack_writer *pack, const char *path) {
+    struct pack_header header;
+
+    if (snprintf(pack->path, sizeof(pack->path), "%s", path) >= (int) sizeof(pack->path) ||
+        snprintf(pack->tmp_path, sizeof(pack->tmp_path), "%s.tmp", path) >= (int) sizeof(pack->tmp_path)) {
+        log_message(CLOG_ERROR, "Archive path too long: %s", path);
+        return -1;
+    }
+
+    pack->fd = open(pack->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (pack->fd < 0) {
+        log_message(CLOG_ERROR, "Failed to create archive %s: %s", pack->tmp_path, strerror(errno));
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+    header.version = PACK_VERSION;
+    header.entry_size = sizeof(struct pack_entry);
+    if (pwrite_all(pack->fd, &header, sizeof(header), 0) != 0) {
+        log_message(CLOG_ERROR, "Failed to write archive %s: %s", pack->tmp_path, strerror(errno));
+        pack_abort(pack);
+        return -1;
+    }
+    pack->end = sizeof(header);
+    return 0;
+}
+
+// Kept as is when compression does not pay
+int pack_add_data(struct pack_writer *pack, const void *data, size_t len, struct pack_entry *entry) {
+    unsigned char *compressed;
+    uLongf compressed_size = compressBound(len);
+    int ret;
+
+    entry->size = len;
+    entry->hash = hash_bytes(data, len, 0);
+    entry->method = PACK_STORED;
+    entry->stored_size = len;
+
+    compressed = malloc(compressed_size);
+    if (compressed == NULL) {
+        return -1;
+    }
+    if (len > 0 && compress2(compressed, &compressed_size, data, len, PACK_COMPRESSION_LEVEL) == Z_OK &&
+        compressed_size < (uLongf) len) {
+        entry->method = PACK_DEFLATE;
+        entry->stored_size = compressed_size;
+    }
+
+    entry->offset = reserve(pack, entry->stored_size);
+    ret = pwrite_all(pack->fd, entry->method == PACK_DEFLATE ? (const void *) compressed : data,
+                     entry->stored_size, entry->offset);
+    free(compressed);
+    return ret;
+}
+
+int pack_add_raw(struct pack_writer *pack, const void *data, size_t len, struct pack_entry *entry) {
+    entry->stored_size = len;
+    entry->offset = reserve(pack, len);
+    return pwrite_all(pack->fd, data, len, entry->offset);
+}
+
+// Compressing in memory up to PACK_COMPRESS_MAX, storing larger reports as they are
+int pack_add_file(struct pack_writer *pack, const char *path, struct pack_entry *entry) {
+    struct stat st;
+    void *map;
+    int fd;
+    int ret = -1;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    entry->mtime_sec = st.st_mtim.tv_sec;
+    entry->mtime_nsec = st.st_mtim.tv_nsec;
+
+    if (st.st_size == 0 || st.st_size > PACK_COMPRESS_MAX) {
+        entry->size = entry->stored_size = st.st_size;
+        entry->method = PACK_STORED;
+        if (hash_fd(fd, &entry->hash) == 0) {
+            entry->offset = reserve(pack, entry->stored_size);
+            ret = copy_range(fd, 0, pack->fd, entry->offset, entry->stored_size);
+        }
+        close(fd);
+        return ret;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    ret = pack_add_data(pack, map, st.st_size, entry);
+    munmap(map, st.st_size);
+    return ret;
+}
+
+int pack_copy_entry(struct pack_writer *pack, const struct pack_reader *from, const struct pack_entry *src,
+                    struct pack_entry *entry) {
+    uint32_t name_offset = entry->name_offset;
+
+    *entry = *src;
+    entry->name_offset = name_offset;
+    entry->offset = reserve(pack, src->stored_size);
+    return copy_range(from->fd, src->offset, pack->fd, entry->offset, src->stored_size);
+}
+
+struct named_entry {
+    const char *name;
+    const struct pack_entry *entry;
+};
+
+static int compare_named(const void *a, const void *b) {
+    return strcmp(((const struct named_entry *) a)->name, ((const struct named_entry *) b)->name);
+}
+
+// Writing the index sorted by name, then the trailer, and only then the archive's real name
+int pack_finish(struct pack_writer *pack, struct pack_entry *entries, char *const *names, size_t count) {
+    struct named_entry *sorted;
+    struct pack_trailer trailer;
+    struct pack_entry *index;
+    unsigned char *block;
+    size_t names_size = 0;
+    size_t entries_size = count * sizeof(struct pack_entry);
+    size_t pos = 0;
+    int ret = -1;
+
+    for (size_t i = 0; i < count; i++) {
+        names_size += strlen(names[i]) + 1;
+    }
+
+    sorted = malloc((count > 0 ? count : 1) * sizeof(*sorted));
+    block = malloc(entries_size + names_size + 1);
+    if (sorted == NULL || block == NULL) {
+        log_message(CLOG_ERROR, "Failed to allocate archive index: %s", strerror(errno));
+        free(sorted);
+        free(block);
+        pack_abort(pack);
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        sorted[i].name = names[i];
+        sorted[i].entry = &entries[i];
+    }
+    qsort(sorted, count, sizeof(*sorted), compare_named);
+
+    // Entries first, then their names
+    index = (struct pack_entry *) block;
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strlen(sorted[i].name) + 1;
+
+        index[i] = *sorted[i].entry;
+        index[i].name_offset = (uint32_t) pos;
+        memcpy(block + entries_size + pos, sorted[i].name, len);
+        pos += len;
+    }
+
+    // The index is read in place from the mapping, so it starts 8-byte aligned
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.index_offset = (pack->end + 7) & ~(uint64_t) 7;
+    trailer.count = count;
+    trailer.names_size = names_size;
+    trailer.index_hash = hash_bytes(block, entries_size + names_size, 0);
+    memcpy(trailer.magic, PACK_END_MAGIC, sizeof(PACK_END_MAGIC));
+
+    if (pwrite_all(pack->fd, block, entries_size + names_size, trailer.index_offset) == 0 &&
+        pwrite_all(pack->fd, &trailer, sizeof(trailer), trailer.index_offset + entries_size + names_size) == 0 &&
+        fsync(pack->fd) == 0) {
+        ret = 0;
+    }
+    free(sorted);
+    free(block);
+
+    if (close(pack->fd) != 0) {
+        ret = -1;
+    }
+    pack->fd = -1;
+    if (ret == 0 && rename(pack->tmp_path, pack->path) != 0) {
+        ret = -1;
+    }
+    if (ret != 0) {
+        log_message(CLOG_ERROR, "Failed to finish archive %s: %s", pack->path, strerror(errno));
+        unlink(pack->tmp_path);
+    }
+    return ret;
+}
+
+void pack_abort(struct pack_writer *pack) {
+    if (pack->fd >= 0) {
+        close(pack->fd);
+        pack->fd = -1;
+    }
+    unlink(pack->tmp_path);
+}
+
+// Mapping the whole archive; pages are only read for the index and the reports extracted
+int pack_open(struct pack_reader *pack, const char *path) {
+    const struct pack_header *header;
+    const struct pack_trailer *trailer;
+    struct stat st;
+    void *map;
+    uint64_t index_size;
+
+    memset(pack, 0, sizeof(*pack));
+    pack->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (pack->fd < 0) {
+        return -1;
+    }
+    if (fstat(pack->fd, &st) != 0 || st.st_size < (off_t) (sizeof(*header) + sizeof(*trailer))) {
+        log_message(CLOG_ERROR, "Archive %s is truncated", path);
+        close(pack->fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, pack->fd, 0);
+    if (map == MAP_FAILED) {
+        log_message(CLOG_ERROR, "Failed to map archive %s: %s", path, strerror(errno));
+        close(pack->fd);
+        return -1;
+    }
+    pack->map = map;
+    pack->map_size = st.st_size;
+
+    header = map;
+    trailer = (const struct pack_trailer *) (pack->map + pack->map_size - sizeof(*trailer));
+    index_size = trailer->count * sizeof(struct pack_entry) + trailer->names_size;
+    if (memcmp(header->magic, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0 || header->version != PACK_VERSION ||
+        header->entry_size != sizeof(struct pack_entry) ||
+        memcmp(trailer->magic, PACK_END_MAGIC, sizeof(PACK_END_MAGIC)) != 0 ||
+        trailer->count > pack->map_size / sizeof(struct pack_entry) ||
+        trailer->index_offset % 8 != 0 || trailer->index_offset < sizeof(*header) ||
+        trailer->index_offset + index_size != pack->map_size - sizeof(*trailer) ||
+        (trailer->count > 0 && (trailer->names_size == 0 || pack->map[trailer->index_offset + index_size - 1] != '\0')) ||
+        hash_bytes(pack->map + trailer->index_offset, index_size, 0) != trailer->index_hash) {
+        log_message(CLOG_ERROR, "Archive %s is damaged or not an archive", path);
+        pack_close(pack);
+        return -1;
+    }
+
+    pack->entries = (const struct pack_entry *) (pack->map + trailer->index_offset);
+    pack->count = trailer->count;
+    pack->names = (const char *) (pack->entries + pack->count);
+    pack->names_size = trailer->names_size;
+    return 0;
+}
+
+const char *pack_entry_name(const struct pack_reader *pack, const struct pack_entry *entry) {
+    return entry->name_offset < pack->names_size ? pack->names + entry->name_offset : "";
+}
+
+const struct pack_entry *pack_find(const struct pack_reader *pack, const char *name) {
+    size_t lo = 0, hi = pack->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(pack_entry_name(pack, &pack->entries[mid]), name);
+        if (cmp == 0) {
+            return &pack->entries[mid];
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+int pack_extract(const struct pack_reader *pack, const struct pack_entry *entry, int fd) {
+    const unsigned char *data;
+    unsigned char *out;
+    z_stream stream;
+    uint64_t written = 0;
+    int status;
+
+    if (entry->offset > pack->map_size || entry->stored_size > pack->map_size - entry->offset) {
+        errno = EIO;
+        return -1;
+    }
+    data = pack->map + entry->offset;
+
+    // Stored bytes have no checksum of their own, deflate streams carry an Adler-32
+    if (entry->method == PACK_STORED) {
+        if (entry->stored_size != entry->size || hash_bytes(data, entry->stored_size, 0) != entry->hash) {
+            errno = EIO;
+            return -1;
+        }
+        return write_all(fd, data, entry->stored_size);
+    }
+    if (entry->method != PACK_DEFLATE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    out = malloc(INFLATE_CHUNK);
+    memset(&stream, 0, sizeof(stream));
+    if (out == NULL || inflateInit(&stream) != Z_OK) {
+        free(out);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // zlib counts input in uInt, so the stored bytes are fed in slices
+    do {
+        if (stream.avail_in == 0) {
+            uint64_t consumed = (uint64_t) ((const unsigned char *) stream.next_in - data);
+            uint64_t left = stream.next_in == NULL ? entry->stored_size : entry->stored_size - consumed;
+            stream.next_in = (unsigned char *) (stream.next_in == NULL ? data : stream.next_in);
+            stream.avail_in = left > (1U << 30) ? (1U << 30) : (uInt) left;
+        }
+        stream.next_out = out;
+        stream.avail_out = INFLATE_CHUNK;
+        status = inflate(&stream, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END) {
+            break;
+        }
+        if (write_all(fd, out, INFLATE_CHUNK - stream.avail_out) != 0) {
+            inflateEnd(&stream);
+            free(out);
+            return -1;
+        }
+        written += INFLATE_CHUNK - stream.avail_out;
+    } while (status != Z_STREAM_END);
+
+    inflateEnd(&stream);
+    free(out);
+    if (status != Z_STREAM_END || written != entry->size) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+void pack_close(struct pack_reader *pack) {
+    if (pack->map != NULL) {
+        munmap((void *) pack->map, pack->map_size);
+    }
+    if (pack->fd >= 0) {
+        close(pack->fd);
+    }
+    memset(pack, 0, sizeof(*pack));
+    pack->fd = -1;
+}
@@ -0,0 +1,378 @@
+/* publish.c - Implementation of generation-swap publishing */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "../include/config.h"
+#include "../include/publish.h"
+#include "../include/file_ops.h"
+#include "../include/logging.h"
+#include "../include/shard.h"
+
+#ifndef DT_REG
+#define DT_REG 8  // Value for regular files
+#endif
+
+#define GENERATION_PREFIX "gen-"
+
+// Where digests were kept before they moved to the state directory
+#define OLD_DIGEST_NAME ".digest"
+
+// Parsing gen-NNNNNN, returns 0 for names that are not generations
+static unsigned long generation_number(const char *name) {
+    char *end;
+    unsigned long number;
+
+    if (strncmp(name, GENERATION_PREFIX, strlen(GENERATION_PREFIX)) != 0) {
+        return 0;
+    }
+    number = strtoul(name + strlen(GENERATION_PREFIX), &end, 10);
+    return *end == '\0' ? number : 0;
+}
+
+static int compare_generations(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *) a;
+    unsigned long y = *(const unsigned long *) b;
+    return (x > y) - (x < y);
+}
+
+// Listing existing generation numbers in ascending order
+static unsigned long *list_generations(const struct shard *shard, size_t *count) {
+    DIR *dir;
+    struct dirent *entry;
+    unsigned long *numbers = NULL;
+    size_t capacity = 0;
+
+    *count = 0;
+    dir = opendir(shard->generation_dir);
+    if (dir == NULL) {
+        return NULL;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned long number = generation_number(entry->d_name);
+        if (number == 0) {
+            continue;
+        }
+        if (*count == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 16;
+            unsigned long *grown = realloc(numbers, new_capacity * sizeof(*grown));
+            if (grown == NULL) {
+                break;
+            }
+            numbers = grown;
+            capacity = new_capacity;
+        }
+        numbers[(*count)++] = number;
+    }
+    closedir(dir);
+
+    if (numbers != NULL) {
+        qsort(numbers, *count, sizeof(*numbers), compare_generations);
+    }
+    return numbers;
+}
+
+static int generation_path(const struct shard *shard, char *path, size_t size, unsigned long number) {
+    if (snprintf(path, size, "%s/%s%06lu", shard->generation_dir, GENERATION_PREFIX, number) >= (int) size) {
+        log_message(CLOG_ERROR, "Generation directory path too long: %s", shard->generation_dir);
+        return -1;
+    }
+    return 0;
+}
+
+// Swapping the dashboard symlink with a rename, so readers see old or new, never neither
+static int point_dashboard_at(const struct shard *shard, const char *gen_dir) {
+    char tmp_link[PATH_MAX];
+
+    if (snprintf(tmp_link, sizeof(tmp_link), "%s.tmp", shard->report_dir) >= (int) sizeof(tmp_link)) {
+        log_message(CLOG_ERROR, "Dashboard path too long: %s", shard->report_dir);
+        return -1;
+    }
+    unlink(tmp_link);
+
+    if (symlink(gen_dir, tmp_link) != 0) {
+        log_message(CLOG_ERROR, "Failed to create dashboard link to %s: %s", gen_dir, strerror(errno));
+        return -1;
+    }
+    if (rename(tmp_link, shard->report_dir) != 0) {
+        log_message(CLOG_ERROR, "Failed to publish %s: %s", gen_dir, strerror(errno));
+        unlink(tmp_link);
+        return -1;
+    }
+    return 0;
+}
+
+// Setting up the generation directory and the dashboard symlink
+int init_publishing(const struct shard *shard) {
+    char gen_dir[PATH_MAX];
+    struct stat st;
+
+    if (create_directory_if_not_exists(shard->generation_dir) != 0) {
+        return -1;
+    }
+
+    if (lstat(shard->report_dir, &st) == 0 && S_ISLNK(st.st_mode)) {
+        return 0;  // Already published by generation
+    }
+
+    if (generation_path(shard, gen_dir, sizeof(gen_dir), 1) != 0) {
+        return -1;
+    }
+
+    if (lstat(shard->report_dir, &st) == 0 && S_ISDIR(st.st_mode)) {
+        // Migrating an existing dashboard directory into the first generation
+        if (rename(shard->report_dir, gen_dir) != 0) {
+            log_message(CLOG_ERROR, "Failed to migrate %s to %s: %s", shard->report_dir, gen_dir, strerror(errno));
+            return -1;
+        }
+        log_message(CLOG_INFO, "Migrated dashboard directory to generation %s", gen_dir);
+    } else if (mkdir(gen_dir, 0755) != 0 && errno != EEXIST) {
+        log_message(CLOG_ERROR, "Failed to create generation %s: %s", gen_dir, strerror(errno));
+        return -1;
+    }
+
+    return point_dashboard_at(shard, gen_dir);
+}
+
+int current_generation(const struct shard *shard, char *path, size_t size) {
+    ssize_t len = readlink(shard->report_dir, path, size - 1);
+
+    if (len < 0) {
+        return -1;
+    }
+    path[len] = '\0';
+    return 0;
+}
+
+// Creating the directory of the next generation number
+int begin_empty_generation(const struct shard *shard, char *gen_dir, size_t size) {
+    char path[PATH_MAX];
+    unsigned long *numbers;
+    size_t count;
+
+    numbers = list_generations(shard, &count);
+    if (generation_path(shard, gen_dir, size, count > 0 ? numbers[count - 1] + 1 : 1) != 0) {
+        free(numbers);
+        return -1;
+    }
+    free(numbers);
+
+    if (mkdir(gen_dir, 0755) != 0) {
+        log_message(CLOG_ERROR, "Failed to create generation %s: %s", gen_dir, strerror(errno));
+        return -1;
+    }
+
+    // The number may have been used by a generation that was discarded
+    if (generation_digest_path(shard, gen_dir, path, sizeof(path)) == 0) {
+        unlink(path);
+    }
+    return 0;
+}
+
+// Creating the next generation, sharing unchanged reports with the current one
+int begin_generation(const struct shard *shard, char *gen_dir, size_t size) {
+    char current[PATH_MAX];
+    char src[PATH_MAX];
+    char dst[PATH_MAX];
+    DIR *dir;
+    struct dirent *entry;
+
+    if (begin_empty_generation(shard, gen_dir, size) != 0) {
+        return -1;
+    }
+
+    if (current_generation(shard, current, sizeof(current)) != 0) {
+        return 0;  // Nothing published yet, start empty
+    }
+
+    dir = opendir(current);
+    if (dir == NULL) {
+        log_message(CLOG_ERROR, "Failed to open generation %s: %s", current, strerror(errno));
+        abort_generation(gen_dir);
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type != DT_REG || strcmp(entry->d_name, OLD_DIGEST_NAME) == 0) {
+            continue;
+        }
+        if (snprintf(src, sizeof(src), "%s/%s", current, entry->d_name) >= (int) sizeof(src) ||
+            snprintf(dst, sizeof(dst), "%s/%s", gen_dir, entry->d_name) >= (int) sizeof(dst) ||
+            link(src, dst) != 0) {
+            log_message(CLOG_ERROR, "Failed to carry %s into %s: %s", entry->d_name, gen_dir, strerror(errno));
+            closedir(dir);
+            abort_generation(gen_dir);
+            return -1;
+        }
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+// Removing a generation directory and its (linked) files
+static void remove_generation(const char *gen_dir) {
+    char path[PATH_MAX];
+    DIR *dir;
+    struct dirent *entry;
+
+    dir = opendir(gen_dir);
+    if (dir != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            if (snprintf(path, sizeof(path), "%s/%s", gen_dir, entry->d_name) < (int) sizeof(path)) {
+                unlink(path);
+            }
+        }
+        closedir(dir);
+    }
+
+    if (rmdir(gen_dir) != 0) {
+        log_message(CLOG_WARNING, "Failed to remove generation %s: %s", gen_dir, strerror(errno));
+    }
+}
+
+int generation_digest_path(const struct shard *shard, const char *gen_dir, char *path, size_t size) {
+    const char *slash = strrchr(gen_dir, '/');
+    char name[NAME_MAX + 1];
+
+    if (snprintf(name, sizeof(name), "%s", slash != NULL ? slash + 1 : gen_dir) >= (int) sizeof(name) ||
+        snprintf(path, size, "%s/%s%s", shard->digest_dir, name, DIGEST_SUFFIX) >= (int) size) {
+        return -1;
+    }
+    return 0;
+}
+
+void abort_generation(const char *gen_dir) {
+    remove_generation(gen_dir);
+}
+
+// Whether every file in a generation is also linked from another one, so nothing exists only here
+static int holds_only_links(const char *gen_dir) {
+    char path[PATH_MAX];
+    struct stat st;
+    DIR *dir;
+    struct dirent *entry;
+    int only_links = 1;
+
+    dir = opendir(gen_dir);
+    if (dir == NULL) {
+        return 0;
+    }
+    while (only_links && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", gen_dir, entry->d_name) >= (int) sizeof(path) ||
+            lstat(path, &st) != 0 || st.st_nlink < 2) {
+            only_links = 0;
+        }
+    }
+    closedir(dir);
+    return only_links;
+}
+
+void remove_unpublished_generations(const struct shard *shard) {
+    char current[PATH_MAX];
+    char path[PATH_MAX];
+    char digest[PATH_MAX];
+    unsigned long *numbers;
+    unsigned long published = 0;
+    size_t count;
+
+    if (current_generation(shard, current, sizeof(current)) == 0) {
+        const char *slash = strrchr(current, '/');
+        published = generation_number(slash != NULL ? slash + 1 : current);
+    }
+
+    numbers = list_generations(shard, &count);
+    for (size_t i = 0; i < count; i++) {
+        if (numbers[i] <= published || generation_path(shard, path, sizeof(path), numbers[i]) != 0) {
+            continue;
+        }
+        // Moved uploads whose commit failed exist only here; keeping them for an operator
+        if (!holds_only_links(path)) {
+            log_message(CLOG_WARNING, "Keeping unpublished generation %s: it holds reports found nowhere else", path);
+            continue;
+        }
+        log_message(CLOG_WARNING, "Removing generation %s, left unpublished by an interrupted run", path);
+        remove_generation(path);
+        if (generation_digest_path(shard, path, digest, sizeof(digest)) == 0) {
+            unlink(digest);
+        }
+    }
+    free(numbers);
+}
+
+// Keeping the newest generations: the published one plus its rollback targets
+static void prune_generations(const struct shard *shard, const char *published) {
+    char path[PATH_MAX];
+    char digest[PATH_MAX];
+    unsigned long *numbers;
+    size_t count;
+
+    numbers = list_generations(shard, &count);
+    for (size_t i = 0; i + GENERATIONS_KEPT < count; i++) {
+        if (generation_path(shard, path, sizeof(path), numbers[i]) == 0 && strcmp(path, published) != 0) {
+            remove_generation(path);
+            if (generation_digest_path(shard, path, digest, sizeof(digest)) == 0) {
+                unlink(digest);
+            }
+        }
+    }
+    free(numbers);
+}
+
+int commit_generation(const struct shard *shard, const char *gen_dir) {
+    if (point_dashboard_at(shard, gen_dir) != 0) {
+        return -1;
+    }
+
+    log_message(CLOG_INFO, "Published dashboard generation %s", gen_dir);
+    prune_generations(shard, gen_dir);
+    return 0;
+}
+
+// Rolling back to the newest generation older than the published one
+int rollback_generation(const struct shard *shard) {
+    char current[PATH_MAX];
+    char previous[PATH_MAX];
+    unsigned long *numbers;
+    unsigned long published = 0;
+    size_t count;
+    int ret = -1;
+
+    if (current_generation(shard, current, sizeof(current)) == 0) {
+        const char *slash = strrchr(current, '/');
+        published = generation_number(slash != NULL ? slash + 1 : current);
+    }
+
+    numbers = list_generations(shard, &count);
+    for (size_t i = count; i > 0; i--) {
+        if (numbers[i - 1] < published) {
+            if (generation_path(shard, previous, sizeof(previous), numbers[i - 1]) == 0) {
+                ret = point_dashboard_at(shard, previous);
+            }
+            if (ret == 0) {
+                log_message(CLOG_INFO, "Rolled dashboard back to generation %s", previous);
+            }
+            break;
+        }
+    }
+    free(numbers);
+
+    if (ret != 0 && published != 0) {
+        log_message(CLOG_ERROR, "No generation older than %s to roll back to", current);
+    }
+    return ret;
+}
@@ -0,0 +1,380 @@
+/* restore.c - Implementation of point-in-time restores */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "../include/config.h"
+#include "../include/restore.h"
+#include "../include/chunk.h"
+#include "../include/file_ops.h"
+#include "../include/logging.h"
+#include "../include/metrics.h"
+#include "../include/pack.h"
+#include "../include/publish.h"
+#include "../include/timestamp.h"
+#include "../include/worker_pool.h"
+
+#ifndef DT_REG
+#define DT_REG 8  // Value for regular files
+#endif
+
+// Shared state for one restore run
+struct restore_run {
+    char gen_dir[PATH_MAX];
+    struct pack_reader pack;
+    struct chunk_store chunks;
+    int have_chunks;
+};
+
+// One report queued for extraction
+struct restore_item {
+    struct restore_run *run;
+    const struct pack_entry *entry;
+    int ok;
+};
+
+// Digits of the time with any of "-_ T:" between them; missing seconds or time of day
+// are filled in as the end of the minute or day
+int parse_restore_time(const char *text, char *stamp, size_t size) {
+    char digits[15];
+    size_t n = 0;
+    int month, day, hour, minute, second;
+
+    if (size < SNAPSHOT_STAMP_LEN + 1) {
+        return -1;
+    }
+    if (strcmp(text, "now") == 0) {
+        snprintf(stamp, size, "%s", current_timestamp(TS_SNAPSHOT));
+        return 0;
+    }
+
+    for (const char *p = text; *p != '\0'; p++) {
+        if (*p >= '0' && *p <= '9') {
+            if (n == 14) {
+                return -1;
+            }
+            digits[n++] = *p;
+        } else if (strchr("-_ T:", *p) == NULL) {
+            return -1;
+        }
+    }
+    if (n == 8) {
+        memcpy(digits + n, "235959", 6);
+    } else if (n == 12) {
+        memcpy(digits + n, "59", 2);
+    } else if (n != 14) {
+        return -1;
+    }
+    digits[14] = '\0';
+
+    month = (digits[4] - '0') * 10 + (digits[5] - '0');
+    day = (digits[6] - '0') * 10 + (digits[7] - '0');
+    hour = (digits[8] - '0') * 10 + (digits[9] - '0');
+    minute = (digits[10] - '0') * 10 + (digits[11] - '0');
+    second = (digits[12] - '0') * 10 + (digits[13] - '0');
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 59) {
+        return -1;
+    }
+
+    snprintf(stamp, size, "%.8s_%.6s", digits, digits + 8);
+    return 0;
+}
+
+int parse_restore_args(const char *args, struct restore_request *request, char *error, size_t size) {
+    const char *p = args;
+
+    memset(request, 0, sizeof(*request));
+    while (*p != '\0') {
+        size_t len = strcspn(p, " \t");
+        const char *eq = memchr(p, '=', len);
+        char value[NAME_MAX + 1];
+
+        if (eq == NULL || (size_t) (p + len - eq - 1) >= sizeof(value)) {
+            snprintf(error, size, "invalid restore argument '%.*s'\n", (int) len, p);
+            return -1;
+        }
+        memcpy(value, eq + 1, p + len - eq - 1);
+        value[p + len - eq - 1] = '\0';
+
+        if (eq - p == 2 && strncmp(p, "at", 2) == 0) {
+            if (parse_restore_time(value, request->at, sizeof(request->at)) != 0) {
+                snprintf(error, size, "invalid restore time '%s'\n", value);
+                return -1;
+            }
+        } else if (eq - p == 4 && strncmp(p, "dept", 4) == 0) {
+            if (add_departments(&request->departments, value) != 0) {
+                snprintf(error, size, "invalid department list '%s'\n", value);
+                return -1;
+            }
+        } else if (eq - p == 4 && strncmp(p, "file", 4) == 0) {
+            snprintf(request->pattern, sizeof(request->pattern), "%s", value);
+        } else if (eq - p == 5 && strncmp(p, "shard", 5) == 0 && strlen(value) < sizeof(request->shard)) {
+            snprintf(request->shard, sizeof(request->shard), "%s", value);
+        } else {
+            snprintf(error, size, "invalid restore argument '%.*s'\n", (int) len, p);
+            return -1;
+        }
+
+        p += len;
+        p += strspn(p, " \t");
+    }
+
+    if (request->at[0] == '\0') {
+        snprintf(error, size, "restore needs a time\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int is_filtered(const struct restore_request *request) {
+    return request->pattern[0] != '\0' || request->departments.count > 0;
+}
+
+static int restore_matches(const struct restore_request *request, const char *name) {
+    int department;
+    long day;
+
+    if (strstr(name, ".xml") == NULL) {
+        return 0;
+    }
+    if (request->pattern[0] != '\0' && fnmatch(request->pattern, name, 0) != 0) {
+        return 0;
+    }
+    if (request->departments.count > 0) {
+        parse_report_name(&request->departments, name, &department, &day);
+        return department >= 0;
+    }
+    return 1;
+}
+
+// Dropping the carried reports a filtered restore replaces; those missing from the snapshot
+// did not exist at that time and stay removed
+static int remove_matching(const struct restore_request *request, struct restore_run *run, int *removed) {
+    char path[PATH_MAX];
+    DIR *dir;
+    struct dirent *entry;
+    int ret = 0;
+
+    *removed = 0;
+    dir = opendir(run->gen_dir);
+    if (dir == NULL) {
+        log_message(CLOG_ERROR, "Failed to open generation %s: %s", run->gen_dir, strerror(errno));
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type != DT_REG || !restore_matches(request, entry->d_name)) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", run->gen_dir, entry->d_name) >= (int) sizeof(path) ||
+            unlink(path) != 0) {
+            log_message(CLOG_ERROR, "Failed to replace %s in %s: %s", entry->d_name, run->gen_dir, strerror(errno));
+            ret = -1;
+            break;
+        }
+        if (pack_find(&run->pack, entry->d_name) == NULL) {
+            (*removed)++;
+        }
+    }
+
+    closedir(dir);
+    return ret;
+}
+
+// Worker job extracting one report with its original mtime, so the next backup reuses it
+static long long restore_job(void *arg) {
+    struct restore_item *item = arg;
+    struct restore_run *run = item->run;
+    const struct pack_entry *entry = item->entry;
+    const char *name = pack_entry_name(&run->pack, entry);
+    char path[PATH_MAX];
+    struct timespec times[2];
+    int fd;
+
+    if (snprintf(path, sizeof(path), "%s/%s", run->gen_dir, name) >= (int) sizeof(path)) {
+        log_message(CLOG_ERROR, "Restore path too long for %s", name);
+        return -1;
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_message(CLOG_ERROR, "Failed to create %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    times[0].tv_sec = times[1].tv_sec = entry->mtime_sec;
+    times[0].tv_nsec = times[1].tv_nsec = entry->mtime_nsec;
+    if ((entry->method == PACK_CHUNKED ? chunk_store_extract(&run->chunks, &run->pack, entry, fd)
+                                       : pack_extract(&run->pack, entry, fd)) != 0 ||
+        futimens(fd, times) != 0) {
+        log_message(CLOG_ERROR, "Failed to restore %s: %s", name, strerror(errno));
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    if (close(fd) != 0) {
+        log_message(CLOG_ERROR, "Failed to restore %s: %s", name, strerror(errno));
+        unlink(path);
+        return -1;
+    }
+
+    item->ok = 1;
+    return (long long) entry->size;
+}
+
+// Names come from the archive, so anything that could leave the generation is refused
+static int safe_report_name(const char *name) {
+    return name[0] != '\0' && name[0] != '.' && strchr(name, '/') == NULL;
+}
+
+// Staging the restored reports in a new generation and publishing it only if all of them made it
+int restore_reports(struct shard *shard, const struct restore_request *request, struct run_summary *summary,
+                    char *snapshot, size_t size) {
+    struct restore_run run;
+    struct restore_item *items = NULL;
+    struct worker_pool *pool = NULL;
+    size_t count = 0;
+    int restored = 0;
+    int removed = 0;
+    int failed = 0;
+    long long total_bytes = 0;
+    uint64_t start = metric_clock();
+    int ret = -1;
+
+    memset(&run, 0, sizeof(run));
+    run.pack.fd = -1;
+    if (summary != NULL) {
+        memset(summary, 0, sizeof(*summary));
+    }
+
+    if (find_snapshot_at(shard, request->at, snapshot, size) != 0) {
+        log_message(CLOG_ERROR, "No snapshot of shard %s at or before %s in %s", shard->name, request->at,
+                    shard->backup_dir);
+        return -1;
+    }
+    if (pack_open(&run.pack, snapshot) != 0) {
+        return -1;
+    }
+
+    items = malloc((run.pack.count > 0 ? run.pack.count : 1) * sizeof(*items));
+    if (items == NULL) {
+        log_message(CLOG_ERROR, "Failed to allocate restore of %s: %s", snapshot, strerror(errno));
+        pack_close(&run.pack);
+        return -1;
+    }
+    for (size_t i = 0; i < run.pack.count; i++) {
+        const char *name = pack_entry_name(&run.pack, &run.pack.entries[i]);
+
+        if (strcmp(name, CHUNK_LIST_NAME) == 0) {
+            continue;
+        }
+        if (!safe_report_name(name)) {
+            log_message(CLOG_WARNING, "Skipping invalid report name in %s: %s", snapshot, name);
+            continue;
+        }
+        if (restore_matches(request, name)) {
+            items[count].run = &run;
+            items[count].entry = &run.pack.entries[i];
+            items[count].ok = 0;
+            run.have_chunks |= run.pack.entries[i].method == PACK_CHUNKED;
+            count++;
+        }
+    }
+    if (count == 0) {
+        log_message(CLOG_ERROR, "No reports in %s match the restore", snapshot);
+        free(items);
+        pack_close(&run.pack);
+        return -1;
+    }
+
+    // Snapshots written before chunking hold whole reports and need no store
+    if (run.have_chunks && chunk_store_open(&run.chunks, shard->backup_dir) != 0) {
+        free(items);
+        pack_close(&run.pack);
+        return -1;
+    }
+
+    if (lock_directories(shard) != 0) {
+        free(items);
+        if (run.have_chunks) {
+            chunk_store_close(&run.chunks);
+        }
+        pack_close(&run.pack);
+        return -1;
+    }
+
+    // A full restore starts empty; a filtered one keeps the other published reports
+    if ((is_filtered(request) ? begin_generation(shard, run.gen_dir, sizeof(run.gen_dir))
+                              : begin_empty_generation(shard, run.gen_dir, sizeof(run.gen_dir))) != 0) {
+        goto out;
+    }
+    if (is_filtered(request) && remove_matching(request, &run, &removed) != 0) {
+        abort_generation(run.gen_dir);
+        goto out;
+    }
+
+    pool = pool_create("restore", shard->workers, WORKER_QUEUE_SIZE);
+    if (pool == NULL) {
+        abort_generation(run.gen_dir);
+        goto out;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (pool_submit(pool, restore_job, &items[i]) != 0) {
+            log_message(CLOG_ERROR, "Failed to queue %s: worker pool is shutting down",
+                        pack_entry_name(&run.pack, items[i].entry));
+        }
+    }
+    pool_totals(pool, NULL, NULL, &total_bytes);
+    pool_log_stats(pool);
+    pool_destroy(pool);
+
+    for (size_t i = 0; i < count; i++) {
+        if (items[i].ok) {
+            restored++;
+        } else {
+            failed++;
+        }
+    }
+
+    if (failed > 0) {
+        log_message(CLOG_ERROR, "Restore of %s from %s failed for %d reports, dashboard left as it was",
+                    shard->name, snapshot, failed);
+        abort_generation(run.gen_dir);
+    } else if (commit_generation(shard, run.gen_dir) != 0) {
+        abort_generation(run.gen_dir);
+    } else {
+        log_message(CLOG_INFO, "Restored %d reports (%lld bytes) of %s from %s, %d removed", restored, total_bytes,
+                    shard->name, snapshot, removed);
+        ret = 0;
+    }
+
+    metric_add(METRIC_FILES_RESTORED, ret == 0 ? restored : 0);
+    metric_add(METRIC_RESTORE_FAILURES, failed);
+    metric_observe_since(HIST_RESTORE_RUN, start);
+
+    if (summary != NULL) {
+        summary->files = ret == 0 ? restored : 0;
+        summary->failed = failed;
+        summary->bytes = ret == 0 ? total_bytes : 0;
+        if (ret == 0) {
+            snprintf(summary->target, sizeof(summary->target), "%s", run.gen_dir);
+        }
+    }
+
+out:
+    unlock_directories(shard);
+    free(items);
+    if (run.have_chunks) {
+        chunk_store_close(&run.chunks);
+    }
+    pack_close(&run.pack);
+    return ret;
+}
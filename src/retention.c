@@ -0,0 +1,679 @@
+/* retention.c - Implementation of snapshot retention and the snapshot catalog */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "../include/config.h"
+#include "../include/retention.h"
+#include "../include/backup.h"
+#include "../include/chunk.h"
+#include "../include/logging.h"
+#include "../include/metrics.h"
+#include "../include/pack.h"
+#include "../include/settings.h"
+#include "../include/shard.h"
+
+#define CATALOG_HEADER "# report_daemon snapshot catalog v1: name disk_bytes report_bytes reports tier\n"
+#define SNAPSHOT_NAME_MAX 32
+
+// Why a snapshot is kept, newest first
+enum snapshot_tier {
+    TIER_LATEST,
+    TIER_ALL,
+    TIER_DAILY,
+    TIER_MONTHLY,
+    TIER_EXPIRED,
+    TIER_CHUNKS,  // a chunk container, kept while a snapshot lists it
+    TIERS
+};
+
+static const char *tier_names[TIERS] = { "latest", "all", "daily", "monthly", "expired", "chunks" };
+
+// What a backup directory entry is
+enum record_kind {
+    RECORD_PACK,
+    RECORD_DIR,     // a directory snapshot from before archives
+    RECORD_CHUNKS   // a chunk container, named after the snapshot that wrote it
+};
+
+// One snapshot as the catalog knows it; sizes are measured once, when it is first seen
+struct snapshot_record {
+    char name[SNAPSHOT_NAME_MAX];
+    long long disk;      // allocated bytes; a share of each hard-linked file for old directory snapshots
+    long long size;      // bytes of the reports inside
+    long reports;        // chunks, for a container
+    int tier;
+    int kind;
+    time_t time;
+};
+
+static int compare_records(const void *a, const void *b) {
+    return strcmp(((const struct snapshot_record *) a)->name, ((const struct snapshot_record *) b)->name);
+}
+
+// YYYYMMDD_HHMMSS.pack archives and their .chunks containers, and YYYYMMDD_HHMMSS directories
+// written by older versions
+static int snapshot_kind(const char *name, int *kind) {
+    size_t len = strlen(name);
+
+    if (len < SNAPSHOT_STAMP_LEN || name[8] != '_') {
+        return 0;
+    }
+    for (int i = 0; i < SNAPSHOT_STAMP_LEN; i++) {
+        if (i != 8 && (name[i] < '0' || name[i] > '9')) {
+            return 0;
+        }
+    }
+    if (len == SNAPSHOT_STAMP_LEN) {
+        *kind = RECORD_DIR;
+        return 1;
+    }
+    *kind = strcmp(name + SNAPSHOT_STAMP_LEN, CHUNK_SUFFIX) == 0 ? RECORD_CHUNKS : RECORD_PACK;
+    return *kind == RECORD_CHUNKS || strcmp(name + SNAPSHOT_STAMP_LEN, PACK_SUFFIX) == 0;
+}
+
+// Snapshot names are local times
+static time_t snapshot_time(const char *name) {
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(name, "%4d%2d%2d_%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
+               &tm.tm_sec) != 6) {
+        return 0;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+static int catalog_path(const struct shard *shard, char *path, size_t size) {
+    if (snprintf(path, size, "%s/%s", shard->backup_dir, SNAPSHOT_CATALOG_NAME) >= (int) size) {
+        log_message(CLOG_ERROR, "Catalog path too long: %s", shard->backup_dir);
+        return -1;
+    }
+    return 0;
+}
+
+// Reading the catalog into a sorted array; a missing catalog is an empty one
+static int load_catalog(const char *path, struct snapshot_record **records, size_t *count) {
+    char line[256];
+    size_t capacity = 0;
+    FILE *fp;
+
+    *records = NULL;
+    *count = 0;
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        struct snapshot_record record;
+        char tier[16];
+
+        memset(&record, 0, sizeof(record));
+        if (line[0] == '#' ||
+            sscanf(line, "%31s %lld %lld %ld %15s", record.name, &record.disk, &record.size, &record.reports,
+                   tier) != 5 ||
+            !snapshot_kind(record.name, &record.kind)) {
+            continue;
+        }
+        record.tier = TIER_EXPIRED;
+        for (int t = 0; t < TIERS; t++) {
+            if (strcmp(tier, tier_names[t]) == 0) {
+                record.tier = t;
+            }
+        }
+        record.time = snapshot_time(record.name);
+
+        if (*count == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 64;
+            struct snapshot_record *grown = realloc(*records, new_capacity * sizeof(*grown));
+            if (grown == NULL) {
+                fclose(fp);
+                free(*records);
+                *records = NULL;
+                *count = 0;
+                return -1;
+            }
+            *records = grown;
+            capacity = new_capacity;
+        }
+        (*records)[(*count)++] = record;
+    }
+
+    fclose(fp);
+    if (*count > 0) {
+        qsort(*records, *count, sizeof(**records), compare_records);
+    }
+    return 0;
+}
+
+static int write_catalog(const char *path, const struct snapshot_record *records, size_t count) {
+    char tmp_path[PATH_MAX];
+    FILE *fp;
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int) sizeof(tmp_path)) {
+        return -1;
+    }
+    fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        log_message(CLOG_ERROR, "Failed to write snapshot catalog %s: %s", tmp_path, strerror(errno));
+        return -1;
+    }
+
+    fputs(CATALOG_HEADER, fp);
+    for (size_t i = 0; i < count; i++) {
+        fprintf(fp, "%s %lld %lld %ld %s\n", records[i].name, records[i].disk, records[i].size, records[i].reports,
+                tier_names[records[i].tier]);
+    }
+
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        log_message(CLOG_ERROR, "Failed to write snapshot catalog %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Sizes from the archive's index, which is all that is read of it; the chunk list is not a report
+static void measure_pack(const char *path, struct snapshot_record *record) {
+    struct pack_reader pack;
+    struct stat st;
+
+    if (stat(path, &st) == 0) {
+        record->disk = (long long) st.st_blocks * 512;
+    }
+    if (pack_open(&pack, path) == 0) {
+        for (size_t i = 0; i < pack.count; i++) {
+            if (pack_entry_name(&pack, &pack.entries[i])[0] != '.') {
+                record->size += (long long) pack.entries[i].size;
+                record->reports++;
+            }
+        }
+        pack_close(&pack);
+    }
+}
+
+// Hard-linked reports are shared by several directory snapshots, each is charged its share
+static void measure_dir(const char *path, struct snapshot_record *record) {
+    struct dirent *entry;
+    struct stat st;
+    DIR *dir;
+
+    record->disk = 0;
+    record->size = 0;
+    record->reports = 0;
+    dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        record->disk += (long long) st.st_blocks * 512 / (st.st_nlink > 0 ? (long long) st.st_nlink : 1);
+        if (strstr(entry->d_name, ".xml") != NULL) {
+            record->size += st.st_size;
+            record->reports++;
+        }
+    }
+    closedir(dir);
+}
+
+static void measure_snapshot(const struct shard *shard, struct snapshot_record *record) {
+    char path[PATH_MAX];
+
+    if (snprintf(path, sizeof(path), "%s/%s", shard->backup_dir, record->name) >= (int) sizeof(path)) {
+        return;
+    }
+    if (record->kind == RECORD_DIR) {
+        measure_dir(path, record);
+    } else {
+        measure_pack(path, record);
+    }
+}
+
+// Listing the snapshots on disk, taking sizes from the catalog where it has them
+static int list_snapshots(const struct shard *shard, const struct snapshot_record *catalog, size_t catalog_count,
+                          struct snapshot_record **records, size_t *count) {
+    struct dirent **names;
+    int n;
+
+    *records = NULL;
+    *count = 0;
+    n = scandir(shard->backup_dir, &names, NULL, alphasort);
+    if (n < 0) {
+        log_message(CLOG_ERROR, "Failed to list snapshots in %s: %s", shard->backup_dir, strerror(errno));
+        return -1;
+    }
+
+    *records = calloc(n > 0 ? n : 1, sizeof(**records));
+    for (int i = 0; i < n; i++) {
+        struct snapshot_record *record;
+        const struct snapshot_record *known;
+        int kind;
+
+        if (*records != NULL && strlen(names[i]->d_name) < SNAPSHOT_NAME_MAX &&
+            snapshot_kind(names[i]->d_name, &kind) &&
+            (names[i]->d_type == DT_UNKNOWN || names[i]->d_type == (kind == RECORD_DIR ? DT_DIR : DT_REG))) {
+            record = &(*records)[(*count)++];
+            snprintf(record->name, sizeof(record->name), "%s", names[i]->d_name);
+            known = catalog_count > 0 ? bsearch(record, catalog, catalog_count, sizeof(*catalog), compare_records)
+                                      : NULL;
+            if (known != NULL) {
+                *record = *known;
+            } else {
+                record->kind = kind;
+                measure_snapshot(shard, record);
+            }
+            record->time = snapshot_time(record->name);
+        }
+        free(names[i]);
+    }
+    free(names);
+
+    if (*records == NULL) {
+        log_message(CLOG_ERROR, "Failed to allocate snapshot list: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// The snapshot and the container of the same time stamp belong together
+static struct snapshot_record *find_partner(struct snapshot_record *records, size_t count,
+                                           const struct snapshot_record *record) {
+    for (size_t i = 0; i < count; i++) {
+        if ((records[i].kind == RECORD_CHUNKS) != (record->kind == RECORD_CHUNKS) &&
+            strncmp(records[i].name, record->name, SNAPSHOT_STAMP_LEN) == 0) {
+            return &records[i];
+        }
+    }
+    return NULL;
+}
+
+// Walking from the newest snapshot back, each kept one claims its day and month,
+// then the oldest are expired until the rest fit the budget; the newest is always kept.
+// Containers count against the budget but are never expired themselves, the sweep after the
+// deletions removes them once no snapshot lists them
+static void assign_tiers(const struct retention_policy *policy, struct snapshot_record *records, size_t count) {
+    time_t now = time(NULL);
+    struct tm today;
+    long last_day = -1;
+    long last_month = -1;
+    long long total = 0;
+    int newest = 1;
+
+    localtime_r(&now, &today);
+    for (size_t i = count; i > 0; i--) {
+        struct snapshot_record *record = &records[i - 1];
+        struct tm tm;
+        long day, month;
+        double age = difftime(now, record->time);
+
+        if (record->kind == RECORD_CHUNKS) {
+            record->tier = TIER_CHUNKS;
+            continue;
+        }
+
+        localtime_r(&record->time, &tm);
+        day = (tm.tm_year + 1900L) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday;
+        month = (tm.tm_year + 1900L) * 12 + tm.tm_mon;
+
+        if (newest) {
+            record->tier = TIER_LATEST;
+            newest = 0;
+        } else if (age < policy->keep_all_days * 86400.0) {
+            record->tier = TIER_ALL;
+        } else if (age < policy->keep_daily_days * 86400.0 && day != last_day) {
+            record->tier = TIER_DAILY;
+        } else if ((today.tm_year + 1900L) * 12 + today.tm_mon - month < policy->keep_monthly_months &&
+                   month != last_month) {
+            record->tier = TIER_MONTHLY;
+        } else {
+            record->tier = TIER_EXPIRED;
+            continue;
+        }
+        last_day = day;
+        last_month = month;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const struct snapshot_record *partner = find_partner(records, count, &records[i]);
+
+        if (records[i].tier == TIER_CHUNKS ? partner == NULL || partner->tier != TIER_EXPIRED
+                                           : records[i].tier != TIER_EXPIRED) {
+            total += records[i].disk;
+        }
+    }
+
+    // An expired snapshot is counted as freeing its own container too, which overstates the gain
+    // while newer snapshots still share its chunks; later passes see the real sizes
+    for (size_t i = 0; policy->budget > 0 && total > policy->budget && i < count; i++) {
+        struct snapshot_record *container;
+
+        if (records[i].tier == TIER_EXPIRED || records[i].tier == TIER_CHUNKS || records[i].tier == TIER_LATEST) {
+            continue;
+        }
+        records[i].tier = TIER_EXPIRED;
+        total -= records[i].disk;
+        container = find_partner(records, count, &records[i]);
+        if (container != NULL) {
+            total -= container->disk;
+        }
+    }
+    if (policy->budget > 0 && total > policy->budget) {
+        log_message(CLOG_WARNING, "Newest snapshot alone uses %lld bytes, over the backup budget of %lld",
+                    total, policy->budget);
+    }
+}
+
+// Space only comes back with the last link to a file
+static long long unlink_counted(int dir_fd, const char *name) {
+    struct stat st;
+    long long freed;
+
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return -1;
+    }
+    freed = S_ISREG(st.st_mode) && st.st_nlink == 1 ? (long long) st.st_blocks * 512 : 0;
+    return unlinkat(dir_fd, name, 0) == 0 ? freed : -1;
+}
+
+static long long delete_snapshot(const struct shard *shard, const struct snapshot_record *record) {
+    char path[PATH_MAX];
+    struct dirent *entry;
+    long long freed = 0;
+    DIR *dir;
+    int backup_fd;
+
+    if (record->kind != RECORD_DIR) {
+        backup_fd = open(shard->backup_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (backup_fd < 0) {
+            return -1;
+        }
+        freed = unlink_counted(backup_fd, record->name);
+        close(backup_fd);
+        return freed;
+    }
+
+    if (snprintf(path, sizeof(path), "%s/%s", shard->backup_dir, record->name) >= (int) sizeof(path)) {
+        return -1;
+    }
+    dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        long long bytes;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        bytes = unlink_counted(dirfd(dir), entry->d_name);
+        if (bytes < 0) {
+            closedir(dir);
+            return -1;
+        }
+        freed += bytes;
+    }
+    closedir(dir);
+    return rmdir(path) == 0 ? freed : -1;
+}
+
+// Marking the containers a snapshot's chunk list names
+static int mark_listed(const struct shard *shard, const struct snapshot_record *snapshot,
+                       const struct snapshot_record *records, size_t count, int *live) {
+    struct pack_reader pack;
+    const struct pack_entry *list;
+    char path[PATH_MAX];
+
+    if (snprintf(path, sizeof(path), "%s/%s", shard->backup_dir, snapshot->name) >= (int) sizeof(path) ||
+        pack_open(&pack, path) != 0) {
+        return -1;
+    }
+    list = pack_find(&pack, CHUNK_LIST_NAME);
+    if (list != NULL && (list->method != PACK_STORED || list->offset > pack.map_size ||
+                         list->stored_size > pack.map_size - list->offset)) {
+        pack_close(&pack);
+        return -1;
+    }
+
+    for (uint64_t pos = 0; list != NULL && pos < list->stored_size;) {
+        const char *line = (const char *) pack.map + list->offset + pos;
+        const char *end = memchr(line, '\n', list->stored_size - pos);
+        size_t len = end != NULL ? (size_t) (end - line) : list->stored_size - pos;
+
+        for (size_t i = 0; i < count; i++) {
+            if (records[i].kind == RECORD_CHUNKS && strlen(records[i].name) == len &&
+                memcmp(records[i].name, line, len) == 0) {
+                live[i] = 1;
+            }
+        }
+        pos += len + 1;
+    }
+    pack_close(&pack);
+    return 0;
+}
+
+// Containers no remaining snapshot lists only held chunks of deleted snapshots, or of a backup
+// that failed after writing its container; they are checked for after deletions, or when a
+// container has outlived its snapshot. Any unreadable snapshot stops the sweep, as its list is unknown
+static int sweep_containers(const struct shard *shard, struct snapshot_record *records, size_t *count,
+                            struct gc_result *result) {
+    int needed = result->deleted > 0;
+    int swept = 0;
+    int backup_fd;
+    int *live;
+    size_t kept = 0;
+
+    for (size_t i = 0; !needed && i < *count; i++) {
+        needed = records[i].kind == RECORD_CHUNKS && find_partner(records, *count, &records[i]) == NULL;
+    }
+    if (!needed) {
+        return 0;
+    }
+
+    live = calloc(*count > 0 ? *count : 1, sizeof(*live));
+    if (live == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < *count; i++) {
+        if (records[i].kind == RECORD_PACK && mark_listed(shard, &records[i], records, *count, live) != 0) {
+            log_message(CLOG_WARNING, "Cannot read chunk list of %s/%s, chunk containers left in place",
+                        shard->backup_dir, records[i].name);
+            free(live);
+            return -1;
+        }
+    }
+
+    backup_fd = open(shard->backup_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (backup_fd < 0) {
+        free(live);
+        return -1;
+    }
+    for (size_t i = 0; i < *count; i++) {
+        long long freed;
+
+        if (records[i].kind != RECORD_CHUNKS || live[i]) {
+            records[kept++] = records[i];
+            continue;
+        }
+        freed = unlink_counted(backup_fd, records[i].name);
+        if (freed < 0) {
+            log_message(CLOG_ERROR, "Failed to delete chunk container %s/%s: %s", shard->backup_dir,
+                        records[i].name, strerror(errno));
+            records[kept++] = records[i];
+            continue;
+        }
+        log_message(CLOG_INFO, "Deleted unused chunk container %s/%s, %lld bytes freed", shard->backup_dir,
+                    records[i].name, freed);
+        result->freed += freed;
+        swept++;
+    }
+    close(backup_fd);
+    free(live);
+
+    *count = kept;
+    return swept;
+}
+
+static void effective_policy(const struct shard *shard, struct retention_policy *policy) {
+    *policy = settings.retention;
+    if (shard->backup_budget > 0) {
+        policy->budget = shard->backup_budget;
+    }
+}
+
+// Oldest expired snapshots go first, RETENTION_BATCH per pass so uploads are not held up
+int collect_snapshots(struct shard *shard, struct gc_result *result) {
+    struct retention_policy policy;
+    struct snapshot_record *catalog = NULL;
+    struct snapshot_record *records = NULL;
+    char path[PATH_MAX];
+    size_t catalog_count = 0;
+    size_t count = 0;
+    size_t kept = 0;
+    int dirs_deleted = 0;
+    int ret = 0;
+
+    memset(result, 0, sizeof(*result));
+    effective_policy(shard, &policy);
+    if (catalog_path(shard, path, sizeof(path)) != 0) {
+        return -1;
+    }
+    if (load_catalog(path, &catalog, &catalog_count) != 0) {
+        log_message(CLOG_WARNING, "Unreadable snapshot catalog %s, measuring every snapshot", path);
+    }
+    if (list_snapshots(shard, catalog, catalog_count, &records, &count) != 0) {
+        free(catalog);
+        return -1;
+    }
+    free(catalog);
+
+    assign_tiers(&policy, records, count);
+
+    for (size_t i = 0; i < count; i++) {
+        struct snapshot_record *record = &records[i];
+        long long freed;
+
+        if (record->tier != TIER_EXPIRED) {
+            records[kept++] = *record;
+            continue;
+        }
+        if (result->deleted == RETENTION_BATCH) {
+            result->pending++;
+            records[kept++] = *record;
+            continue;
+        }
+
+        freed = delete_snapshot(shard, record);
+        if (freed < 0) {
+            log_message(CLOG_ERROR, "Failed to delete snapshot %s/%s: %s", shard->backup_dir, record->name,
+                        strerror(errno));
+            records[kept++] = *record;
+            ret = -1;
+            continue;
+        }
+        log_message(CLOG_INFO, "Deleted snapshot %s/%s, %lld bytes freed", shard->backup_dir, record->name, freed);
+        result->deleted++;
+        result->freed += freed;
+        dirs_deleted += record->kind == RECORD_DIR;
+    }
+
+    if (sweep_containers(shard, records, &kept, result) < 0) {
+        ret = -1;
+    }
+
+    // Shares of hard-linked files changed with the deletion
+    for (size_t i = 0; dirs_deleted > 0 && i < kept; i++) {
+        if (records[i].kind == RECORD_DIR) {
+            measure_snapshot(shard, &records[i]);
+        }
+    }
+
+    for (size_t i = 0; i < kept; i++) {
+        if (records[i].tier == TIER_CHUNKS) {
+            result->disk_bytes += records[i].disk;
+        } else if (records[i].tier != TIER_EXPIRED) {
+            result->kept++;
+            result->disk_bytes += records[i].disk;
+            result->report_bytes += records[i].size;
+        }
+    }
+    if (write_catalog(path, records, kept) != 0) {
+        ret = -1;
+    }
+    free(records);
+
+    log_message(result->deleted > 0 ? CLOG_INFO : CLOG_DEBUG,
+                "Retention of %s: %d snapshots kept using %lld bytes, %d deleted freeing %lld bytes, %d left to delete",
+                shard->name, result->kept, result->disk_bytes, result->deleted, result->freed, result->pending);
+    metric_add(METRIC_SNAPSHOTS_DELETED, result->deleted);
+    metric_add(METRIC_SNAPSHOT_BYTES_FREED, result->freed);
+    return ret;
+}
+
+static void format_size(long long bytes, char *buffer, size_t size) {
+    static const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    double value = (double) bytes;
+    int unit = 0;
+
+    while (value >= 1024 && unit < 4) {
+        value /= 1024;
+        unit++;
+    }
+    snprintf(buffer, size, unit == 0 ? "%.0f %s" : "%.1f %s", value, units[unit]);
+}
+
+int print_snapshot_usage(const struct shard *shard, FILE *out) {
+    struct retention_policy policy;
+    struct snapshot_record *records;
+    char path[PATH_MAX];
+    char disk[32], size[32], budget[32];
+    long long total_disk = 0, total_size = 0;
+    size_t count;
+    size_t snapshots = 0;
+
+    effective_policy(shard, &policy);
+    if (catalog_path(shard, path, sizeof(path)) != 0 || load_catalog(path, &records, &count) != 0) {
+        fprintf(stderr, "Cannot read snapshot catalog %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(out, "%s: %s\n", shard->name, shard->backup_dir);
+    for (size_t i = 0; i < count; i++) {
+        format_size(records[i].disk, disk, sizeof(disk));
+        format_size(records[i].size, size, sizeof(size));
+        fprintf(out, "  %-22s %7ld %-7s %10s %10s on disk  %s\n", records[i].name, records[i].reports,
+                records[i].kind == RECORD_CHUNKS ? "chunks" : "reports", size, disk, tier_names[records[i].tier]);
+        total_disk += records[i].disk;
+
+        // Chunks are the reports of the snapshots again, stored once
+        if (records[i].kind != RECORD_CHUNKS) {
+            total_size += records[i].size;
+            snapshots++;
+        }
+    }
+
+    format_size(total_disk, disk, sizeof(disk));
+    format_size(total_size, size, sizeof(size));
+    if (policy.budget > 0) {
+        format_size(policy.budget, budget, sizeof(budget));
+    } else {
+        snprintf(budget, sizeof(budget), "none");
+    }
+    fprintf(out, "  total: %zu snapshots, %s of reports in %s on disk, budget %s\n", snapshots, size, disk, budget);
+    free(records);
+    return 0;
+}
@@ -0,0 +1,527 @@
+/* scheduler.c - Implementation of the timerfd job scheduler */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <linux/limits.h>
+
+#include "../include/config.h"
+#include "../include/scheduler.h"
+#include "../include/logging.h"
+#include "../include/metrics.h"
+#include "../include/settings.h"
+
+#define SCHEDULE_CRON      0
+#define SCHEDULE_INTERVAL  1
+#define SCHEDULE_ON_DEMAND 2
+
+// Give up looking for a matching minute after this many steps (several years)
+#define CRON_SEARCH_LIMIT 100000
+
+struct job {
+    char name[32];
+    int kind;
+    struct cron_expr cron;
+    int interval;
+    int jitter;
+    int catch_up;
+    scheduled_fn fn;
+    time_t next_run;   // 0 while not queued
+    time_t last_run;
+    int heap_pos;      // -1 while not queued
+};
+
+static struct job jobs[SCHEDULER_MAX_JOBS];
+static int job_count = 0;
+static struct job *heap[SCHEDULER_MAX_JOBS];
+static int heap_size = 0;
+static int timer_fd = -1;
+static unsigned int jitter_seed = 0;
+
+// Run times persisted for catch-up, loaded before jobs are registered
+struct saved_run {
+    char name[32];
+    time_t last_run;
+};
+static struct saved_run saved_runs[SCHEDULER_MAX_JOBS];
+static int saved_count = 0;
+
+/* ---- Cron expressions ---- */
+
+// Parsing one field: '*', 'n', 'a-b', any of them with '/step', comma separated
+static int parse_cron_field(const char *field, int min, int max, uint64_t *bits, int *any) {
+    char buffer[64];
+    char *save = NULL;
+    char *item;
+
+    *bits = 0;
+    *any = strcmp(field, "*") == 0;
+    snprintf(buffer, sizeof(buffer), "%s", field);
+
+    for (item = strtok_r(buffer, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        int lo = min, hi = max, step = 1;
+        char *slash = strchr(item, '/');
+        char *end;
+
+        if (slash != NULL) {
+            *slash = '\0';
+            step = (int) strtol(slash + 1, &end, 10);
+            if (*end != '\0' || step < 1) {
+                return -1;
+            }
+        }
+
+        if (strcmp(item, "*") != 0) {
+            char *dash = strchr(item, '-');
+            lo = (int) strtol(item, &end, 10);
+            if (end == item || (dash == NULL && *end != '\0')) {
+                return -1;
+            }
+            hi = lo;
+            if (dash != NULL) {
+                hi = (int) strtol(dash + 1, &end, 10);
+                if (*end != '\0') {
+                    return -1;
+                }
+            } else if (slash != NULL) {
+                hi = max;  // 'n/step' runs from n to the end of the range
+            }
+        }
+
+        if (lo < min || hi > max || lo > hi) {
+            return -1;
+        }
+        for (int v = lo; v <= hi; v += step) {
+            *bits |= 1ULL << v;
+        }
+    }
+
+    return *bits != 0 ? 0 : -1;
+}
+
+int parse_cron(const char *text, struct cron_expr *expr) {
+    char fields[5][64];
+    uint64_t bits;
+    int any;
+
+    if (strcmp(text, "@hourly") == 0) {
+        text = "0 * * * *";
+    } else if (strcmp(text, "@daily") == 0) {
+        text = "0 0 * * *";
+    } else if (strcmp(text, "@weekly") == 0) {
+        text = "0 0 * * 0";
+    } else if (strcmp(text, "@monthly") == 0) {
+        text = "0 0 1 * *";
+    }
+
+    if (sscanf(text, "%63s %63s %63s %63s %63s", fields[0], fields[1], fields[2], fields[3], fields[4]) != 5) {
+        return -1;
+    }
+
+    memset(expr, 0, sizeof(*expr));
+    if (parse_cron_field(fields[0], 0, 59, &bits, &any) != 0) {
+        return -1;
+    }
+    expr->minutes = bits;
+    if (parse_cron_field(fields[1], 0, 23, &bits, &any) != 0) {
+        return -1;
+    }
+    expr->hours = (uint32_t) bits;
+    if (parse_cron_field(fields[2], 1, 31, &bits, &expr->any_day) != 0) {
+        return -1;
+    }
+    expr->days = (uint32_t) bits;
+    if (parse_cron_field(fields[3], 1, 12, &bits, &any) != 0) {
+        return -1;
+    }
+    expr->months = (uint16_t) bits;
+    if (parse_cron_field(fields[4], 0, 7, &bits, &expr->any_weekday) != 0) {
+        return -1;
+    }
+    // Sunday is both 0 and 7
+    expr->weekdays = (uint8_t) ((bits | (bits >> 7)) & 0x7f);
+
+    return 0;
+}
+
+// Classic cron: when both day fields are restricted, either may match
+static int cron_day_matches(const struct cron_expr *expr, const struct tm *tm) {
+    int dom = (expr->days >> tm->tm_mday) & 1;
+    int dow = (expr->weekdays >> tm->tm_wday) & 1;
+
+    if (expr->any_day && expr->any_weekday) {
+        return 1;
+    }
+    if (expr->any_day) {
+        return dow;
+    }
+    if (expr->any_weekday) {
+        return dom;
+    }
+    return dom || dow;
+}
+
+// Letting mktime carry overflowing fields, then refreshing the broken-down time
+static time_t normalise_tm(struct tm *tm) {
+    time_t t;
+
+    tm->tm_isdst = -1;
+    t = mktime(tm);
+    localtime_r(&t, tm);
+    return t;
+}
+
+time_t next_cron_time(const struct cron_expr *expr, time_t after) {
+    struct tm tm;
+    time_t t = after - (after % 60) + 60;
+
+    localtime_r(&t, &tm);
+    tm.tm_sec = 0;
+
+    for (int i = 0; i < CRON_SEARCH_LIMIT; i++) {
+        if (!((expr->months >> (tm.tm_mon + 1)) & 1)) {
+            tm.tm_mon++;
+            tm.tm_mday = 1;
+            tm.tm_hour = 0;
+            tm.tm_min = 0;
+        } else if (!cron_day_matches(expr, &tm)) {
+            tm.tm_mday++;
+            tm.tm_hour = 0;
+            tm.tm_min = 0;
+        } else if (!((expr->hours >> tm.tm_hour) & 1)) {
+            tm.tm_hour++;
+            tm.tm_min = 0;
+        } else if (!((expr->minutes >> tm.tm_min) & 1)) {
+            tm.tm_min++;
+        } else {
+            t = normalise_tm(&tm);
+            if (t > after) {
+                return t;
+            }
+            tm.tm_min++;
+        }
+        normalise_tm(&tm);
+    }
+
+    return -1;
+}
+
+/* ---- Min-heap of jobs ordered by next run ---- */
+
+static int job_before(const struct job *a, const struct job *b) {
+    if (a->next_run != b->next_run) {
+        return a->next_run < b->next_run;
+    }
+    return a < b;  // Registration order breaks ties
+}
+
+static void heap_swap(int i, int j) {
+    struct job *tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+    heap[i]->heap_pos = i;
+    heap[j]->heap_pos = j;
+}
+
+static void heap_up(int i) {
+    while (i > 0 && job_before(heap[i], heap[(i - 1) / 2])) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heap_down(int i) {
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+
+        if (left < heap_size && job_before(heap[left], heap[smallest])) {
+            smallest = left;
+        }
+        if (right < heap_size && job_before(heap[right], heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+static void heap_push(struct job *job) {
+    job->heap_pos = heap_size;
+    heap[heap_size++] = job;
+    heap_up(job->heap_pos);
+}
+
+static struct job *heap_pop() {
+    struct job *top = heap[0];
+
+    heap_size--;
+    if (heap_size > 0) {
+        heap[0] = heap[heap_size];
+        heap[0]->heap_pos = 0;
+        heap_down(0);
+    }
+    top->heap_pos = -1;
+    return top;
+}
+
+/* ---- Timer and persistence ---- */
+
+// Arming the timer for the earliest job, or disarming it when nothing is queued
+static void arm_timer() {
+    struct itimerspec spec;
+
+    if (timer_fd < 0) {
+        return;
+    }
+
+    memset(&spec, 0, sizeof(spec));
+    if (heap_size > 0) {
+        spec.it_value.tv_sec = heap[0]->next_run;
+    }
+
+    // Realtime and cancel-on-set: cron times follow wall-clock changes and suspend
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, NULL) != 0) {
+        log_message(CLOG_ERROR, "Failed to arm scheduler timer: %s", strerror(errno));
+    }
+}
+
+static void load_saved_runs() {
+    FILE *fp = fopen(settings.scheduler_state_file, "r");
+    long long last_run;
+    char name[32];
+
+    if (fp == NULL) {
+        return;
+    }
+    while (saved_count < SCHEDULER_MAX_JOBS && fscanf(fp, "%31s %lld", name, &last_run) == 2) {
+        snprintf(saved_runs[saved_count].name, sizeof(saved_runs[saved_count].name), "%s", name);
+        saved_runs[saved_count].last_run = (time_t) last_run;
+        saved_count++;
+    }
+    fclose(fp);
+}
+
+// Persisting last run times of catch-up jobs
+static void save_runs() {
+    char tmp_path[PATH_MAX];
+    FILE *fp;
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", settings.scheduler_state_file) >= (int) sizeof(tmp_path)) {
+        return;
+    }
+    fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        log_message(CLOG_WARNING, "Failed to save scheduler state: %s", strerror(errno));
+        return;
+    }
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].catch_up && jobs[i].last_run > 0) {
+            fprintf(fp, "%s %lld\n", jobs[i].name, (long long) jobs[i].last_run);
+        }
+    }
+    if (fclose(fp) != 0 || rename(tmp_path, settings.scheduler_state_file) != 0) {
+        log_message(CLOG_WARNING, "Failed to save scheduler state: %s", strerror(errno));
+        unlink(tmp_path);
+    }
+}
+
+int init_scheduler() {
+    timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        log_message(CLOG_ERROR, "Failed to create scheduler timer: %s", strerror(errno));
+        return -1;
+    }
+
+    jitter_seed = (unsigned int) time(NULL) ^ (unsigned int) getpid();
+    load_saved_runs();
+    return timer_fd;
+}
+
+int scheduler_fd() {
+    return timer_fd;
+}
+
+static int add_job(const char *name, int kind, int jitter, scheduled_fn fn) {
+    struct job *job;
+
+    if (job_count == SCHEDULER_MAX_JOBS) {
+        log_message(CLOG_ERROR, "Cannot schedule %s: too many jobs", name);
+        return -1;
+    }
+
+    job = &jobs[job_count];
+    memset(job, 0, sizeof(*job));
+    snprintf(job->name, sizeof(job->name), "%s", name);
+    job->kind = kind;
+    job->jitter = jitter > 0 ? jitter : 0;
+    job->fn = fn;
+    job->heap_pos = -1;
+
+    for (int i = 0; i < saved_count; i++) {
+        if (strcmp(saved_runs[i].name, job->name) == 0) {
+            job->last_run = saved_runs[i].last_run;
+        }
+    }
+
+    return job_count++;
+}
+
+static time_t with_jitter(const struct job *job, time_t base) {
+    return job->jitter > 0 ? base + rand_r(&jitter_seed) % (job->jitter + 1) : base;
+}
+
+int schedule_cron(const char *name, const char *expr, int jitter, int catch_up, scheduled_fn fn) {
+    time_t now = time(NULL);
+    time_t base;
+    struct job *job;
+    int id;
+
+    id = add_job(name, SCHEDULE_CRON, jitter, fn);
+    if (id < 0) {
+        return -1;
+    }
+    job = &jobs[id];
+    job->catch_up = catch_up;
+
+    if (parse_cron(expr, &job->cron) != 0) {
+        log_message(CLOG_ERROR, "Invalid schedule for %s: '%s'", name, expr);
+        job_count--;
+        return -1;
+    }
+
+    // A run that fell due while the daemon was down (or the box was off) happens now
+    if (catch_up && job->last_run > 0 && (base = next_cron_time(&job->cron, job->last_run)) > 0 && base <= now) {
+        log_message(CLOG_INFO, "Job %s missed its run at %lld, catching up", name, (long long) base);
+        job->next_run = with_jitter(job, now);
+    } else {
+        base = next_cron_time(&job->cron, now);
+        if (base < 0) {
+            log_message(CLOG_ERROR, "Schedule for %s never fires: '%s'", name, expr);
+            job_count--;
+            return -1;
+        }
+        job->next_run = with_jitter(job, base);
+    }
+
+    heap_push(job);
+    arm_timer();
+    return id;
+}
+
+int schedule_interval(const char *name, int seconds, int jitter, scheduled_fn fn) {
+    int id = add_job(name, SCHEDULE_INTERVAL, jitter, fn);
+
+    if (id < 0) {
+        return -1;
+    }
+    jobs[id].interval = seconds > 0 ? seconds : 1;
+    jobs[id].next_run = with_jitter(&jobs[id], time(NULL) + jobs[id].interval);
+    heap_push(&jobs[id]);
+    arm_timer();
+    return id;
+}
+
+int schedule_on_demand(const char *name, scheduled_fn fn) {
+    return add_job(name, SCHEDULE_ON_DEMAND, 0, fn);
+}
+
+void trigger_job(int job_id, int delay) {
+    struct job *job;
+    time_t when;
+
+    if (job_id < 0 || job_id >= job_count) {
+        return;
+    }
+    job = &jobs[job_id];
+    when = time(NULL) + (delay > 0 ? delay : 0);
+
+    if (job->heap_pos < 0) {
+        job->next_run = when;
+        heap_push(job);
+    } else if (when < job->next_run) {
+        job->next_run = when;
+        heap_up(job->heap_pos);
+    } else {
+        return;
+    }
+    arm_timer();
+}
+
+// Running due jobs in time order and putting recurring ones back on the heap
+int run_due_jobs() {
+    uint64_t expirations;
+    time_t now;
+    int ran = 0;
+    int persist = 0;
+
+    // ECANCELED means the clock was changed: the loop below re-evaluates everything
+    if (timer_fd >= 0 && read(timer_fd, &expirations, sizeof(expirations)) < 0 &&
+        errno != EAGAIN && errno != ECANCELED) {
+        log_message(CLOG_ERROR, "Failed to read scheduler timer: %s", strerror(errno));
+    }
+
+    while (heap_size > 0 && heap[0]->next_run <= (now = time(NULL))) {
+        struct job *job = heap_pop();
+        time_t base;
+
+        log_message(CLOG_DEBUG, "Running scheduled job %s", job->name);
+        job->last_run = now;
+        job->fn();
+        metric_add(METRIC_JOBS_RUN, 1);
+        ran++;
+
+        now = time(NULL);
+        switch (job->kind) {
+            case SCHEDULE_CRON:
+                persist |= job->catch_up;
+                base = next_cron_time(&job->cron, now);
+                if (base > 0) {
+                    job->next_run = with_jitter(job, base);
+                    heap_push(job);
+                }
+                break;
+            case SCHEDULE_INTERVAL:
+                job->next_run = with_jitter(job, now + job->interval);
+                heap_push(job);
+                break;
+            default:
+                job->next_run = 0;  // On-demand jobs wait for the next trigger
+                break;
+        }
+    }
+
+    if (persist) {
+        save_runs();
+    }
+    arm_timer();
+    return ran;
+}
+
+long seconds_until_next_job() {
+    long remaining;
+
+    if (heap_size == 0) {
+        return -1;
+    }
+    remaining = (long) (heap[0]->next_run - time(NULL));
+    return remaining > 0 ? remaining : 0;
+}
+
+void cleanup_scheduler() {
+    if (timer_fd >= 0) {
+        close(timer_fd);
+        timer_fd = -1;
+    }
+    job_count = 0;
+    heap_size = 0;
+    saved_count = 0;
+}
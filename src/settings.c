@@ -0,0 +1,413 @@
+/* settings.c - Implementation of runtime configuration */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "../include/config.h"
+#include "../include/settings.h"
+#include "../include/logging.h"
+#include "../include/transfer.h"
+
+struct daemon_settings settings;
+
+// Copying a path setting, which must be absolute since the daemon runs from /
+static int set_path(char *dst, const char *key, const char *value) {
+    if (value[0] != '/' || strlen(value) >= PATH_MAX) {
+        log_message(CLOG_ERROR, "Setting %s must be an absolute path: %s", key, value);
+        return -1;
+    }
+    snprintf(dst, PATH_MAX, "%s", value);
+
+    // Trailing slashes would break the paths derived from it
+    for (size_t len = strlen(dst); len > 1 && dst[len - 1] == '/'; len--) {
+        dst[len - 1] = '\0';
+    }
+    return 0;
+}
+
+static int set_publish(int *dst, const char *key, const char *value) {
+    if (strcmp(value, "nightly") == 0) {
+        *dst = PUBLISH_NIGHTLY;
+    } else if (strcmp(value, "continuous") == 0) {
+        *dst = PUBLISH_CONTINUOUS;
+    } else {
+        log_message(CLOG_ERROR, "Setting %s must be nightly or continuous: %s", key, value);
+        return -1;
+    }
+    return 0;
+}
+
+static int set_io_backend(int *dst, const char *key, const char *value) {
+    if (strcmp(value, "uring") == 0) {
+        *dst = IO_BACKEND_URING;
+    } else if (strcmp(value, "threads") == 0) {
+        *dst = IO_BACKEND_THREADS;
+    } else {
+        log_message(CLOG_ERROR, "Setting %s must be uring or threads: %s", key, value);
+        return -1;
+    }
+    return 0;
+}
+
+static int set_log_full_policy(int *dst, const char *key, const char *value) {
+    if (strcmp(value, "block") == 0) {
+        *dst = LOG_FULL_BLOCK;
+    } else if (strcmp(value, "drop") == 0) {
+        *dst = LOG_FULL_DROP;
+    } else if (strcmp(value, "count") == 0) {
+        *dst = LOG_FULL_COUNT;
+    } else {
+        log_message(CLOG_ERROR, "Setting %s must be block, drop or count: %s", key, value);
+        return -1;
+    }
+    return 0;
+}
+
+static int set_number(int *dst, const char *key, const char *value, int min) {
+    char *end;
+    long number = strtol(value, &end, 10);
+
+    if (*value == '\0' || *end != '\0' || number < min || number > 1000000) {
+        log_message(CLOG_ERROR, "Setting %s must be a number of at least %d: %s", key, min, value);
+        return -1;
+    }
+    *dst = (int) number;
+    return 0;
+}
+
+// Byte counts with an optional K, M, G or T suffix (powers of 1024)
+static int set_size(long long *dst, const char *key, const char *value) {
+    char *end;
+    double number = strtod(value, &end);
+    const char *units = "KMGT";
+    const char *unit;
+
+    if (*end != '\0' && (unit = strchr(units, toupper((unsigned char) *end))) != NULL) {
+        for (const char *u = units; u <= unit; u++) {
+            number *= 1024;
+        }
+        end++;
+        if (*end == 'B' || *end == 'b') {
+            end++;
+        }
+    }
+    if (*value == '\0' || *end != '\0' || number < 0 || number > 9e18) {
+        log_message(CLOG_ERROR, "Setting %s must be a size like 500M or 2G: %s", key, value);
+        return -1;
+    }
+    *dst = (long long) number;
+    return 0;
+}
+
+void default_settings() {
+    memset(&settings, 0, sizeof(settings));
+    snprintf(settings.pid_file, PATH_MAX, "%s", PID_FILE);
+    snprintf(settings.control_socket, PATH_MAX, "%s", CONTROL_SOCKET);
+    snprintf(settings.log_dir, PATH_MAX, "%s", LOG_DIR);
+    snprintf(settings.state_dir, PATH_MAX, "%s", STATE_DIR);
+    settings.check_interval = CHECK_INTERVAL;
+    settings.settle_seconds = SETTLE_SECONDS;
+    settings.workers = WORKER_THREADS;
+    settings.publish = PUBLISH_NIGHTLY;
+    settings.io_backend = IO_BACKEND;
+    settings.log_full_policy = LOG_FULL_POLICY;
+    settings.audit_days = AUDIT_DAYS;
+    settings.late_after_hours = LATE_AFTER_HOURS;
+    settings.retention.keep_all_days = KEEP_ALL_DAYS;
+    settings.retention.keep_daily_days = KEEP_DAILY_DAYS;
+    settings.retention.keep_monthly_months = KEEP_MONTHLY_MONTHS;
+    settings.retention.budget = BACKUP_BUDGET;
+}
+
+struct shard *find_shard(const char *name) {
+    for (int i = 0; i < settings.shard_count; i++) {
+        if (strcmp(settings.shards[i].name, name) == 0) {
+            return &settings.shards[i];
+        }
+    }
+    return NULL;
+}
+
+// Finding a shard, adding it on first mention
+static struct shard *shard_named(const char *name) {
+    struct shard *shard = find_shard(name);
+
+    if (shard != NULL) {
+        return shard;
+    }
+    if (settings.shard_count == MAX_SHARDS) {
+        log_message(CLOG_ERROR, "Too many shards, at most %d are supported", MAX_SHARDS);
+        return NULL;
+    }
+    if (name[0] == '\0' || strlen(name) >= SHARD_NAME_MAX || strpbrk(name, "/ \t,") != NULL) {
+        log_message(CLOG_ERROR, "Invalid shard name: '%s'", name);
+        return NULL;
+    }
+
+    shard = &settings.shards[settings.shard_count++];
+    memset(shard, 0, sizeof(*shard));
+    snprintf(shard->name, sizeof(shard->name), "%s", name);
+    return shard;
+}
+
+int apply_setting(const char *shard_name, const char *key, const char *value) {
+    struct shard *shard;
+
+    if (shard_name == NULL) {
+        if (strcmp(key, "pid_file") == 0) {
+            return set_path(settings.pid_file, key, value);
+        } else if (strcmp(key, "control_socket") == 0) {
+            return set_path(settings.control_socket, key, value);
+        } else if (strcmp(key, "log_dir") == 0) {
+            return set_path(settings.log_dir, key, value);
+        } else if (strcmp(key, "state_dir") == 0) {
+            return set_path(settings.state_dir, key, value);
+        } else if (strcmp(key, "check_interval") == 0) {
+            return set_number(&settings.check_interval, key, value, 1);
+        } else if (strcmp(key, "settle_seconds") == 0) {
+            return set_number(&settings.settle_seconds, key, value, 1);
+        } else if (strcmp(key, "workers") == 0) {
+            return set_number(&settings.workers, key, value, 1);
+        } else if (strcmp(key, "publish") == 0) {
+            return set_publish(&settings.publish, key, value);
+        } else if (strcmp(key, "io_backend") == 0) {
+            return set_io_backend(&settings.io_backend, key, value);
+        } else if (strcmp(key, "log_full_policy") == 0) {
+            return set_log_full_policy(&settings.log_full_policy, key, value);
+        } else if (strcmp(key, "audit_days") == 0) {
+            return set_number(&settings.audit_days, key, value, 1);
+        } else if (strcmp(key, "late_after_hours") == 0) {
+            return set_number(&settings.late_after_hours, key, value, 0);
+        } else if (strcmp(key, "departments") == 0) {
+            return add_departments(&settings.departments, value);
+        } else if (strcmp(key, "keep_all_days") == 0) {
+            return set_number(&settings.retention.keep_all_days, key, value, 0);
+        } else if (strcmp(key, "keep_daily_days") == 0) {
+            return set_number(&settings.retention.keep_daily_days, key, value, 0);
+        } else if (strcmp(key, "keep_monthly_months") == 0) {
+            return set_number(&settings.retention.keep_monthly_months, key, value, 0);
+        } else if (strcmp(key, "backup_budget") == 0) {
+            return set_size(&settings.retention.budget, key, value);
+        }
+        // Directory settings outside a [shard] section belong to the default shard
+        shard_name = DEFAULT_SHARD;
+    }
+
+    shard = shard_named(shard_name);
+    if (shard == NULL) {
+        return -1;
+    }
+
+    if (strcmp(key, "upload_dir") == 0) {
+        return set_path(shard->upload_dir, key, value);
+    } else if (strcmp(key, "dashboard_dir") == 0) {
+        return set_path(shard->report_dir, key, value);
+    } else if (strcmp(key, "generation_dir") == 0) {
+        return set_path(shard->generation_dir, key, value);
+    } else if (strcmp(key, "backup_dir") == 0) {
+        return set_path(shard->backup_dir, key, value);
+    } else if (strcmp(key, "quarantine_dir") == 0) {
+        return set_path(shard->quarantine_dir, key, value);
+    } else if (strcmp(key, "workers") == 0) {
+        return set_number(&shard->workers, key, value, 1);
+    } else if (strcmp(key, "publish") == 0) {
+        return set_publish(&shard->publish, key, value);
+    } else if (strcmp(key, "departments") == 0) {
+        return add_departments(&shard->departments, value);
+    } else if (strcmp(key, "backup_budget") == 0) {
+        return set_size(&shard->backup_budget, key, value);
+    }
+
+    log_message(CLOG_ERROR, "Unknown setting: %s", key);
+    return -1;
+}
+
+// Trimming whitespace in place
+static char *trim(char *text) {
+    char *end;
+
+    while (isspace((unsigned char) *text)) {
+        text++;
+    }
+    end = text + strlen(text);
+    while (end > text && isspace((unsigned char) end[-1])) {
+        *--end = '\0';
+    }
+    return text;
+}
+
+// Reading "key = value" lines, with [shard NAME] starting a shard's section
+int load_settings_file(const char *path, int required) {
+    char line[PATH_MAX + 64];
+    char section[SHARD_NAME_MAX + 8] = "";
+    FILE *fp;
+    int line_number = 0;
+    int ret = 0;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        if (!required && errno == ENOENT) {
+            return 0;
+        }
+        log_message(CLOG_ERROR, "Failed to open config file %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *text = trim(line);
+        char *equals;
+
+        line_number++;
+        if (*text == '\0' || *text == '#' || *text == ';') {
+            continue;
+        }
+
+        if (*text == '[') {
+            char name[SHARD_NAME_MAX + 8];
+            if (sscanf(text, "[shard %39[^]]]", name) != 1) {
+                log_message(CLOG_ERROR, "%s:%d: expected [shard NAME]", path, line_number);
+                ret = -1;
+                break;
+            }
+            snprintf(section, sizeof(section), "%s", trim(name));
+            continue;
+        }
+
+        equals = strchr(text, '=');
+        if (equals == NULL) {
+            log_message(CLOG_ERROR, "%s:%d: expected key = value", path, line_number);
+            ret = -1;
+            break;
+        }
+        *equals = '\0';
+
+        if (apply_setting(section[0] != '\0' ? section : NULL, trim(text), trim(equals + 1)) != 0) {
+            log_message(CLOG_ERROR, "%s:%d: invalid setting", path, line_number);
+            ret = -1;
+            break;
+        }
+    }
+
+    fclose(fp);
+    return ret;
+}
+
+// Deriving a path inside a directory, -1 if it does not fit
+static int join_path(char *dst, const char *dir, const char *name) {
+    return snprintf(dst, PATH_MAX, "%s/%s", dir, name) < PATH_MAX ? 0 : -1;
+}
+
+// Generations and quarantine live next to the dashboard link: <parent>/<base>[-<shard>]
+static int default_sibling_dir(struct shard *shard, char *dir, const char *base) {
+    char parent[PATH_MAX];
+    char *slash;
+    int is_default = strcmp(shard->name, DEFAULT_SHARD) == 0;
+
+    snprintf(parent, sizeof(parent), "%s", shard->report_dir);
+    slash = strrchr(parent, '/');
+    if (slash == parent) {
+        slash[1] = '\0';
+    } else if (slash != NULL) {
+        *slash = '\0';
+    }
+
+    return snprintf(dir, PATH_MAX, "%s/%s%s%s", strcmp(parent, "/") == 0 ? "" : parent, base,
+                    is_default ? "" : "-", is_default ? "" : shard->name) < PATH_MAX ? 0 : -1;
+}
+
+static int paths_clash(const char *a, const char *b) {
+    return strcmp(a, b) == 0;
+}
+
+int finish_settings() {
+    if (join_path(settings.log_file, settings.log_dir, LOG_FILE_NAME) != 0 ||
+        join_path(settings.change_log_file, settings.log_dir, CHANGE_LOG_FILE_NAME) != 0 ||
+        join_path(settings.metrics_file, settings.log_dir, METRICS_FILE_NAME) != 0 ||
+        join_path(settings.scheduler_state_file, settings.state_dir, SCHEDULER_STATE_FILE_NAME) != 0) {
+        log_message(CLOG_ERROR, "Log or state directory path too long");
+        return -1;
+    }
+
+    if (settings.shard_count == 0 && shard_named(DEFAULT_SHARD) == NULL) {
+        return -1;
+    }
+    if (settings.audit_days > AUDIT_MAX_DAYS) {
+        log_message(CLOG_ERROR, "Setting audit_days must be at most %d", AUDIT_MAX_DAYS);
+        return -1;
+    }
+    if (settings.departments.count == 0 && add_departments(&settings.departments, DEPARTMENTS) != 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < settings.shard_count; i++) {
+        struct shard *shard = &settings.shards[i];
+        char index_name[NAME_MAX];
+        char journal_name[NAME_MAX];
+        char digest_name[NAME_MAX];
+        char audit_name[NAME_MAX];
+
+        if (strcmp(shard->name, DEFAULT_SHARD) == 0) {
+            // The default shard keeps the compiled-in directories unless they were overridden
+            if (shard->upload_dir[0] == '\0') {
+                snprintf(shard->upload_dir, PATH_MAX, "%s", UPLOAD_DIR);
+            }
+            if (shard->report_dir[0] == '\0') {
+                snprintf(shard->report_dir, PATH_MAX, "%s", REPORT_DIR);
+            }
+            if (shard->backup_dir[0] == '\0') {
+                snprintf(shard->backup_dir, PATH_MAX, "%s", BACKUP_DIR);
+            }
+            snprintf(index_name, sizeof(index_name), "%s", UPLOAD_INDEX_FILE_NAME);
+            snprintf(journal_name, sizeof(journal_name), "%s", TRANSFER_JOURNAL_FILE_NAME);
+            snprintf(digest_name, sizeof(digest_name), "%s", DIGEST_DIR_NAME);
+            snprintf(audit_name, sizeof(audit_name), "%s", AUDIT_FILE_NAME);
+        } else {
+            if (shard->upload_dir[0] == '\0' || shard->report_dir[0] == '\0' || shard->backup_dir[0] == '\0') {
+                log_message(CLOG_ERROR, "Shard %s needs upload_dir, dashboard_dir and backup_dir", shard->name);
+                return -1;
+            }
+            snprintf(index_name, sizeof(index_name), "upload-%s.index", shard->name);
+            snprintf(journal_name, sizeof(journal_name), "transfer-%s.journal", shard->name);
+            snprintf(digest_name, sizeof(digest_name), "%s-%s", DIGEST_DIR_NAME, shard->name);
+            snprintf(audit_name, sizeof(audit_name), "audit-%s.csv", shard->name);
+        }
+
+        if ((shard->generation_dir[0] == '\0' && default_sibling_dir(shard, shard->generation_dir, "generations") != 0) ||
+            (shard->quarantine_dir[0] == '\0' &&
+             default_sibling_dir(shard, shard->quarantine_dir, QUARANTINE_DIR_NAME) != 0) ||
+            join_path(shard->index_file, settings.state_dir, index_name) != 0 ||
+            join_path(shard->journal_file, settings.state_dir, journal_name) != 0 ||
+            join_path(shard->digest_dir, settings.state_dir, digest_name) != 0 ||
+            join_path(shard->audit_file, settings.log_dir, audit_name) != 0) {
+            log_message(CLOG_ERROR, "Paths for shard %s are too long", shard->name);
+            return -1;
+        }
+        if (shard->workers == 0) {
+            shard->workers = settings.workers;
+        }
+        if (shard->publish == 0) {
+            shard->publish = settings.publish;
+        }
+        if (shard->departments.count == 0) {
+            shard->departments = settings.departments;
+        }
+
+        // Two shards sharing a directory would move or back up each other's files
+        for (int j = 0; j < i; j++) {
+            const struct shard *other = &settings.shards[j];
+            if (paths_clash(shard->upload_dir, other->upload_dir) ||
+                paths_clash(shard->report_dir, other->report_dir) ||
+                paths_clash(shard->generation_dir, other->generation_dir) ||
+                paths_clash(shard->backup_dir, other->backup_dir) ||
+                paths_clash(shard->quarantine_dir, other->quarantine_dir)) {
+                log_message(CLOG_ERROR, "Shards %s and %s share a directory", other->name, shard->name);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,654 @@
+/* shard.c - Implementation of per-shard worker threads */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "../include/config.h"
+#include "../include/shard.h"
+#include "../include/backup.h"
+#include "../include/publish.h"
+#include "../include/restore.h"
+#include "../include/logging.h"
+#include "../include/settings.h"
+
+static int activity_fd = -1;
+
+// Setting up the shard's locks and making sure its directories exist
+int init_shard(struct shard *shard) {
+    pthread_mutex_init(&shard->dir_mutex, NULL);
+    pthread_mutex_init(&shard->request_mutex, NULL);
+    pthread_cond_init(&shard->request_done, NULL);
+    shard->event_fd = -1;
+    shard->epoll_fd = -1;
+    shard->timer_fd = -1;
+    shard->watcher.fd = -1;
+    shard->watcher.wd = -1;
+    shard->watcher.lost = 0;
+    shard->thread_running = 0;
+
+    if (create_directory_if_not_exists(shard->upload_dir) != 0 ||
+        create_directory_if_not_exists(shard->backup_dir) != 0 ||
+        create_directory_if_not_exists(shard->quarantine_dir) != 0 ||
+        create_directory_if_not_exists(shard->digest_dir) != 0) {
+        log_message(CLOG_ERROR, "Failed to create directories for shard %s", shard->name);
+        return -1;
+    }
+
+    // The dashboard is a symlink to the published generation
+    if (init_publishing(shard) != 0) {
+        log_message(CLOG_ERROR, "Failed to set up dashboard publishing for shard %s", shard->name);
+        return -1;
+    }
+
+    // Ensure correct permissions at startup
+    if (chmod(shard->upload_dir, 0777) != 0) { // Fully open for all users
+        log_message(CLOG_ERROR, "Failed to set upload directory permissions at startup: %s", strerror(errno));
+    }
+
+    if (chmod(shard->report_dir, 0755) != 0) { // Readable by all, modifiable only by root
+        log_message(CLOG_ERROR, "Failed to set dashboard directory permissions at startup: %s", strerror(errno));
+    }
+    return 0;
+}
+
+// Watching the upload directory so changes are seen as they happen
+// A watch that was lost stays marked lost until it is back, so scans keep retrying it
+static void watch_uploads(struct shard *shard) {
+    struct epoll_event ev;
+    int lost = shard->watcher.lost;
+
+    ev.events = EPOLLIN;
+    if (init_watcher(&shard->watcher, shard->upload_dir, shard) >= 0) {
+        ev.data.fd = shard->watcher.fd;
+        if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->watcher.fd, &ev) != 0) {
+            cleanup_watcher(&shard->watcher);
+            shard->watcher.lost = lost;
+        }
+    } else {
+        shard->watcher.lost = lost;
+    }
+}
+
+// Running jobs in a fixed order: the audit sees the uploads before a transfer moves them
+static void run_shard_jobs(struct shard *shard, int jobs, struct shard_report *report) {
+    memset(report, 0, sizeof(*report));
+
+    if (jobs & SHARD_AUDIT) {
+        report->audit_status = check_missing_reports(shard, &report->audit);
+        if (report->audit_status != 0) {
+            report->status = -1;
+        }
+    }
+    if (jobs & SHARD_SCAN) {
+        if (shard->watcher.lost) {
+            watch_uploads(shard);  // The directory may be back
+        }
+        report->changes = check_uploads(shard);
+        if (report->changes < 0) {
+            report->status = -1;
+        }
+    }
+    if (jobs & SHARD_BACKUP) {
+        report->backup_status = backup_reports(shard, &report->backup);
+        if (report->backup_status != 0) {
+            report->status = -1;
+        }
+    }
+    if (jobs & SHARD_TRANSFER) {
+        report->transfer_status = transfer_reports(shard, &report->transfer);
+        if (report->transfer_status != 0) {
+            report->status = -1;
+        }
+    }
+    // Expired snapshots go after each backup, so the next one finds room
+    if (jobs & (SHARD_BACKUP | SHARD_GC)) {
+        report->gc_status = collect_snapshots(shard, &report->gc);
+        if (report->gc.pending > 0) {
+            post_shard_jobs(shard, SHARD_GC);  // The rest after whatever else is waiting
+        }
+        if (report->gc_status != 0) {
+            report->status = -1;
+        }
+    }
+    if (jobs & SHARD_ROLLBACK) {
+        report->rollback_status = rollback_reports(shard);
+        if (report->rollback_status != 0) {
+            report->status = -1;
+        }
+    }
+    if ((jobs & SHARD_RESTORE) && shard->restore != NULL) {
+        report->restore_status = restore_reports(shard, shard->restore, &report->restore, report->restored_from,
+                                                 sizeof(report->restored_from));
+        if (report->restore_status != 0) {
+            report->status = -1;
+        }
+    }
+}
+
+// Telling the main loop that buffered writes may be due
+static void note_activity() {
+    uint64_t one = 1;
+
+    if (activity_fd >= 0 && write(activity_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        log_message(CLOG_WARNING, "Failed to signal shard activity: %s", strerror(errno));
+    }
+}
+
+/* Continuous publishing */
+
+static long monotonic_seconds() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long) now.tv_sec;
+}
+
+static int compare_pending(const void *a, const void *b) {
+    return strcmp(((const struct pending_upload *) a)->name, ((const struct pending_upload *) b)->name);
+}
+
+static struct pending_upload *find_pending(struct shard *shard, const char *name) {
+    struct pending_upload key;
+
+    if (shard->pending_count == 0 || snprintf(key.name, sizeof(key.name), "%s", name) >= (int) sizeof(key.name)) {
+        return NULL;
+    }
+    return bsearch(&key, shard->pending, shard->pending_count, sizeof(key), compare_pending);
+}
+
+static int grow_pending(struct shard *shard, const char *name) {
+    if (shard->pending_count == shard->pending_capacity) {
+        size_t new_capacity = shard->pending_capacity ? shard->pending_capacity * 2 : 64;
+        struct pending_upload *grown = realloc(shard->pending, new_capacity * sizeof(*grown));
+        if (grown == NULL) {
+            log_message(CLOG_ERROR, "Failed to track upload %s: %s", name, strerror(errno));
+            return -1;
+        }
+        shard->pending = grown;
+        shard->pending_capacity = new_capacity;
+    }
+    return 0;
+}
+
+// Finding an upload's entry, inserting it in name order on first sight
+static struct pending_upload *add_pending(struct shard *shard, const char *name) {
+    struct pending_upload *entry = find_pending(shard, name);
+    size_t low = 0, high = shard->pending_count;
+
+    if (entry != NULL) {
+        return entry;
+    }
+    if (strlen(name) > NAME_MAX || grow_pending(shard, name) != 0) {
+        return NULL;
+    }
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strcmp(shard->pending[mid].name, name) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    memmove(&shard->pending[low + 1], &shard->pending[low], (shard->pending_count - low) * sizeof(*entry));
+    shard->pending_count++;
+
+    entry = &shard->pending[low];
+    memset(entry, 0, sizeof(*entry));
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    return entry;
+}
+
+// Dropping entries whose name was cleared
+static void compact_pending(struct shard *shard) {
+    size_t kept = 0;
+
+    for (size_t i = 0; i < shard->pending_count; i++) {
+        if (shard->pending[i].name[0] != '\0') {
+            shard->pending[kept++] = shard->pending[i];
+        }
+    }
+    shard->pending_count = kept;
+}
+
+static void drop_pending(struct shard *shard, const char *name) {
+    struct pending_upload *entry = find_pending(shard, name);
+
+    if (entry != NULL) {
+        entry->name[0] = '\0';
+        compact_pending(shard);
+    }
+}
+
+static int64_t stat_mtime_ns(const struct stat *st) {
+    return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// Called for every change the upload index finds: the upload settles before it is published
+void track_upload(struct shard *shard, const char *name, const struct stat *st) {
+    struct pending_upload *entry;
+
+    if (shard->timer_fd < 0) {
+        return;  // Not a running continuous shard
+    }
+
+    entry = add_pending(shard, name);
+    if (entry != NULL) {
+        entry->size = st->st_size;
+        entry->mtime_ns = stat_mtime_ns(st);
+        entry->checked_at = monotonic_seconds();
+        entry->ready = 0;
+    }
+}
+
+// The writer closed the file (or renamed it into place), so it is complete now
+static void upload_complete(struct shard *shard, const char *name) {
+    struct pending_upload *entry;
+
+    if (shard->timer_fd < 0) {
+        return;
+    }
+
+    entry = add_pending(shard, name);
+    if (entry != NULL && !entry->ready) {
+        entry->ready = 1;
+        entry->checked_at = monotonic_seconds();
+    }
+}
+
+// Publishing every complete upload in one generation
+static void publish_pending(struct shard *shard) {
+    char **names;
+    size_t count = 0;
+
+    names = malloc(shard->pending_count * sizeof(*names));
+    if (names == NULL) {
+        log_message(CLOG_ERROR, "Failed to publish uploads for %s: %s", shard->name, strerror(errno));
+        return;
+    }
+    for (size_t i = 0; i < shard->pending_count; i++) {
+        if (shard->pending[i].ready) {
+            names[count++] = shard->pending[i].name;
+        }
+    }
+
+    if (count > 0) {
+        log_message(CLOG_INFO, "Publishing %zu complete uploads for %s", count, shard->name);
+        transfer_uploads(shard, names, count, NULL);
+    }
+    free(names);
+
+    // Failed moves stay in the upload directory for the next scan or manual transfer
+    for (size_t i = 0; i < shard->pending_count; i++) {
+        if (shard->pending[i].ready) {
+            shard->pending[i].name[0] = '\0';
+        }
+    }
+    compact_pending(shard);
+}
+
+// Promoting uploads whose size and mtime held still for settle_seconds, then publishing
+static void check_pending(struct shard *shard) {
+    char path[PATH_MAX];
+    struct stat st;
+    long now = monotonic_seconds();
+    int due = 0;
+
+    for (size_t i = 0; i < shard->pending_count; i++) {
+        struct pending_upload *entry = &shard->pending[i];
+
+        if (entry->ready) {
+            due |= now >= entry->checked_at + PUBLISH_DELAY;
+            continue;
+        }
+        if (now < entry->checked_at + settings.settle_seconds) {
+            continue;
+        }
+
+        if (snprintf(path, sizeof(path), "%s/%s", shard->upload_dir, entry->name) >= (int) sizeof(path) ||
+            stat(path, &st) != 0) {
+            entry->name[0] = '\0';  // Removed before it settled
+        } else if (st.st_size == entry->size && stat_mtime_ns(&st) == entry->mtime_ns) {
+            entry->ready = 1;
+            entry->checked_at = now;
+        } else {
+            // Still being written
+            entry->size = st.st_size;
+            entry->mtime_ns = stat_mtime_ns(&st);
+            entry->checked_at = now;
+        }
+    }
+    compact_pending(shard);
+
+    if (due) {
+        publish_pending(shard);
+    }
+}
+
+// Arming the timer for the next settle check or publish, disarming it when nothing waits
+static void arm_pending_timer(struct shard *shard) {
+    struct itimerspec spec;
+    long next = -1;
+    long now;
+
+    if (shard->timer_fd < 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < shard->pending_count; i++) {
+        const struct pending_upload *entry = &shard->pending[i];
+        long at = entry->checked_at + (entry->ready ? PUBLISH_DELAY : settings.settle_seconds);
+        if (next < 0 || at < next) {
+            next = at;
+        }
+    }
+
+    memset(&spec, 0, sizeof(spec));
+    if (next >= 0) {
+        now = monotonic_seconds();
+        if (next > now) {
+            spec.it_value.tv_sec = next - now;
+        } else {
+            spec.it_value.tv_nsec = 1;
+        }
+    }
+    timerfd_settime(shard->timer_fd, 0, &spec, NULL);
+}
+
+// Queueing everything already in the upload directory to settle, for a continuous shard starting up
+// Appended and sorted once, the list is empty at this point
+static void track_existing_uploads(struct shard *shard) {
+    char path[PATH_MAX];
+    struct stat st;
+    DIR *dir;
+    struct dirent *entry;
+    long now = monotonic_seconds();
+
+    dir = opendir(shard->upload_dir);
+    if (dir == NULL) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        struct pending_upload *pending;
+
+        if (entry->d_type != DT_REG || strstr(entry->d_name, ".xml") == NULL ||
+            snprintf(path, sizeof(path), "%s/%s", shard->upload_dir, entry->d_name) >= (int) sizeof(path) ||
+            stat(path, &st) != 0 || grow_pending(shard, entry->d_name) != 0) {
+            continue;
+        }
+        pending = &shard->pending[shard->pending_count++];
+        memset(pending, 0, sizeof(*pending));
+        snprintf(pending->name, sizeof(pending->name), "%s", entry->d_name);
+        pending->size = st.st_size;
+        pending->mtime_ns = stat_mtime_ns(&st);
+        pending->checked_at = now;
+    }
+    closedir(dir);
+
+    if (shard->pending_count > 0) {
+        qsort(shard->pending, shard->pending_count, sizeof(*shard->pending), compare_pending);
+    }
+}
+
+static void on_upload_event(void *owner, const char *name, int removed) {
+    struct shard *shard = owner;
+
+    if (removed) {
+        report_upload_removed(shard, name);
+        drop_pending(shard, name);
+    } else {
+        report_upload_change(shard, name);
+        upload_complete(shard, name);
+    }
+}
+
+// Taking the queued requests and running them, the waiting caller gets its report
+static void serve_requests(struct shard *shard) {
+    struct shard_report report;
+    int jobs, sync_jobs;
+
+    pthread_mutex_lock(&shard->request_mutex);
+    jobs = shard->pending_jobs;
+    sync_jobs = shard->sync_jobs;
+    shard->pending_jobs = 0;
+    shard->sync_jobs = 0;
+    pthread_mutex_unlock(&shard->request_mutex);
+
+    if (jobs != 0) {
+        run_shard_jobs(shard, jobs, &report);
+    }
+    if (sync_jobs != 0) {
+        run_shard_jobs(shard, sync_jobs, &report);
+        pthread_mutex_lock(&shard->request_mutex);
+        shard->sync_report = report;
+        shard->sync_done = 1;
+        pthread_cond_broadcast(&shard->request_done);
+        pthread_mutex_unlock(&shard->request_mutex);
+    }
+}
+
+static void *shard_main(void *arg) {
+    struct shard *shard = arg;
+    struct epoll_event events[4];
+    int stopping = 0;
+
+    while (!stopping) {
+        int ready = epoll_wait(shard->epoll_fd, events, 4, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_message(CLOG_ERROR, "Shard %s epoll_wait failed: %s", shard->name, strerror(errno));
+            sleep(1);
+            continue;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.fd == shard->event_fd) {
+                uint64_t count;
+                if (read(shard->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    log_message(CLOG_WARNING, "Shard %s failed to read its event descriptor", shard->name);
+                }
+                serve_requests(shard);
+            } else if (events[i].data.fd == shard->timer_fd) {
+                uint64_t expirations;
+                if (read(shard->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                    log_message(CLOG_WARNING, "Shard %s failed to read its timer", shard->name);
+                }
+                check_pending(shard);
+            } else if (process_watcher_events(&shard->watcher, on_upload_event) == WATCHER_OVERFLOW) {
+                // Events were lost, so rescan the whole directory
+                check_uploads(shard);
+            }
+        }
+        arm_pending_timer(shard);
+        note_activity();
+
+        pthread_mutex_lock(&shard->request_mutex);
+        stopping = shard->stopping;
+        pthread_mutex_unlock(&shard->request_mutex);
+    }
+
+    return NULL;
+}
+
+static void close_shard_fds(struct shard *shard) {
+    cleanup_watcher(&shard->watcher);
+    if (shard->timer_fd >= 0) {
+        close(shard->timer_fd);
+        shard->timer_fd = -1;
+    }
+    if (shard->epoll_fd >= 0) {
+        close(shard->epoll_fd);
+        shard->epoll_fd = -1;
+    }
+    if (shard->event_fd >= 0) {
+        close(shard->event_fd);
+        shard->event_fd = -1;
+    }
+}
+
+int start_shard(struct shard *shard) {
+    struct epoll_event ev;
+    int ret;
+
+    // One activity descriptor is shared by every shard
+    if (activity_fd < 0) {
+        activity_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (activity_fd < 0) {
+            log_message(CLOG_ERROR, "Failed to create activity descriptor: %s", strerror(errno));
+        }
+    }
+
+    if (init_upload_index(shard) != 0) {
+        return -1;
+    }
+
+    // Moves a crashed transfer left half done are finished before anything else runs
+    recover_transfer(shard);
+
+    shard->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (shard->event_fd < 0 || shard->epoll_fd < 0) {
+        log_message(CLOG_ERROR, "Failed to create descriptors for shard %s: %s", shard->name, strerror(errno));
+        close_shard_fds(shard);
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = shard->event_fd;
+    if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->event_fd, &ev) != 0) {
+        log_message(CLOG_ERROR, "Failed to register shard %s with epoll: %s", shard->name, strerror(errno));
+        close_shard_fds(shard);
+        return -1;
+    }
+    watch_uploads(shard);
+
+    // Continuous shards wake on a timer to publish uploads once they are complete
+    if (shard->publish == PUBLISH_CONTINUOUS) {
+        shard->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        ev.data.fd = shard->timer_fd;
+        if (shard->timer_fd < 0 || epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->timer_fd, &ev) != 0) {
+            log_message(CLOG_ERROR, "Failed to set up continuous publishing for %s: %s", shard->name, strerror(errno));
+            if (shard->timer_fd >= 0) {
+                close(shard->timer_fd);
+                shard->timer_fd = -1;
+            }
+        } else {
+            track_existing_uploads(shard);
+            arm_pending_timer(shard);
+        }
+    }
+
+    ret = pthread_create(&shard->thread, NULL, shard_main, shard);
+    if (ret != 0) {
+        log_message(CLOG_ERROR, "Failed to start thread for shard %s: %s", shard->name, strerror(ret));
+        close_shard_fds(shard);
+        return -1;
+    }
+
+    shard->thread_running = 1;
+    log_message(CLOG_INFO, "Shard %s serving %s, publishing %s", shard->name, shard->upload_dir,
+                shard->publish == PUBLISH_CONTINUOUS ? "continuously" : "nightly");
+    return 0;
+}
+
+int shard_watching(const struct shard *shard) {
+    return shard->thread_running && shard->watcher.fd >= 0;
+}
+
+static void wake_shard(struct shard *shard) {
+    uint64_t one = 1;
+
+    if (write(shard->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        log_message(CLOG_ERROR, "Failed to wake shard %s: %s", shard->name, strerror(errno));
+    }
+}
+
+void post_shard_jobs(struct shard *shard, int jobs) {
+    struct shard_report report;
+
+    if (!shard->thread_running) {
+        run_shard_jobs(shard, jobs, &report);
+        return;
+    }
+
+    pthread_mutex_lock(&shard->request_mutex);
+    shard->pending_jobs |= jobs;
+    pthread_mutex_unlock(&shard->request_mutex);
+    wake_shard(shard);
+}
+
+// Posting to every shard first, so the shards work in parallel while we wait
+int run_jobs_on_shards(struct shard *shards, int count, int jobs, struct shard_report *reports) {
+    int status = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (!shards[i].thread_running) {
+            continue;
+        }
+        pthread_mutex_lock(&shards[i].request_mutex);
+        shards[i].sync_jobs |= jobs;
+        shards[i].sync_done = 0;
+        pthread_mutex_unlock(&shards[i].request_mutex);
+        wake_shard(&shards[i]);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!shards[i].thread_running) {
+            run_shard_jobs(&shards[i], jobs, &reports[i]);
+        } else {
+            pthread_mutex_lock(&shards[i].request_mutex);
+            while (!shards[i].sync_done) {
+                pthread_cond_wait(&shards[i].request_done, &shards[i].request_mutex);
+            }
+            reports[i] = shards[i].sync_report;
+            pthread_mutex_unlock(&shards[i].request_mutex);
+        }
+        if (reports[i].status != 0) {
+            status = -1;
+        }
+    }
+    return status;
+}
+
+void stop_shard(struct shard *shard) {
+    if (shard->thread_running) {
+        pthread_mutex_lock(&shard->request_mutex);
+        shard->stopping = 1;
+        pthread_mutex_unlock(&shard->request_mutex);
+        wake_shard(shard);
+        pthread_join(shard->thread, NULL);
+        shard->thread_running = 0;
+    }
+
+    close_shard_fds(shard);
+    cleanup_upload_index(shard);
+    free(shard->pending);
+    shard->pending = NULL;
+    shard->pending_count = 0;
+    shard->pending_capacity = 0;
+}
+
+int shard_activity_fd() {
+    return activity_fd;
+}
+
+void clear_shard_activity() {
+    uint64_t count;
+
+    if (activity_fd >= 0 && read(activity_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        log_message(CLOG_WARNING, "Failed to read activity descriptor: %s", strerror(errno));
+    }
+}
@@ -0,0 +1,50 @@
+/* timestamp.c - Implementation of cached timestamp formatting */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/timestamp.h"
+
+static const char *const ts_patterns[TS_FORMATS] = {
+    "%Y-%m-%d %H:%M:%S",
+    "%Y%m%d_%H%M%S",
+    "%Y%m%d",
+};
+
+// Last formatted second per format, one set per thread so no locking is needed
+struct ts_cache {
+    int valid;
+    time_t second;
+    char text[32];
+};
+
+static __thread struct ts_cache ts_cache[TS_FORMATS];
+
+// Formatting a timestamp, reusing the previous result within the same second
+const char *format_timestamp(time_t timestamp, int format) {
+    struct ts_cache *cache;
+    struct tm time_info;
+
+    if (format < 0 || format >= TS_FORMATS) {
+        format = TS_LOG;
+    }
+    cache = &ts_cache[format];
+
+    if (cache->valid && cache->second == timestamp) {
+        return cache->text;
+    }
+
+    if (localtime_r(&timestamp, &time_info) == NULL ||
+        strftime(cache->text, sizeof(cache->text), ts_patterns[format], &time_info) == 0) {
+        snprintf(cache->text, sizeof(cache->text), "%lld", (long long) timestamp);
+    }
+    cache->second = timestamp;
+    cache->valid = 1;
+
+    return cache->text;
+}
+
+const char *current_timestamp(int format) {
+    return format_timestamp(time(NULL), format);
+}
@@ -0,0 +1,514 @@
+/* transfer.c - Implementation of the native transfer engine */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <linux/limits.h>
+
+#include "../include/config.h"
+#include "../include/transfer.h"
+#include "../include/logging.h"
+#include "../include/uring.h"
+
+// Largest chunk handed to the kernel in one copy call
+#define COPY_CHUNK (1 << 30)
+
+// Copying with a plain read/write loop when the kernel cannot do it for us
+static int copy_fd_rw(int in_fd, int out_fd, off_t *copied) {
+    char buffer[BUFFER_SIZE * 16];
+    ssize_t n;
+
+    while ((n = read(in_fd, buffer, sizeof(buffer))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(out_fd, buffer + off, n - off);
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            off += w;
+        }
+        *copied += n;
+    }
+    return 0;
+}
+
+// Copying file contents inside the kernel, falling back as each method is refused
+static int copy_fd(int in_fd, int out_fd, off_t size, off_t *copied) {
+    ssize_t n;
+    int use_cfr = 1;
+
+    *copied = 0;
+    while (*copied < size) {
+        size_t chunk = (size - *copied) > COPY_CHUNK ? COPY_CHUNK : (size_t) (size - *copied);
+
+        if (use_cfr) {
+            n = copy_file_range(in_fd, NULL, out_fd, NULL, chunk, 0);
+            if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+                use_cfr = 0;
+                continue;
+            }
+        } else {
+            n = sendfile(out_fd, in_fd, NULL, chunk);
+            if (n < 0 && (errno == ENOSYS || errno == EINVAL)) {
+                return copy_fd_rw(in_fd, out_fd, copied);
+            }
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;  // File shrank while copying
+        }
+        *copied += n;
+    }
+    return 0;
+}
+
+// Copying a file through a temporary name so readers never see a partial report
+int copy_file(const char *src_path, const char *dst_path, off_t *bytes_copied) {
+    char tmp_path[PATH_MAX];
+    const char *slash = strrchr(dst_path, '/');
+    int dir_len = slash != NULL ? (int) (slash - dst_path + 1) : 0;
+    struct stat st;
+    off_t copied = 0;
+    int in_fd, out_fd;
+    int saved_errno;
+
+    // A unique name beside the destination, so concurrent copies and reports never share it
+    if (snprintf(tmp_path, sizeof(tmp_path), "%.*s%sXXXXXX", dir_len, dst_path, COPY_TMP_PREFIX) >=
+        (int) sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    in_fd = open(src_path, O_RDONLY | O_CLOEXEC);
+    if (in_fd < 0) {
+        return -1;
+    }
+
+    if (fstat(in_fd, &st) != 0) {
+        saved_errno = errno;
+        close(in_fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    out_fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (out_fd >= 0 && fchmod(out_fd, 0644) != 0) {
+        saved_errno = errno;
+        close(out_fd);
+        unlink(tmp_path);
+        errno = saved_errno;
+        out_fd = -1;
+    }
+    if (out_fd < 0) {
+        saved_errno = errno;
+        close(in_fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    if (copy_fd(in_fd, out_fd, st.st_size, &copied) != 0 || fsync(out_fd) != 0) {
+        saved_errno = errno;
+        close(in_fd);
+        close(out_fd);
+        unlink(tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+
+    close(in_fd);
+    if (close(out_fd) != 0 || rename(tmp_path, dst_path) != 0) {
+        saved_errno = errno;
+        unlink(tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+
+    if (bytes_copied != NULL) {
+        *bytes_copied = copied;
+    }
+    return 0;
+}
+
+// Only called when no copy into dir is running, so every temporary file there was abandoned
+void remove_copy_leftovers(const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+
+    if (d == NULL) {
+        return;
+    }
+    while ((entry = readdir(d)) != NULL) {
+        if (strncmp(entry->d_name, COPY_TMP_PREFIX, strlen(COPY_TMP_PREFIX)) == 0 &&
+            strstr(entry->d_name, ".xml") == NULL && unlinkat(dirfd(d), entry->d_name, 0) == 0) {
+            log_message(CLOG_INFO, "Removed partial copy %s/%s", dir, entry->d_name);
+        }
+    }
+    closedir(d);
+}
+
+// Moving a single file into the destination directory
+int transfer_file(const char *src_dir, const char *dst_dir, const char *name, struct transfer_result *result) {
+    char src_path[PATH_MAX];
+    char dst_path[PATH_MAX];
+    struct stat st;
+
+    memset(result, 0, sizeof(*result));
+    snprintf(result->name, sizeof(result->name), "%s", name);
+
+    if (snprintf(src_path, sizeof(src_path), "%s/%s", src_dir, name) >= (int) sizeof(src_path) ||
+        snprintf(dst_path, sizeof(dst_path), "%s/%s", dst_dir, name) >= (int) sizeof(dst_path)) {
+        result->error = ENAMETOOLONG;
+        return -1;
+    }
+
+    if (stat(src_path, &st) != 0) {
+        result->error = errno;
+        return -1;
+    }
+
+    // Same filesystem: a rename is atomic and moves no data
+    if (rename(src_path, dst_path) == 0) {
+        result->method = TRANSFER_RENAME;
+        result->bytes = st.st_size;
+        result->mode = st.st_mode;
+        return 0;
+    }
+
+    if (errno != EXDEV) {
+        result->error = errno;
+        return -1;
+    }
+
+    // Different filesystems: copy, make it durable, then drop the upload
+    result->method = TRANSFER_COPY;
+    if (copy_file(src_path, dst_path, &result->bytes) != 0) {
+        result->error = errno;
+        return -1;
+    }
+
+    if (unlink(src_path) != 0) {
+        result->error = errno;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Steps of one file's move, kept in the low bits of each submission's user_data
+enum move_step {
+    STEP_STATX,
+    STEP_RENAME,
+    STEP_OPEN_SRC,
+    STEP_READ,
+    STEP_OPEN_TMP,
+    STEP_WRITE,
+    STEP_FSYNC,
+    STEP_CLOSE_SRC,
+    STEP_CLOSE_TMP,
+    STEP_COMMIT,
+    STEP_UNLINK,
+    STEP_BITS = 4
+};
+
+// Per-file state while its submissions are in flight
+struct batch_file {
+    struct statx stx;
+    char tmp[sizeof(COPY_TMP_PREFIX) + 24];  // named by its index, unlike any report
+    int copy;   // the rename crossed filesystems
+    int step;   // first step that failed
+};
+
+struct batch {
+    struct uring ring;
+    int src_fd;
+    int dst_fd;
+    unsigned char *buffers;
+    char *const *names;
+    struct batch_file *files;
+    struct transfer_result *results;
+};
+
+int transfer_batch_available(void) {
+    return uring_available();
+}
+
+static void prep(struct io_uring_sqe *sqe, int opcode, int fd, const void *addr, unsigned len, uint64_t off,
+                 size_t index, int step) {
+    sqe->opcode = (uint8_t) opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = ((uint64_t) index << STEP_BITS) | (uint64_t) step;
+}
+
+// Reaping want completions; the first failure of a file is kept, the cancelled steps after it are not
+static int reap(struct batch *batch, unsigned want) {
+    while (want > 0) {
+        struct io_uring_cqe *cqe = uring_peek_cqe(&batch->ring);
+        size_t index;
+        int step;
+        int res;
+
+        if (cqe == NULL) {
+            if (uring_submit_and_wait(&batch->ring, 1) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        index = (size_t) (cqe->user_data >> STEP_BITS);
+        step = (int) (cqe->user_data & ((1 << STEP_BITS) - 1));
+        res = cqe->res;
+        uring_cqe_seen(&batch->ring);
+        want--;
+
+        // A read or write shorter than the file breaks the chain like an error
+        if ((step == STEP_READ || step == STEP_WRITE) && res >= 0 && (uint64_t) res != batch->files[index].stx.stx_size) {
+            res = -EIO;
+        }
+        if (step == STEP_RENAME && res == -EXDEV) {
+            batch->files[index].copy = 1;
+        } else if (res < 0 && res != -ECANCELED && batch->results[index].error == 0) {
+            batch->results[index].error = -res;
+            batch->files[index].step = step;
+        }
+    }
+    return 0;
+}
+
+// Each file is a linked statx then rename, so a missing upload is never renamed
+static void rename_window(struct batch *batch, size_t first, size_t count) {
+    for (size_t i = first; i < first + count; i++) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&batch->ring);
+
+        prep(sqe, IORING_OP_STATX, batch->src_fd, batch->names[i], STATX_SIZE | STATX_MODE,
+             (uint64_t) (uintptr_t) &batch->files[i].stx, i, STEP_STATX);
+        sqe->flags = IOSQE_IO_LINK;
+
+        sqe = uring_get_sqe(&batch->ring);
+        prep(sqe, IORING_OP_RENAMEAT, batch->src_fd, batch->names[i], (unsigned) batch->dst_fd,
+             (uint64_t) (uintptr_t) batch->names[i], i, STEP_RENAME);
+    }
+    // Lost track of the window: its files may or may not have moved, and count as failed
+    if (uring_submit_and_wait(&batch->ring, (unsigned) count * 2) != 0 || reap(batch, (unsigned) count * 2) != 0) {
+        for (size_t i = first; i < first + count; i++) {
+            batch->results[i].error = errno;
+        }
+    }
+}
+
+// Open, read, create, write, sync, close both, rename and unlink, as one chain per file in its own
+// registered buffer and pair of direct descriptor slots
+static void queue_copy(struct batch *batch, size_t index, unsigned slot) {
+    struct batch_file *file = &batch->files[index];
+    unsigned size = (unsigned) file->stx.stx_size;
+    unsigned char *buffer = batch->buffers + (size_t) slot * URING_BUFFER_SIZE;
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(&batch->ring);
+    prep(sqe, IORING_OP_OPENAT, batch->src_fd, batch->names[index], 0, 0, index, STEP_OPEN_SRC);
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = slot * 2 + 1;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = uring_get_sqe(&batch->ring);
+    prep(sqe, IORING_OP_READ_FIXED, (int) (slot * 2), buffer, size, 0, index, STEP_READ);
+    sqe->buf_index = (uint16_t) slot;
+    sqe->flags = IOSQE_IO_LINK | IOSQE_FIXED_FILE;
+
+    sqe = uring_get_sqe(&batch->ring);
+    prep(sqe, IORING_OP_OPENAT, batch->dst_fd, file->tmp, REPORT_FILE_PERMS, 0, index, STEP_OPEN_TMP);
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->file_index = slot * 2 + 2;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = uring_get_sqe(&batch->ring);
+    prep(sqe, IORING_OP_WRITE_FIXED, (int) (slot * 2 + 1), buffer, size, 0, index, STEP_WRITE);
+    sqe->buf_index = (uint16_t) slot;
+    sqe->flags = IOSQE_IO_LINK | IOSQE_FIXED_FILE;
+
+    sqe = uring_get_sqe(&batch->ring);
+    prep(sqe, IORING_OP_FSYNC, (int) (slot * 2 + 1), NULL, 0, 0, index, STEP_FSYNC);
+    sqe->flags = IOSQE_IO_LINK | IOSQE_FIXED_FILE;
+
+    sqe = uring_get_sqe(&batch->ring);
+    prep(sqe, IORING_OP_CLOSE, 0, NULL, 0, 0, index, STEP_CLOSE_SRC);
+    sqe->file_index = slot * 2 + 1;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = uring_get_sqe(&batch->ring);
+    prep(sqe, IORING_OP_CLOSE, 0, NULL, 0, 0, index, STEP_CLOSE_TMP);
+    sqe->file_index = slot * 2 + 2;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = uring_get_sqe(&batch->ring);
+    prep(sqe, IORING_OP_RENAMEAT, batch->dst_fd, file->tmp, (unsigned) batch->dst_fd,
+         (uint64_t) (uintptr_t) batch->names[index], index, STEP_COMMIT);
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = uring_get_sqe(&batch->ring);
+    prep(sqe, IORING_OP_UNLINKAT, batch->src_fd, batch->names[index], 0, 0, index, STEP_UNLINK);
+}
+
+#define COPY_SQES 9  // submissions queue_copy makes per file
+
+// Reports too big for a buffer take the synchronous path, as a transfer_file would after EXDEV
+static void copy_alone(struct batch *batch, const char *src_dir, const char *dst_dir, size_t index) {
+    char src_path[PATH_MAX];
+    char dst_path[PATH_MAX];
+
+    snprintf(src_path, sizeof(src_path), "%s/%s", src_dir, batch->names[index]);
+    snprintf(dst_path, sizeof(dst_path), "%s/%s", dst_dir, batch->names[index]);
+    if (copy_file(src_path, dst_path, &batch->results[index].bytes) != 0 || unlink(src_path) != 0) {
+        batch->results[index].error = errno;
+    }
+}
+
+static void copy_files(struct batch *batch, const char *src_dir, const char *dst_dir, size_t count) {
+    unsigned queued = 0;
+    size_t window[URING_BUFFERS];
+
+    for (size_t i = 0; i <= count; i++) {
+        if (i < count && batch->files[i].copy) {
+            if (batch->files[i].stx.stx_size > URING_BUFFER_SIZE) {
+                copy_alone(batch, src_dir, dst_dir, i);
+                continue;
+            }
+            snprintf(batch->files[i].tmp, sizeof(batch->files[i].tmp), "%s%zu.tmp", COPY_TMP_PREFIX, i);
+            queue_copy(batch, i, queued);
+            window[queued++] = i;
+        }
+        if (queued == 0 || (i < count && queued < URING_BUFFERS)) {
+            continue;
+        }
+
+        if (uring_submit_and_wait(&batch->ring, queued * COPY_SQES) != 0 || reap(batch, queued * COPY_SQES) != 0) {
+            for (unsigned k = 0; k < queued; k++) {
+                batch->results[window[k]].error = errno;
+            }
+        }
+        // A chain that stopped before its rename leaves a partial temporary file
+        for (unsigned k = 0; k < queued; k++) {
+            struct batch_file *file = &batch->files[window[k]];
+
+            if (batch->results[window[k]].error != 0 && file->step < STEP_COMMIT) {
+                unlinkat(batch->dst_fd, file->tmp, 0);
+            }
+        }
+        queued = 0;
+    }
+}
+
+// Anything the ring cannot be set up for goes through transfer_file instead
+static int setup_batch(struct batch *batch, const char *src_dir, const char *dst_dir) {
+    struct iovec iov[URING_BUFFERS];
+    size_t size = (size_t) URING_BUFFERS * URING_BUFFER_SIZE;
+
+    batch->src_fd = open(src_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    batch->dst_fd = open(dst_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    batch->buffers = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (batch->src_fd < 0 || batch->dst_fd < 0 || batch->buffers == MAP_FAILED) {
+        return -1;
+    }
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        iov[i].iov_base = batch->buffers + (size_t) i * URING_BUFFER_SIZE;
+        iov[i].iov_len = URING_BUFFER_SIZE;
+    }
+    if (uring_init(&batch->ring, URING_ENTRIES) != 0) {
+        return -1;
+    }
+    if (uring_register_buffers(&batch->ring, iov, URING_BUFFERS) != 0 ||
+        uring_register_file_slots(&batch->ring, URING_BUFFERS * 2) != 0) {
+        uring_exit(&batch->ring);
+        return -1;
+    }
+    return 0;
+}
+
+static void cleanup_batch(struct batch *batch) {
+    if (batch->buffers != MAP_FAILED) {
+        munmap(batch->buffers, (size_t) URING_BUFFERS * URING_BUFFER_SIZE);
+    }
+    if (batch->src_fd >= 0) {
+        close(batch->src_fd);
+    }
+    if (batch->dst_fd >= 0) {
+        close(batch->dst_fd);
+    }
+    free(batch->files);
+}
+
+// Renames go in windows filling the ring; the ones that cross filesystems are then copied
+int transfer_files(const char *src_dir, const char *dst_dir, char *const *names, size_t count,
+                   struct transfer_result *results) {
+    struct batch batch;
+    size_t window = URING_ENTRIES / 2;
+    int failed = 0;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.src_fd = batch.dst_fd = -1;
+    batch.buffers = MAP_FAILED;
+    batch.names = names;
+    batch.results = results;
+    batch.files = calloc(count > 0 ? count : 1, sizeof(*batch.files));
+    if (!uring_available() || batch.files == NULL || setup_batch(&batch, src_dir, dst_dir) != 0) {
+        if (uring_available()) {
+            log_message(CLOG_WARNING, "Failed to set up io_uring for %s, moving files one at a time: %s", dst_dir,
+                        strerror(errno));
+        }
+        cleanup_batch(&batch);
+        for (size_t i = 0; i < count; i++) {
+            failed += transfer_file(src_dir, dst_dir, names[i], &results[i]) != 0;
+        }
+        return failed;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        memset(&results[i], 0, sizeof(results[i]));
+        snprintf(results[i].name, sizeof(results[i].name), "%s", names[i]);
+    }
+    for (size_t first = 0; first < count; first += window) {
+        rename_window(&batch, first, count - first < window ? count - first : window);
+    }
+    copy_files(&batch, src_dir, dst_dir, count);
+    uring_exit(&batch.ring);
+
+    for (size_t i = 0; i < count; i++) {
+        if (results[i].error != 0) {
+            failed++;
+            continue;
+        }
+        results[i].method = batch.files[i].copy ? TRANSFER_COPY : TRANSFER_RENAME;
+        results[i].mode = batch.files[i].copy ? 0 : batch.files[i].stx.stx_mode;
+        if (results[i].bytes == 0) {
+            results[i].bytes = (off_t) batch.files[i].stx.stx_size;
+        }
+    }
+    cleanup_batch(&batch);
+    return failed;
+}
@@ -0,0 +1,217 @@
+/* uring.c - Implementation of minimal io_uring rings */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "../include/config.h"
+#include "../include/uring.h"
+#include "../include/logging.h"
+
+static int available = 0;
+static pthread_once_t probe_once = PTHREAD_ONCE_INIT;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned count) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+// Operations a batched transfer chains together
+static const int required_ops[] = {
+    IORING_OP_STATX, IORING_OP_RENAMEAT, IORING_OP_UNLINKAT, IORING_OP_OPENAT, IORING_OP_READ_FIXED,
+    IORING_OP_WRITE_FIXED, IORING_OP_FSYNC, IORING_OP_CLOSE
+};
+
+// A kernel too old, a seccomp filter or kernel.io_uring_disabled all end up here
+static void probe(void) {
+    struct io_uring_probe *ops;
+    struct uring ring;
+    size_t size = sizeof(*ops) + 256 * sizeof(struct io_uring_probe_op);
+
+    if (uring_init(&ring, 8) != 0) {
+        log_message(CLOG_INFO, "io_uring unavailable (%s), file batches use worker threads", strerror(errno));
+        return;
+    }
+    ops = calloc(1, size);
+    if (ops == NULL || sys_io_uring_register(ring.fd, IORING_REGISTER_PROBE, ops, 256) != 0) {
+        log_message(CLOG_INFO, "io_uring cannot list its operations, file batches use worker threads");
+        free(ops);
+        uring_exit(&ring);
+        return;
+    }
+
+    available = 1;
+    for (size_t i = 0; i < sizeof(required_ops) / sizeof(required_ops[0]); i++) {
+        if (required_ops[i] > ops->last_op || !(ops->ops[required_ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            log_message(CLOG_INFO, "io_uring lacks operation %d, file batches use worker threads", required_ops[i]);
+            available = 0;
+            break;
+        }
+    }
+    if (available && uring_register_file_slots(&ring, 2) != 0) {
+        log_message(CLOG_INFO, "io_uring lacks direct descriptors, file batches use worker threads");
+        available = 0;
+    }
+    free(ops);
+    uring_exit(&ring);
+}
+
+int uring_available(void) {
+    pthread_once(&probe_once, probe);
+    return available;
+}
+
+int uring_init(struct uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    int saved_errno;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->sq_map = ring->cq_map = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Recent kernels share one mapping between the two rings
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = ring->sq_map_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        goto fail;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            goto fail;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto fail;
+    }
+
+    ring->sq_head = (unsigned *) ((char *) ring->sq_map + params.sq_off.head);
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_map + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *) ((char *) ring->sq_map + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_array = (unsigned *) ((char *) ring->sq_map + params.sq_off.array);
+    ring->cq_head = (unsigned *) ((char *) ring->cq_map + params.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_map + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) ((char *) ring->cq_map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_map + params.cq_off.cqes);
+    return 0;
+
+fail:
+    saved_errno = errno;
+    uring_exit(ring);
+    errno = saved_errno;
+    return -1;
+}
+
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, unsigned count) {
+    return sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, count) == 0 ? 0 : -1;
+}
+
+// A table of -1 descriptors is a table of empty slots
+int uring_register_file_slots(struct uring *ring, unsigned count) {
+    int *fds = malloc(count * sizeof(*fds));
+    int ret;
+
+    if (fds == NULL) {
+        return -1;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        fds[i] = -1;
+    }
+    ret = sys_io_uring_register(ring->fd, IORING_REGISTER_FILES, fds, count) == 0 ? 0 : -1;
+    free(fds);
+    return ret;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    unsigned tail = *ring->sq_tail + ring->queued;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        return NULL;
+    }
+    sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    ring->queued++;
+    return sqe;
+}
+
+// Publishing the new tail before entering, so the kernel sees every filled-in entry
+int uring_submit_and_wait(struct uring *ring, unsigned wait) {
+    unsigned submit = ring->queued;
+    int ret;
+
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued, __ATOMIC_RELEASE);
+    ring->queued = 0;
+    do {
+        ret = sys_io_uring_enter(ring->fd, submit, wait, IORING_ENTER_GETEVENTS);
+        if (ret >= 0) {
+            submit -= (unsigned) ret < submit ? (unsigned) ret : submit;
+        }
+    } while ((ret < 0 && errno == EINTR) || (ret >= 0 && submit > 0));
+    return ret < 0 ? -1 : 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_exit(struct uring *ring) {
+    if (ring->sqes != MAP_FAILED && ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_map != MAP_FAILED && ring->cq_map != NULL && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map != MAP_FAILED && ring->sq_map != NULL) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
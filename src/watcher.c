@@ -0,0 +1,127 @@
+/* watcher.c - Implementation of the inotify upload watcher */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/inotify.h>
+
+#include "../include/config.h"
+#include "../include/watcher.h"
+#include "../include/logging.h"
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)
+
+// Starting the inotify watch on the directory
+int init_watcher(struct watcher *watcher, const char *dir_path, void *owner) {
+    watcher->owner = owner;
+    watcher->dir = dir_path;
+    watcher->lost = 0;
+    watcher->wd = -1;
+    watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->fd < 0) {
+        log_message(CLOG_ERROR, "Failed to initialise inotify: %s", strerror(errno));
+        return -1;
+    }
+
+    watcher->wd = inotify_add_watch(watcher->fd, dir_path, WATCH_EVENTS);
+    if (watcher->wd < 0) {
+        log_message(CLOG_ERROR, "Failed to watch %s: %s", dir_path, strerror(errno));
+        close(watcher->fd);
+        watcher->fd = -1;
+        return -1;
+    }
+
+    log_message(CLOG_INFO, "Watching %s for changes", dir_path);
+    return watcher->fd;
+}
+
+// Draining the inotify queue and reporting each XML change
+int process_watcher_events(struct watcher *watcher, watch_event_fn on_event) {
+    // Aligned as the kernel requires for struct inotify_event
+    char buffer[BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t len;
+    int handled = 0;
+    int overflow = 0;
+
+    if (watcher->fd < 0) {
+        return -1;
+    }
+
+    for (;;) {
+        len = read(watcher->fd, buffer, sizeof(buffer));
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                break;
+            }
+            log_message(CLOG_ERROR, "Failed to read inotify events: %s", strerror(errno));
+            return -1;
+        }
+
+        for (char *ptr = buffer; ptr < buffer + len; ptr += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *) ptr;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflow = 1;
+                continue;
+            }
+
+            if (event->mask & IN_IGNORED) {
+                // Watched directory was removed or unmounted
+                log_message(CLOG_WARNING, "Upload directory watch on %s was removed", watcher->dir);
+                watcher->wd = -1;
+                overflow = 1;
+                continue;
+            }
+
+            if (event->len == 0 || strstr(event->name, ".xml") == NULL) {
+                continue;
+            }
+
+            if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                on_event(watcher->owner, event->name, 0);
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                on_event(watcher->owner, event->name, 1);
+            }
+            handled++;
+        }
+    }
+
+    // A recreated or remounted directory can be watched again, otherwise the owner has to poll
+    if (watcher->wd < 0) {
+        watcher->wd = inotify_add_watch(watcher->fd, watcher->dir, WATCH_EVENTS);
+        if (watcher->wd < 0) {
+            log_message(CLOG_ERROR, "Failed to watch %s again, falling back to periodic scans: %s", watcher->dir,
+                        strerror(errno));
+            cleanup_watcher(watcher);
+            watcher->lost = 1;
+        } else {
+            log_message(CLOG_INFO, "Watching %s for changes again", watcher->dir);
+        }
+        return WATCHER_OVERFLOW;
+    }
+
+    if (overflow) {
+        log_message(CLOG_WARNING, "inotify queue overflowed, falling back to a full scan");
+        return WATCHER_OVERFLOW;
+    }
+
+    return handled;
+}
+
+// Stopping the watcher
+void cleanup_watcher(struct watcher *watcher) {
+    if (watcher->fd >= 0) {
+        if (watcher->wd >= 0) {
+            inotify_rm_watch(watcher->fd, watcher->wd);
+        }
+        close(watcher->fd);
+    }
+    watcher->fd = -1;
+    watcher->wd = -1;
+}
@@ -0,0 +1,258 @@
+/* worker_pool.c - Implementation of the worker pool */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "../include/config.h"
+#include "../include/worker_pool.h"
+#include "../include/logging.h"
+
+struct pool_job {
+    pool_job_fn fn;
+    void *arg;
+};
+
+struct worker_stats {
+    int done;
+    int failed;
+    long long bytes;
+    long long busy_ns;
+};
+
+struct worker {
+    struct worker_pool *pool;
+    pthread_t thread;
+    int id;
+    struct worker_stats stats;
+};
+
+struct worker_pool {
+    char label[32];
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_cond_t idle;
+    struct pool_job *queue;
+    int queue_size;
+    int head;
+    int count;
+    int active;
+    int shutting_down;
+    int worker_count;
+    struct worker *workers;
+    struct timespec started;
+};
+
+static long long elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
+
+// Worker thread taking jobs off the shared queue
+static void *worker_main(void *arg) {
+    struct worker *self = arg;
+    struct worker_pool *pool = self->pool;
+    struct pool_job job;
+    struct timespec start, end;
+    long long result;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->count == 0 && !pool->shutting_down) {
+            pthread_cond_wait(&pool->not_empty, &pool->mutex);
+        }
+        if (pool->count == 0 && pool->shutting_down) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+
+        job = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->queue_size;
+        pool->count--;
+        pool->active++;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->mutex);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        result = job.fn(job.arg);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        // Stats are only written by this worker and read after pool_wait()
+        self->stats.busy_ns += elapsed_ns(&start, &end);
+        if (result < 0) {
+            self->stats.failed++;
+        } else {
+            self->stats.done++;
+            self->stats.bytes += result;
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->active--;
+        if (pool->count == 0 && pool->active == 0) {
+            pthread_cond_broadcast(&pool->idle);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return NULL;
+}
+
+// Creating the pool and starting its workers
+struct worker_pool *pool_create(const char *label, int workers, int queue_size) {
+    struct worker_pool *pool;
+    int ret;
+
+    if (workers < 1) {
+        workers = 1;
+    }
+    if (queue_size < workers) {
+        queue_size = workers;
+    }
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        log_message(CLOG_ERROR, "Failed to allocate worker pool: %s", strerror(errno));
+        return NULL;
+    }
+
+    pool->queue = calloc(queue_size, sizeof(*pool->queue));
+    pool->workers = calloc(workers, sizeof(*pool->workers));
+    if (pool->queue == NULL || pool->workers == NULL) {
+        log_message(CLOG_ERROR, "Failed to allocate worker pool: %s", strerror(errno));
+        free(pool->queue);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+
+    snprintf(pool->label, sizeof(pool->label), "%s", label);
+    pool->queue_size = queue_size;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &pool->started);
+
+    for (int i = 0; i < workers; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        ret = pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]);
+        if (ret != 0) {
+            log_message(CLOG_ERROR, "Failed to start %s worker %d: %s", label, i, strerror(ret));
+            break;
+        }
+        pool->worker_count++;
+    }
+
+    if (pool->worker_count == 0) {
+        pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+// Queueing a job for the workers
+int pool_submit(struct worker_pool *pool, pool_job_fn fn, void *arg) {
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->count == pool->queue_size && !pool->shutting_down) {
+        pthread_cond_wait(&pool->not_full, &pool->mutex);
+    }
+    if (pool->shutting_down) {
+        pthread_mutex_unlock(&pool->mutex);
+        return -1;
+    }
+
+    pool->queue[(pool->head + pool->count) % pool->queue_size].fn = fn;
+    pool->queue[(pool->head + pool->count) % pool->queue_size].arg = arg;
+    pool->count++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return 0;
+}
+
+// Waiting for the queue to drain and all workers to go idle
+void pool_wait(struct worker_pool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->count > 0 || pool->active > 0) {
+        pthread_cond_wait(&pool->idle, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void pool_totals(struct worker_pool *pool, int *done, int *failed, long long *bytes) {
+    int total_done = 0;
+    int total_failed = 0;
+    long long total_bytes = 0;
+
+    pool_wait(pool);
+    for (int i = 0; i < pool->worker_count; i++) {
+        total_done += pool->workers[i].stats.done;
+        total_failed += pool->workers[i].stats.failed;
+        total_bytes += pool->workers[i].stats.bytes;
+    }
+
+    if (done != NULL) {
+        *done = total_done;
+    }
+    if (failed != NULL) {
+        *failed = total_failed;
+    }
+    if (bytes != NULL) {
+        *bytes = total_bytes;
+    }
+}
+
+// Logging per-worker throughput for the pool's lifetime
+void pool_log_stats(struct worker_pool *pool) {
+    struct timespec now;
+    double wall;
+
+    pool_wait(pool);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    wall = elapsed_ns(&pool->started, &now) / 1e9;
+
+    for (int i = 0; i < pool->worker_count; i++) {
+        const struct worker_stats *st = &pool->workers[i].stats;
+        double busy = st->busy_ns / 1e9;
+
+        if (st->done == 0 && st->failed == 0) {
+            continue;
+        }
+
+        log_message(CLOG_INFO, "%s worker %d: %d files (%d failed), %.2f MB in %.3fs busy, %.2f MB/s",
+                    pool->label, i, st->done, st->failed, st->bytes / 1e6, busy,
+                    busy > 0 ? st->bytes / 1e6 / busy : 0.0);
+    }
+
+    log_message(CLOG_INFO, "%s pool: %d workers, %.3fs wall time", pool->label, pool->worker_count, wall);
+}
+
+// Stopping the workers once the queue is empty
+void pool_destroy(struct worker_pool *pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutting_down = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_cond_broadcast(&pool->not_full);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i = 0; i < pool->worker_count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_cond_destroy(&pool->not_full);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->queue);
+    free(pool->workers);
+    free(pool);
+}
@@ -0,0 +1,555 @@
+/* xml_check.c - Implementation of the XML well-formedness check */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define XML_CHECK_X86 1
+#include <immintrin.h>
+#endif
+
+#include "../include/xml_check.h"
+
+// Returned by the markup scanners: the first byte text cannot contain as is
+typedef const char *(*find_special_fn)(const char *p, const char *end);
+
+// Open elements, as offsets of their names in the document
+struct open_element {
+    size_t offset;
+    size_t len;
+};
+
+struct xml_doc {
+    const char *start;
+    const char *end;
+    struct open_element *stack;
+    size_t depth;
+    size_t capacity;
+    int has_doctype;  // Entities other than the predefined five may be declared
+    char *reason;
+    size_t reason_size;
+};
+
+static int is_space(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Control characters XML does not allow anywhere
+static int is_illegal(unsigned char c) {
+    return c < 0x20 && c != '\t' && c != '\n' && c != '\r';
+}
+
+// Character classes for the scalar parts of the parser (non-ASCII bytes are allowed in names)
+#define CHAR_NAME_START 0x01
+#define CHAR_NAME       0x02  /* anywhere in a name */
+#define CHAR_SPACE      0x04
+#define CHAR_VALUE_STOP 0x08  /* ends a run of plain attribute value: quotes, '<', '&', control characters */
+static unsigned char char_class[256];
+
+// Scanning a byte at a time, for the tail of a block and for hosts without SSE2
+static const char *find_special_scalar(const char *p, const char *end) {
+    while (p < end && *p != '<' && *p != '&' && !is_illegal((unsigned char) *p)) {
+        p++;
+    }
+    return p;
+}
+
+#ifdef XML_CHECK_X86
+// Testing 16 bytes at once for '<', '&' and control characters other than tab, LF and CR
+static const char *find_special_sse2(const char *p, const char *end) {
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i ctl = _mm_set1_epi8(0x1f);
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+
+    while (end - p >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) p);
+        __m128i low = _mm_cmpeq_epi8(_mm_min_epu8(block, ctl), block);
+        __m128i allowed = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, tab), _mm_cmpeq_epi8(block, lf)),
+                                       _mm_cmpeq_epi8(block, cr));
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, lt), _mm_cmpeq_epi8(block, amp)),
+                                    _mm_andnot_si128(allowed, low));
+        int mask = _mm_movemask_epi8(hits);
+
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return find_special_scalar(p, end);
+}
+
+// The same test 32 bytes at a time, picked at run time on CPUs that have AVX2
+__attribute__((target("avx2")))
+static const char *find_special_avx2(const char *p, const char *end) {
+    const __m256i lt = _mm256_set1_epi8('<');
+    const __m256i amp = _mm256_set1_epi8('&');
+    const __m256i ctl = _mm256_set1_epi8(0x1f);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+
+    while (end - p >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) p);
+        __m256i low = _mm256_cmpeq_epi8(_mm256_min_epu8(block, ctl), block);
+        __m256i allowed = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, tab),
+                                                          _mm256_cmpeq_epi8(block, lf)),
+                                          _mm256_cmpeq_epi8(block, cr));
+        __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, lt), _mm256_cmpeq_epi8(block, amp)),
+                                       _mm256_andnot_si256(allowed, low));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(hits);
+
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return find_special_sse2(p, end);
+}
+#endif
+
+static find_special_fn find_special = find_special_scalar;
+static pthread_once_t xml_check_once = PTHREAD_ONCE_INIT;
+
+// Filling the name table and picking the widest scanner the CPU supports, once
+static void init_xml_check(void) {
+    for (int c = 0; c < 256; c++) {
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == ':' || c >= 0x80) {
+            char_class[c] |= CHAR_NAME_START | CHAR_NAME;
+        } else if ((c >= '0' && c <= '9') || c == '-' || c == '.') {
+            char_class[c] |= CHAR_NAME;
+        }
+        if (is_space(c)) {
+            char_class[c] |= CHAR_SPACE;
+        }
+        if (c == '"' || c == '\'' || c == '<' || c == '&' || is_illegal(c)) {
+            char_class[c] |= CHAR_VALUE_STOP;
+        }
+    }
+#ifdef XML_CHECK_X86
+    __builtin_cpu_init();
+    find_special = __builtin_cpu_supports("avx2") ? find_special_avx2 : find_special_sse2;
+#endif
+}
+
+// Recording why the document was rejected, returns 1 for the caller to pass on
+static int reject(struct xml_doc *doc, const char *at, const char *what) {
+    snprintf(doc->reason, doc->reason_size, "%s at byte %zu", what, (size_t) (at - doc->start));
+    return 1;
+}
+
+// Finding the end of a comment, processing instruction or CDATA section opened just before from
+static const char *find_terminator(const char *from, const char *end, const char *terminator) {
+    size_t len = strlen(terminator);
+    const char *p = from;
+    const char *hit;
+
+    while ((hit = memchr(p, terminator[len - 1], end - p)) != NULL) {
+        if ((size_t) (hit - from) + 1 >= len && memcmp(hit + 1 - len, terminator, len) == 0) {
+            return hit + 1;
+        }
+        p = hit + 1;
+    }
+    return NULL;
+}
+
+static const char *skip_name(const char *p, const char *end) {
+    if (p == end || !(char_class[(unsigned char) *p] & CHAR_NAME_START)) {
+        return NULL;
+    }
+    while (++p < end && (char_class[(unsigned char) *p] & CHAR_NAME)) {
+    }
+    return p;
+}
+
+static const char *skip_space(const char *p, const char *end) {
+    while (p < end && (char_class[(unsigned char) *p] & CHAR_SPACE)) {
+        p++;
+    }
+    return p;
+}
+
+// Checking a character or entity reference starting at '&', returns the byte after ';'
+static const char *check_reference(struct xml_doc *doc, const char *p) {
+    const char *name = p + 1;
+    const char *q = name;
+
+    if (q < doc->end && *q == '#') {
+        const char *digits;
+        int hex = 0;
+
+        if (++q < doc->end && *q == 'x') {
+            hex = 1;
+            q++;
+        }
+        digits = q;
+
+        while (q < doc->end && ((*q >= '0' && *q <= '9') ||
+               (hex && ((*q >= 'a' && *q <= 'f') || (*q >= 'A' && *q <= 'F'))))) {
+            q++;
+        }
+        return q > digits && q < doc->end && *q == ';' ? q + 1 : NULL;
+    }
+
+    q = skip_name(name, doc->end);
+    if (q == NULL || q == doc->end || *q != ';') {
+        return NULL;
+    }
+    if (doc->has_doctype) {
+        return q + 1;  // May be declared in the DTD
+    }
+
+    static const char *const predefined[] = { "lt", "gt", "amp", "apos", "quot" };
+    for (size_t i = 0; i < sizeof(predefined) / sizeof(predefined[0]); i++) {
+        if ((size_t) (q - name) == strlen(predefined[i]) && memcmp(name, predefined[i], q - name) == 0) {
+            return q + 1;
+        }
+    }
+    return NULL;
+}
+
+static int push_element(struct xml_doc *doc, const char *name, size_t len) {
+    if (doc->depth == doc->capacity) {
+        size_t capacity = doc->capacity ? doc->capacity * 2 : 32;
+        struct open_element *grown = realloc(doc->stack, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            snprintf(doc->reason, doc->reason_size, "out of memory");
+            return -1;
+        }
+        doc->stack = grown;
+        doc->capacity = capacity;
+    }
+    doc->stack[doc->depth].offset = name - doc->start;
+    doc->stack[doc->depth].len = len;
+    doc->depth++;
+    return 0;
+}
+
+// Parsing a start tag after '<', returns the byte after '>' or NULL with the reason set
+static const char *check_start_tag(struct xml_doc *doc, const char *p, int *empty) {
+    const char *end = doc->end;
+    const char *name = p;
+    const char *q = skip_name(p, end);
+
+    if (q == NULL) {
+        reject(doc, p, "invalid element name");
+        return NULL;
+    }
+    if (push_element(doc, name, q - name) != 0) {
+        return NULL;
+    }
+
+    for (;;) {
+        const char *attr = skip_space(q, end);
+        char quote;
+
+        if (attr == end) {
+            reject(doc, attr, "unexpected end of file in start tag");
+            return NULL;
+        }
+        if (*attr == '>') {
+            *empty = 0;
+            return attr + 1;
+        }
+        if (*attr == '/') {
+            if (attr + 1 == end || attr[1] != '>') {
+                reject(doc, attr, "expected '>' after '/'");
+                return NULL;
+            }
+            *empty = 1;
+            doc->depth--;
+            return attr + 2;
+        }
+        if (attr == q) {
+            reject(doc, attr, "missing space before attribute");
+            return NULL;
+        }
+
+        q = skip_name(attr, end);
+        if (q == NULL) {
+            reject(doc, attr, "invalid attribute name");
+            return NULL;
+        }
+        q = skip_space(q, end);
+        if (q == end || *q != '=') {
+            reject(doc, q, "expected '=' after attribute name");
+            return NULL;
+        }
+        q = skip_space(q + 1, end);
+        if (q == end || (*q != '"' && *q != '\'')) {
+            reject(doc, q, "attribute value is not quoted");
+            return NULL;
+        }
+        // Values are short, a table lookup per byte beats setting up a vector scan for each
+        quote = *q++;
+        for (;;) {
+            unsigned char c;
+
+            while (q < end && !(char_class[(unsigned char) *q] & CHAR_VALUE_STOP)) {
+                q++;
+            }
+            if (q == end || *q == quote) {
+                break;
+            }
+            c = (unsigned char) *q;
+            if (c == '<') {
+                reject(doc, q, "'<' in attribute value");
+                return NULL;
+            }
+            if (c == '&') {
+                const char *ref = q;
+                if ((q = check_reference(doc, q)) == NULL) {
+                    reject(doc, ref, "invalid entity reference in attribute value");
+                    return NULL;
+                }
+                continue;
+            }
+            if (is_illegal(c)) {
+                reject(doc, q, "control character in attribute value");
+                return NULL;
+            }
+            q++;  // The other quote character
+        }
+        if (q == end) {
+            reject(doc, q, "unexpected end of file in attribute value");
+            return NULL;
+        }
+        q++;
+    }
+}
+
+// Parsing an end tag after "</" against the innermost open element
+static const char *check_end_tag(struct xml_doc *doc, const char *p) {
+    const struct open_element *open;
+    const char *q = skip_name(p, doc->end);
+
+    if (q == NULL) {
+        reject(doc, p, "invalid end tag name");
+        return NULL;
+    }
+    if (doc->depth == 0) {
+        reject(doc, p, "end tag without a start tag");
+        return NULL;
+    }
+    open = &doc->stack[doc->depth - 1];
+    if ((size_t) (q - p) != open->len || memcmp(p, doc->start + open->offset, open->len) != 0) {
+        char what[XML_REASON_MAX];
+        snprintf(what, sizeof(what), "end tag does not match <%.*s>", (int) (open->len < 64 ? open->len : 64),
+                 doc->start + open->offset);
+        reject(doc, p, what);
+        return NULL;
+    }
+    q = skip_space(q, doc->end);
+    if (q == doc->end || *q != '>') {
+        reject(doc, q, "expected '>' in end tag");
+        return NULL;
+    }
+    doc->depth--;
+    return q + 1;
+}
+
+// Skipping a DOCTYPE declaration, including an internal subset in brackets
+static const char *skip_doctype(struct xml_doc *doc, const char *p) {
+    int brackets = 0;
+    char quote = 0;
+
+    for (; p < doc->end; p++) {
+        if (quote) {
+            quote = *p == quote ? 0 : quote;
+        } else if (*p == '"' || *p == '\'') {
+            quote = *p;
+        } else if (*p == '[') {
+            brackets++;
+        } else if (*p == ']') {
+            brackets--;
+        } else if (*p == '>' && brackets <= 0) {
+            doc->has_doctype = 1;
+            return p + 1;
+        }
+    }
+    reject(doc, p, "unexpected end of file in DOCTYPE");
+    return NULL;
+}
+
+// Walking the document markup by markup; text between markup is skipped by the vector scan
+static int check_document(struct xml_doc *doc) {
+    const char *p = doc->start;
+    const char *end = doc->end;
+    int root_done = 0;
+
+    // A UTF-8 byte order mark is allowed before anything else
+    if (end - p >= 3 && memcmp(p, "\xEF\xBB\xBF", 3) == 0) {
+        p += 3;
+    }
+
+    while (p < end) {
+        const char *q = find_special(p, end);
+
+        // Outside the root element only whitespace may appear between markup
+        if (doc->depth == 0) {
+            const char *text = skip_space(p, q);
+            if (text < q) {
+                return reject(doc, text, root_done ? "text after the root element" : "text before the root element");
+            }
+        }
+        if (q == end) {
+            break;
+        }
+
+        if (*q == '&') {
+            if (doc->depth == 0) {
+                return reject(doc, q, root_done ? "text after the root element" : "text before the root element");
+            }
+            if ((p = check_reference(doc, q)) == NULL) {
+                return reject(doc, q, "invalid entity reference");
+            }
+            continue;
+        }
+        if (*q != '<') {
+            return reject(doc, q, "control character");
+        }
+
+        q++;
+        if (q == end) {
+            return reject(doc, q, "unexpected end of file after '<'");
+        }
+
+        if (*q == '?') {
+            if (skip_name(q + 1, end) == NULL) {
+                return reject(doc, q, "invalid processing instruction");
+            }
+            if ((p = find_terminator(q + 1, end, "?>")) == NULL) {
+                return reject(doc, q, "unexpected end of file in processing instruction");
+            }
+        } else if (end - q >= 3 && memcmp(q, "!--", 3) == 0) {
+            if ((p = find_terminator(q + 3, end, "-->")) == NULL) {
+                return reject(doc, q, "unexpected end of file in comment");
+            }
+        } else if (end - q >= 8 && memcmp(q, "![CDATA[", 8) == 0) {
+            if (doc->depth == 0) {
+                return reject(doc, q, "CDATA section outside the root element");
+            }
+            if ((p = find_terminator(q + 8, end, "]]>")) == NULL) {
+                return reject(doc, q, "unexpected end of file in CDATA section");
+            }
+        } else if (end - q >= 8 && memcmp(q, "!DOCTYPE", 8) == 0) {
+            if (root_done || doc->depth > 0 || doc->has_doctype) {
+                return reject(doc, q, "misplaced DOCTYPE");
+            }
+            if ((p = skip_doctype(doc, q + 8)) == NULL) {
+                return 1;
+            }
+        } else if (*q == '/') {
+            if ((p = check_end_tag(doc, q + 1)) == NULL) {
+                return 1;
+            }
+            root_done = doc->depth == 0;
+        } else {
+            int empty;
+
+            if (root_done) {
+                return reject(doc, q, "second root element");
+            }
+            if ((p = check_start_tag(doc, q, &empty)) == NULL) {
+                return 1;
+            }
+            root_done = doc->depth == 0;
+        }
+    }
+
+    if (doc->depth > 0) {
+        const struct open_element *open = &doc->stack[doc->depth - 1];
+        char what[XML_REASON_MAX];
+        snprintf(what, sizeof(what), "unexpected end of file, <%.*s> not closed",
+                 (int) (open->len < 64 ? open->len : 64), doc->start + open->offset);
+        return reject(doc, end, what);
+    }
+    if (!root_done) {
+        return reject(doc, end, "no root element");
+    }
+    return 0;
+}
+
+int check_xml(const char *data, size_t len, char *reason, size_t size) {
+    struct xml_doc doc;
+    int ret;
+
+    pthread_once(&xml_check_once, init_xml_check);
+
+    memset(&doc, 0, sizeof(doc));
+    doc.start = data;
+    doc.end = data + len;
+    doc.reason = reason;
+    doc.reason_size = size;
+    if (size > 0) {
+        reason[0] = '\0';
+    }
+
+    ret = check_document(&doc);
+    free(doc.stack);
+    return ret;
+}
+
+// Reading the file into memory rather than mapping it: uploads are writable by their owners, and a
+// mapped file truncated during the check would kill the daemon with SIGBUS
+int check_xml_file(const char *path, char *reason, size_t size) {
+    struct stat st;
+    char *data;
+    size_t len = 0;
+    int fd;
+    int ret;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    data = malloc(st.st_size > 0 ? (size_t) st.st_size : 1);
+    if (data == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    // A file that shrank is checked as far as it goes, growth is left for the next check
+    while (len < (size_t) st.st_size) {
+        ssize_t n = pread(fd, data + len, (size_t) st.st_size - len, (off_t) len);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            int saved_errno = errno;
+
+            free(data);
+            close(fd);
+            errno = saved_errno;
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        len += (size_t) n;
+    }
+    close(fd);
+
+    if (len == 0) {
+        free(data);
+        snprintf(reason, size, "empty file");
+        return 1;
+    }
+    ret = check_xml(data, len, reason, size);
+    free(data);
+    return ret;
+}